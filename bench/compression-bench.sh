@@ -0,0 +1,103 @@
+#!/bin/bash
+# Compare vault object compression: lzop, zstd, and zstd with a trained
+# dictionary, on a synthetic corpus of small, similar text files.
+#
+# usage: bench/compression-bench.sh [ -n files ] [ -s size ] [ -l level ] [ -d dir ] [ -- submitfiles options ]
+#
+# Two corpora are generated from the same templates with different
+# values: the first is backed up (with lzop) to train the dictionary on,
+# and the second is backed up into a copy of that vault once per mode.
+# For each mode this prints the bytes the second backup added to the
+# vault, the compression ratio, and the submitfiles throughput in MB/s
+# of file data.
+
+SNEBU=${SNEBU:-$(dirname $0)/../snebu}
+NFILES=5000
+FSIZE=4096
+LEVEL=3
+BASEDIR=${TMPDIR:-/tmp}
+
+while getopts "n:s:l:d:" opt; do
+    case $opt in
+	n) NFILES=$OPTARG ;;
+	s) FSIZE=$OPTARG ;;
+	l) LEVEL=$OPTARG ;;
+	d) BASEDIR=$OPTARG ;;
+	*) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+set -e
+WORKDIR=$(mktemp -d $BASEDIR/snebu-compression-bench.XXXXXX)
+FILE_PATTERN="%y\t%#m\t%D\t%i\t%u\t%U\t%g\t%G\t%s\t0\t%C@\t%T@\t%p\0"
+
+# Config file like text: the same sections and keys throughout, values vary
+corpus() {
+    mkdir -p $1
+    awk -v n=$NFILES -v size=$FSIZE -v seed=$2 -v dir=$1 'BEGIN {
+	srand(seed)
+	split("server client database cache logging auth proxy backup mail web", sect)
+	split("host port user timeout retries path level enabled max_connections interval", key)
+	split("localhost db01.example.com /var/lib/app /etc/ssl/certs info debug warning yes no true", val)
+	for (i = 0; i < n; i++) {
+	    f = dir "/f" i ".conf"
+	    len = 0
+	    while (len < size) {
+		line = sprintf("[%s]\n", sect[int(rand() * 10) + 1])
+		for (k = 1; k <= 10; k++) {
+		    if (rand() < 0.5)
+			line = line sprintf("%s = %d\n", key[k], int(rand() * 10000))
+		    else
+			line = line sprintf("%s = %s\n", key[k], val[int(rand() * 10) + 1])
+		}
+		line = line sprintf("# changed %d by admin%d\n\n", int(rand() * 1000000), int(rand() * 50))
+		printf "%s", line > f
+		len += length(line)
+	    }
+	    close(f)
+	}
+    }'
+}
+
+backup() {
+    find $WORKDIR/$2 -printf "$FILE_PATTERN" |
+	HOME=$WORKDIR/home $SNEBU newbackup --name bench --retention daily --datestamp $1 \
+	--null --not-null-output -v > $WORKDIR/inc 2>/dev/null
+    tar --no-recursion -P -T $WORKDIR/inc -cf - 2>/dev/null |
+	HOME=$WORKDIR/home $SNEBU submitfiles --name bench --datestamp $1 "${@:3}"
+}
+
+# Bytes in vault files, leaving out directories
+vaultbytes() {
+    find $WORKDIR/$1 -type f -printf "%s\n" | awk '{ t += $1 } END { print t + 0 }'
+}
+
+corpus $WORKDIR/train 1
+corpus $WORKDIR/src 2
+INBYTES=$(du -sb --apparent-size $WORKDIR/src | cut -f1)
+mkdir -p $WORKDIR/home
+printf 'vault = %s\nmeta = %s\n' $WORKDIR/vault $WORKDIR/meta > $WORKDIR/home/.snebu.conf
+backup 1 train "$@"
+mv $WORKDIR/vault $WORKDIR/vault.base
+mv $WORKDIR/meta $WORKDIR/meta.base
+BASEBYTES=$(vaultbytes vault.base)
+
+printf "%-10s %12s %8s %10s\n" mode bytes ratio MB/s
+for mode in lzo zstd zstd+dict; do
+    rm -rf $WORKDIR/vault $WORKDIR/meta
+    cp -a $WORKDIR/vault.base $WORKDIR/vault
+    cp -a $WORKDIR/meta.base $WORKDIR/meta
+    case $mode in
+	zstd) HOME=$WORKDIR/home $SNEBU compression -n bench --method zstd --level $LEVEL >/dev/null ;;
+	zstd+dict) HOME=$WORKDIR/home $SNEBU compression -n bench --level $LEVEL --train >/dev/null ;;
+    esac
+    sync
+    start=$(date +%s.%N)
+    backup 2 src "$@"
+    end=$(date +%s.%N)
+    bytes=$(( $(vaultbytes vault) - BASEBYTES ))
+    awk -v m=$mode -v b=$bytes -v t=$INBYTES -v s=$start -v e=$end \
+	'BEGIN { printf "%-10s %12d %8.2f %10.1f\n", m, b, t / b, t / 1048576 / (e - s) }'
+done
+rm -rf $WORKDIR
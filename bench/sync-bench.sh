@@ -0,0 +1,50 @@
+#!/bin/bash
+# Compare submitfiles throughput across the --sync modes.
+#
+# usage: bench/sync-bench.sh [ -n files ] [ -s size ] [ -d dir ] [ -- submitfiles options ]
+#
+# Backs up the same tree of small files into a fresh vault once per
+# mode, and prints the elapsed time for each.  The scratch directory
+# is made under dir (default $TMPDIR or /tmp), which should be on the
+# filesystem you want to measure; tmpfs makes every mode look the same.
+
+SNEBU=${SNEBU:-$(dirname $0)/../snebu}
+NFILES=2000
+FSIZE=4096
+BASEDIR=${TMPDIR:-/tmp}
+
+while getopts "n:s:d:" opt; do
+    case $opt in
+	n) NFILES=$OPTARG ;;
+	s) FSIZE=$OPTARG ;;
+	d) BASEDIR=$OPTARG ;;
+	*) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+set -e
+WORKDIR=$(mktemp -d $BASEDIR/snebu-sync-bench.XXXXXX)
+mkdir -p $WORKDIR/src
+for ((i = 0; i < NFILES; i++)); do
+    head -c $FSIZE /dev/urandom > $WORKDIR/src/f$i
+done
+
+FILE_PATTERN="%y\t%#m\t%D\t%i\t%u\t%U\t%g\t%G\t%s\t0\t%C@\t%T@\t%p\0"
+printf "%-6s %10s %12s\n" mode seconds files/s
+for mode in none group file; do
+    rm -rf $WORKDIR/vault $WORKDIR/meta $WORKDIR/home
+    mkdir -p $WORKDIR/home
+    printf 'vault = %s\nmeta = %s\n' $WORKDIR/vault $WORKDIR/meta > $WORKDIR/home/.snebu.conf
+    find $WORKDIR/src -printf "$FILE_PATTERN" |
+	HOME=$WORKDIR/home $SNEBU newbackup --name bench --retention daily --datestamp 1 \
+	--null --not-null-output -v > $WORKDIR/inc 2>/dev/null
+    sync
+    start=$(date +%s.%N)
+    tar --no-recursion -P -T $WORKDIR/inc -cf - 2>/dev/null |
+	HOME=$WORKDIR/home $SNEBU submitfiles --name bench --datestamp 1 --sync $mode "$@"
+    end=$(date +%s.%N)
+    awk -v m=$mode -v s=$start -v e=$end -v n=$NFILES \
+	'BEGIN { printf "%-6s %10.2f %12.0f\n", m, e - s, n / (e - s) }'
+done
+rm -rf $WORKDIR
@@ -0,0 +1,693 @@
+/* Copyright 2009 - 2021 Derek Pressnall
+ *
+ * This file is part of Snebu, the Simple Network Encrypting Backup Utility
+ *
+ * Snebu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3
+ * as published by the Free Software Foundation.
+ *
+ * Snebu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Snebu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Per backup name object compression settings, and zstd dictionary
+ * training.  A dictionary is trained on the contents of a random
+ * sample of the name's small files already in the vault, which is
+ * where lzop does worst and a dictionary helps most.
+ *
+ * recompress rewrites objects that no recent backup refers to with a
+ * slower, tighter codec:  zstd at a high level, or lzo1x_999.  It walks
+ * diskfiles in hash order from where the last run stopped, so a run
+ * limited in time picks up where the one before it left off.  Each new
+ * object is written to a temp file and read back before it replaces
+ * the old one.  An object that becomes .zst keeps its .lzo file, listed
+ * in recompress_retired, until no backup or restore holds the pack
+ * lock, since a restore looks up every object's format before it
+ * starts reading them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sqlite3.h>
+
+#include "tarlib.h"
+
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#endif
+
+#define COMP_SAMPLE_MAX (128 * 1024)	// largest file to train on
+#define COMP_SAMPLES 2000
+#define COMP_DICTSIZE (110 * 1024)
+#define COMP_MINSAMPLES 10
+#define RECOMP_DAYS 30
+#define RECOMP_LEVEL 19
+#define RECOMP_BATCH 256		// objects looked up at a time
+#define RECOMP_BUFSIZE (256 * 1024)
+
+// A recompress run's settings and statements
+struct recompress {
+    struct vault_codec *codec;		// NULL for lzo1x_999
+    long long int cutoff;		// backups from here on are recent
+    sqlite3_stmt *refs;			// is an object referenced, recently
+    sqlite3_stmt *setformat;
+    sqlite3_stmt *retire;
+    sqlite3_stmt *cursor;
+    char *buf;
+    int verbose;
+    unsigned long long int objects;
+    unsigned long long int before;	// stored sizes of objects rewritten
+    unsigned long long int after;
+};
+
+void usage();
+int checkperm(sqlite3 *bkcatalog, char *action, char *backupname);
+struct vault_object *vault_object_open_r(sqlite3 *db, char *hash, char *format);
+size_t vault_object_read(void *buf, size_t sz, size_t count, struct vault_object *vo);
+int vault_object_close(struct vault_object *vo);
+struct vault_codec *vault_codec_new(int level);
+void vault_codec_free(struct vault_codec *codec);
+struct vault_zstd *vault_zstd_init_w(struct vault_codec *codec, size_t (*c_fwrite)(), void *c_fhandle);
+size_t vault_zstd_write(void *buf, size_t sz, size_t count, struct vault_zstd *vz);
+int vault_zstd_finalize_w(struct vault_zstd *vz);
+struct vault_zstd *vault_zstd_init_r(sqlite3 *db, size_t (*c_fread)(), void *c_handle);
+size_t vault_zstd_read(void *buf, size_t sz, size_t count, struct vault_zstd *vz);
+int vault_zstd_finalize_r(struct vault_zstd *vz);
+int vault_lock(int op);
+double ftime();
+int compression(int argc, char **argv);
+int compression_show(char *bkname);
+long long int compression_train(char *bkname, int nsamples, int verbose);
+int recompress(int argc, char **argv);
+long long int recompress_object(struct recompress *rc, char *hash);
+int recompress_verify(struct recompress *rc, FILE *f, unsigned char *cfsha);
+int recompress_commit(struct recompress *rc, char *hash, char *tmpfilepath, char *oldpath);
+void recompress_cursor(struct recompress *rc, char *hash);
+void recompress_reap(int verbose);
+extern sqlite3 *bkcatalog;
+extern char *SHN;
+extern struct {
+    char *vault;
+    char *meta;
+    int hash;
+} config;
+
+
+int compression(int argc, char **argv)
+{
+    int optc;
+    char *sqlerr;
+    char *sqlstmt = 0;
+    char bkname[128];
+    char *method = NULL;
+    int level = 0;
+    int train = 0;
+    int nsamples = COMP_SAMPLES;
+    int nodict = 0;
+    int verbose = 0;
+    long long int dictid = 0;
+    struct option longopts[] = {
+	{ "name", required_argument, NULL, 'n' },
+	{ "method", required_argument, NULL, 'm' },
+	{ "level", required_argument, NULL, 'l' },
+	{ "train", no_argument, NULL, 't' },
+	{ "samples", required_argument, NULL, 's' },
+	{ "no-dictionary", no_argument, NULL, 0 },
+	{ NULL, no_argument, NULL, 0 }
+    };
+    int longoptidx;
+
+    *bkname = '\0';
+    while ((optc = getopt_long(argc, argv, "n:m:l:ts:v", longopts, &longoptidx)) >= 0) {
+	switch (optc) {
+	    case 'n':
+		strncpy(bkname, optarg, 127);
+		bkname[127] = 0;
+		break;
+	    case 'm':
+		method = optarg;
+		if (strcmp(method, "lzo") != 0 && strcmp(method, "zstd") != 0) {
+		    fprintf(stderr, "Compression method must be lzo or zstd\n");
+		    exit(1);
+		}
+		break;
+	    case 'l':
+		level = atoi(optarg);
+		if (level < 1 || level > 19) {
+		    fprintf(stderr, "Compression level must be 1 to 19\n");
+		    exit(1);
+		}
+		break;
+	    case 't':
+		train = 1;
+		break;
+	    case 's':
+		nsamples = atoi(optarg);
+		if (nsamples < COMP_MINSAMPLES) {
+		    fprintf(stderr, "Need at least %d samples\n", COMP_MINSAMPLES);
+		    exit(1);
+		}
+		break;
+	    case 'v':
+		verbose = 1;
+		break;
+	    case 0:
+		if (strcmp("no-dictionary", longopts[longoptidx].name) == 0)
+		    nodict = 1;
+		break;
+	    default:
+		usage();
+		exit(1);
+	}
+    }
+    if (*bkname == '\0') {
+	fprintf(stderr, "Backup name (-n) is required\n");
+	usage();
+	return(1);
+    }
+    if (checkperm(bkcatalog, "compression", bkname))
+	return(1);
+    if (method == NULL && level == 0 && train == 0 && nodict == 0)
+	return(compression_show(bkname));
+    if (train == 1 && method != NULL && strcmp(method, "lzo") == 0) {
+	fprintf(stderr, "A dictionary is only used with zstd\n");
+	return(1);
+    }
+#ifndef HAVE_ZSTD
+    if (train == 1 || (method != NULL && strcmp(method, "zstd") == 0)) {
+	fprintf(stderr, "snebu was built without zstd support\n");
+	return(1);
+    }
+#endif
+    if (train == 1 && (dictid = compression_train(bkname, nsamples, verbose)) == 0)
+	return(1);
+
+    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"insert or ignore into object_compression (name) values ('%q'); "
+	"update object_compression set method = coalesce(%Q, method), "
+	"level = coalesce(nullif(%d, 0), level), "
+	"dict_id = case when %d = 1 then null when %lld != 0 then %lld else dict_id end "
+	"where name = '%q'", bkname, train == 1 ? "zstd" : method, level, nodict,
+	dictid, dictid, bkname)), 0, 0, &sqlerr);
+    if (sqlerr != 0) {
+	fprintf(stderr, "%s\n%s\n\n", sqlerr, sqlstmt);
+	sqlite3_free(sqlerr);
+	sqlite3_free(sqlstmt);
+	return(1);
+    }
+    sqlite3_free(sqlstmt);
+    return(compression_show(bkname));
+}
+
+int compression_show(char *bkname)
+{
+    sqlite3_stmt *sqlres;
+    char *sqlstmt;
+
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select c.method, c.level, c.dict_id, length(z.dictionary) "
+	"from object_compression c left join zstd_dictionaries z "
+	"on z.dict_id = c.dict_id where c.name = '%q'", bkname)), -1, &sqlres, 0);
+    sqlite3_free(sqlstmt);
+    if (sqlite3_step(sqlres) == SQLITE_ROW && strcmp((char *) sqlite3_column_text(sqlres, 0), "zstd") == 0) {
+	printf("%s zstd level %d", bkname, sqlite3_column_int(sqlres, 1));
+	if (sqlite3_column_type(sqlres, 2) != SQLITE_NULL)
+	    printf(" dictionary %lld (%d bytes)", sqlite3_column_int64(sqlres, 2),
+		sqlite3_column_int(sqlres, 3));
+	printf("\n");
+    }
+    else
+	printf("%s lzo\n", bkname);
+    sqlite3_finalize(sqlres);
+    return(0);
+}
+
+/* Train a dictionary on up to nsamples of the backup name's files, and
+ * store it in zstd_dictionaries.  Returns its id, or 0 on failure.
+ */
+long long int compression_train(char *bkname, int nsamples, int verbose)
+{
+#ifdef HAVE_ZSTD
+    sqlite3_stmt *sqlres;
+    char *sqlstmt;
+    struct vault_object *vo;
+    char *samples = NULL;
+    size_t *sizes;
+    size_t total = 0;
+    size_t alloc = 0;
+    unsigned int n = 0;
+    size_t c;
+    char *dict;
+    size_t dictsize;
+    long long int dictid;
+
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select hash, format from (select distinct f.%s as hash, "
+	"coalesce(d.format, 'lzo') as format from file_entities f "
+	"join backupset_detail bd on bd.file_id = f.file_id "
+	"join backupsets b on b.backupset_id = bd.backupset_id "
+	"left join diskfiles d on d.%s = f.%s "
+	"where b.name = '%q' and f.ftype = '0' and f.size > 0 and f.size <= %d) "
+	"order by random() limit %d",
+	SHN, SHN, SHN, bkname, COMP_SAMPLE_MAX, nsamples)), -1, &sqlres, 0);
+    sqlite3_free(sqlstmt);
+    sizes = malloc(sizeof(size_t) * nsamples);
+    while (sqlite3_step(sqlres) == SQLITE_ROW) {
+	if ((vo = vault_object_open_r(bkcatalog, (char *) sqlite3_column_text(sqlres, 0),
+	    (char *) sqlite3_column_text(sqlres, 1))) == NULL)
+	    continue;
+	if (alloc < total + COMP_SAMPLE_MAX) {
+	    alloc = (total + COMP_SAMPLE_MAX) * 2;
+	    samples = realloc(samples, alloc);
+	}
+	c = vault_object_read(samples + total, 1, COMP_SAMPLE_MAX, vo);
+	if (vault_object_close(vo) != 0 || c == 0)
+	    continue;
+	sizes[n++] = c;
+	total += c;
+    }
+    sqlite3_finalize(sqlres);
+    if (n < COMP_MINSAMPLES) {
+	fprintf(stderr, "Only found %d files of %s to train on, need at least %d\n",
+	    n, bkname, COMP_MINSAMPLES);
+	free(samples);
+	free(sizes);
+	return(0);
+    }
+    dict = malloc(COMP_DICTSIZE);
+    dictsize = ZDICT_trainFromBuffer(dict, COMP_DICTSIZE, samples, sizes, n);
+    free(samples);
+    free(sizes);
+    if (ZDICT_isError(dictsize)) {
+	fprintf(stderr, "Error training dictionary: %s\n", ZDICT_getErrorName(dictsize));
+	free(dict);
+	return(0);
+    }
+    dictid = ZDICT_getDictID(dict, dictsize);
+    sqlite3_prepare_v2(bkcatalog,
+	"insert or replace into zstd_dictionaries (dict_id, name, datestamp, dictionary) "
+	"values (?1, ?2, ?3, ?4)", -1, &sqlres, 0);
+    sqlite3_bind_int64(sqlres, 1, dictid);
+    sqlite3_bind_text(sqlres, 2, bkname, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(sqlres, 3, time(NULL));
+    sqlite3_bind_blob(sqlres, 4, dict, dictsize, SQLITE_STATIC);
+    if (sqlite3_step(sqlres) != SQLITE_DONE) {
+	fprintf(stderr, "Error saving dictionary: %s\n", sqlite3_errmsg(bkcatalog));
+	dictid = 0;
+    }
+    sqlite3_finalize(sqlres);
+    free(dict);
+    if (verbose == 1 && dictid != 0)
+	fprintf(stderr, "Trained a %zu byte dictionary on %u files, %zu bytes\n",
+	    dictsize, n, total);
+    return(dictid);
+#else
+    return(0);
+#endif
+}
+
+int recompress(int argc, char **argv)
+{
+    int optc;
+    char *sqlstmt = 0;
+    sqlite3_stmt *sqlres;
+    struct recompress rc;
+    char *method = NULL;
+    int level = RECOMP_LEVEL;
+    int days = RECOMP_DAYS;
+    double rate = 0;
+    double maxtime = 0;
+    int restart = 0;
+    char batch[RECOMP_BATCH][41];
+    char last[41];
+    int n;
+    int done = 0;
+    double start;
+    unsigned long long int readbytes = 0;
+    long long int nread;
+    struct option longopts[] = {
+	{ "age", required_argument, NULL, 'a' },
+	{ "method", required_argument, NULL, 'm' },
+	{ "level", required_argument, NULL, 'l' },
+	{ "rate", required_argument, NULL, 0 },
+	{ "time", required_argument, NULL, 0 },
+	{ "restart", no_argument, NULL, 0 },
+	{ NULL, no_argument, NULL, 0 }
+    };
+    int longoptidx;
+
+    memset(&rc, 0, sizeof(rc));
+    while ((optc = getopt_long(argc, argv, "a:m:l:v", longopts, &longoptidx)) >= 0) {
+	switch (optc) {
+	    case 'a':
+		days = atoi(optarg);
+		break;
+	    case 'm':
+		method = optarg;
+		if (strcmp(method, "lzo") != 0 && strcmp(method, "zstd") != 0) {
+		    fprintf(stderr, "Compression method must be lzo or zstd\n");
+		    exit(1);
+		}
+		break;
+	    case 'l':
+		level = atoi(optarg);
+		if (level < 1 || level > 19) {
+		    fprintf(stderr, "Compression level must be 1 to 19\n");
+		    exit(1);
+		}
+		break;
+	    case 'v':
+		rc.verbose = 1;
+		break;
+	    case 0:
+		if (strcmp("rate", longopts[longoptidx].name) == 0)
+		    rate = atof(optarg) * 1024 * 1024;
+		else if (strcmp("time", longopts[longoptidx].name) == 0)
+		    maxtime = atof(optarg) * 60;
+		else if (strcmp("restart", longopts[longoptidx].name) == 0)
+		    restart = 1;
+		break;
+	    default:
+		usage();
+		exit(1);
+	}
+    }
+    if (checkperm(bkcatalog, "recompress", NULL))
+	return(1);
+#ifdef HAVE_ZSTD
+    if (method == NULL || strcmp(method, "zstd") == 0)
+	rc.codec = vault_codec_new(level);
+#else
+    if (method != NULL && strcmp(method, "zstd") == 0) {
+	fprintf(stderr, "snebu was built without zstd support\n");
+	return(1);
+    }
+#endif
+    rc.cutoff = (long long int) time(NULL) - (long long int) days * 86400;
+    rc.buf = malloc(RECOMP_BUFSIZE);
+    if (restart == 1)
+	sqlite3_exec(bkcatalog, "delete from recompress_state", 0, 0, 0);
+    recompress_reap(rc.verbose);
+
+    // Chunks count as referenced by the objects made of them
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select exists (select 1 from file_entities f where f.%s in "
+	"(select ?1 union all select object from object_chunks where chunk = ?1)), "
+	"exists (select 1 from file_entities f "
+	"join backupset_detail d on d.file_id = f.file_id "
+	"join backupsets b on b.backupset_id = d.backupset_id "
+	"where f.%s in (select ?1 union all select object from object_chunks where chunk = ?1) "
+	"and cast(b.serial as integer) >= ?2)", SHN, SHN)), -1, &(rc.refs), 0);
+    sqlite3_free(sqlstmt);
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"update diskfiles set format = 'zst' where %s = ?1 "
+	"and coalesce(format, 'lzo') = 'lzo'", SHN)), -1, &(rc.setformat), 0);
+    sqlite3_free(sqlstmt);
+    sqlite3_prepare_v2(bkcatalog,
+	"insert or ignore into recompress_retired (hash, ext) values (?1, 'lzo')",
+	-1, &(rc.retire), 0);
+    sqlite3_prepare_v2(bkcatalog,
+	"insert or replace into recompress_state (id, hash, datestamp) values (1, ?1, ?2)",
+	-1, &(rc.cursor), 0);
+
+    *last = '\0';
+    sqlite3_prepare_v2(bkcatalog, "select hash from recompress_state where id = 1", -1, &sqlres, 0);
+    if (sqlite3_step(sqlres) == SQLITE_ROW && sqlite3_column_type(sqlres, 0) == SQLITE_TEXT)
+	snprintf(last, 41, "%s", (char *) sqlite3_column_text(sqlres, 0));
+    sqlite3_finalize(sqlres);
+    if (rc.verbose == 1 && *last != '\0')
+	fprintf(stderr, "Resuming after %s\n", last);
+
+    /* Look objects up a batch at a time, so the catalog isn't held open
+     * for reading while they are rewritten.  Encrypted (longer named),
+     * raw, chunk list and already zstd objects are left alone.
+     */
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select %s from diskfiles where %s > ?1 and length(%s) = 40 "
+	"and coalesce(format, 'lzo') = 'lzo' order by %s limit %d",
+	SHN, SHN, SHN, SHN, RECOMP_BATCH)), -1, &sqlres, 0);
+    sqlite3_free(sqlstmt);
+    start = ftime();
+    while (done == 0) {
+	sqlite3_bind_text(sqlres, 1, last, -1, SQLITE_TRANSIENT);
+	for (n = 0; n < RECOMP_BATCH && sqlite3_step(sqlres) == SQLITE_ROW; n++)
+	    snprintf(batch[n], 41, "%s", (char *) sqlite3_column_text(sqlres, 0));
+	sqlite3_reset(sqlres);
+	if (n == 0) {
+	    // Went all the way through; the next run starts over
+	    recompress_cursor(&rc, "");
+	    break;
+	}
+	for (int i = 0; i < n; i++) {
+	    if (maxtime > 0 && ftime() - start >= maxtime) {
+		done = 1;
+		// Carry on from the last one finished
+		if (i > 0)
+		    recompress_cursor(&rc, batch[i - 1]);
+		break;
+	    }
+	    if ((nread = recompress_object(&rc, batch[i])) < 0)
+		continue;
+	    readbytes += nread;
+	    if (rate > 0 && readbytes / rate > ftime() - start)
+		usleep((readbytes / rate - (ftime() - start)) * 1000000);
+	}
+	if (done == 0) {
+	    recompress_cursor(&rc, batch[n - 1]);
+	    strcpy(last, batch[n - 1]);
+	}
+    }
+    sqlite3_finalize(sqlres);
+    sqlite3_finalize(rc.refs);
+    sqlite3_finalize(rc.setformat);
+    sqlite3_finalize(rc.retire);
+    sqlite3_finalize(rc.cursor);
+    vault_codec_free(rc.codec);
+    free(rc.buf);
+    recompress_reap(rc.verbose);
+    if (rc.verbose == 1)
+	fprintf(stderr, "Recompressed %llu objects, %llu bytes to %llu bytes\n",
+	    rc.objects, rc.before, rc.after);
+    return(0);
+}
+
+/* Rewrite one object, if it is in a file of its own, cold, and comes
+ * out smaller.  Returns the bytes read for it, or -1 if it was skipped.
+ */
+long long int recompress_object(struct recompress *rc, char *hash)
+{
+    char oldpath[1024];
+    char tmpfilepath[1024];
+    unsigned char hdr[16];
+    unsigned char cfsha[EVP_MAX_MD_SIZE];
+    unsigned char newsha[EVP_MAX_MD_SIZE];
+    struct stat st;
+    struct vault_object *vo;
+    struct sha_file *s1f;
+    struct vault_zstd *vz = NULL;
+    struct lzop_file *lzf = NULL;
+    FILE *f;
+    int fd;
+    size_t c;
+    int cold;
+    int damaged;
+    long long int newsize;
+
+    // Packed objects have no file of their own
+    snprintf(oldpath, sizeof(oldpath), "%s/%.2s/%s.lzo", config.vault, hash, hash + 2);
+    if (stat(oldpath, &st) != 0)
+	return(-1);
+    if (rc->codec == NULL) {
+	if ((f = fopen(oldpath, "r")) == NULL)
+	    return(-1);
+	c = fread(hdr, 1, sizeof(hdr), f);
+	fclose(f);
+	if (c < sizeof(hdr) || hdr[15] == LZOP_M_LZO1X_999)
+	    return(-1);
+    }
+    sqlite3_bind_text(rc->refs, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(rc->refs, 2, rc->cutoff);
+    // Unreferenced objects are only waiting for purge
+    cold = sqlite3_step(rc->refs) == SQLITE_ROW && sqlite3_column_int(rc->refs, 0) == 1
+	&& sqlite3_column_int(rc->refs, 1) == 0;
+    sqlite3_reset(rc->refs);
+    if (cold == 0)
+	return(-1);
+
+    if ((vo = vault_object_open_r(bkcatalog, hash, "lzo")) == NULL)
+	return(-1);
+    snprintf(tmpfilepath, sizeof(tmpfilepath), "%s/%.2s/trXXXXXX", config.vault, hash);
+    if ((fd = mkstemp(tmpfilepath)) < 0 || (f = fdopen(fd, "w+")) == NULL) {
+	fprintf(stderr, "Error creating temp file %s\n", tmpfilepath);
+	exit(1);
+    }
+    fchmod(fd, st.st_mode & 07777);
+    if (rc->codec != NULL)
+	vz = vault_zstd_init_w(rc->codec, fwrite, f);
+    else
+	lzf = lzop_init_w999(fwrite, f);
+    s1f = sha_file_init_w(NULL, NULL, config.hash);
+    while ((c = vault_object_read(rc->buf, 1, RECOMP_BUFSIZE, vo)) > 0) {
+	sha_file_update(s1f, rc->buf, c);
+	if (vz != NULL)
+	    vault_zstd_write(rc->buf, 1, c, vz);
+	else
+	    lzop_write(rc->buf, 1, c, lzf);
+    }
+    sha_finalize_w(s1f, cfsha);
+    damaged = vault_object_close(vo);
+    if (vz != NULL)
+	vault_zstd_finalize_w(vz);
+    else
+	lzop_finalize_w(lzf);
+    if (fflush(f) != 0 || fsync(fd) != 0) {
+	fprintf(stderr, "Error writing %s\n", tmpfilepath);
+	exit(1);
+    }
+    newsize = ftello(f);
+    if (damaged != 0)
+	fprintf(stderr, "%s is damaged, leaving it as it is\n", oldpath);
+    if (damaged != 0 || newsize >= st.st_size || recompress_verify(rc, f, newsha) != 0
+	|| memcmp(cfsha, newsha, config.hash == 1 ? SHA_DIGEST_LENGTH : SHA256_DIGEST_LENGTH) != 0) {
+	if (damaged == 0 && newsize < st.st_size)
+	    fprintf(stderr, "Rewrite of %s didn't read back the same, leaving it as it is\n", oldpath);
+	fclose(f);
+	unlink(tmpfilepath);
+	return(st.st_size);
+    }
+    fclose(f);
+    if (recompress_commit(rc, hash, tmpfilepath, oldpath) != 0) {
+	unlink(tmpfilepath);
+	return(st.st_size);
+    }
+    rc->objects++;
+    rc->before += st.st_size;
+    rc->after += newsize;
+    return(st.st_size);
+}
+
+// Read a rewritten object back, for the hash of what it holds
+int recompress_verify(struct recompress *rc, FILE *f, unsigned char *cfsha)
+{
+    struct sha_file *s1f;
+    struct vault_zstd *vz = NULL;
+    struct lzop_file *lzf = NULL;
+    size_t c;
+    int error;
+
+    rewind(f);
+    if (rc->codec != NULL)
+	vz = vault_zstd_init_r(bkcatalog, fread, f);
+    else
+	lzf = lzop_init_r(fread, f);
+    s1f = sha_file_init_w(NULL, NULL, config.hash);
+    while ((c = vz != NULL ? vault_zstd_read(rc->buf, 1, RECOMP_BUFSIZE, vz) :
+	lzop_read(rc->buf, 1, RECOMP_BUFSIZE, lzf)) > 0)
+	sha_file_update(s1f, rc->buf, c);
+    sha_finalize_w(s1f, cfsha);
+    if (vz != NULL)
+	return(vault_zstd_finalize_r(vz));
+    error = lzf->error;
+    lzop_finalize_r(lzf);
+    return(error);
+}
+
+/* Put a rewritten object in place of the old one.  The catalog is
+ * checked and updated in the same transaction as the rename, so an
+ * object purge has dropped in the meantime isn't brought back, and a
+ * crash before the commit leaves the old object in use, to be redone
+ * by the next run.
+ */
+int recompress_commit(struct recompress *rc, char *hash, char *tmpfilepath, char *oldpath)
+{
+    char newpath[1024];
+    int live;
+
+    sqlite3_exec(bkcatalog, "BEGIN IMMEDIATE", 0, 0, 0);
+    sqlite3_bind_text(rc->refs, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(rc->refs, 2, rc->cutoff);
+    live = sqlite3_step(rc->refs) == SQLITE_ROW && sqlite3_column_int(rc->refs, 0) == 1;
+    sqlite3_reset(rc->refs);
+    if (live == 1 && rc->codec != NULL) {
+	sqlite3_bind_text(rc->setformat, 1, hash, -1, SQLITE_STATIC);
+	if (sqlite3_step(rc->setformat) != SQLITE_DONE) {
+	    fprintf(stderr, "Error updating the catalog: %s\n", sqlite3_errmsg(bkcatalog));
+	    exit(1);
+	}
+	sqlite3_reset(rc->setformat);
+	live = sqlite3_changes(bkcatalog) == 1;
+    }
+    if (live == 0) {
+	sqlite3_exec(bkcatalog, "ROLLBACK", 0, 0, 0);
+	return(1);
+    }
+    snprintf(newpath, sizeof(newpath), "%s/%.2s/%s.%s", config.vault, hash, hash + 2,
+	rc->codec != NULL ? "zst" : "lzo");
+    if (rename(tmpfilepath, newpath) != 0) {
+	fprintf(stderr, "Error renaming %s to %s\n", tmpfilepath, newpath);
+	sqlite3_exec(bkcatalog, "ROLLBACK", 0, 0, 0);
+	return(1);
+    }
+    if (rc->codec != NULL) {
+	sqlite3_bind_text(rc->retire, 1, hash, -1, SQLITE_STATIC);
+	sqlite3_step(rc->retire);
+	sqlite3_reset(rc->retire);
+    }
+    recompress_cursor(rc, hash);
+    if (sqlite3_exec(bkcatalog, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+	fprintf(stderr, "Error updating the catalog: %s\n", sqlite3_errmsg(bkcatalog));
+	exit(1);
+    }
+    return(0);
+}
+
+// Remember where to carry on from next time
+void recompress_cursor(struct recompress *rc, char *hash)
+{
+    sqlite3_bind_text(rc->cursor, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(rc->cursor, 2, time(NULL));
+    sqlite3_step(rc->cursor);
+    sqlite3_reset(rc->cursor);
+}
+
+/* Remove the files of objects since rewritten in another format, if no
+ * backup or restore is running that may have looked them up already.
+ */
+void recompress_reap(int verbose)
+{
+    sqlite3_stmt *sqlres;
+    char path[1024];
+    int n = 0;
+
+    if (vault_lock(LOCK_EX | LOCK_NB) != 0) {
+	if (verbose == 1)
+	    fprintf(stderr, "Backups or restores in progress, keeping replaced files\n");
+	return;
+    }
+    sqlite3_prepare_v2(bkcatalog, "select hash, ext from recompress_retired", -1, &sqlres, 0);
+    while (sqlite3_step(sqlres) == SQLITE_ROW) {
+	snprintf(path, sizeof(path), "%s/%.2s/%s.%s", config.vault,
+	    (char *) sqlite3_column_text(sqlres, 0), (char *) sqlite3_column_text(sqlres, 0) + 2,
+	    (char *) sqlite3_column_text(sqlres, 1));
+	if (unlink(path) == 0)
+	    n++;
+    }
+    sqlite3_finalize(sqlres);
+    sqlite3_exec(bkcatalog, "delete from recompress_retired", 0, 0, 0);
+    vault_lock(LOCK_UN);
+    if (verbose == 1 && n > 0)
+	fprintf(stderr, "Removed %d replaced files\n", n);
+}
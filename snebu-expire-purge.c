@@ -42,6 +42,10 @@ extern struct {
     int hash;
 } config;
 extern char *SHN;
+int vault_compact(sqlite3 *db, int verbose);
+int vault_filter_purged(sqlite3 *db, unsigned long long int n, int verbose);
+int vault_partial_expire(int verbose);
+int latest_state_purge(sqlite3 *bkcatalog, char *purgetable, int verbose);
 
 int expire(int argc, char **argv)
 {
@@ -244,6 +248,7 @@ int expire(int argc, char **argv)
 int purge(int argc, char **argv)
 {
     sqlite3_stmt *sqlres;
+    sqlite3_stmt *packedres;
     char *sqlstmt = NULL;
     char *sqlerr;
     time_t purgedate;
@@ -345,15 +350,21 @@ int purge(int argc, char **argv)
 	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
 	sqlite3_free(sqlerr);
     }
+    else
+	latest_state_purge(bkcatalog, "purgelist1", verbose);
 
     if (verbose > 0)
 	fprintf(stderr, "Creating final purge list\n");
+    // Chunks are kept as long as a file still refers to any object made of them
     sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
 	"insert into purgelist (datestamp, %s) "
 	"select %d, d.%s from diskfiles d "
 	"left join file_entities f "
 	"on d.%s = f.%s "
-	"where f.%s is null ", SHN, purgedate, SHN, SHN, SHN, SHN)), 0, 0, &sqlerr);
+	"where f.%s is null and not exists ( "
+	"select 1 from object_chunks c join file_entities g "
+	"on g.%s = c.object where c.chunk = d.%s)",
+	SHN, purgedate, SHN, SHN, SHN, SHN, SHN, SHN)), 0, 0, &sqlerr);
 
     if (sqlerr != 0) {
 	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
@@ -363,18 +374,44 @@ int purge(int argc, char **argv)
     if (verbose > 0)
 	fprintf(stderr, "Removing files\n");
     sqlite3_prepare_v2(bkcatalog,
-	(sqlstmt = sqlite3_mprintf("select %s, datestamp from purgelist", SHN)),
+	(sqlstmt = sqlite3_mprintf("select p.%s, p.datestamp, d.format from purgelist p "
+	"left join diskfiles d on d.%s = p.%s", SHN, SHN, SHN)),
 	-1, &sqlres, 0);
+    sqlite3_prepare_v2(bkcatalog,
+	"select lastref from packed_objects where hash = ? and dead = 0",
+	-1, &packedres, 0);
     int rows_purged = 0;
     while (sqlite3_step(sqlres) == SQLITE_ROW) {
 
 	sha1 = (char *) sqlite3_column_text(sqlres, 0);
+	/* A chunked object is only its chunk list; its chunks are purged
+	 * along with it unless other objects share them.
+	 */
+	if (sqlite3_column_type(sqlres, 2) == SQLITE_TEXT &&
+	    strcmp((char *) sqlite3_column_text(sqlres, 2), "chunked") == 0) {
+	    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+		"delete from object_chunks where object = '%q'; "
+		"insert into diskfiles_purged (hash) values ('%q')", sha1, sha1)), 0, 0, &sqlerr);
+	    if (sqlerr != 0) {
+		fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
+		sqlite3_free(sqlerr);
+	    }
+	    sqlite3_free(sqlstmt);
+	    rows_purged++;
+	    continue;
+	}
 	strncpya0(&destfilepath, destdir, 0);
 	strcata(&destfilepath, "/");
 	strncata0(&destfilepath, sha1, 2);
 	strcata(&destfilepath, "/");
 	strcata(&destfilepath, sha1 + 2);
-	if (strlen(sha1) > 40)
+	if (sqlite3_column_type(sqlres, 2) == SQLITE_TEXT &&
+	    strcmp((char *) sqlite3_column_text(sqlres, 2), "raw") == 0)
+	    strcata(&destfilepath, ".raw");
+	else if (sqlite3_column_type(sqlres, 2) == SQLITE_TEXT &&
+	    strcmp((char *) sqlite3_column_text(sqlres, 2), "zst") == 0)
+	    strcata(&destfilepath, ".zst");
+	else if (strlen(sha1) > 40)
 	    strcata(&destfilepath, ".enc");
 	else
 	    strcata(&destfilepath, ".lzo");
@@ -408,6 +445,35 @@ int purge(int argc, char **argv)
 		sqlite3_free(sqlstmt);
 	    }
 	}
+	else {
+	    /* Packed objects are only marked dead here, and their space
+	     * reclaimed when the pack is compacted.
+	     */
+	    sqlite3_bind_text(packedres, 1, sha1, -1, SQLITE_STATIC);
+	    if (sqlite3_step(packedres) == SQLITE_ROW) {
+		if (sqlite3_column_int(packedres, 0) < sqlite3_column_int(sqlres, 1)) {
+		    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+			"update packed_objects set dead = 1 where hash = '%q'; "
+			"insert into diskfiles_purged (hash) values ('%q')", sha1, sha1)), 0, 0, &sqlerr);
+		    if (sqlerr != 0) {
+			fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
+			sqlite3_free(sqlerr);
+		    }
+		    sqlite3_free(sqlstmt);
+		    rows_purged++;
+		}
+		else {
+		    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+			"delete from purgelist where %s = '%q'", SHN, sha1)), 0, 0, &sqlerr);
+		    if (sqlerr != 0) {
+			fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
+			sqlite3_free(sqlerr);
+		    }
+		    sqlite3_free(sqlstmt);
+		}
+	    }
+	    sqlite3_reset(packedres);
+	}
 	if (rows_purged % 1000 == 0) {
 	    if (verbose > 0)
 		fprintf(stderr, "Purged %d files          \r", rows_purged);
@@ -458,6 +524,12 @@ int purge(int argc, char **argv)
     }
     sqlite3_free(sqlstmt);
 
+    sqlite3_finalize(packedres);
+    sqlite3_finalize(sqlres);
+
     sqlite3_exec(bkcatalog, "END", 0, 0, 0);
+    vault_filter_purged(bkcatalog, rows_purged, verbose);
+    vault_compact(bkcatalog, verbose);
+    vault_partial_expire(verbose);
     return(0);
 }
@@ -42,6 +42,8 @@ char *strunesc(char *src, char **target);
 long int strtoln(char *nptr, char **endptr, int base, int len);
 sqlite3 *opendb();
 int permissions(int argc, char **argv);
+int compression(int argc, char **argv);
+int recompress(int argc, char **argv);
 int checkperm(sqlite3 *bkcatalog, char *action, char *backupname);
 int busy_retry(void *userdata, int count);
 
@@ -60,6 +62,9 @@ struct {
     char *vault;
     char *meta;
     int hash;
+    int content_hash;
+    unsigned long long int chunk_threshold;
+    int hole_elision;
 } config;
 
 char *SHN;
@@ -76,6 +81,8 @@ int main(int argc, char **argv)
 	{ "expire", &expire, 1 },
 	{ "purge", &purge, 1 },
 	{ "permissions", &permissions, 1},
+	{ "compression", &compression, 1 },
+	{ "recompress", &recompress, 1 },
 	{ "help", &gethelp, 0 }/*,
 	{ "import", &import, 1 },
 	{ "export", &export, 1 } */
@@ -167,6 +174,9 @@ void getconfig(char *configpatharg)
 
     config.vault = NULL;
     config.meta = NULL;
+    config.content_hash = 0;
+    config.chunk_threshold = 0;
+    config.hole_elision = 0;
     if (configpatharg == NULL)
         snprintf(configpath, 256, "%s/.snebu.conf", getenv("HOME"));
     else {
@@ -201,6 +211,14 @@ void getconfig(char *configpatharg)
                         fprintf(stderr, "Memory allocation failure\n");
                         exit(1);
                     }
+                if (strcmp(configvar, "content_hash") == 0)
+                    config.content_hash = strcmp(configvalue, "1") == 0 ||
+                        strcmp(configvalue, "yes") == 0 ? 1 : 0;
+                if (strcmp(configvar, "chunk_threshold") == 0)
+                    config.chunk_threshold = strtoull(configvalue, 0, 10);
+                if (strcmp(configvar, "hole_elision") == 0)
+                    config.hole_elision = strcmp(configvalue, "1") == 0 ||
+                        strcmp(configvalue, "yes") == 0 ? 1 : 0;
             }
         }
 	dfree(configlinel);
@@ -344,6 +362,7 @@ int initdb(sqlite3 *bkcatalog)
     err = sqlite3_exec(bkcatalog,
 	"create table if not exists diskfiles ( \n"
 	"    sha2          char, \n"
+	"    format        char, \n"
 	"constraint diskfilesc1 unique ( \n"
 	"    sha2))", 0, 0, &sqlerr);
     if (sqlerr != 0) {
@@ -353,6 +372,21 @@ int initdb(sqlite3 *bkcatalog)
     if (err != 0)
 	return(err);
 
+    /* format is set for objects named by the hash of their content
+     * rather than of the stored stream, and says how they are stored.
+     */
+    if (sqlite3_table_column_metadata(bkcatalog, NULL, "diskfiles", "format",
+	NULL, NULL, NULL, NULL, NULL) != 0) {
+	err = sqlite3_exec(bkcatalog,
+	    "alter table diskfiles add column format char", 0, 0, &sqlerr);
+	if (sqlerr != 0) {
+	    fprintf(stderr, "Alter table diskfiles: %s\n", sqlerr);
+	    sqlite3_free(sqlerr);
+	}
+	if (err != 0)
+	    return(err);
+    }
+
     err = sqlite3_exec(bkcatalog,
 	"create table if not exists file_entities (  \n"
 	"    file_id       integer primary key,  \n"
@@ -454,6 +488,92 @@ int initdb(sqlite3 *bkcatalog)
 	    "datestamp,  \n"
 	    "sha2 ))", 0, 0, 0);
 
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists packs (  \n"
+	"    pack          integer primary key,  \n"
+	"    created       integer)", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists packed_objects (  \n"
+	"    hash          char primary key,  \n"
+	"    pack          integer,  \n"
+	"    offset        integer,  \n"
+	"    length        integer,  \n"
+	"    lastref       integer,  \n"
+	"    dead          integer default 0)", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    err = sqlite3_exec(bkcatalog,
+	"create index if not exists packed_objects_i1 on packed_objects (  \n"
+	"    pack)", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    /* A file stored as content-defined chunks is a diskfiles row with
+     * format "chunked" and no vault file; its contents are these chunk
+     * objects in seq order.
+     */
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists object_chunks (  \n"
+	"    object        char,  \n"
+	"    seq           integer,  \n"
+	"    chunk         char,  \n"
+	"    length        integer,  \n"
+	"primary key (object, seq))", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    err = sqlite3_exec(bkcatalog,
+	"create index if not exists object_chunks_i1 on object_chunks (  \n"
+	"    chunk)", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    /* How each backup name's new objects are compressed, lzop unless set
+     * here.  Dictionaries are kept for as long as the catalog, since
+     * zstd objects only name theirs by id.
+     */
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists object_compression (  \n"
+	"    name          char primary key,  \n"
+	"    method        char default 'lzo',  \n"
+	"    level         integer default 3,  \n"
+	"    dict_id       integer)", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists zstd_dictionaries (  \n"
+	"    dict_id       integer primary key,  \n"
+	"    name          char,  \n"
+	"    datestamp     integer,  \n"
+	"    dictionary    blob)", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    /* Where the last recompress run stopped, and the files of objects it
+     * rewrote in another format, to be removed once no backup or restore
+     * could still be reading them.
+     */
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists recompress_state (  \n"
+	"    id            integer primary key,  \n"
+	"    hash          char,  \n"
+	"    datestamp     integer)", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists recompress_retired (  \n"
+	"    hash          char,  \n"
+	"    ext           char,  \n"
+	"primary key (hash, ext))", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
     err = sqlite3_exec(bkcatalog,
 	    "create table if not exists backupsets (  \n"
 	    "backupset_id  integer primary key,  \n"
@@ -543,6 +663,20 @@ int initdb(sqlite3 *bkcatalog)
     if (err != 0)
 	return(err);
 
+    /* The files of the last backup of each name made from a newbackup
+     * manifest that submitfiles finished, as sorted blocks of
+     * fingerprints and file_ids, for newbackup to diff with.
+     */
+    err = sqlite3_exec(bkcatalog,
+	"create table if not exists latest_state (  \n"
+	"    name          char,  \n"
+	"    block         integer,  \n"
+	"    backupset_id  integer,  \n"
+	"    entries       blob,  \n"
+	"primary key (name, block))", 0, 0, 0);
+    if (err != 0)
+	return(err);
+
 // file_entities with backupsets and backupset_detail view
     err = sqlite3_exec(bkcatalog,
 	"create view if not exists \n"
@@ -626,6 +760,12 @@ void usage()
 	    "\n"
 	    "    permissions [ -l | -a | -r ] -c command -n hostname -u user\n"
 	    "\n"
+	    "    compression -n backupname [ --method lzo|zstd ] [ --level N ]\n"
+	    "      [ --train ]\n"
+	    "\n"
+	    "    recompress [ -a days ] [ --method lzo|zstd ] [ --rate MB/s ]\n"
+	    "      [ --time minutes ]\n"
+	    "\n"
 	    "    help [ subcommand ]\n"
 	    "\n"
 	    " The \"snebu\" command is a backup tool which manages storing data from\n"
@@ -691,6 +831,11 @@ int help(char *topic)
 	    "                            Re-write path names beginning with \"/path/name/\"\n"
 	    "                            to \"/new/name/\"\n"
 	    "\n"
+	    "     --resume-list FILE     Write the offset to resume each needed file from\n"
+	    "                            to FILE, for files a cut off submitfiles left\n"
+	    "                            part of in the vault.  Pass it to \"tarcrypt\n"
+	    "                            resume\" to send only the rest.\n"
+	    "\n"
 	    " -v,                        Verbose output\n"
 	);
     if (strcmp(topic, "submitfiles") == 0)
@@ -708,6 +853,55 @@ int help(char *topic)
 	    "                            time_t format, sames as the output of the \"date\n"
 	    "                            +%%s\" command.\n"
 	    "\n"
+	    " -t, --threads N            Compress, hash and store received files using\n"
+	    "                            N worker threads.  Defaults to 1.\n"
+	    "\n"
+	    " --block-threads N          Split files larger than 256KB into blocks and\n"
+	    "                            compress them on N additional threads.\n"
+	    "\n"
+	    " --inflight-blocks N        Number of blocks per file that may be queued for\n"
+	    "                            compression at once.  Defaults to twice the\n"
+	    "                            --block-threads value.\n"
+	    "\n"
+	    " --in-process               Read the tar stream in a thread of the catalog\n"
+	    "                            process instead of a separate process.\n"
+	    "\n"
+	    " --small-file-size N        Compress files up to N bytes in memory, and only\n"
+	    "                            write them out if not already in the vault.\n"
+	    "                            Defaults to 1048576, 0 turns this off.\n"
+	    "\n"
+	    " --pack-threshold N         Append vault objects of up to N bytes, as stored,\n"
+	    "                            to pack files instead of giving each its own\n"
+	    "                            file.  Only files staged in memory are packed.\n"
+	    "                            Defaults to 0, no packing.\n"
+	    "\n"
+	    " --sync none|file|group     When to flush vault files to disk.  \"group\"\n"
+	    "                            syncs the vault once before each batch of\n"
+	    "                            catalog records is committed, \"file\" syncs\n"
+	    "                            every file as it is stored.  Defaults to none.\n"
+	    "\n"
+	    " --io-uring                 Write, close and rename files staged in memory\n"
+	    "                            into the vault through io_uring, so the next\n"
+	    "                            file is processed while they are stored.\n"
+	    "                            Ignored where io_uring is unavailable, and\n"
+	    "                            with --sync file.\n"
+	    "\n"
+	    " --batch-size N             Commit received file records to the catalog\n"
+	    "                            every N records (default 10000), or after 5\n"
+	    "                            seconds if the catalog is idle.  Records keep\n"
+	    "                            arriving while a batch is committed.\n"
+	    "\n"
+	    " --virtual-file PATH        Read a single file's contents from standard\n"
+	    "                            input instead of a tar file, such as the\n"
+	    "                            output of a database dump, and record it in\n"
+	    "                            the backup as PATH.  No newbackup is needed.\n"
+	    "\n"
+	    " --mode MODE                Octal permissions for --virtual-file.\n"
+	    "                            Defaults to 0600.\n"
+	    "\n"
+	    " -r, --retention schedule   With --virtual-file, create the backup set with\n"
+	    "                            this retention schedule if it doesn't exist.\n"
+	    "\n"
 	    " -v,                        Verbose output\n"
 	);
     if (strcmp(topic, "restore") == 0)
@@ -776,7 +970,8 @@ int help(char *topic)
 	    "Usage: snebu purge\n"
 	    " Permanantly removes files from disk storage that are no longer\n"
 	    " referenced by any backups. Run this command after running \"snebu\n"
-	    " expire\".\n"
+	    " expire\".  Pack files that are mostly purged objects, or small, are\n"
+	    " then rewritten, unless a backup or restore is using them.\n"
 	);
     if (strcmp(topic, "permissions") == 0)
 	printf(
@@ -803,16 +998,74 @@ int help(char *topic)
             "  expire\n"
             "  purge\n"
             "  permissions\n"
+            "  compression\n"
+            "  recompress\n"
             "\n"
-            "Note, that since the purge subcommand doesn't take a list of hostnames, along\n"
-	    "with the permissions subcommand, and the expire subcommand when run with the\n"
-	    "--age option, you must specify the hostname '*' to give access to a specific\n"
-	    "user.\n"
+            "Note, that since the purge and recompress subcommands don't take a list of\n"
+	    "hostnames, along with the permissions subcommand, and the expire subcommand\n"
+	    "when run with the --age option, you must specify the hostname '*' to give\n"
+	    "access to a specific user.\n"
 	    "\n"
 	    "To grant permissions, a this command must be run as the user that snebu is\n"
 	    "installed under, or the user must be granted access to the permissions\n"
 	    "subcommand\n"
 	);
+    if (strcmp(topic, "compression") == 0)
+	printf(
+	    "Usage: snebu compression -n backupname [ --method lzo|zstd ] [ --level N ]\n"
+	    "  [ --train [ --samples N ]] [ --no-dictionary ]\n"
+	    " Sets how vault objects stored for a backup name from now on are\n"
+	    " compressed.  With only -n, shows the current setting.  Objects already\n"
+	    " in the vault are left as they are, and restore reads either kind.\n"
+	    "\n"
+	    "Options:\n"
+	    " -n, --name backupname      Name of the backup.\n"
+	    "\n"
+	    " -m, --method lzo|zstd      Compress new objects with lzop (the default), or\n"
+	    "                            zstd.\n"
+	    "\n"
+	    " -l, --level N              zstd compression level, 1 to 19.  Defaults to 3.\n"
+	    "\n"
+	    " -t, --train                Train a zstd dictionary on a sample of the\n"
+	    "                            backup name's small files (128KB or less) in\n"
+	    "                            the vault, and compress new objects with it.\n"
+	    "                            Implies --method zstd.\n"
+	    "\n"
+	    " -s, --samples N            Number of files to train on.  Defaults to 2000.\n"
+	    "\n"
+	    "     --no-dictionary        Stop using the trained dictionary for new objects.\n"
+	    "                            It is kept for reading the ones that use it.\n"
+	    "\n"
+	    " -v,                        Verbose output\n"
+	);
+    if (strcmp(topic, "recompress") == 0)
+	printf(
+	    "Usage: snebu recompress [ -a days ] [ --method lzo|zstd ] [ --level N ]\n"
+	    "  [ --rate MB/s ] [ --time minutes ] [ --restart ]\n"
+	    " Rewrites vault objects that no recent backup refers to with a slower,\n"
+	    " tighter codec, checking each new copy reads back the same before it\n"
+	    " replaces the old one.  Each run carries on from where the last one\n"
+	    " stopped, so it can be run nightly with a time limit.  Packed, raw and\n"
+	    " encrypted objects are left alone.\n"
+	    "\n"
+	    "Options:\n"
+	    " -a, --age days             Only rewrite objects that no backup from the\n"
+	    "                            last \"days\" days refers to.  Defaults to 30.\n"
+	    "\n"
+	    " -m, --method lzo|zstd      Rewrite with zstd (the default), or with lzop's\n"
+	    "                            lzo1x_999, which any lzop can still read.\n"
+	    "\n"
+	    " -l, --level N              zstd compression level, 1 to 19.  Defaults to 19.\n"
+	    "\n"
+	    "     --rate MB/s            Read no more than this many MB of objects a\n"
+	    "                            second.\n"
+	    "\n"
+	    "     --time minutes         Stop after this many minutes.\n"
+	    "\n"
+	    "     --restart              Start over from the beginning of the vault.\n"
+	    "\n"
+	    " -v,                        Verbose output\n"
+	);
     if (strcmp(topic, "help") == 0)
 	printf(
 	    "Usage: snebu help [ subcommand ]\n"
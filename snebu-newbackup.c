@@ -21,7 +21,9 @@
 #include <getopt.h>
 #include <string.h>
 #include <sqlite3.h>
+#include <stdint.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "tarlib.h"
 
 extern struct {
@@ -41,7 +43,69 @@ char *stresc(char *src, char **target);
 char *strescb(char *src, char **target, int len);
 char *strunesc(char *src, char **target);
 int checkperm(sqlite3 *bkcatalog, char *action, char *backupname);
-int flush_inbound_files(sqlite3 *bkcatalog, int bkid, int force_full_backup, int output_terminator);
+void vault_partial_path(char *bkname, char *filename, unsigned long long int size,
+    long long int modtime, char *path);
+unsigned long long int vault_partial_offset(char *path, char **ext);
+
+/* What earlier backups of this name hold, as an open addressing hash
+ * table of fingerprints of the columns that decide whether a file has
+ * changed.  Each manifest line is fingerprinted the same way as it is
+ * read, so the diff costs one probe per line instead of a join over
+ * the whole manifest.  The fingerprint is the first 128 bits of a
+ * SHA-256 over the columns, so the columns themselves aren't kept.
+ *
+ * The table is filled from latest_state, which holds the fingerprints
+ * and file_ids of the last backup of each name that submitfiles
+ * finished sending a newbackup manifest for, sorted by fingerprint, in
+ * blobs of up to NB_BLOCK_ENTRIES entries.  submitfiles rewrites it for
+ * the name as such a session ends, reusing what is there for files
+ * that carried over.  Sets that didn't come from a manifest (a
+ * --virtual-file dump, say) hold only part of the host, and never
+ * replace it.  Backups of the
+ * name started since then (one that was cut off, or the one being
+ * resumed) are added from backupset_detail, so the cost of a diff
+ * follows the size of the host rather than how many backups of it are
+ * kept.  A name with no latest_state yet is loaded from all of its
+ * backups, as before.  purge drops the file_ids it removes.
+ */
+#define NB_FP_SIZE 16
+#define NB_NCOLS 13
+#define NB_LISTED -1			// file_id of a line already listed
+#define NB_MINSLOTS 65536
+#define NB_ENTRY_SIZE (NB_FP_SIZE + 8)	// fingerprint, then little endian file_id
+#define NB_BLOCK_ENTRIES 65536
+
+struct nb_diff {
+    struct nb_diff_slot {
+	unsigned char fp[NB_FP_SIZE];
+	sqlite3_int64 file_id;		// 0 for an empty slot
+    } *slots;
+    size_t nslots;			// always a power of two
+    size_t count;
+    EVP_MD_CTX *ctx;
+    const EVP_MD *md;
+    sqlite3_int64 *keep;		// file_ids carried into this backup
+    size_t nkeep;
+    size_t maxkeep;
+};
+
+struct nb_diff *nb_diff_new();
+void nb_diff_load(struct nb_diff *d, sqlite3 *bkcatalog, char *bkname, int verbose);
+void nb_diff_fingerprint(struct nb_diff *d, const char **col, unsigned char *fp);
+int nb_diff_row_fingerprint(struct nb_diff *d, sqlite3_stmt *sqlres, int firstcol,
+    unsigned char *fp);
+void nb_diff_add(struct nb_diff *d, unsigned char *fp, sqlite3_int64 file_id);
+int nb_diff_match(struct nb_diff *d, unsigned char *fp);
+void nb_diff_commit(struct nb_diff *d, sqlite3 *bkcatalog, int bkid);
+void nb_diff_free(struct nb_diff *d);
+void nb_list_needed(char *infilename, char ftype, unsigned long long int size,
+    long long int modtime, int output_terminator, char *bkname, FILE *resumelist,
+    char **escfname);
+int latest_state_update(sqlite3 *bkcatalog, int bkid, int verbose);
+int latest_state_purge(sqlite3 *bkcatalog, char *purgetable, int verbose);
+static void nb_entry_get(const unsigned char *p, struct nb_diff_slot *slot);
+static void nb_entry_put(unsigned char *p, struct nb_diff_slot *slot);
+static int nb_cmp_slot(const void *a, const void *b);
 
 int newbackup(int argc, char **argv)
 {
@@ -85,6 +149,7 @@ int newbackup(int argc, char **argv)
     char *unescfname = 0;
     char *unescltarget = 0;
     int verbose = 0;
+    FILE *resumelist = NULL;
     struct option longopts[] = {
 	{ "name", required_argument, NULL, 'n' },
 	{ "datestamp", required_argument, NULL, 'd' },
@@ -96,6 +161,7 @@ int newbackup(int argc, char **argv)
 	{ "null-output", no_argument, NULL, 0 },
 	{ "not-null-output", no_argument, NULL, 0 },
 	{ "full", no_argument, NULL, 0 },
+	{ "resume-list", required_argument, NULL, 0 },
 	{ "verbose", no_argument, NULL, 'v' },
 	{ NULL, no_argument, NULL, 0 }
     };
@@ -159,6 +225,12 @@ int newbackup(int argc, char **argv)
 		    output_terminator = 10;
 		if (strcmp("full", longopts[longoptidx].name) == 0)
 		    force_full_backup = 1;
+		if (strcmp("resume-list", longopts[longoptidx].name) == 0) {
+		    if ((resumelist = fopen(optarg, "w")) == NULL) {
+			fprintf(stderr, "Error creating %s\n", optarg);
+			return(1);
+		    }
+		}
 		break;
 	    default:
 		usage();
@@ -216,86 +288,19 @@ int newbackup(int argc, char **argv)
     sqlite3_free(sqlstmt);
 
     logaction(bkcatalog, bkid, 0, "New backup");
+
     sqlite3_exec(bkcatalog,
-        "create temporary table if not exists inbound_file_entities (  \n"
-//      "create table if not exists inbound_file_entities (  \n"
-        "    backupset_id     integer,  \n"
-        "    ftype         char,  \n"
-        "    permission    char,  \n"
+        "create temporary table if not exists inbound_needed_files (  \n"
         "    device_id     char,  \n"
         "    inode         char,  \n"
-        "    user_name     char,  \n"
-        "    user_id       integer,  \n"
-        "    group_name    char,  \n"
-        "    group_id      integer,  \n"
-        "    size          integer,  \n"
-        "    hash           char,  \n"
-        "    cdatestamp    integer,  \n"
-        "    datestamp     integer,  \n"
         "    filename      char,  \n"
-        "    extdata       char default '',  \n"
         "    infilename    char,  \n"
-        "constraint inbound_file_entitiesc1 unique (  \n"
-        "    backupset_id,  \n"
-        "    ftype,  \n"
-        "    permission,  \n"
-        "    device_id,  \n"
-        "    inode,  \n"
-        "    user_name,  \n"
-        "    user_id,  \n"
-        "    group_name,  \n"
-        "    group_id,  \n"
-        "    size,  \n"
-        "    hash,  \n"
-        "    cdatestamp,  \n"
-        "    datestamp,  \n"
-        "    filename,  \n"
-        "    extdata, \n"
-        "    infilename))", 0, 0, &sqlerr);
-
+        "    size          integer,  \n"
+        "    cdatestamp    integer)", 0, 0, &sqlerr);
     if (sqlerr != 0) {
 	fprintf(stderr, "%s\n\n\n",sqlerr);
 	sqlite3_free(sqlerr);
-    }   
-
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"create temporary table thishost_file_ids as "
-	"select distinct file_id from backupsets b "
-	"join backupset_detail d "
-	"on b.backupset_id = d.backupset_id and name = '%q'", bkname)), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
-    }
-    sqlite3_free(sqlstmt);
-
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"create temporary table thishost_file_details as "
-	"select t.file_id, ftype, permission, device_id, inode, user_name, user_id, "
-	"group_name, group_id, size, %s hash, cdatestamp, datestamp, "
-	"filename, extdata from thishost_file_ids t join file_entities f "
-	"on t.file_id = f.file_id", SHN)), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
     }
-    sqlite3_free(sqlstmt);
-
-
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"create index if not exists thishost_file_details_i1 on thishost_file_details (hash)")), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
-    }
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"create index if not exists thishost_file_details_i2 on thishost_file_details (filename)")), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
-    }
-    sqlite3_free(sqlstmt);
-
 
     if (verbose >= 1)
 	fprintf(stderr, "Gathering full snapshot file manifest\n");
@@ -303,21 +308,18 @@ int newbackup(int argc, char **argv)
     time_t curtime = time(NULL);
 
     sqlite3_prepare_v2(bkcatalog,
-	(sqlstmt = sqlite3_mprintf(
-            "insert or ignore into inbound_file_entities "
-            "(backupset_id, ftype, permission, device_id, inode, user_name, user_id, group_name,  "
-            "group_id, size, hash, cdatestamp, datestamp, filename, extdata, infilename)  "
-	    "values (@bkid, @ftype, @mode, @devid, @inode, @auid, @nuid, @agid, @ngid, @filesize, @hash, @cmodtime, @modtime, @pathsub, @linktarget, @filename)")),
-	    -1, &sqlres, 0);
-
-        
+	"insert into inbound_needed_files "
+	"(device_id, inode, filename, infilename, size, cdatestamp)  "
+	"values (@devid, @inode, @pathsub, @filename, @filesize, @cmodtime)",
+	-1, &sqlres, 0);
+
     char *tmppathsub = NULL;
-    int fib1 = 0;
-    int fib2 = 1;
-    int fib3 = 1;
+    char *escfname = 0;
+    struct nb_diff *diff = nb_diff_new();
+    unsigned char fp[NB_FP_SIZE];
 
-    time_t starttime = time(NULL);
     time_t laststattime = time(NULL);
+    time_t lastflushtime = time(NULL);
     while (getdelim(&filespecs, &filespeclen, input_terminator, stdin) > 0) {
 	int pathskip = 0;
 	char pathsub[4097];
@@ -325,6 +327,8 @@ int newbackup(int argc, char **argv)
 	parse(filespecs, &filespecsl, '\t');
 	if (filecount < 1) {
 	    sqlite3_exec(bkcatalog, "END", 0, 0, 0);
+	    if (force_full_backup == 0)
+		nb_diff_load(diff, bkcatalog, bkname, verbose);
 	    sqlite3_exec(bkcatalog, "BEGIN", 0, 0, 0);
 	}
 	filecount++;
@@ -403,58 +407,56 @@ int newbackup(int argc, char **argv)
 		break;
 	    }
 	}
-	sqlite3_bind_int(sqlres, 1, bkid);
-	sqlite3_bind_text(sqlres, 2, &fs.ftype, 1, SQLITE_STATIC);
-	sprintf(tmpmodestr, "%4.4o", fs.mode);
-	sqlite3_bind_text(sqlres, 3, tmpmodestr, -1, SQLITE_STATIC);
-	sqlite3_bind_text(sqlres, 4, fs.devid, -1, SQLITE_STATIC);
-	sqlite3_bind_text(sqlres, 5, fs.inode, -1, SQLITE_STATIC);
-	sqlite3_bind_text(sqlres, 6, fs.auid, -1, SQLITE_STATIC);
-	sqlite3_bind_int(sqlres, 7, fs.nuid);
-	sqlite3_bind_text(sqlres, 8, fs.agid, -1, SQLITE_STATIC);
-	sqlite3_bind_int(sqlres, 9, fs.ngid);
-	sqlite3_bind_int64(sqlres, 10, fs.filesize);
-	sqlite3_bind_text(sqlres, 11, fs.sha1, -1, SQLITE_STATIC);
-	sqlite3_bind_int(sqlres, 12, fs.cmodtime);
-	sqlite3_bind_int(sqlres, 13, fs.modtime);
 	strncpya0(&tmppathsub, pathsub, 0);
 	strcata(&tmppathsub, fs.filename + pathskip);
-	sqlite3_bind_text(sqlres, 14, tmppathsub, -1, SQLITE_STATIC);
-	sqlite3_bind_text(sqlres, 15, fs.linktarget, -1, SQLITE_STATIC);
-	sqlite3_bind_text(sqlres, 16, fs.filename, -1, SQLITE_STATIC);
+	{
+	    char ftypestr[2] = { fs.ftype, 0 };
+	    char nuidstr[32];
+	    char ngidstr[32];
+	    char filesizestr[32];
+	    char cmodtimestr[32];
+	    char modtimestr[32];
+	    const char *col[NB_NCOLS] = { ftypestr, tmpmodestr, fs.devid, fs.inode,
+		fs.auid, nuidstr, fs.agid, ngidstr, filesizestr, cmodtimestr,
+		modtimestr, tmppathsub, fs.linktarget };
 
-	sqlite3_step(sqlres);
-	sqlite3_reset(sqlres);
-#if 0
-        sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-            "insert or ignore into inbound_file_entities "
-            "(backupset_id, ftype, permission, device_id, inode, user_name, user_id, group_name,  "
-            "group_id, size, hash, cdatestamp, datestamp, filename, extdata, infilename)  "
-            "values ('%d', '%c', '%4.4o', '%q', '%q', '%q', '%d', '%q', '%d', '%llu', '%q', '%d', '%d', '%q%q', '%q', '%q')",
-            bkid, fs.ftype, fs.mode, fs.devid, fs.inode, fs.auid, fs.nuid, fs.agid, fs.ngid,
-            fs.filesize, fs.sha1, fs.cmodtime, fs.modtime, pathsub, fs.filename + pathskip, fs.linktarget, fs.filename)), 0, 0, &sqlerr);
-        if (sqlerr != 0) {
-            fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-            sqlite3_free(sqlerr);
-        }
-        sqlite3_free(sqlstmt);
-#endif
+	    sprintf(tmpmodestr, "%4.4o", fs.mode);
+	    sprintf(nuidstr, "%d", fs.nuid);
+	    sprintf(ngidstr, "%d", fs.ngid);
+	    sprintf(filesizestr, "%llu", fs.filesize);
+	    sprintf(cmodtimestr, "%d", fs.cmodtime);
+	    sprintf(modtimestr, "%d", fs.modtime);
+	    nb_diff_fingerprint(diff, col, fp);
+	}
+
+	// List it unless it is unchanged since an earlier backup of this
+	// name, or was already listed by an identical line
+	if (nb_diff_match(diff, fp) == 0) {
+	    nb_diff_add(diff, fp, NB_LISTED);
+	    nb_list_needed(fs.filename, fs.ftype, fs.filesize, fs.modtime,
+		output_terminator, bkname, resumelist, &escfname);
+	    sqlite3_bind_text(sqlres, 1, fs.devid, -1, SQLITE_STATIC);
+	    sqlite3_bind_text(sqlres, 2, fs.inode, -1, SQLITE_STATIC);
+	    sqlite3_bind_text(sqlres, 3, tmppathsub, -1, SQLITE_STATIC);
+	    sqlite3_bind_text(sqlres, 4, fs.filename, -1, SQLITE_STATIC);
+	    sqlite3_bind_int64(sqlres, 5, fs.filesize);
+	    sqlite3_bind_int(sqlres, 6, fs.cmodtime);
+	    sqlite3_step(sqlres);
+	    sqlite3_reset(sqlres);
+	}
+
+	if ((curtime = time(NULL)) > lastflushtime) {
+	    fflush(stdout);
+	    if (resumelist != NULL)
+		fflush(resumelist);
+	    lastflushtime = curtime;
+	}
         if (verbose > 0) {
-	    if ((curtime = time(NULL)) > laststattime + 2) {
+	    if (curtime > laststattime + 2) {
 		fprintf(stderr, " Processed %d files              \r", filecount);
 		laststattime = curtime;
 	    }
 	}
-	if ((curtime = time(NULL)) > starttime + fib3) {
-	    fib1 = fib2;
-	    fib2 = fib3;
-	    fib3 = fib1 + fib2;
-
-	    if (verbose > 0) {
-		fprintf(stderr, "*\r");
-	    }
-	    flush_inbound_files(bkcatalog, bkid, force_full_backup, output_terminator);
-	}
     }
     sqlite3_finalize(sqlres);
     dfree(filespecsl);
@@ -464,167 +466,570 @@ int newbackup(int argc, char **argv)
         sqlite3_close(bkcatalog);
 	exit(1);
     }
-    if (verbose > 0) {
-	fprintf(stderr, "*\r");
-	flush_inbound_files(bkcatalog, bkid, force_full_backup, output_terminator);
+    fflush(stdout);
+    if (verbose > 0)
 	fprintf(stderr, " Processed %d files              \n", filecount);
-    }
-    sqlite3_exec(bkcatalog, "END", 0, 0, 0);
+    nb_diff_commit(diff, bkcatalog, bkid);
+    nb_diff_free(diff);
+    if (resumelist != NULL)
+	fclose(resumelist);
     logaction(bkcatalog, bkid, 3, "Finished generating incremental manifest");
 
     return(0);
 }
-int flush_inbound_files(sqlite3 *bkcatalog, int bkid, int force_full_backup, int output_terminator)
+
+struct nb_diff *nb_diff_new()
+{
+    struct nb_diff *d;
+
+    if ((d = calloc(1, sizeof(struct nb_diff))) == NULL ||
+	(d->slots = calloc(NB_MINSLOTS, sizeof(struct nb_diff_slot))) == NULL) {
+	fprintf(stderr, "newbackup: out of memory\n");
+	exit(1);
+    }
+    d->nslots = NB_MINSLOTS;
+    d->ctx = EVP_MD_CTX_new();
+    d->md = EVP_sha256();
+    return(d);
+}
+
+/* Load this name's latest_state, and the files of any backups of it
+ * started since.  Without a latest_state, every backup of the name is
+ * loaded.
+ */
+void nb_diff_load(struct nb_diff *d, sqlite3 *bkcatalog, char *bkname, int verbose)
 {
-    static int first_flush = 0;
-    char *escfname = 0;
     sqlite3_stmt *sqlres;
     char *sqlstmt = 0;
-    char *sqlerr;
+    unsigned char fp[NB_FP_SIZE];
+    struct nb_diff_slot slot;
+    const unsigned char *entries;
+    int snapshot_id = 0;
+    size_t fromstate;
+    int i;
+    int n;
 
-    sqlite3_exec(bkcatalog,
-    "create index if not exists inbound_file_entitiesi1 on inbound_file_entities (  \n"
-    "    filename)", 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n\n\n",sqlerr);
-	sqlite3_free(sqlerr);
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select backupset_id, entries from latest_state where name = '%q' "
+	"order by block", bkname)), -1, &sqlres, 0);
+    while (sqlite3_step(sqlres) == SQLITE_ROW) {
+	snapshot_id = sqlite3_column_int(sqlres, 0);
+	entries = sqlite3_column_blob(sqlres, 1);
+	n = sqlite3_column_bytes(sqlres, 1) / NB_ENTRY_SIZE;
+	for (i = 0; i < n; i++) {
+	    nb_entry_get(entries + i * NB_ENTRY_SIZE, &slot);
+	    nb_diff_add(d, slot.fp, slot.file_id);
+	}
     }
+    sqlite3_finalize(sqlres);
+    sqlite3_free(sqlstmt);
+    if (verbose >= 1 && snapshot_id > 0)
+	fprintf(stderr, "Loaded %zu files from the latest state\n", d->count);
+    fromstate = d->count;
 
-    sqlite3_exec(bkcatalog,
-    "create index if not exists inbound_file_entitiesi2 on inbound_file_entities (  \n"
-    "    infilename)", 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n\n\n",sqlerr);
-	sqlite3_free(sqlerr);
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select file_id, ftype, permission, device_id, inode, user_name, user_id, "
+	"group_name, group_id, size, cdatestamp, datestamp, filename, extdata "
+	"from file_entities where file_id in (select d.file_id from backupsets b "
+	"join backupset_detail d on b.backupset_id = d.backupset_id "
+	"where b.name = '%q' and b.backupset_id > %d)", bkname, snapshot_id)), -1, &sqlres, 0);
+    while (sqlite3_step(sqlres) == SQLITE_ROW)
+	if (nb_diff_row_fingerprint(d, sqlres, 1, fp) == 0)
+	    nb_diff_add(d, fp, sqlite3_column_int64(sqlres, 0));
+    sqlite3_finalize(sqlres);
+    sqlite3_free(sqlstmt);
+    if (verbose >= 1 && (snapshot_id == 0 || d->count > fromstate))
+	fprintf(stderr, "Loaded %zu files from %s backups\n", d->count - fromstate,
+	    snapshot_id == 0 ? "earlier" : "later");
+}
+
+/* Fingerprint a file_entities row, given as the NB_NCOLS compared
+ * columns starting at firstcol.  Returns 1 for a row the old join
+ * could never have matched (a null in one of the columns).  An S or E
+ * entry (a regular file stored sparse or encrypted) is compared as a
+ * plain regular file, ignoring its extdata.
+ */
+int nb_diff_row_fingerprint(struct nb_diff *d, sqlite3_stmt *sqlres, int firstcol,
+    unsigned char *fp)
+{
+    const char *col[NB_NCOLS];
+    int i;
+
+    for (i = 0; i < NB_NCOLS; i++)
+	if ((col[i] = (const char *) sqlite3_column_text(sqlres, firstcol + i)) == NULL)
+	    return(1);
+    if (strcmp(col[0], "S") == 0 || strcmp(col[0], "E") == 0) {
+	col[0] = "0";
+	col[NB_NCOLS - 1] = "";
     }
+    nb_diff_fingerprint(d, col, fp);
+    return(0);
+}
 
-    if (force_full_backup == 1) {
-	if (first_flush == 0) {
-	    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-		"delete from needed_file_entities where backupset_id = '%d' ",
-		bkid)), 0, 0, &sqlerr);
-	    if (sqlerr != 0) {
-		fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-		sqlite3_free(sqlerr);
-	    }
-	    sqlite3_free(sqlstmt);
-	    first_flush = 1;
+void nb_diff_fingerprint(struct nb_diff *d, const char **col, unsigned char *fp)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    int i;
+
+    EVP_DigestInit_ex(d->ctx, d->md, NULL);
+    for (i = 0; i < NB_NCOLS; i++)
+	EVP_DigestUpdate(d->ctx, col[i], strlen(col[i]) + 1);
+    EVP_DigestFinal_ex(d->ctx, md, &mdlen);
+    memcpy(fp, md, NB_FP_SIZE);
+}
+
+/* Entries with the same fingerprint (the same file stored under more
+ * than one file_id) each get a slot of their own.
+ */
+void nb_diff_add(struct nb_diff *d, unsigned char *fp, sqlite3_int64 file_id)
+{
+    uint64_t h;
+    size_t i;
+
+    if ((d->count + 1) * 2 > d->nslots) {
+	struct nb_diff_slot *old = d->slots;
+	size_t oldn = d->nslots;
+
+	d->nslots *= 2;
+	if ((d->slots = calloc(d->nslots, sizeof(struct nb_diff_slot))) == NULL) {
+	    fprintf(stderr, "newbackup: out of memory\n");
+	    exit(1);
 	}
-	sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	    "insert or ignore into needed_file_entities  "
-	    "(backupset_id, device_id, inode, filename, infilename, size, cdatestamp)  "
-	    "select %d, device_id, inode, filename, infilename, size, cdatestamp from inbound_file_entities", bkid)), 0, 0, &sqlerr);
-	if (sqlerr != 0) {
-	    fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-	    sqlite3_free(sqlerr);
+	for (i = 0; i < oldn; i++) {
+	    size_t j;
+
+	    if (old[i].file_id == 0)
+		continue;
+	    memcpy(&h, old[i].fp, sizeof(h));
+	    for (j = h & (d->nslots - 1); d->slots[j].file_id != 0;
+		j = (j + 1) & (d->nslots - 1))
+		;
+	    d->slots[j] = old[i];
 	}
+	free(old);
     }
-    else {
-	if (first_flush == 0) {
-	    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-		"delete from needed_file_entities where backupset_id = '%d' ",
-		bkid)), 0, 0, &sqlerr);
-	    if (sqlerr != 0) {
-		fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-		sqlite3_free(sqlerr);
+    memcpy(&h, fp, sizeof(h));
+    for (i = h & (d->nslots - 1); d->slots[i].file_id != 0; i = (i + 1) & (d->nslots - 1))
+	;
+    memcpy(d->slots[i].fp, fp, NB_FP_SIZE);
+    d->slots[i].file_id = file_id;
+    d->count++;
+}
+
+/* Returns nonzero if the line needn't be listed.  Every earlier
+ * file_id it matches is kept for the new backup's detail, as the old
+ * join did.
+ */
+int nb_diff_match(struct nb_diff *d, unsigned char *fp)
+{
+    uint64_t h;
+    size_t i;
+    int found = 0;
+
+    memcpy(&h, fp, sizeof(h));
+    for (i = h & (d->nslots - 1); d->slots[i].file_id != 0; i = (i + 1) & (d->nslots - 1)) {
+	if (memcmp(d->slots[i].fp, fp, NB_FP_SIZE) != 0)
+	    continue;
+	found = 1;
+	if (d->slots[i].file_id == NB_LISTED)
+	    continue;
+	if (d->nkeep >= d->maxkeep) {
+	    d->maxkeep = d->maxkeep == 0 ? 65536 : d->maxkeep * 2;
+	    if ((d->keep = realloc(d->keep, d->maxkeep * sizeof(sqlite3_int64))) == NULL) {
+		fprintf(stderr, "newbackup: out of memory\n");
+		exit(1);
 	    }
-	    sqlite3_free(sqlstmt);
-	    first_flush = 1;
 	}
-        sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	    "delete from inbound_file_entities "
-	    "where exists (select * from needed_file_entities "
-	    "where needed_file_entities.filename = inbound_file_entities.filename "
-	    "and needed_file_entities.backupset_id = %d)" , bkid)),0, 0, &sqlerr);
-        if (sqlerr != 0) {
-            fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-            sqlite3_free(sqlerr);
-        }   
-        sqlite3_free(sqlstmt);
-
-        sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-            "insert or ignore into needed_file_entities  "
-            "(backupset_id, device_id, inode, filename, infilename, size, cdatestamp)  "
-            "select distinct %d, i.device_id, i.inode, i.filename, i.infilename, "
-            "i.size, i.cdatestamp from inbound_file_entities i  "
-            "left join thishost_file_details f on  "
-            "i.ftype = case when f.ftype = 'S' or f.ftype = 'E' then '0' else f.ftype end  "
-            "and i.permission = f.permission  "
-            "and i.device_id = f.device_id and i.inode = f.inode  "
-            "and i.user_name = f.user_name and i.user_id = f.user_id  "
-            "and i.group_name = f.group_name and i.group_id = f.group_id  "
-            "and i.size = f.size and i.cdatestamp = f.cdatestamp and i.datestamp = f.datestamp  "
-            "and i.filename = f.filename and ((i.ftype = '0' and (f.ftype = 'S' or f.ftype = 'E'))  "
-            "or i.extdata = f.extdata)  "
-            "where f.file_id is null ",
-            bkid)), 0, 0, &sqlerr);
-        if (sqlerr != 0) {
-            fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-            sqlite3_free(sqlerr);
-        }   
-        sqlite3_free(sqlstmt);
-
-        sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-            "insert or ignore into backupset_detail  "
-            "(backupset_id, file_id)  "
-            "select %d, f.file_id from thishost_file_details f  "
-            "join inbound_file_entities i  "
-            "on i.ftype = case when f.ftype = 'S' or f.ftype = 'E' then '0' else f.ftype end  "
-            "and i.permission = f.permission  "
-            "and i.device_id = f.device_id and i.inode = f.inode  "
-            "and i.user_name = f.user_name and i.user_id = f.user_id  "
-            "and i.group_name = f.group_name and i.group_id = f.group_id  "
-            "and i.size = f.size and i.cdatestamp = f.cdatestamp and i.datestamp = f.datestamp  "
-            "and i.filename = f.filename and ((i.ftype = '0'  and (f.ftype = 'S' or f.ftype = 'E'))  "
-            "or i.extdata = f.extdata)", bkid)), 0, 0, &sqlerr);
-        if (sqlerr != 0) {
-            fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-            sqlite3_free(sqlerr);
-        }
-        sqlite3_free(sqlstmt);
+	d->keep[d->nkeep++] = d->slots[i].file_id;
     }
-    sqlite3_exec(bkcatalog, "END", 0, 0, 0);
-    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"select n.infilename from needed_file_entities n "
-	"join inbound_file_entities i "
-	"on n.infilename = i.infilename "
-	"where n.backupset_id = '%d'", bkid)), -1, &sqlres, 0);
-    while (sqlite3_step(sqlres) == SQLITE_ROW)
-	if (output_terminator == 0) {
-	    printf("%s", sqlite3_column_text(sqlres, 0));
-	    fwrite("\000", 1, 1, stdout);
-	}
-	else
-	    printf("%s\n", stresc((char *) sqlite3_column_text(sqlres, 0), &escfname));
-    fflush(stdout);
+    return(found);
+}
 
-    sqlite3_finalize(sqlres);
-    sqlite3_free(sqlstmt);
+static int nb_cmp_file_id(const void *a, const void *b)
+{
+    sqlite3_int64 x = *(const sqlite3_int64 *) a;
+    sqlite3_int64 y = *(const sqlite3_int64 *) b;
 
+    return(x < y ? -1 : x > y);
+}
 
-    sqlite3_exec(bkcatalog, "BEGIN", 0, 0, 0);
+/* The only catalog writes: what needs sending, and what carries over
+ * unchanged, in the transaction the manifest was read under.  The
+ * file_ids go in sorted so the backupset_detail index is filled in
+ * order.
+ */
+void nb_diff_commit(struct nb_diff *d, sqlite3 *bkcatalog, int bkid)
+{
+    sqlite3_stmt *sqlres;
+    char *sqlstmt = 0;
+    char *sqlerr;
+    size_t i;
 
-    sqlite3_exec(bkcatalog,
-    "drop index inbound_file_entitiesi1", 0, 0, &sqlerr);
+    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"delete from needed_file_entities where backupset_id = '%d' ",
+	bkid)), 0, 0, &sqlerr);
     if (sqlerr != 0) {
-	fprintf(stderr, "%s\n\n\n",sqlerr);
+	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
 	sqlite3_free(sqlerr);
     }
+    sqlite3_free(sqlstmt);
 
-    sqlite3_exec(bkcatalog,
-    "drop index inbound_file_entitiesi2", 0, 0, &sqlerr);
+    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"insert or ignore into needed_file_entities  "
+	"(backupset_id, device_id, inode, filename, infilename, size, cdatestamp)  "
+	"select %d, device_id, inode, filename, infilename, size, cdatestamp "
+	"from inbound_needed_files", bkid)), 0, 0, &sqlerr);
     if (sqlerr != 0) {
-	fprintf(stderr, "%s\n\n\n",sqlerr);
+	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
 	sqlite3_free(sqlerr);
     }
+    sqlite3_free(sqlstmt);
+
+    qsort(d->keep, d->nkeep, sizeof(sqlite3_int64), nb_cmp_file_id);
+    sqlite3_prepare_v2(bkcatalog,
+	"insert or ignore into backupset_detail (backupset_id, file_id) values (?1, ?2)",
+	-1, &sqlres, 0);
+    for (i = 0; i < d->nkeep; i++) {
+	if (i > 0 && d->keep[i] == d->keep[i - 1])
+	    continue;
+	sqlite3_bind_int(sqlres, 1, bkid);
+	sqlite3_bind_int64(sqlres, 2, d->keep[i]);
+	sqlite3_step(sqlres);
+	sqlite3_reset(sqlres);
+    }
+    sqlite3_finalize(sqlres);
+
+    sqlite3_exec(bkcatalog, "END", 0, 0, 0);
+}
+
+void nb_diff_free(struct nb_diff *d)
+{
+    EVP_MD_CTX_free(d->ctx);
+    free(d->slots);
+    free(d->keep);
+    free(d);
+}
+
+/* List a file that needs sending.  With a resume list, a regular file
+ * that an interrupted backup left part of in the vault goes in it too,
+ * along with how much of it is there.
+ */
+void nb_list_needed(char *infilename, char ftype, unsigned long long int size,
+    long long int modtime, int output_terminator, char *bkname, FILE *resumelist,
+    char **escfname)
+{
+    char partpath[1024];
+    char *partext;
+    unsigned long long int offset;
+
+    if (output_terminator == 0) {
+	printf("%s", infilename);
+	fwrite("\000", 1, 1, stdout);
+    }
+    else
+	printf("%s\n", stresc(infilename, escfname));
+    if (resumelist != NULL && ftype == '0') {
+	vault_partial_path(bkname, infilename, size, modtime, partpath);
+	offset = vault_partial_offset(partpath, &partext);
+	if (offset > 0 && offset < size) {
+	    fprintf(resumelist, "%llu\t%s", offset, infilename);
+	    fwrite("\000", 1, 1, resumelist);
+	}
+    }
+}
+
+static void nb_entry_get(const unsigned char *p, struct nb_diff_slot *slot)
+{
+    uint64_t id = 0;
+    int i;
+
+    memcpy(slot->fp, p, NB_FP_SIZE);
+    for (i = 7; i >= 0; i--)
+	id = (id << 8) | p[NB_FP_SIZE + i];
+    slot->file_id = (sqlite3_int64) id;
+}
+
+static void nb_entry_put(unsigned char *p, struct nb_diff_slot *slot)
+{
+    uint64_t id = (uint64_t) slot->file_id;
+    int i;
+
+    memcpy(p, slot->fp, NB_FP_SIZE);
+    for (i = 0; i < 8; i++, id >>= 8)
+	p[NB_FP_SIZE + i] = id & 0xff;
+}
+
+static int nb_cmp_slot(const void *a, const void *b)
+{
+    const struct nb_diff_slot *x = a;
+    const struct nb_diff_slot *y = b;
+    int r;
+
+    if ((r = memcmp(x->fp, y->fp, NB_FP_SIZE)) != 0)
+	return(r);
+    return(x->file_id < y->file_id ? -1 : x->file_id > y->file_id);
+}
+
+/* Replace a name's latest_state with the files backupset bkid holds
+ * now, if newbackup made a manifest for it.  Files it shares with the
+ * current latest_state keep their fingerprints; only the rest are read
+ * from file_entities.
+ */
+int latest_state_update(sqlite3 *bkcatalog, int bkid, int verbose)
+{
+    sqlite3_stmt *sqlres;
+    sqlite3_stmt *rowres;
+    char *sqlstmt = 0;
+    char *bkname = NULL;
+    unsigned char *want = NULL;
+    sqlite3_int64 maxid = 0;
+    sqlite3_int64 id;
+    struct nb_diff *d;
+    struct nb_diff_slot *slots = NULL;
+    size_t nslots = 0;
+    size_t maxslots = 0;
+    size_t reused = 0;
+    const unsigned char *entries;
+    unsigned char *blob;
+    size_t i;
+    size_t j;
+    int n;
+    int block;
+    int err = 0;
+
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select name, (select max(file_id) from file_entities) from backupsets b "
+	"where backupset_id = %d and exists (select 1 from log l "
+	"where l.backupset_id = b.backupset_id and l.action = 3)", bkid)), -1, &sqlres, 0);
+    if (sqlite3_step(sqlres) == SQLITE_ROW) {
+	strncpya0(&bkname, (char *) sqlite3_column_text(sqlres, 0), 0);
+	maxid = sqlite3_column_int64(sqlres, 1);
+    }
+    sqlite3_finalize(sqlres);
+    sqlite3_free(sqlstmt);
+    if (bkname == NULL || maxid < 1)
+	return(1);
+
+    // The files this backup holds, by file_id
+    if ((want = calloc(maxid / 8 + 1, 1)) == NULL) {
+	fprintf(stderr, "latest state: out of memory\n");
+	exit(1);
+    }
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select file_id from backupset_detail where backupset_id = %d", bkid)),
+	-1, &sqlres, 0);
+    while (sqlite3_step(sqlres) == SQLITE_ROW)
+	if ((id = sqlite3_column_int64(sqlres, 0)) > 0 && id <= maxid)
+	    want[id / 8] |= 1 << (id % 8);
+    sqlite3_finalize(sqlres);
+    sqlite3_free(sqlstmt);
 
+    // Carry over the entries for those still there
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select entries from latest_state where name = '%q' order by block",
+	bkname)), -1, &sqlres, 0);
+    while (sqlite3_step(sqlres) == SQLITE_ROW) {
+	entries = sqlite3_column_blob(sqlres, 0);
+	n = sqlite3_column_bytes(sqlres, 0) / NB_ENTRY_SIZE;
+	for (i = 0; i < n; i++) {
+	    if (nslots >= maxslots) {
+		maxslots = maxslots == 0 ? NB_BLOCK_ENTRIES : maxslots * 2;
+		if ((slots = realloc(slots, maxslots * sizeof(struct nb_diff_slot))) == NULL) {
+		    fprintf(stderr, "latest state: out of memory\n");
+		    exit(1);
+		}
+	    }
+	    nb_entry_get(entries + i * NB_ENTRY_SIZE, &(slots[nslots]));
+	    id = slots[nslots].file_id;
+	    if (id > 0 && id <= maxid && (want[id / 8] & (1 << (id % 8))) != 0) {
+		want[id / 8] &= ~(1 << (id % 8));
+		nslots++;
+	    }
+	}
+    }
+    sqlite3_finalize(sqlres);
+    sqlite3_free(sqlstmt);
+    reused = nslots;
+
+    // Fingerprint the rest
+    d = nb_diff_new();
+    sqlite3_prepare_v2(bkcatalog,
+	"select ftype, permission, device_id, inode, user_name, user_id, "
+	"group_name, group_id, size, cdatestamp, datestamp, filename, extdata "
+	"from file_entities where file_id = ?1", -1, &rowres, 0);
+    for (id = 0; id <= maxid; id++) {
+	if (want[id / 8] == 0) {
+	    id |= 7;
+	    continue;
+	}
+	if ((want[id / 8] & (1 << (id % 8))) == 0)
+	    continue;
+	sqlite3_bind_int64(rowres, 1, id);
+	if (sqlite3_step(rowres) == SQLITE_ROW) {
+	    if (nslots >= maxslots) {
+		maxslots = maxslots == 0 ? NB_BLOCK_ENTRIES : maxslots * 2;
+		if ((slots = realloc(slots, maxslots * sizeof(struct nb_diff_slot))) == NULL) {
+		    fprintf(stderr, "latest state: out of memory\n");
+		    exit(1);
+		}
+	    }
+	    if (nb_diff_row_fingerprint(d, rowres, 0, slots[nslots].fp) == 0) {
+		slots[nslots].file_id = id;
+		nslots++;
+	    }
+	}
+	sqlite3_reset(rowres);
+    }
+    sqlite3_finalize(rowres);
+    nb_diff_free(d);
+    free(want);
+
+    qsort(slots, nslots, sizeof(struct nb_diff_slot), nb_cmp_slot);
+    if ((blob = malloc(NB_BLOCK_ENTRIES * NB_ENTRY_SIZE)) == NULL) {
+	fprintf(stderr, "latest state: out of memory\n");
+	exit(1);
+    }
+    sqlite3_exec(bkcatalog, "BEGIN IMMEDIATE", 0, 0, 0);
     sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"delete from inbound_file_entities"
-	)), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n%s\n\n",sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
+	"delete from latest_state where name = '%q'", bkname)), 0, 0, 0);
+    sqlite3_free(sqlstmt);
+    sqlite3_prepare_v2(bkcatalog,
+	"insert into latest_state (name, block, backupset_id, entries) "
+	"values (?1, ?2, ?3, ?4)", -1, &sqlres, 0);
+    for (i = 0, block = 0; i < nslots; block++) {
+	for (j = 0; j < NB_BLOCK_ENTRIES && i < nslots; j++, i++)
+	    nb_entry_put(blob + j * NB_ENTRY_SIZE, &(slots[i]));
+	sqlite3_bind_text(sqlres, 1, bkname, -1, SQLITE_STATIC);
+	sqlite3_bind_int(sqlres, 2, block);
+	sqlite3_bind_int(sqlres, 3, bkid);
+	sqlite3_bind_blob(sqlres, 4, blob, j * NB_ENTRY_SIZE, SQLITE_STATIC);
+	if (sqlite3_step(sqlres) != SQLITE_DONE)
+	    err = 1;
+	sqlite3_reset(sqlres);
+    }
+    sqlite3_finalize(sqlres);
+    if (err == 0 && sqlite3_exec(bkcatalog, "COMMIT", 0, 0, 0) == SQLITE_OK) {
+	if (verbose >= 1)
+	    fprintf(stderr, "Latest state for %s: %zu files, %zu carried over\n",
+		bkname, nslots, reused);
+    }
+    else {
+	fprintf(stderr, "Error updating the latest state for %s: %s\n", bkname,
+	    sqlite3_errmsg(bkcatalog));
+	sqlite3_exec(bkcatalog, "ROLLBACK", 0, 0, 0);
+	err = 1;
+    }
+    free(blob);
+    free(slots);
+    dfree(bkname);
+    return(err);
+}
+
+/* Drop the file_ids listed in purgetable (a table with a file_id
+ * column) from every latest_state.  Only blocks that held any of them
+ * are rewritten.  Runs inside the caller's transaction.
+ */
+int latest_state_purge(sqlite3 *bkcatalog, char *purgetable, int verbose)
+{
+    sqlite3_stmt *sqlres;
+    sqlite3_stmt *updres;
+    char *sqlstmt = 0;
+    unsigned char *gone;
+    sqlite3_int64 maxid = 0;
+    sqlite3_int64 id;
+    struct {
+	char *name;
+	int block;
+    } *blocks = NULL;
+    int nblocks = 0;
+    const unsigned char *entries;
+    unsigned char *blob;
+    struct nb_diff_slot slot;
+    unsigned long long int removed = 0;
+    int i;
+    int j;
+    int k;
+    int n;
+
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select max(file_id) from %s", purgetable)), -1, &sqlres, 0);
+    if (sqlite3_step(sqlres) == SQLITE_ROW)
+	maxid = sqlite3_column_int64(sqlres, 0);
+    sqlite3_finalize(sqlres);
+    sqlite3_free(sqlstmt);
+    if (maxid < 1)
+	return(0);
+
+    if ((gone = calloc(maxid / 8 + 1, 1)) == NULL) {
+	fprintf(stderr, "latest state: out of memory\n");
+	exit(1);
     }
+    sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	"select file_id from %s", purgetable)), -1, &sqlres, 0);
+    while (sqlite3_step(sqlres) == SQLITE_ROW)
+	if ((id = sqlite3_column_int64(sqlres, 0)) > 0 && id <= maxid)
+	    gone[id / 8] |= 1 << (id % 8);
+    sqlite3_finalize(sqlres);
     sqlite3_free(sqlstmt);
+
+    sqlite3_prepare_v2(bkcatalog, "select name, block from latest_state", -1, &sqlres, 0);
+    while (sqlite3_step(sqlres) == SQLITE_ROW) {
+	if ((blocks = realloc(blocks, sizeof(*blocks) * (nblocks + 1))) == NULL) {
+	    fprintf(stderr, "latest state: out of memory\n");
+	    exit(1);
+	}
+	blocks[nblocks].name = NULL;
+	strncpya0(&(blocks[nblocks].name), (char *) sqlite3_column_text(sqlres, 0), 0);
+	blocks[nblocks].block = sqlite3_column_int(sqlres, 1);
+	nblocks++;
+    }
+    sqlite3_finalize(sqlres);
+
+    if ((blob = malloc(NB_BLOCK_ENTRIES * NB_ENTRY_SIZE)) == NULL) {
+	fprintf(stderr, "latest state: out of memory\n");
+	exit(1);
+    }
+    sqlite3_prepare_v2(bkcatalog,
+	"select entries from latest_state where name = ?1 and block = ?2", -1, &sqlres, 0);
+    sqlite3_prepare_v2(bkcatalog,
+	"update latest_state set entries = ?3 where name = ?1 and block = ?2", -1, &updres, 0);
+    for (i = 0; i < nblocks; i++) {
+	sqlite3_bind_text(sqlres, 1, blocks[i].name, -1, SQLITE_STATIC);
+	sqlite3_bind_int(sqlres, 2, blocks[i].block);
+	if (sqlite3_step(sqlres) == SQLITE_ROW) {
+	    entries = sqlite3_column_blob(sqlres, 0);
+	    n = sqlite3_column_bytes(sqlres, 0) / NB_ENTRY_SIZE;
+	    if (n > NB_BLOCK_ENTRIES)
+		n = NB_BLOCK_ENTRIES;
+	    for (j = 0, k = 0; j < n; j++) {
+		nb_entry_get(entries + j * NB_ENTRY_SIZE, &slot);
+		if (slot.file_id > 0 && slot.file_id <= maxid &&
+		    (gone[slot.file_id / 8] & (1 << (slot.file_id % 8))) != 0)
+		    continue;
+		nb_entry_put(blob + k * NB_ENTRY_SIZE, &slot);
+		k++;
+	    }
+	    sqlite3_reset(sqlres);
+	    if (k < n) {
+		removed += n - k;
+		sqlite3_bind_text(updres, 1, blocks[i].name, -1, SQLITE_STATIC);
+		sqlite3_bind_int(updres, 2, blocks[i].block);
+		sqlite3_bind_blob(updres, 3, blob, k * NB_ENTRY_SIZE, SQLITE_STATIC);
+		sqlite3_step(updres);
+		sqlite3_reset(updres);
+	    }
+	}
+	else
+	    sqlite3_reset(sqlres);
+	dfree(blocks[i].name);
+    }
+    sqlite3_finalize(sqlres);
+    sqlite3_finalize(updres);
+    free(blocks);
+    free(blob);
+    free(gone);
+    if (verbose > 0)
+	fprintf(stderr, "Removed %llu purged files from latest states\n", removed);
     return(0);
 }
@@ -26,6 +26,7 @@
 #include <getopt.h>
 #include <sqlite3.h>
 #include <errno.h>
+#include <sys/file.h>
 
 #include "tarlib.h"
 
@@ -41,6 +42,11 @@ extern struct {
 extern char *SHN;
 
 char *strunesc(char *src, char **target);
+FILE *vault_pack_open_r(sqlite3 *db, char *hash, unsigned long long int *length);
+struct vault_object *vault_object_open_r(sqlite3 *db, char *hash, char *format);
+size_t vault_object_read(void *buf, size_t sz, size_t count, struct vault_object *vo);
+int vault_object_close(struct vault_object *vo);
+int vault_lock(int op);
 
 
 int restore(int argc, char **argv)
@@ -69,6 +75,7 @@ int restore(int argc, char **argv)
     char *sqlerr;
     int use_pax_header = 0;
     int verbose = 0;
+    int damaged = 0;
     char *(*graft)[2] = 0;
     int numgrafts = 0;
     int maxgrafts = 0;
@@ -441,6 +448,13 @@ int restore(int argc, char **argv)
 
     }
 
+    /* Every object's format is looked up here, before any is read, so
+     * hold off recompress from removing the files they name.
+     */
+    if (vault_lock(LOCK_SH) != 0) {
+	fprintf(stderr, "Error taking the vault lock\n");
+	exit(1);
+    }
     if (verbose >= 1)
 	fprintf(stderr, "Sorting files\n");
     sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
@@ -450,7 +464,8 @@ int restore(int argc, char **argv)
 	"a.permission, a.device_id, a.inode, a.user_name, a.user_id,  "
 	"a.group_name, a.group_id, case when b.file_id not null and a.file_id != b.file_id then 0 else a.size end, a.hash, a.datestamp, a.filename,  "
 	"case when b.file_id not null and a.file_id != b.file_id  "
-	"then b.filename else a.extdata end, a.xheader, c.keygroup "
+	"then b.filename else a.extdata end, a.xheader, c.keygroup, "
+	"(select d.format from diskfiles d where d.%s = a.hash) "
 	"from restore_file_entities a left join hardlink_file_entities b  "
 	"on a.ftype = b.ftype and a.permission = b.permission  "
 	"and a.device_id = b.device_id and a.inode = b.inode  "
@@ -466,7 +481,7 @@ int restore(int argc, char **argv)
 	"join temp_keymap on keynum = db_keynum "
 	"group by cd.file_id "
 	"order by 1) c "
-	"on a.file_id = c.file_id order by 1"
+	"on a.file_id = c.file_id order by 1", SHN
 	)), -1, &sqlres, 0);
     sqlite3_free(sqlstmt);
     sqlite3_prepare_v2(bkcatalog,
@@ -490,11 +505,17 @@ int restore(int argc, char **argv)
     while (sqlite3_step(sqlres) == SQLITE_ROW) {
 	char in_ftype = (sqlite3_column_text(sqlres, 1))[0];
 	FILE *sha1file;
+	struct vault_object *vo;
 	size_t (*backing_fread)();
 	void *backing_f_handle;
 	size_t bytestoread;
+	int error;
+	unsigned long long int packlen;
 	size_t blockpad;
 	char tmpfsstring[32];
+	int raw;
+	int chunked;
+	int zstd;
 
 	if (in_ftype == 'E')
 	    fs.ftype = '0';
@@ -531,13 +552,33 @@ int restore(int argc, char **argv)
 	    strncata0(&sha1filepath, (char *) sqlite3_column_text(sqlres, 10), 2);
 	    strcata(&sha1filepath, "/");
 	    strcata(&sha1filepath, (char *) sqlite3_column_text(sqlres, 10) + 2);
-	    if (in_ftype == '0' || in_ftype == 'S' || in_ftype == '1')
+	    raw = sqlite3_column_type(sqlres, 16) == SQLITE_TEXT &&
+		strcmp((char *) sqlite3_column_text(sqlres, 16), "raw") == 0;
+	    chunked = sqlite3_column_type(sqlres, 16) == SQLITE_TEXT &&
+		strcmp((char *) sqlite3_column_text(sqlres, 16), "chunked") == 0;
+	    zstd = sqlite3_column_type(sqlres, 16) == SQLITE_TEXT &&
+		strcmp((char *) sqlite3_column_text(sqlres, 16), "zst") == 0;
+	    if (raw == 1)
+		strcata(&sha1filepath, ".raw");
+	    else if (zstd == 1)
+		strcata(&sha1filepath, ".zst");
+	    else if (in_ftype == '0' || in_ftype == 'S' || in_ftype == '1')
 		strcata(&sha1filepath, ".lzo");
 	    else if (in_ftype == 'E')
 		strcata(&sha1filepath, ".enc");
 
-	    sha1file = fopen(sha1filepath, "r");
-	    if (sha1file == NULL) {
+	    /* Everything but encrypted files is read back through the vault,
+	     * which stops at the end of an object kept in a pack.
+	     */
+	    sha1file = NULL;
+	    vo = NULL;
+	    packlen = 0;
+	    if (in_ftype != 'E')
+		vo = vault_object_open_r(bkcatalog, (char *) sqlite3_column_text(sqlres, 10),
+		    raw == 1 ? "raw" : zstd == 1 ? "zst" : chunked == 1 ? "chunked" : "lzo");
+	    else if ((sha1file = fopen(sha1filepath, "r")) == NULL)
+		sha1file = vault_pack_open_r(bkcatalog, (char *) sqlite3_column_text(sqlres, 10), &packlen);
+	    if (sha1file == NULL && vo == NULL) {
 		perror("restore: open backing file:");
 		fprintf(stderr, "ftype: %c Can not restore %s -- missing backing file %s\n", in_ftype, fs.filename, sha1filepath);
 		continue;
@@ -550,9 +591,13 @@ int restore(int argc, char **argv)
 
 		backing_f_handle = sha1file;
 		backing_fread = fread;
-		fseek(sha1file, 0L, SEEK_END);
-		bytestoread = ftell(sha1file);
-		rewind(sha1file);
+		if (packlen > 0)
+		    bytestoread = packlen;
+		else {
+		    fseek(sha1file, 0L, SEEK_END);
+		    bytestoread = ftell(sha1file);
+		    rewind(sha1file);
+		}
 		sz_c_hdr = getline(&c_hdrbuf, &c_hdrbuf_alloc, sha1file);
 		tc_compression = c_hdrbuf;
 		tc_cipher = strchr(c_hdrbuf, '|');
@@ -589,8 +634,8 @@ int restore(int argc, char **argv)
 		fs.filesize = bytestoread;
 	    }
 	    else {
-		backing_f_handle = lzop_init_r(fread, sha1file);
-		backing_fread = lzop_read;
+		backing_f_handle = vo;
+		backing_fread = vault_object_read;
 		bytestoread = fs.filesize;
 	    }
 	    if (in_ftype == 'S') {
@@ -598,7 +643,13 @@ int restore(int argc, char **argv)
 		int n;
 		char **sparselist = NULL;
 		unsigned long int sparsehdrsz;
-		c_getline(&s_buf, backing_fread, backing_f_handle);
+		// Files submitfiles found holes in keep the map in the catalog
+		if (fs.linktarget != NULL && fs.linktarget[0] != '\0') {
+		    strncpya0(&s_buf, fs.linktarget, 0);
+		    fs.linktarget[0] = '\0';
+		}
+		else
+		    c_getline(&s_buf, backing_fread, backing_f_handle);
 		n = parse(s_buf, &sparselist, ':');
 		if (n <= 1 || n % 2 != 1) {
 		    fprintf(stderr, "Sparse data corrupted header %s %d %s\n", sha1filepath, n, fs.filename);
@@ -638,10 +689,24 @@ int restore(int argc, char **argv)
 		bytestoread -= c;
 	    }
 	    memset(buf, 0, 512);
+	    /* What the vault couldn't supply is filled with zeros, so the
+	     * files after it still come out of the tar stream whole.
+	     */
+	    error = bytestoread > 0;
+	    while (bytestoread > 0) {
+		size_t c = bytestoread > 512 ? 512 : bytestoread;
+		fwrite(buf, 1, c, stdout);
+		bytestoread -= c;
+	    }
 	    fwrite(buf, 1, blockpad, stdout);
-	    if (in_ftype != 'E')
-	        lzop_finalize_r((struct lzop_file *) backing_f_handle);
-	    fclose(sha1file);
+	    if (vo != NULL)
+		error |= vault_object_close(vo);
+	    else
+		fclose(sha1file);
+	    if (error != 0) {
+		fprintf(stderr, "Error reading %s from the vault\n", fs.filename);
+		damaged++;
+	    }
 	}
 	else {
 	    tar_write_next_hdr(&fs);
@@ -663,5 +728,9 @@ int restore(int argc, char **argv)
 	free(graft);
     free(files_from_fname);
     free(files_from_fnameu);
+    if (damaged > 0) {
+	fprintf(stderr, "%d files couldn't be read back in full\n", damaged);
+	exit(1);
+    }
     return(0);
 }
@@ -28,10 +28,370 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <math.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <lzo/lzo1x.h>
 
 #include "tarlib.h"
 
-int submitfiles2(int out);
+/* A metadata record passed from the tar reader to the catalog writer.
+ * Records go either over a pipe from a separate reader process, one
+ * length-prefixed binary frame each, or through a pair of queues from
+ * a reader thread in the same process.
+ */
+struct sf_record {
+    char type;			// '0' key, '1' file, '2' progress, '3' key header,
+				// '4' files already in the vault
+    char ftype;
+    int mode;
+    char *auid;
+    int nuid;
+    char *agid;
+    int ngid;
+    unsigned long long int filesize;
+    char hash[EVP_MAX_MD_SIZE * 2 + 1];
+    time_t modtime;
+    char *filename;
+    char *linktarget;
+    char *xheader;
+    int xheaderlen;
+    int keynum;
+    char *fingerprint;
+    char *eprvkey;
+    char *pubkey;
+    char *hmackeyhash;
+    char *comment;
+    int nfiles;
+    int pack;			// pack the object was appended to, or 0
+    unsigned long long int offset;
+    unsigned long long int length;
+    char *format;		// set if named by the hash of its content
+    char *chunklist;		// "hash format length\n" per chunk, if chunked
+};
+
+// Single producer, single consumer ring of record pointers
+struct sf_queue {
+    struct sf_record **ring;
+    unsigned int size;
+    unsigned int head;		// consumer only
+    unsigned int tail;		// written by producer, read by consumer
+    int waiting;		// consumer is asleep on cond
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+#define SF_QUEUESIZE 65536
+
+/* Memory held by the buffer between the tar reader process and the
+ * catalog, beyond which records are spilled to disk.
+ */
+#define SF_PIPEBUF_RAM (16 * 1024 * 1024)
+#define SF_SPILL_SEGMENT (64ULL * 1024 * 1024)
+
+/* Frame layout:  a 32 bit length of the rest of the frame, the record
+ * type, then the record's fields in order.  Integers are written at
+ * their native width, and strings as a 32 bit length followed by the
+ * bytes and a null terminator, so the receiver can use them in place.
+ */
+struct sf_link {
+    FILE *f;			// framed records over a pipe, or
+    struct sf_queue full;	// records to the catalog writer
+    struct sf_queue empty;	// and back to the reader for reuse
+    int nrecords;
+    char *frame;		// dmalloc'd frame buffer
+    size_t framelen;
+    struct sf_record rec;	// points into frame on the receiving end
+};
+
+// Tuning options for the tar reader side
+struct sf_opts {
+    int nthreads;			// file workers
+    int blockthreads;			// lzop block compression threads
+    int inflight;			// blocks per file queued for compression
+    unsigned long long int smallmax;	// stage files up to this size in memory
+    unsigned long long int packmax;	// pack objects up to this size
+    int sync;				// SF_SYNC_*
+    int uring;				// commit small objects through io_uring
+    char *bkname;			// backup set, for naming partial objects
+    char *virtualfile;			// store stdin as this file, not a tar stream
+    int virtualmode;
+    struct vault_codec *codec;		// the backup name's zstd settings, if any
+};
+
+/* When vault objects are flushed to disk.  With SF_SYNC_GROUP, the
+ * catalog side syncs the vault filesystem once before each flush of
+ * received records, so rows never reference objects that could still
+ * be lost, and the cost is paid per flush rather than per file.
+ */
+#define SF_SYNC_NONE 0
+#define SF_SYNC_FILE 1			// fdatasync each object, fsync its directory
+#define SF_SYNC_GROUP 2
+
+// Received records committed to the catalog per transaction, at most
+#define SF_BATCHSIZE 10000
+
+// Seconds a part filled batch waits for an idle catalog thread
+#define SF_BATCHWAIT 5
+
+// Hashed ahead of file contents when the vault is set to content_hash
+#define SF_CONTENT_TAG "snebu content\n"
+
+/* Files of at least chunk_threshold bytes (snebu.conf) are cut into
+ * content-defined chunks, each stored as an object of its own named by
+ * the hash of its content.  A cut is made where a gear hash of the
+ * last 64 bytes has its top bits clear; fewer bits are tested once a
+ * chunk passes SF_CDC_AVG, which keeps sizes close to the average
+ * (FastCDC's normalized chunking).  The file itself is named by the
+ * hash of its chunk list, and has no vault file.
+ */
+#define SF_CDC_MIN (256 * 1024)
+#define SF_CDC_AVG (1024 * 1024)
+#define SF_CDC_MAX (4 * 1024 * 1024)
+#define SF_CDC_MASKS (~0ULL << (64 - 22))
+#define SF_CDC_MASKL (~0ULL << (64 - 18))
+#define SF_CHUNKS_TAG "snebu chunks\n"
+
+/* Files whose first block has at least SF_RAW_ENTROPY bits per byte, and
+ * which lzo can't get below SF_RAW_RATIO percent of its size, are stored
+ * raw.  Smaller samples read low even for random data.
+ */
+#define SF_PROBE_MIN 4096
+#define SF_RAW_ENTROPY 7.9
+#define SF_RAW_RATIO 97
+
+/* Files of at least SF_RESUME_MIN bytes are written to a partial object
+ * in the vault as they arrive, which is flushed to disk every
+ * SF_CHECKPOINT bytes.  If the transfer is cut off, the next backup
+ * sends only what the partial doesn't hold.
+ */
+#define SF_RESUME_MIN (64ULL * 1024 * 1024)
+#define SF_CHECKPOINT (64ULL * 1024 * 1024)
+
+/* With hole_elision set, aligned SF_HOLE_BLOCK sized runs of zeros in
+ * plain files are left out of the vault object, and the file recorded
+ * as sparse, with its map of data segments in the catalog's extdata
+ * column.  A file whose map would go past SF_HOLE_MAXSEG segments is
+ * stored dense instead, to keep catalog rows small.
+ */
+#define SF_HOLE_BLOCK (64 * 1024)
+#define SF_HOLE_MAXSEG 1024
+
+struct sf_membuf {
+    char *buf;				// dmalloc'd
+    size_t len;
+};
+
+/* A large file's object while it is being written.  Rather than saving
+ * hash and compressor state at each checkpoint, a resumed object is
+ * read back through the hash, which also checks it; lzop blocks don't
+ * depend on each other, so compression just carries on after the last
+ * whole one.
+ */
+struct sf_partial {
+    char path[1024];			// without the extension
+    char filepath[1024 + 8];
+    FILE *f;
+    char *ext;
+    unsigned long long int resume;	// bytes of the file it already holds
+    unsigned long long int written;
+    unsigned long long int synced;
+    int holes;				// set once holes are left out, so no resuming
+};
+
+// c_fread style source that also copies what it reads to a sink
+struct sf_tee {
+    size_t (*c_fread)();
+    void *c_handle;
+    size_t (*c_fwrite)();
+    void *c_fhandle;
+};
+
+// c_fread style source that leaves out blocks of zeros, and maps the rest
+struct sf_holes {
+    size_t (*c_fread)();
+    void *c_handle;
+    char *buf;				// one block
+    size_t len;
+    size_t pos;
+    unsigned long long int offset;	// of buf in the file
+    struct sparsedata *map;		// dmalloc'd, data segments
+    int nmap;
+    int holes;
+    int overflow;			// map full, so zeros are kept from here on
+    struct sf_partial *partial;		// renamed at the first hole
+};
+
+// c_fread style source that puts the holes left out of a file back in
+struct sf_dense {
+    size_t (*c_fread)();
+    void *c_handle;
+    struct sparsedata *map;
+    int nmap;
+    int seg;
+    unsigned long long int offset;
+    unsigned long long int size;
+};
+
+/* Received files are recorded straight into file_entities and
+ * backupset_detail as they arrive, rather than staged and joined back
+ * on every column at each flush.
+ */
+struct sf_ingest {
+    sqlite3 *bkcatalog;
+    int bkid;
+    sqlite3_stmt *needed;		// needed rows for a received name
+    sqlite3_stmt *diskfile;
+    sqlite3_stmt *entity;		// insert into file_entities
+    sqlite3_stmt *entityid;		// file_id of an identical entity
+    sqlite3_stmt *detail;		// insert into backupset_detail
+    sqlite3_stmt *cipher;		// cipher_detail by inbound key number
+    sqlite3_stmt *linktarget;		// entities a hard link points to
+    sqlite3_stmt *linkcipher;		// cipher_detail of the link target
+    sqlite3_stmt *seen;			// insert into diskfiles_t
+    sqlite3_stmt *packed;		// insert into packed_objects_t
+    sqlite3_stmt *chunk;		// insert into object_chunks
+    struct vault_filter *filter;	// every diskfiles row goes in here too
+    sqlite3_int64 *ids;			// dmalloc'd, entities of the last record
+    int nids;
+};
+
+// A file_entities row, bound as ?1 through ?15 in column order
+struct sf_entity {
+    char *ftype;
+    char *permission;
+    char *device_id;
+    char *inode;
+    char *user_name;
+    int user_id;
+    char *group_name;
+    int group_id;
+    sqlite3_int64 size;
+    char *hash;
+    sqlite3_int64 cdatestamp;
+    sqlite3_int64 datestamp;
+    char *filename;
+    char *extdata;
+    void *xheader;
+    int xheaderlen;
+};
+
+struct sf_reader_args {
+    struct sf_link *out;
+    struct sf_opts opts;
+};
+
+// HMAC of the file last seen for each key, by inbound key number
+struct sf_cryptinfo {
+    int keynum;
+    char *hmac;
+};
+
+// Key and file records received since the last hand off
+struct sf_batch {
+    struct sf_record *recs;		// fields dmalloc'd, reused by later batches
+    int nrecs;
+    int size;
+};
+
+/* Received records are copied into one batch while the catalog thread
+ * records and commits the one before it, so reading the metadata
+ * stream only waits on the catalog when it falls a whole batch behind.
+ * The catalog connection belongs to the thread until it is joined.
+ */
+struct sf_catalog {
+    sqlite3 *bkcatalog;
+    struct sf_ingest *ing;
+    int verbose;
+    int bkid;
+    unsigned long long est_size;
+    int sync;
+    struct sf_batch batch[2];
+    struct sf_batch *staging;		// filled by the reader of the stream
+    struct sf_batch *pending;		// with the catalog thread, or NULL
+    int done;
+    unsigned long long linkbytes;	// hard linked data, for the status line
+    struct sf_cryptinfo *cryptinfo;
+    int numkeys;
+    char *keygroups;
+    char **keygroupsp;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+pid_t submitfiles2(int out, struct sf_opts *opts);
+int sf_reader(struct sf_link *out, struct sf_opts *opts);
+int sf_virtual(struct sf_link *out, struct sf_opts *opts);
+void *sf_reader_thread(void *arg);
+struct sf_pool *sf_pool_init(struct sf_opts *opts);
+struct sf_job *sf_job_next(struct sf_pool *pool, struct sf_link *out);
+void sf_job_done(struct sf_pool *pool, struct sf_job *job);
+int sf_job_feed(struct sf_pool *pool, struct sf_job *job);
+int sf_emit(struct sf_pool *pool, struct sf_link *out, int maxpending);
+int sf_write_record(struct sf_link *out, struct sf_job *job);
+int sf_pool_finalize(struct sf_pool *pool, struct sf_link *out);
+void sf_progress(struct sf_job *job, size_t c);
+size_t sf_stdin_read(void *buf, size_t sz, size_t count, struct sf_job *job);
+size_t sf_chunk_read(void *buf, size_t sz, size_t count, struct sf_job *job);
+void *sf_worker(void *arg);
+int sf_store(struct sf_job *job, size_t (*c_fread)(), void *c_handle);
+char *sf_encode(struct sf_job *job, size_t (*c_fread)(), void *c_handle,
+    size_t (*c_fwrite)(), void *c_fhandle, unsigned char *cfsha);
+char *sf_passthru(struct sf_job *job, size_t (*c_fread)(), void *c_handle,
+    size_t (*c_fwrite)(), void *c_fhandle, unsigned char *cfsha);
+size_t sf_tee_read(void *buf, size_t size, size_t nmemb, struct sf_tee *tee);
+size_t sf_holes_read(void *buf, size_t size, size_t nmemb, struct sf_holes *h);
+void sf_holes_finish(struct sf_holes *h, struct sf_job *job);
+char *sf_holes_dense(struct sf_job *job, struct sf_holes *h, char *ext, unsigned char *cfsha);
+size_t sf_dense_read(void *buf, size_t size, size_t nmemb, struct sf_dense *d);
+size_t sf_null_write(void *buf, size_t size, size_t nmemb, void *handle);
+struct lzop_file *sf_lzop_init(struct sf_job *job, size_t (*c_fwrite)(), void *c_fhandle);
+void sf_partial_open(struct sf_partial *part, char *ext);
+void sf_partial_replay(struct sf_partial *part, struct sha_file *s1f, int content, char *filename);
+size_t sf_partial_write(void *buf, size_t sz, size_t count, struct sf_partial *part);
+size_t sf_hash_write(void *buf, size_t size, size_t nmemb, struct sha_file *s1f);
+int sf_incompressible(char *buf, size_t len);
+int sf_chunked(struct sf_job *job, size_t (*c_fread)(), void *c_handle);
+size_t sf_cdc_cut(unsigned char *buf, size_t len);
+int sf_cdc_store(struct sf_job *job, char *buf, size_t len);
+void sf_cdc_init();
+int sf_commit(struct sf_pool *pool, char *hash, char *ext, FILE *f, char *tmpfilepath);
+int sf_close(FILE *f, int sync);
+int sf_sync_vault();
+FILE *sf_tmpfile(struct sf_pool *pool, char *tmpfilepath);
+size_t sf_mem_write(void *buf, size_t sz, size_t count, struct sf_membuf *mem);
+void sf_skipped(struct sf_job *job);
+void sf_vault_path(char *hash, char *ext, char *targetdir, char *targetpath);
+int sf_exists(char *hash, char *ext);
+int sf_stored(struct sf_job *job, char *ext);
+void sf_vault_mkdir(struct sf_pool *pool, char *hash, char *targetdir);
+void sf_store_done(void *arg);
+int sf_put_stats(struct sf_link *link, int nfiles, unsigned long long bytes);
+struct sf_link *sf_link_init(FILE *f);
+void sf_link_free(struct sf_link *link);
+struct sf_record *sf_record_get(struct sf_link *link);
+void sf_record_free(struct sf_record *rec);
+int sf_put_key(struct sf_link *link, int keynum, struct key_st *key);
+int sf_put_keyhdr(struct sf_link *link);
+int sf_put_progress(struct sf_link *link, char *filename, size_t bytes);
+int sf_put_end(struct sf_link *link);
+struct sf_record *sf_get_record(struct sf_link *link);
+void sf_release_record(struct sf_link *link, struct sf_record *rec);
+void sf_frame_begin(struct sf_link *link, char type);
+void sf_frame_int(struct sf_link *link, void *v, size_t n);
+void sf_frame_str(struct sf_link *link, char *str, uint32_t len);
+int sf_frame_send(struct sf_link *link);
+void sf_unframe_int(char **p, void *v, size_t n);
+char *sf_unframe_str(char **p, int *len);
+void sf_queue_init(struct sf_queue *q, unsigned int size);
+void sf_queue_free(struct sf_queue *q);
+void sf_queue_push(struct sf_queue *q, struct sf_record *rec);
+int sf_queue_pop(struct sf_queue *q, struct sf_record **rec, int wait);
 char *stresc(char *src, char **target);
 char *strescb(char *src, char **target, int len);
 char *strunesc(char *src, char **target);
@@ -44,6 +404,12 @@ size_t rbsize(struct ringbuf *r);
 size_t rbused(struct ringbuf *r);
 size_t rbavail(struct ringbuf *r);
 void rbfree(struct ringbuf *r);
+struct spillbuf *sbinit(size_t s, char *dir);
+void sbwrite(void *buf, size_t n, struct spillbuf *sb);
+size_t sbread(void *buf, size_t n, struct spillbuf *sb);
+unsigned long long int sbused(struct spillbuf *sb);
+void sbfree(struct spillbuf *sb);
+char *sbmap(struct spillbuf *sb, unsigned long long int seg);
 int pipebuf(int *in,  int *out);
 void usage();
 int checkperm(sqlite3 *bkcatalog, char *action, char *backupname);
@@ -52,18 +418,61 @@ extern struct {
     char *vault;
     char *meta;
     int hash;
+    int content_hash;
+    unsigned long long int chunk_threshold;
+    int hole_elision;
 } config;
 extern char *SHN;
 char *EncodeBlock2(char *out, char *in, int m, int *n);
 char *DecodeBlock2(char *out, char *in, int m, int *n);
 double ftime();
 int flush_received_files(sqlite3 *bkcatalog, int verbose, int bkid,
-    unsigned long long est_size,  unsigned long long *bytes_read);
+    unsigned long long est_size, int sync);
+struct sf_ingest *sf_ingest_init(sqlite3 *bkcatalog, int bkid);
+void sf_ingest_free(struct sf_ingest *ing);
+unsigned long long sf_ingest_record(struct sf_ingest *ing, struct sf_record *rec, char *permission);
+void sf_ingest_chunks(struct sf_ingest *ing, struct sf_record *rec);
+sqlite3_int64 sf_ingest_entity(struct sf_ingest *ing, struct sf_entity *e);
+void sf_bind_entity(sqlite3_stmt *stmt, struct sf_entity *e);
+void sf_ingest_step(struct sf_ingest *ing, sqlite3_stmt *stmt);
 int submitfiles_tmptables(sqlite3 *bkcatalog, int bkid);
+struct sf_catalog *sf_catalog_init(sqlite3 *bkcatalog, int verbose, int bkid,
+    unsigned long long est_size, int sync, int batchsize);
+int sf_catalog_stage(struct sf_catalog *cat, struct sf_record *rec);
+int sf_catalog_submit(struct sf_catalog *cat, int wait);
+void sf_catalog_finish(struct sf_catalog *cat);
+void *sf_catalog_thread(void *arg);
+void sf_catalog_record(struct sf_catalog *cat, struct sf_record *rec);
+void sf_record_copy(struct sf_record *dst, struct sf_record *src);
 sqlite3 *opendb();
 long int strtoln(char *nptr, char **endptr, int base, int len);
 void update_status(unsigned long long total_bytes_received, unsigned long long est_size, char *cur_filename, time_t cur_time, time_t start_time, char indicator);
 int logaction(sqlite3 *bkcatalog, int backupset_id, int action, char *message);
+int latest_state_update(sqlite3 *bkcatalog, int bkid, int verbose);
+struct vault_packer *vault_packer_init(unsigned long long int packmax);
+void vault_packer_free(struct vault_packer *vp);
+int vault_packed(struct vault_packer *vp, char *hash);
+int vault_pack_put(struct vault_packer *vp, char *hash, char *buf, size_t len,
+    int *pack, unsigned long long int *offset);
+int vault_pack_sync(struct vault_packer *vp);
+int vault_lock(int op);
+struct vault_uring *vault_uring_init();
+struct vault_filter *vault_filter_open();
+void vault_filter_close(struct vault_filter *vf);
+int vault_filter_maybe(struct vault_filter *vf, char *hash);
+void vault_filter_add(struct vault_filter *vf, char *hash);
+int vault_filter_prepare(sqlite3 *db, int verbose);
+void vault_uring_commit(struct vault_uring *vu, char *buf, size_t len, int fd,
+    char *tmpfilepath, char *targetpath, void (*done)(void *arg), void *arg);
+void vault_uring_free(struct vault_uring *vu);
+void vault_partial_path(char *bkname, char *filename, unsigned long long int size,
+    long long int modtime, char *path);
+unsigned long long int vault_partial_offset(char *path, char **ext);
+struct vault_codec *vault_codec_load(sqlite3 *db, char *bkname);
+void vault_codec_free(struct vault_codec *codec);
+struct vault_zstd *vault_zstd_init_w(struct vault_codec *codec, size_t (*c_fwrite)(), void *c_fhandle);
+size_t vault_zstd_write(void *buf, size_t sz, size_t count, struct vault_zstd *vz);
+int vault_zstd_finalize_w(struct vault_zstd *vz);
 
 struct {
     unsigned long long unit;
@@ -80,57 +489,57 @@ int submitfiles(int argc, char **argv)
 {
     int in = -1;
     int out = -1;
-    char *inbuf = NULL;
-    size_t len = 0;
     int optc;
     char bkname[128];
     char datestamp[128];
     int foundopts = 0;
     int verbose = 0;
-    FILE *metadata;
-    char **mdfields = NULL;
+    int inprocess = 0;
+    pthread_t reader;
+    pid_t readerpid = 0;
+    int status;
+    struct sf_link *metadata;
+    struct sf_record *rec;
     char *sqlstmt = NULL;
     sqlite3_stmt *sqlres;
     char *sqlerr = NULL;
-    sqlite3_stmt *inbfrec;
-    long cipherid = 0;
-    char *xattru = NULL;
-    int xattrn;
-    char *paxdata;
-    int paxdatalen;
-    int cipher_record;
-    char *filenameu = NULL;
-    char *linknameu = NULL;
-    unsigned long long linkedfiles_bytes = 0;
-    char *eprvkeyu = NULL;
-    char *pubkeyu = NULL;
-    char *commentu = NULL;
+    struct sf_catalog *cat;
 
     struct option longopts[] = {
         { "name", required_argument, NULL, 'n' },
         { "datestamp", required_argument, NULL, 'd' },
         { "verbose", no_argument, NULL, 'v' },
+        { "threads", required_argument, NULL, 't' },
+        { "block-threads", required_argument, NULL, 0 },
+        { "inflight-blocks", required_argument, NULL, 0 },
+        { "in-process", no_argument, NULL, 0 },
+        { "small-file-size", required_argument, NULL, 0 },
+        { "pack-threshold", required_argument, NULL, 0 },
+        { "sync", required_argument, NULL, 0 },
+        { "io-uring", no_argument, NULL, 0 },
+        { "batch-size", required_argument, NULL, 0 },
+        { "virtual-file", required_argument, NULL, 0 },
+        { "mode", required_argument, NULL, 0 },
+        { "retention", required_argument, NULL, 'r' },
         { NULL, no_argument, NULL, 0 }
     };
 
-    struct cryptinfo_s {
-	int keynum;
-	char *hmac;
-    };
-    char *keygroups = NULL;
-    char **keygroupsp = NULL;
-
     int longoptidx;
-    int numkeys = 0;
-    struct cryptinfo_s *cryptinfo = NULL;
-    int cryptinfo_n = 0;
-    char xattr_varstring[1024];
     int bkid;
     unsigned long long est_size = 0;
     int est_files = 0;
     int tot_files = 0;
+    struct sf_opts opts = { 1, 0, 0, 1024 * 1024, 0, SF_SYNC_NONE, 0, NULL, NULL, 0600, NULL };
+    char *retention = NULL;
+    unsigned long long skipbytes = 0;
+    int skipfiles = 0;
+    int batchsize = SF_BATCHSIZE;	// records per catalog transaction
+    int lzofiles = 0;			// objects by how they are stored
+    int rawfiles = 0;
+    int chunkedfiles = 0;
+    char *objmsg = NULL;
 
-    while ((optc = getopt_long(argc, argv, "n:d:v", longopts, &longoptidx)) >= 0)
+    while ((optc = getopt_long(argc, argv, "n:d:r:vt:", longopts, &longoptidx)) >= 0)
         switch (optc) {
             case 'n':
                 strncpy(bkname, optarg, 127);
@@ -142,10 +551,77 @@ int submitfiles(int argc, char **argv)
                 datestamp[127] = 0;
                 foundopts |= 2;
                 break;
+            case 'r':
+                retention = optarg;
+                break;
             case 'v':
                 verbose += 1;
                 foundopts |= 4;
                 break;
+            case 't':
+                opts.nthreads = atoi(optarg);
+                if (opts.nthreads < 1) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    return(1);
+                }
+                break;
+            case 0:
+                if (strcmp("block-threads", longopts[longoptidx].name) == 0) {
+                    opts.blockthreads = atoi(optarg);
+                    if (opts.blockthreads < 1) {
+                        fprintf(stderr, "Invalid thread count %s\n", optarg);
+                        return(1);
+                    }
+                }
+                else if (strcmp("inflight-blocks", longopts[longoptidx].name) == 0) {
+                    opts.inflight = atoi(optarg);
+                    if (opts.inflight < 2) {
+                        fprintf(stderr, "Invalid in-flight block count %s\n", optarg);
+                        return(1);
+                    }
+                }
+                else if (strcmp("in-process", longopts[longoptidx].name) == 0) {
+                    inprocess = 1;
+                }
+                else if (strcmp("small-file-size", longopts[longoptidx].name) == 0) {
+                    opts.smallmax = strtoull(optarg, 0, 10);
+                }
+                else if (strcmp("pack-threshold", longopts[longoptidx].name) == 0) {
+                    opts.packmax = strtoull(optarg, 0, 10);
+                }
+                else if (strcmp("sync", longopts[longoptidx].name) == 0) {
+                    if (strcmp(optarg, "none") == 0)
+                        opts.sync = SF_SYNC_NONE;
+                    else if (strcmp(optarg, "file") == 0)
+                        opts.sync = SF_SYNC_FILE;
+                    else if (strcmp(optarg, "group") == 0)
+                        opts.sync = SF_SYNC_GROUP;
+                    else {
+                        fprintf(stderr, "Invalid sync mode %s\n", optarg);
+                        return(1);
+                    }
+                }
+                else if (strcmp("io-uring", longopts[longoptidx].name) == 0) {
+                    opts.uring = 1;
+                }
+                else if (strcmp("batch-size", longopts[longoptidx].name) == 0) {
+                    batchsize = atoi(optarg);
+                    if (batchsize < 1) {
+                        fprintf(stderr, "Invalid batch size %s\n", optarg);
+                        return(1);
+                    }
+                }
+                else if (strcmp("virtual-file", longopts[longoptidx].name) == 0) {
+                    if (optarg[0] != '/') {
+                        fprintf(stderr, "Virtual file name %s must start with /\n", optarg);
+                        return(1);
+                    }
+                    opts.virtualfile = optarg;
+                }
+                else if (strcmp("mode", longopts[longoptidx].name) == 0) {
+                    opts.virtualmode = strtol(optarg, NULL, 8) & 07777;
+                }
+                break;
             default:
                 usage();
                 return(1);
@@ -155,12 +631,24 @@ int submitfiles(int argc, char **argv)
         usage();
         return(1);
     }
-    /* needed to populate config that slubmitfiles2 needs in separate process */
-    opendb(bkcatalog);
-    sqlite3_close(bkcatalog);
+    if (opts.inflight == 0)
+        opts.inflight = opts.blockthreads * 2;
+    opts.bkname = bkname;
+    if (inprocess == 0) {
+        /* needed to populate config that slubmitfiles2 needs in separate process */
+        opendb(bkcatalog);
+        vault_filter_prepare(bkcatalog, verbose);
+        opts.codec = vault_codec_load(bkcatalog, bkname);
+        sqlite3_close(bkcatalog);
+        // Held until the catalog has recorded any packed objects
+        if (vault_lock(LOCK_SH) != 0) {
+            fprintf(stderr, "Error locking the vault packs\n");
+            return(1);
+        }
 
-    pipebuf(&in, &out);
-    submitfiles2(in);
+        pipebuf(&in, &out);
+        readerpid = submitfiles2(in, &opts);
+    }
     opendb(bkcatalog);
 
     if (checkperm(bkcatalog, "backup", bkname)) {
@@ -168,6 +656,17 @@ int submitfiles(int argc, char **argv)
         return(1);
     }
 
+    // A virtual file can start a backup set of its own
+    if (opts.virtualfile != NULL && retention != NULL) {
+        sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+            "insert or ignore into backupsets (name, retention, serial)  "
+            "values ('%q', '%q', '%q')", bkname, retention, datestamp)), 0, 0, &sqlerr);
+        if (sqlerr != 0) {
+            fprintf(stderr, "%s\n%s\n", sqlerr, sqlstmt);
+            sqlite3_free(sqlerr);
+        }
+        sqlite3_free(sqlstmt);
+    }
     sqlite3_prepare_v2(bkcatalog,
         (sqlstmt = sqlite3_mprintf("select backupset_id from backupsets  "
             "where name = '%q' and serial = '%q'",
@@ -182,6 +681,23 @@ int submitfiles(int argc, char **argv)
     sqlite3_free(sqlstmt);
     sqlite3_finalize(sqlres);
 
+    /* A virtual file doesn't come from newbackup's manifest, so it is
+     * added to the needed list here, for its record to be matched to.
+     */
+    if (opts.virtualfile != NULL) {
+        sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+            "insert or replace into needed_file_entities  "
+            "(backupset_id, device_id, inode, filename, infilename, size, cdatestamp)  "
+            "values (%d, '0', '0', '%q', '%q', 0, %lld)", bkid, opts.virtualfile,
+            opts.virtualfile, (long long) time(NULL))), 0, 0, &sqlerr);
+        if (sqlerr != 0) {
+            fprintf(stderr, "%s\n%s\n", sqlerr, sqlstmt);
+            sqlite3_free(sqlerr);
+            return(1);
+        }
+        sqlite3_free(sqlstmt);
+    }
+
     sqlite3_prepare_v2(bkcatalog,
         (sqlstmt = sqlite3_mprintf("select sum(size)  "
             "from needed_file_entities where backupset_id = %d",
@@ -210,25 +726,27 @@ int submitfiles(int argc, char **argv)
 	    b_total_unit = i;
 
     submitfiles_tmptables(bkcatalog, bkid);
-    metadata = fdopen(out, "r");
-
-    sqlstmt = sqlite3_mprintf(
-        "insert or replace into received_file_entities_t  "
-        "(backupset_id, ftype, permission, user_name, user_id,  "
-        "group_name, group_id, size, hash, datestamp, filename, extdata, xheader)  "
-        "values (@bkid, @ftype, @mode, @auid, @nuid, @agid,  "
-        "@ngid, @filesize, @hash, @modtime, @filename, @linktarget, @xheader)");
+    if (inprocess == 1) {
+        struct sf_reader_args *args = malloc(sizeof(struct sf_reader_args));
 
-    sqlite3_prepare_v2(bkcatalog, sqlstmt, -1, &inbfrec, 0);
-    sqlite3_free(sqlstmt);
+        if (vault_lock(LOCK_SH) != 0) {
+            fprintf(stderr, "Error locking the vault packs\n");
+            return(1);
+        }
 
-    sqlite3_exec(bkcatalog,
-        "create temporary table if not exists temp_cipher_detail "
-        "as select * from cipher_detail where 0", 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-        fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-        sqlite3_free(sqlerr);
+        vault_filter_prepare(bkcatalog, verbose);
+        opts.codec = vault_codec_load(bkcatalog, bkname);
+        metadata = sf_link_init(NULL);
+        args->out = metadata;
+        args->opts = opts;
+        if (pthread_create(&reader, NULL, sf_reader_thread, args) != 0) {
+            fprintf(stderr, "Error starting reader thread\n");
+            exit(1);
+        }
     }
+    else
+        metadata = sf_link_init(fdopen(out, "r"));
+
     sqlite3_exec(bkcatalog,
         "create temporary table if not exists temp_key_map ( "
 	"keyposition	integer, "
@@ -240,7 +758,6 @@ int submitfiles(int argc, char **argv)
         sqlite3_free(sqlerr);
     }
 
-    int inlen = 0;
     unsigned long long  total_bytes_received = 0;
     double start_time = ftime();
     double lastupdate_time = 0;
@@ -254,185 +771,62 @@ int submitfiles(int argc, char **argv)
 	    (double) est_size / display_units[b_total_unit].unit,
 	    display_units[b_total_unit].label);
     logaction(bkcatalog, bkid, 4, "Begin receiving files");
+    cat = sf_catalog_init(bkcatalog, verbose, bkid, est_size, opts.sync, batchsize);
 
-    while ((inlen = getline(&inbuf, &len, metadata)) > 0) {
-	if (inbuf[inlen - 1] == '\n')
-	    inbuf[inlen - 1] = '\0';
-	else {
-	    fprintf(stderr, "Metadata recording error\n");
-	    exit(1);
-	}
-	parse(inbuf, &mdfields, '\t');
-	// Record encryption key data from global header
-	if (strcmp(mdfields[0], "0") == 0) {
-	    if (atoi(mdfields[1]) + 1 > numkeys)
-		numkeys = atoi(mdfields[1]) + 1;
-	    strunesc(mdfields[3], &eprvkeyu);
-	    strunesc(mdfields[4], &pubkeyu);
-	    strunesc(mdfields[6], &commentu);
-	    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-		"insert or ignore into cipher_master (pkfp, eprivkey, pubkey, hmackeyhash, comment) "
-		"values ('%q', '%q', '%q', '%q', '%q')", mdfields[2], eprvkeyu, pubkeyu,
-		mdfields[5], commentu)), 0, 0, &sqlerr);
-	    if (sqlerr != 0) {
-		fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-		sqlite3_free(sqlerr);
-	    }
-	    sqlite3_free(sqlstmt);
-	    // get the primary key (cipherid) of recorded key data
-	    if (sqlite3_prepare_v2(bkcatalog,
-		sqlstmt = sqlite3_mprintf("select cipherid from cipher_master "
-		"where pkfp = '%q' and eprivkey = '%q' and pubkey = '%q' "
-		"and hmackeyhash = '%q' and comment = '%q'", mdfields[2], eprvkeyu, pubkeyu,
-		mdfields[5], commentu), -1, &sqlres, 0) == SQLITE_OK) {
-		sqlite3_free(sqlstmt);
-		if (sqlite3_step(sqlres) == SQLITE_ROW) {
-		    cipherid = sqlite3_column_int(sqlres, 0);
-		}
-		else {
-		    fprintf(stderr, "Cipher key recording failure\n");
-		    exit(1);
-		}
-		sqlite3_finalize(sqlres);
-	    }
-	    // temporary map of inbound key number and recorded key
-	    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-		"insert or replace into temp_key_map (keyposition, id)"
-		"values (%d, %d)", atoi(mdfields[1]), cipherid)), 0, 0, 0);
-	    sqlite3_free(sqlstmt);
-	    if (numkeys > cryptinfo_n) {
-		if (cryptinfo == NULL)
-		    cryptinfo = malloc(sizeof(struct cryptinfo_s) * numkeys);
-		else
-		    cryptinfo = realloc(cryptinfo, sizeof(struct cryptinfo_s) * numkeys);
-		for (int i = cryptinfo_n; i < numkeys; i++) {
-		    cryptinfo[i].hmac = NULL;
-		}
-		cryptinfo_n = numkeys;
-	    }
+    while ((rec = sf_get_record(metadata)) != NULL) {
+	if (rec->type == '0') {
+	    if (sf_catalog_stage(cat, rec) >= batchsize)
+		sf_catalog_submit(cat, 1);
 	}
-	else if (strcmp(mdfields[0], "1") == 0) {
-	    if (xattru == NULL)
-		xattru = dmalloc((int) (strlen(mdfields[13]) * 3 / 4));
-	    else
-		if (dmalloc_size(xattru) < ((int) (strlen(mdfields[13]) * 3 / 4)))
-		    xattru = drealloc(xattru, (int) (strlen(mdfields[13]) * 3 / 4));
-	    DecodeBlock2(xattru, mdfields[13], strlen(mdfields[13]), &xattrn);
-	    cipher_record = 0;
-	    if (getpaxvar(xattru, xattrn, "TC.cipher", &paxdata, &paxdatalen) == 0) {
-		cipher_record = 1;
-		cpypaxvarstr(xattru, xattrn, "TC.keygroup", &keygroups);
-		parse(keygroups, &keygroupsp, '|');
-		for (int i = 0; keygroupsp[i] != NULL; i++) {
-		    int n = atoi(keygroupsp[i]);
-		    if (n < numkeys) {
-			cryptinfo[n].keynum = n;
-			if (numkeys > 1)
-			    sprintf(xattr_varstring, "TC.hmac.%d", n);
-			else
-			    sprintf(xattr_varstring, "TC.hmac");
-			cpypaxvarstr(xattru, xattrn, xattr_varstring, &(cryptinfo[n].hmac));
-			delpaxvar(&xattru, &xattrn, xattr_varstring);
-		    }
-		}
-	    }
-	    delpaxvar(&xattru, &xattrn, "atime");
-	    delpaxvar(&xattru, &xattrn, "TC.segmented.header");
-            sqlite3_bind_int(inbfrec, 1, bkid);
-            sqlite3_bind_text(inbfrec, 2, mdfields[1], -1, SQLITE_STATIC);
-            sqlite3_bind_text(inbfrec, 3, mdfields[2], -1, SQLITE_STATIC);
-            sqlite3_bind_text(inbfrec, 4, mdfields[3], -1, SQLITE_STATIC);
-            sqlite3_bind_int(inbfrec, 5, atoi(mdfields[4]));
-            sqlite3_bind_text(inbfrec, 6, mdfields[5], -1, SQLITE_STATIC);
-            sqlite3_bind_int(inbfrec, 7, atoi(mdfields[6]));
-            sqlite3_bind_int64(inbfrec, 8, atoll(mdfields[7]));
-            sqlite3_bind_text(inbfrec, 9, mdfields[8], -1, SQLITE_STATIC);
-            sqlite3_bind_int(inbfrec, 10, atoi(mdfields[9]));
-            strunesc(mdfields[10], &filenameu);
-            sqlite3_bind_text(inbfrec, 11, filenameu, -1, SQLITE_STATIC);
-            strunesc(mdfields[11], &linknameu);
-            sqlite3_bind_text(inbfrec, 12, linknameu, -1, SQLITE_STATIC);
-            sqlite3_bind_blob(inbfrec, 13, xattru, xattrn, SQLITE_STATIC);
-            if (! sqlite3_step(inbfrec)) {
-                fprintf(stderr, "Error inserting metadata record into temporary table\n"); ;
-                exit(1);
-            }
-	    sqlite3_int64 fileid = sqlite3_last_insert_rowid(bkcatalog);
-	    total_bytes_received += atoll(mdfields[7]);
+	else if (rec->type == '1') {
+	    total_bytes_received += rec->filesize;
 	    tot_files++;
-
-            sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-                "insert or ignore into diskfiles_t (hash)  "
-                "values ('%q')", mdfields[8])), 0, 0, &sqlerr);
-            if (sqlerr != 0) {
-                fprintf(stderr, "%s\n", sqlerr);
-                sqlite3_free(sqlerr);
-            }
-	    sqlite3_free(sqlstmt);
-	    if (cipher_record == 1) {
-		for (int i = 0; keygroupsp[i] != NULL; i++) {
-		    int n = atoi(keygroupsp[i]);
-		    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-			"insert or ignore into temp_cipher_detail (file_id, keynum, hmac) "
-			"values (%d, %d, '%q')", fileid,  cryptinfo[n].keynum,
-			cryptinfo[n].hmac)), 0, 0, &sqlerr);
-		    if (sqlerr != 0) {
-			fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-			sqlite3_free(sqlerr);
-		    }
-		    sqlite3_free(sqlstmt);
-		}
+	    if (strcmp(rec->format, "raw") == 0)
+		rawfiles++;
+	    else if (strcmp(rec->format, "chunked") == 0)
+		chunkedfiles++;
+	    else if (rec->ftype != 'E' && strcmp(rec->hash, "0") != 0)
+		lzofiles++;
+	    curtime = ftime();
+	    /* Hand the batch over once it is full, or once it has waited a
+	     * while and the catalog thread has nothing else to do.
+	     */
+	    if ((sf_catalog_stage(cat, rec) >= batchsize || curtime > lastflush_time + SF_BATCHWAIT) &&
+		sf_catalog_submit(cat, cat->staging->nrecs >= batchsize) == 0) {
+		if (verbose >= 1)
+		    update_status(total_bytes_received + __atomic_load_n(&(cat->linkbytes), __ATOMIC_RELAXED),
+			est_size, rec->filename, curtime, start_time, '*');
+		lastflush_time = curtime;
+		lastupdate_time = 0;
 	    }
-            sqlite3_reset(inbfrec);
 	    // Update status line
-
-	    if ((curtime = ftime()) > lastupdate_time + 1 || lastupdate_time == 0) {
+	    if (curtime > lastupdate_time + 1 || lastupdate_time == 0) {
 		lastupdate_time = curtime;
-		if ((curtime = ftime()) > lastflush_time + 5) {
-		    if (verbose >= 1)
-			update_status(total_bytes_received, est_size, mdfields[10], curtime, start_time, '*');
-		    flush_received_files(bkcatalog, verbose, bkid, est_size, &linkedfiles_bytes);
-		    total_bytes_received += linkedfiles_bytes;
-		    lastflush_time = curtime;
-		}
 		if (verbose >= 1)
-		    update_status(total_bytes_received, est_size, mdfields[10], curtime, start_time, ' ');
+		    update_status(total_bytes_received + __atomic_load_n(&(cat->linkbytes), __ATOMIC_RELAXED),
+			est_size, rec->filename, curtime, start_time, ' ');
 	    }
 	}
-	else if (strcmp(mdfields[0], "2") == 0) {
+	else if (rec->type == '2') {
 	    if ((curtime = ftime()) > lastupdate_time + 1 || lastupdate_time == 0) {
 		lastupdate_time = curtime;
 		    if (verbose >= 1)
-			update_status(total_bytes_received + atoll(mdfields[2]), est_size, mdfields[1], curtime, start_time, '+');
+			update_status(total_bytes_received + rec->filesize, est_size, rec->filename, curtime, start_time, '+');
 	    }
 	}
-	else if (strcmp(mdfields[0], "2") == 0) {
-	    flush_received_files(bkcatalog, verbose, bkid, est_size, &linkedfiles_bytes);
-	    lastflush_time = curtime;
+	else if (rec->type == '4') {
+	    skipfiles = rec->nfiles;
+	    skipbytes = rec->filesize;
 	}
-	inbuf[0] = '\0';
+	sf_release_record(metadata, rec);
     } 
 
-
-    free(inbuf);
-    dfree(keygroups);
-    dfree(keygroupsp);
-    dfree(mdfields);
-    dfree(eprvkeyu);
-    dfree(pubkeyu);
-    dfree(commentu);
-    for (int i = 0; i < numkeys; i++) {
-	dfree(cryptinfo[i].hmac);
-    }
-    free(cryptinfo);
-    dfree(xattru);
-    dfree(filenameu);
-    dfree(linknameu);
-    sqlite3_finalize(inbfrec);
     if (verbose >= 1)
-	update_status(total_bytes_received, est_size, "Completed", curtime, start_time, '*');
-    flush_received_files(bkcatalog, verbose, bkid, est_size, &linkedfiles_bytes);
-    total_bytes_received += linkedfiles_bytes;
+	update_status(total_bytes_received + __atomic_load_n(&(cat->linkbytes), __ATOMIC_RELAXED),
+	    est_size, "Completed", curtime, start_time, '*');
+    sf_catalog_finish(cat);
+    total_bytes_received += cat->linkbytes;
+    free(cat);
     if (verbose >= 1) {
 	update_status(total_bytes_received, est_size, "Completed", curtime, start_time, ' ');
 	fprintf(stderr, "\n");
@@ -450,7 +844,55 @@ int submitfiles(int argc, char **argv)
 	fprintf(stderr, "%6.2f %s in %d files received.\n",
 	    (double) total_bytes_received / display_units[b_received_unit].unit,
 	    display_units[b_received_unit].label, tot_files);
-    fclose(metadata);
+
+    int b_skip_unit = 0;
+    for (int i = 0; i < sizeof(display_units) / sizeof(*display_units); i++)
+        if (skipbytes >= display_units[i].unit)
+            b_skip_unit = i;
+
+    if (verbose >= 1 && skipfiles > 0)
+	fprintf(stderr, "%6.2f %s in %d files already in the vault, not rewritten.\n",
+	    (double) skipbytes / display_units[b_skip_unit].unit,
+	    display_units[b_skip_unit].label, skipfiles);
+    if (asprintf(&objmsg, "%d files stored compressed, %d raw, %d chunked", lzofiles, rawfiles, chunkedfiles) < 0) {
+	fprintf(stderr, "Memory allocation failure\n");
+	exit(1);
+    }
+    if (verbose >= 1)
+	fprintf(stderr, "%s.\n", objmsg);
+
+    logaction(bkcatalog, bkid, 8, objmsg);
+    free(objmsg);
+
+    double elapsed = ftime() - start_time;
+    double bps = elapsed > 0 ? total_bytes_received / elapsed : 0;
+    int bps_unit = 0;
+    for (int i = 0; i < sizeof(display_units) / sizeof(*display_units); i++)
+        if (bps >= display_units[i].unit)
+            bps_unit = i;
+    if (verbose >= 1)
+	fprintf(stderr, "%6.2f %s/s over %.1f seconds with %d thread%s.\n",
+	    bps / display_units[bps_unit].unit, display_units[bps_unit].label,
+	    elapsed, opts.nthreads, opts.nthreads == 1 ? "" : "s");
+    if (verbose >= 1)
+	fprintf(stderr, "%d records cataloged, %.0f records/s.\n", tot_files,
+	    elapsed > 0 ? tot_files / elapsed : 0);
+    if (metadata->f != NULL)
+	fclose(metadata->f);
+    else
+	pthread_join(reader, NULL);
+    sf_link_free(metadata);
+    vault_lock(LOCK_UN);
+    // The reader exits on a file it couldn't store, such as a damaged partial
+    if (readerpid > 0 && (waitpid(readerpid, &status, 0) < 0 || !WIFEXITED(status)
+	|| WEXITSTATUS(status) != 0)) {
+	fprintf(stderr, "Error reading the tar stream, backup incomplete\n");
+	sqlite3_close(bkcatalog);
+	exit(1);
+    }
+    // A virtual file on its own is only part of the host
+    if (opts.virtualfile == NULL)
+	latest_state_update(bkcatalog, bkid, verbose);
     logaction(bkcatalog, bkid, 7, "End receiving files");
     sqlite3_close(bkcatalog);
 
@@ -458,412 +900,2132 @@ int submitfiles(int argc, char **argv)
     return(0);
 }
 
-int submitfiles2(int out_h)
+/* Each tar entry passes through a slot in a ring, kept in tar order.
+ * The tar reader fills in a slot and (for entries with a file body)
+ * either stores the body itself, or queues the slot for one of the
+ * worker threads and feeds it the body in chunks.  Metadata records
+ * are written out from the head of the ring only once the entry's
+ * vault file is in place, so the parent sees them in tar order no
+ * matter which worker finishes first.
+ */
+#define SF_CHUNKSIZE (256 * 1024)
+#define SF_FREE 0
+#define SF_BUSY 1
+#define SF_DONE 2
+
+struct sf_chunk {
+    struct sf_chunk *next;
+    size_t len;
+    size_t pos;
+    char data[];
+};
+
+struct sf_job {
+    struct filespec fs;
+    char ftype;				// file type as recorded in the catalog
+    unsigned long long int filesize;	// file size as recorded in the catalog
+    char hash[EVP_MAX_MD_SIZE * 2 + 1];	// vault file name, or "0"
+    char *format;			// "" unless hash is of the content
+    char *ciphertype;
+    char *sparsetext;			// map of the data, if holes were left out
+    int holes;
+    int is_ciphered;
+    int use_hmac;
+    int precompressed;			// body is an lzop stream from the client
+    unsigned long long int resume;	// body starts this far into the file
+    int virtual;			// body runs to the end of stdin
+    char *chunklist;			// dmalloc'd, see sf_record
+    size_t chunklistlen;
+    struct sf_partial *partial;		// set while storing a resumable file
+    int pack;				// set if the object went into a pack
+    unsigned long long int packoffset;
+    unsigned long long int packlen;
+    size_t remaining;			// file body bytes not yet read from stdin
+    int fed;				// set once all body bytes are queued
+    struct sf_chunk *chunks;
+    struct sf_chunk *lastchunk;
+    size_t tot_size;
+    double lastupdate_time;
+    struct sf_link *out;
+    int state;
+    struct sf_job *next;
+    struct sf_pool *pool;
+};
+
+struct sf_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;		// a job was queued, or a chunk was fed
+    pthread_cond_t done;		// a job finished, or a chunk was released
+    struct sf_job *jobs;
+    int njobs;
+    int head;
+    int count;
+    struct sf_job *queue;
+    struct sf_job *queuetail;
+    struct sf_chunk *freechunks;
+    int nchunks;
+    int maxchunks;
+    pthread_t *threads;
+    int nthreads;
+    int shutdown;
+    struct lzop_pool *lzpool;		// block compression threads, if any
+    int inflight;
+    unsigned long long int smallmax;
+    struct vault_packer *packer;	// NULL if there are no packs to use
+    unsigned long long int packmax;
+    int sync;
+    struct vault_uring *uring;		// NULL for synchronous commits
+    struct vault_filter *filter;	// objects that may be in the vault
+    unsigned long long int chunkmin;	// chunk files this size and up, if set
+    char *bkname;
+    struct vault_codec *codec;		// NULL to compress with lzop
+    char dirs[256];			// vault subdirectories known to exist
+    int tmpfile;			// 1 while O_TMPFILE temp files work
+    int skipfiles;			// files already in the vault
+    unsigned long long int skipbytes;
+};
+
+// Run the tar reader in a child process, sending records to out_h
+pid_t submitfiles2(int out_h, struct sf_opts *opts)
+{
+    pid_t child;
+    struct sf_link *out;
+
+    if ((child = fork()) == 0) {
+	out = sf_link_init(fdopen(out_h, "w"));
+	sf_reader(out, opts);
+	fflush(out->f);
+	fclose(out->f);
+	sf_link_free(out);
+	close(out_h);
+	free(config.vault);
+	free(config.meta);
+	exit(0);
+    }
+    else {
+	close(out_h);
+    }
+    return(child);
+}
+
+// Run the tar reader in a thread of the catalog process
+void *sf_reader_thread(void *arg)
+{
+    struct sf_reader_args *a = arg;
+
+    sf_reader(a->out, &(a->opts));
+    sf_put_end(a->out);
+    free(a);
+    return(NULL);
+}
+
+/* Read the tar stream on stdin, store file contents in the vault,
+ * and send a metadata record for each entry to the catalog side.
+ */
+int sf_reader(struct sf_link *out, struct sf_opts *opts)
 {
     struct filespec fs;
-    char *tmpfiledir = config.vault;
-    char *destdir = config.vault;
-    char destdir2[3];
     char tmpfilepath[1024];
-    char targetdir[1024];
-    char targetpath[1024];
-    struct stat tmpfstat;
-    size_t sizeremaining;
     char *paxdata;
     int paxdatalen;
-    int curtmpfile;
     FILE *curfile;
     struct tarsplit_file *tsf;
     size_t c;
     size_t bufsize = 256 * 1024;
     char databuf[bufsize];
     int padding;
-    char *escfname = NULL;
-    char *esclname = NULL;
-    char *escxheader = NULL;
-    struct lzop_file *lzf;
-    struct sha_file *s1f;
-    unsigned char cfsha1[SHA_DIGEST_LENGTH];
-    unsigned char cfsha1x[SHA_DIGEST_LENGTH * 2 + 1];
-    unsigned char cfsha2[SHA256_DIGEST_LENGTH];
-    unsigned char cfsha2x[SHA256_DIGEST_LENGTH * 2 + 1];
-    unsigned char *cfshax = NULL;
     int use_hmac = 0;
     unsigned char hmac[EVP_MAX_MD_SIZE * 2 + 1];
-    int wrote_file = 0;
-    pid_t child;
     int numkeys = 0;
     char paxhdr_varstring[256];
+    char *ciphertype = NULL;
+    struct sf_pool *pool;
+    struct sf_job *job;
 
-    if ((child = fork()) == 0) {
-	FILE *out = fdopen(out_h, "w");
-	char *sparsetext = NULL;
-	char *ciphertype = NULL;
-
-	fsinit(&fs);
-	while (tar_get_next_hdr(&fs)) {
-	    use_hmac = 0;
-	    wrote_file = 0;
-		if (fs.ftype == 'g') {
-		char *paxdatacpy = NULL;
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.version", &paxdata, &paxdatalen) == 0) {
-		    struct key_st *keys;
-		    char *esceprvkey = NULL;
-		    char *escpubkey = NULL;
-		    char *esccomment= NULL;
-		    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.numkeys", &paxdata, &paxdatalen) == 0) {
-			strncpya0(&paxdatacpy, paxdata, paxdatalen);
-			numkeys = atoi(paxdatacpy);
+    if (opts->virtualfile != NULL)
+	return(sf_virtual(out, opts));
+    pool = sf_pool_init(opts);
+    fsinit(&fs);
+    while (tar_get_next_hdr(&fs)) {
+	use_hmac = 0;
+	    if (fs.ftype == 'g') {
+	    char *paxdatacpy = NULL;
+	    // Key records apply to the files after them, so let
+	    // everything before this header go out first.
+	    sf_emit(pool, out, 0);
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.version", &paxdata, &paxdatalen) == 0) {
+		struct key_st *keys;
+		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.numkeys", &paxdata, &paxdatalen) == 0) {
+		    strncpya0(&paxdatacpy, paxdata, paxdatalen);
+		    numkeys = atoi(paxdatacpy);
+		}
+		else
+		    numkeys = 1;
+		keys = malloc(sizeof(struct key_st) * numkeys);
+		for (int i = 0; i < numkeys; i++) {
+		    keys[i].fingerprint = NULL;
+		    keys[i].eprvkey = NULL;
+		    keys[i].pubkey = NULL;
+		    keys[i].hmac_hash_b64 = NULL;
+		    keys[i].comment = NULL;
+		}
+		for (int i = 0; i < numkeys; i++) {
+		    if (numkeys > 1) {
+			sprintf(paxhdr_varstring, "TC.pubkey.fingerprint.%d", i);
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].fingerprint));
+			sprintf(paxhdr_varstring, "TC.eprivkey.%d", i);
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].eprvkey));
+			sprintf(paxhdr_varstring, "TC.pubkey.%d", i);
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].pubkey));
+			sprintf(paxhdr_varstring, "TC.hmackeyhash.%d", i);
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].hmac_hash_b64));
+			sprintf(paxhdr_varstring, "TC.keyfile.comment.%d", i);
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].comment));
 		    }
-		    else
-			numkeys = 1;
-		    keys = malloc(sizeof(struct key_st) * numkeys);
-		    for (int i = 0; i < numkeys; i++) {
-			keys[i].fingerprint = NULL;
-			keys[i].eprvkey = NULL;
-			keys[i].pubkey = NULL;
-			keys[i].hmac_hash_b64 = NULL;
-			keys[i].comment = NULL;
+		    else {
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.pubkey.fingerprint", &(keys[0].fingerprint));
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.eprivkey", &(keys[0].eprvkey));
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.pubkey",&(keys[0].pubkey));
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.hmackeyhash", &(keys[0].hmac_hash_b64));
+			cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.keyfile.comment", &(keys[0].comment));
 		    }
-		    for (int i = 0; i < numkeys; i++) {
-			if (numkeys > 1) {
-			    sprintf(paxhdr_varstring, "TC.pubkey.fingerprint.%d", i);
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].fingerprint));
-			    sprintf(paxhdr_varstring, "TC.eprivkey.%d", i);
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].eprvkey));
-			    sprintf(paxhdr_varstring, "TC.pubkey.%d", i);
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].pubkey));
-			    sprintf(paxhdr_varstring, "TC.hmackeyhash.%d", i);
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].hmac_hash_b64));
-			    sprintf(paxhdr_varstring, "TC.keyfile.comment.%d", i);
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, paxhdr_varstring, &(keys[i].comment));
-			}
-			else {
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.pubkey.fingerprint", &(keys[0].fingerprint));
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.eprivkey", &(keys[0].eprvkey));
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.pubkey",&(keys[0].pubkey));
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.hmackeyhash", &(keys[0].hmac_hash_b64));
-			    cpypaxvarstr(fs.xheader, fs.xheaderlen, "TC.keyfile.comment", &(keys[0].comment));
-			}
 
-		    }
-		    fprintf(out, "3\n");
+		}
+		sf_put_keyhdr(out);
+		for (int i = 0; i < numkeys; i++)
+		    sf_put_key(out, i, &(keys[i]));
+		if (numkeys > 0) {
 		    for (int i = 0; i < numkeys; i++) {
-			fprintf(out, "0\t%d\t%s\t%s\t%s\t%s\t%s\t\n", i,
-			    keys[i].fingerprint, stresc(keys[i].eprvkey, &esceprvkey), stresc(keys[i].pubkey, &escpubkey),
-			    keys[i].hmac_hash_b64, stresc(keys[i].comment, &esccomment));
-		    }
-		    if (numkeys > 0) {
-			for (int i = 0; i < numkeys; i++) {
-			    dfree(keys[i].comment);
-			    dfree(keys[i].fingerprint);
-			    dfree(keys[i].hmac_hash_b64);
-			    dfree(keys[i].eprvkey);
-			    dfree(keys[i].pubkey);
-			}
-			free(keys);
+			dfree(keys[i].comment);
+			dfree(keys[i].fingerprint);
+			dfree(keys[i].hmac_hash_b64);
+			dfree(keys[i].eprvkey);
+			dfree(keys[i].pubkey);
 		    }
-		    dfree(esceprvkey);
-		    dfree(escpubkey);
-		    dfree(esccomment);
+		    free(keys);
 		}
-		dfree(paxdatacpy);
+	    }
+	    dfree(paxdatacpy);
+
+	}
+	else if (fs.ftype == '5' && getpaxvar(fs.xheader, fs.xheaderlen, "TC.segmented.header",
+	    &paxdata, &paxdatalen) == 0) {
 
+	    job = sf_job_next(pool, out);
+	    curfile = sf_tmpfile(pool, tmpfilepath);
+	    tsf = tarsplit_init_r(fread, stdin, numkeys);
+	    if (ciphertype != NULL)
+		ciphertype[0] = '\0';
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.compression", &paxdata, &paxdatalen) == 0) {
+		strncata0(&ciphertype, paxdata, paxdatalen - 1);
 	    }
-	    else if (fs.ftype == '5' && getpaxvar(fs.xheader, fs.xheaderlen, "TC.segmented.header",
-		&paxdata, &paxdatalen) == 0) {
-
-		sprintf(tmpfilepath, "%s/tbXXXXXX", tmpfiledir);
-		curtmpfile = mkstemp(tmpfilepath);
-		curfile = fdopen(curtmpfile, "w");
-		tsf = tarsplit_init_r(fread, stdin, numkeys);
-		if (ciphertype != NULL)
-		    ciphertype[0] = '\0';
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.compression", &paxdata, &paxdatalen) == 0) {
-		    strncata0(&ciphertype, paxdata, paxdatalen - 1);
-		}
-		strncata0(&ciphertype, "|", 1);
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) == 0) {
-		    strncata0(&ciphertype, paxdata, paxdatalen - 1);
-		}
-		fprintf(curfile, "%s\n", ciphertype);
-
-		double curtime = ftime();
-		double lastupdate_time = curtime;
-		size_t tot_size = 0;
-		while ((c = tarsplit_read(databuf, 1, bufsize, tsf)) > 0) {
-		    fwrite(databuf, 1, c, curfile);
-		    tot_size += c;
-		    if ((curtime = ftime()) > lastupdate_time + 1) {
-			fprintf(out, "2\t%s\t%lu\n", stresc(fs.filename, &escfname), tot_size);
-		    }
+	    strncata0(&ciphertype, "|", 1);
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) == 0) {
+		strncata0(&ciphertype, paxdata, paxdatalen - 1);
+	    }
+	    fprintf(curfile, "%s\n", ciphertype);
+
+	    double curtime = ftime();
+	    double lastupdate_time = curtime;
+	    size_t tot_size = 0;
+	    while ((c = tarsplit_read(databuf, 1, bufsize, tsf)) > 0) {
+		fwrite(databuf, 1, c, curfile);
+		tot_size += c;
+		if ((curtime = ftime()) > lastupdate_time + 1) {
+		    sf_put_progress(out, fs.filename, tot_size);
+		    lastupdate_time = curtime;
 		}
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) == 0) {
-		   for (int i = 0; i < numkeys; i++) {
-			if ((tsf->hmac[i])[0] != '\0') {
-			    strncata0(&ciphertype, (char *) (tsf->hmac[i]), EVP_MAX_MD_SIZE * 2);
-			    use_hmac = 1;
-			}
-		   }
-		   if (use_hmac == 1) {
-			unsigned char *tmphash;
-			strcpy((char *) hmac, (char *) (tmphash = sha256_hex(ciphertype)));
-			free(tmphash);
-		   }
-#if 0
-		    if ((tsf->hmac[0])[0] != '\0') {
-			strncpy((char *) hmac, (char *) (tsf->hmac[0]), EVP_MAX_MD_SIZE * 2);
-			hmac[EVP_MAX_MD_SIZE * 2] = '\0';
-			if (hmac[strlen((char *) hmac) - 1] == '\n')
-			    hmac[strlen((char *) hmac) - 1] = '\0';
+	    }
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) == 0) {
+	       for (int i = 0; i < numkeys; i++) {
+		    if ((tsf->hmac[i])[0] != '\0') {
+			strncata0(&ciphertype, (char *) (tsf->hmac[i]), EVP_MAX_MD_SIZE * 2);
 			use_hmac = 1;
 		    }
-#endif
-		   if (numkeys > 1) {
-			for (int i = 0; i < numkeys; i++) {
-			    sprintf(paxhdr_varstring, "TC.hmac.%d", i);
-			    setpaxvar(&(fs.xheader), &(fs.xheaderlen), paxhdr_varstring, (char *) tsf->hmac[i], strlen((char *) tsf->hmac[i]));
-			}
-		    }
-		    else {
-			setpaxvar(&(fs.xheader), &(fs.xheaderlen), "TC.hmac", (char *) tsf->hmac[0], strlen((char *) tsf->hmac[0]));
+	       }
+	       if (use_hmac == 1) {
+		    unsigned char *tmphash;
+		    strcpy((char *) hmac, (char *) (tmphash = sha256_hex(ciphertype)));
+		    free(tmphash);
+	       }
+	       if (numkeys > 1) {
+		    for (int i = 0; i < numkeys; i++) {
+			sprintf(paxhdr_varstring, "TC.hmac.%d", i);
+			setpaxvar(&(fs.xheader), &(fs.xheaderlen), paxhdr_varstring, (char *) tsf->hmac[i], strlen((char *) tsf->hmac[i]));
 		    }
 		}
-		if (escxheader == NULL)
-		    escxheader = dmalloc(((int)((fs.xheaderlen + 2) / 3)) * 4 + 1);
-		else
-		    if (dmalloc_size(escxheader) < ((int)((fs.xheaderlen + 2) / 3)) * 4 + 1)
-			escxheader = drealloc(escxheader, ((int)((fs.xheaderlen + 2) / 3)) * 4 + 1);
-
-		unsigned long long int filesize = fs.filesize;
-
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.original.size", &paxdata, &paxdatalen) == 0) {
-		    filesize = strtoull(paxdata, 0, 10);
+		else {
+		    setpaxvar(&(fs.xheader), &(fs.xheaderlen), "TC.hmac", (char *) tsf->hmac[0], strlen((char *) tsf->hmac[0]));
 		}
+	    }
+	    if (use_hmac == 0) {
+		fprintf(stderr, "No hmac found for segmented file %s, aborting\n", fs.filename);
+		exit(1);
+	    }
 
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.sparse.original.size", &paxdata, &paxdatalen) == 0) {
-		    filesize = strtoull(paxdata, 0, 10);
-		}
+	    fsdup(&(job->fs), &fs);
+	    job->ftype = 'E';
+	    job->filesize = fs.filesize;
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.original.size", &paxdata, &paxdatalen) == 0) {
+		job->filesize = strtoull(paxdata, 0, 10);
+	    }
 
-		fprintf(out, "1\t%c\t%4.4o\t%s\t%d\t%s\t%d\t%lld\t%s\t%lu\t%s\t%s\t%d\t%s",
-		    'E', fs.mode, fs.auid, fs.nuid, fs.agid, fs.ngid, filesize,
-			use_hmac == 0 ? cfsha1x : hmac, fs.modtime, stresc(fs.filename, &escfname),
-			stresc(fs.linktarget == 0 ? "" : fs.linktarget, &esclname), fs.xheaderlen,
-			fs.xheaderlen == 0 ? "" : EncodeBlock2(escxheader, fs.xheader, fs.xheaderlen, NULL)
-		    );
-		tarsplit_finalize_r(tsf);
-		if (fclose(curfile) == 0)
-		    wrote_file = 1;
-		else {
-		    fprintf(stderr, "Error writing file, aborting\n");
-		    exit(1);
-		}
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.sparse.original.size", &paxdata, &paxdatalen) == 0) {
+		job->filesize = strtoull(paxdata, 0, 10);
 	    }
-	    else if (fs.filesize > 0 || fs.n_sparsedata > 0) {
-		int is_ciphered = 0;
-		size_t (*c_fwrite)();
-		void *c_handle;
-		unsigned long long int filesize = fs.filesize;
-
-		sprintf(tmpfilepath, "%s/tbXXXXXX", tmpfiledir);
-		curtmpfile = mkstemp(tmpfilepath);
-		curfile = fdopen(curtmpfile, "w");
-		if (ciphertype != NULL)
-                    ciphertype[0] = '\0';
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.compression", &paxdata, &paxdatalen) == 0) {
-		    strncata0(&ciphertype, paxdata, paxdatalen - 1);
-		}
-		strncata0(&ciphertype, "|", 1);
-		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) == 0) {
-		    strncata0(&ciphertype, paxdata, paxdatalen - 1);
-		    is_ciphered = 1;
-		}
-		if (is_ciphered == 1)
-		    fprintf(curfile, "%s\n", ciphertype);
-		sizeremaining = fs.filesize;
-		padding = 512 - ((fs.filesize - 1) % 512 + 1);
-		if (is_ciphered == 1) {
-		    is_ciphered = 1;
-		    if (numkeys > 1)
-			for (int i = 0; i < numkeys; i++) {
-			    sprintf(paxhdr_varstring, "TC.hmac.%d", i);
-			    if (getpaxvar(fs.xheader, fs.xheaderlen, paxhdr_varstring, &paxdata, &paxdatalen) == 0) {
-				strncata0(&ciphertype, paxdata, paxdatalen - 1);
-				use_hmac = 1;
-			    }
-			}
-		    else {
-			if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.hmac", &paxdata, &paxdatalen) == 0) {
+	    strcpy(job->hash, (char *) hmac);
+	    tarsplit_finalize_r(tsf);
+	    sf_commit(pool, job->hash, "enc", curfile, tmpfilepath);
+	    sf_job_done(pool, job);
+	}
+	else if (fs.filesize > 0 || fs.n_sparsedata > 0) {
+	    job = sf_job_next(pool, out);
+	    fsdup(&(job->fs), &fs);
+	    job->filesize = fs.filesize;
+	    job->is_ciphered = 0;
+	    job->use_hmac = 0;
+	    if (job->ciphertype != NULL)
+		job->ciphertype[0] = '\0';
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.compression", &paxdata, &paxdatalen) == 0) {
+		strncata0(&(job->ciphertype), paxdata, paxdatalen - 1);
+	    }
+	    strncata0(&(job->ciphertype), "|", 1);
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) == 0) {
+		strncata0(&(job->ciphertype), paxdata, paxdatalen - 1);
+		job->is_ciphered = 1;
+	    }
+	    padding = 512 - ((fs.filesize - 1) % 512 + 1);
+	    if (job->is_ciphered == 1) {
+		strncpya0(&ciphertype, job->ciphertype, 0);
+		if (numkeys > 1)
+		    for (int i = 0; i < numkeys; i++) {
+			sprintf(paxhdr_varstring, "TC.hmac.%d", i);
+			if (getpaxvar(fs.xheader, fs.xheaderlen, paxhdr_varstring, &paxdata, &paxdatalen) == 0) {
 			    strncata0(&ciphertype, paxdata, paxdatalen - 1);
-			    use_hmac = 1;
+			    job->use_hmac = 1;
 			}
 		    }
-		    if (use_hmac == 1) {
-			unsigned char *tmphash;
-			strcpy((char *) hmac, (char *) (tmphash = sha256_hex(ciphertype)));
-			free(tmphash);
-		    }
-		}
-		if (config.hash == 1)
-		    s1f = sha_file_init_w(fwrite, curfile, 1);
-		else if (config.hash == 2)
-		    s1f = sha_file_init_w(fwrite, curfile, 2);
 		else {
-		    fprintf(stderr, "Couldn't determine hash type %d\n", config.hash);
-		    exit(1);
-		}
-		c_fwrite = sha_file_write;
-		c_handle = s1f;
-		if (use_hmac == 0) {
-		    lzf = lzop_init_w(sha_file_write, s1f);
-		    c_fwrite = lzop_write;
-		    c_handle = lzf;
-		}
-		if (fs.n_sparsedata > 0) {
-		    int stlen;
-		    if (sparsetext != NULL)
-			sparsetext[0] = '\0';
-		    stlen = gen_sparse_data_string(&fs, &sparsetext);
-		    c_fwrite(sparsetext, 1, stlen, c_handle);
-		    filesize = fs.sparse_realsize;
-		}
-		double curtime = ftime();
-		double lastupdate_time = curtime;
-		size_t tot_size = 0;
-		while (sizeremaining > 0) {
-		    c = fread(databuf, 1, sizeremaining < bufsize ? sizeremaining : bufsize, stdin);
-		    c_fwrite(databuf, 1, c, c_handle);
-		    sizeremaining -= c;
-		    tot_size += c;
-		    if ((curtime = ftime()) > lastupdate_time + 1) {
-			fprintf(out, "2\t%s\t%lu\n", stresc(fs.filename, &escfname), tot_size);
+		    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.hmac", &paxdata, &paxdatalen) == 0) {
+			strncata0(&ciphertype, paxdata, paxdatalen - 1);
+			job->use_hmac = 1;
 		    }
 		}
-		if (use_hmac == 0)
-		    lzop_finalize_w(lzf);
-		if (config.hash == 1) {
-		    sha_finalize_w(s1f, cfsha1);
-		    encode_block_16(cfsha1x, cfsha1, SHA_DIGEST_LENGTH);
-		    cfshax = cfsha1x;
-		} else if (config.hash == 2) {
-		    sha_finalize_w(s1f, cfsha2);
-		    encode_block_16(cfsha2x, cfsha2, SHA256_DIGEST_LENGTH);
-		    cfshax = cfsha2x;
-		    cfsha2x[40] = '\0';
+		if (job->use_hmac == 1) {
+		    unsigned char *tmphash;
+		    strcpy(job->hash, (char *) (tmphash = sha256_hex(ciphertype)));
+		    free(tmphash);
 		}
-		else {
-		    fprintf(stderr, "Error in determining hash type\n");
-		    exit(1);
+	    }
+	    if (fs.n_sparsedata > 0)
+		job->filesize = fs.sparse_realsize;
+	    if (job->is_ciphered == 1) { 
+		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.original.size", &paxdata, &paxdatalen) == 0) {
+		    job->filesize = strtoull(paxdata, 0, 10);
 		}
-		if (fclose(curfile) == 0)
-		    wrote_file = 1;
-		else {
-		    fprintf(stderr, "Error writing file, aborting\n");
+
+		if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.sparse.original.size", &paxdata, &paxdatalen) == 0) {
+		    job->filesize = strtoull(paxdata, 0, 10);
+		}
+	    }
+	    /* Bodies compressed by "tarcrypt compress" are already in the
+	     * vault's object format, and are stored as sent.  The TC
+	     * variables are dropped so the catalog sees a plain file.
+	     */
+	    job->precompressed = 0;
+	    if (job->is_ciphered == 0 && fs.n_sparsedata == 0
+		&& strcmp(job->ciphertype, "lzop|") == 0
+		&& getpaxvar(fs.xheader, fs.xheaderlen, "TC.original.size", &paxdata, &paxdatalen) == 0) {
+		job->filesize = strtoull(paxdata, 0, 10);
+		job->precompressed = 1;
+		delpaxvar(&(job->fs.xheader), &(job->fs.xheaderlen), "TC.compression");
+		delpaxvar(&(job->fs.xheader), &(job->fs.xheaderlen), "TC.original.size");
+	    }
+	    // The tail of a file, sent by "tarcrypt resume" to finish a partial object
+	    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.resume.offset", &paxdata, &paxdatalen) == 0) {
+		if (job->is_ciphered == 1 || job->precompressed == 1 || fs.n_sparsedata > 0) {
+		    fprintf(stderr, "Can't resume %s, aborting\n", fs.filename);
 		    exit(1);
 		}
-		while (padding > 0)
-		    padding -= fread(databuf, 1, padding < bufsize ? padding : bufsize, stdin);
-		if (escxheader == NULL)
-		    escxheader = dmalloc(((int)((fs.xheaderlen + 2) / 3)) * 4 + 1);
-		else
-		    if (dmalloc_size(escxheader) < ((int)((fs.xheaderlen + 2) / 3)) * 4 + 1)
-			escxheader = drealloc(escxheader, ((int)((fs.xheaderlen + 2) / 3)) * 4 + 1);
+		job->resume = strtoull(paxdata, 0, 10);
+		job->filesize += job->resume;
+		job->fs.filesize = job->filesize;
+		delpaxvar(&(job->fs.xheader), &(job->fs.xheaderlen), "TC.resume.offset");
+	    }
+	    job->ftype = job->is_ciphered == 1 ? 'E' : fs.n_sparsedata > 0 ? 'S' : fs.ftype;
+	    job->remaining = fs.filesize;
 
+	    if (pool->nthreads == 0) {
+		if (sf_store(job, sf_stdin_read, job) == 0)
+		    sf_job_done(pool, job);
+	    }
+	    else
+		sf_job_feed(pool, job);
+	    while (padding > 0)
+		padding -= fread(databuf, 1, padding < bufsize ? padding : bufsize, stdin);
+	}
+	else {
+	    job = sf_job_next(pool, out);
+	    if (fs.ftype == '5' && strlen(fs.filename) > 0 && fs.filename[strlen(fs.filename) - 1] == '/') {
+		fs.filename[strlen(fs.filename) - 1] = '\0';
+	    }
+	    fsdup(&(job->fs), &fs);
+	    job->ftype = fs.ftype;
+	    job->filesize = fs.filesize;
+	    strcpy(job->hash, "0");
+	    sf_job_done(pool, job);
+	}
+	sf_emit(pool, out, pool->njobs);
+	fsclear(&fs);
+    }
 
-		if (is_ciphered == 1) { 
-		    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.original.size", &paxdata, &paxdatalen) == 0) {
-			filesize = strtoull(paxdata, 0, 10);
-		    }
+    sf_pool_finalize(pool, out);
+    fsfree(&fs);
+    dfree(ciphertype);
+    return(0);
+}
 
-		    if (getpaxvar(fs.xheader, fs.xheaderlen, "TC.sparse.original.size", &paxdata, &paxdatalen) == 0) {
-			filesize = strtoull(paxdata, 0, 10);
-		    }
-		}
+/* Store stdin as a single file named by --virtual-file, for dumps
+ * piped straight in.  Its size isn't known until the input ends, so
+ * the body is read here rather than handed to the workers, and always
+ * goes through a temp file.  It is owned by whoever ran submitfiles.
+ */
+int sf_virtual(struct sf_link *out, struct sf_opts *opts)
+{
+    struct filespec fs;
+    struct sf_pool *pool;
+    struct sf_job *job;
+    struct passwd *pw;
+    struct group *gr;
 
-		fprintf(out, "1\t%c\t%4.4o\t%s\t%d\t%s\t%d\t%lld\t%s\t%lu\t%s\t%s\t%d\t%s",
-		    is_ciphered == 1 ? 'E' : fs.n_sparsedata > 0 ? 'S' : fs.ftype, fs.mode,
-		    fs.auid, fs.nuid, fs.agid, fs.ngid, filesize, use_hmac == 0 ? cfshax : hmac,
-		    fs.modtime, stresc(fs.filename, &escfname),
-		    stresc(fs.linktarget == 0 ? "" : fs.linktarget, &esclname), fs.xheaderlen,
-		    fs.xheaderlen == 0 ? "" : EncodeBlock2(escxheader, fs.xheader, fs.xheaderlen, NULL)
-		);
-		wrote_file = 1;
-	    }
-	    else {
-		if (escxheader == NULL)
-		    escxheader = dmalloc(((int)((fs.xheaderlen + 2) / 3)) * 4 + 1);
-		else
-		    if (dmalloc_size(escxheader) < ((int)((fs.xheaderlen + 2) / 3)) * 4 + 1)
-			escxheader = drealloc(escxheader, ((int)((fs.xheaderlen + 2) / 3)) * 4 + 1);
-		if (fs.ftype == '5' && strlen(fs.filename) > 0 && fs.filename[strlen(fs.filename) - 1] == '/') {
-		    fs.filename[strlen(fs.filename) - 1] = '\0';
-		}
-		fprintf(out, "1\t%c\t%4.4o\t%s\t%d\t%s\t%d\t%lld\t%s\t%lu\t%s\t%s\t%d\t%s\n",
-		    fs.ftype, fs.mode, fs.auid, fs.nuid, fs.agid, fs.ngid,
-			fs.filesize, "0", fs.modtime, stresc(fs.filename, &escfname),
-			stresc(fs.linktarget == 0 ? "" : fs.linktarget, &esclname), fs.xheaderlen,
-			fs.xheaderlen == 0 ? "" : EncodeBlock2(escxheader, fs.xheader, fs.xheaderlen, NULL)
-		    );
-	    }
+    pool = sf_pool_init(opts);
+    fsinit(&fs);
+    fs.ftype = '0';
+    fs.mode = opts->virtualmode;
+    fs.nuid = getuid();
+    fs.ngid = getgid();
+    snprintf(fs.auid, sizeof(fs.auid), "%s", (pw = getpwuid(fs.nuid)) != NULL ? pw->pw_name : "");
+    snprintf(fs.agid, sizeof(fs.agid), "%s", (gr = getgrgid(fs.ngid)) != NULL ? gr->gr_name : "");
+    fs.modtime = time(NULL);
+    strncpya0(&(fs.filename), opts->virtualfile, 0);
+
+    job = sf_job_next(pool, out);
+    fsdup(&(job->fs), &fs);
+    job->ftype = '0';
+    job->is_ciphered = 0;
+    job->use_hmac = 0;
+    job->precompressed = 0;
+    job->virtual = 1;
+    job->remaining = SIZE_MAX;
+    sf_store(job, sf_stdin_read, job);
+    job->filesize = job->tot_size;
+    job->fs.filesize = job->tot_size;
+    sf_job_done(pool, job);
+    sf_pool_finalize(pool, out);
+    fsfree(&fs);
+    return(0);
+}
+
+struct sf_pool *sf_pool_init(struct sf_opts *opts)
+{
+    struct sf_pool *pool;
+
+    pool = malloc(sizeof(struct sf_pool));
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->work), NULL);
+    pthread_cond_init(&(pool->done), NULL);
+    pool->nthreads = opts->nthreads > 1 ? opts->nthreads : 0;
+    pool->uring = opts->uring == 1 && opts->sync != SF_SYNC_FILE ? vault_uring_init() : NULL;
+    // With io_uring, even a lone reader keeps many commits in flight
+    pool->njobs = opts->nthreads > 1 ? opts->nthreads * 8 : pool->uring != NULL ? 64 : 1;
+    pool->jobs = malloc(sizeof(struct sf_job) * pool->njobs);
+    for (int i = 0; i < pool->njobs; i++) {
+	fsinit(&(pool->jobs[i].fs));
+	pool->jobs[i].ciphertype = NULL;
+	pool->jobs[i].sparsetext = NULL;
+	pool->jobs[i].chunklist = NULL;
+	pool->jobs[i].state = SF_FREE;
+	pool->jobs[i].pool = pool;
+    }
+    pool->head = 0;
+    pool->count = 0;
+    pool->queue = NULL;
+    pool->queuetail = NULL;
+    pool->freechunks = NULL;
+    pool->nchunks = 0;
+    pool->maxchunks = pool->nthreads * 4;
+    pool->shutdown = 0;
+    pool->lzpool = opts->blockthreads > 0 ? lzop_pool_init(opts->blockthreads) : NULL;
+    pool->inflight = opts->inflight;
+    pool->smallmax = opts->smallmax;
+    pool->packer = vault_packer_init(opts->packmax);
+    pool->filter = vault_filter_open();
+    pool->packmax = pool->packer != NULL ? opts->packmax : 0;
+    pool->sync = opts->sync;
+    pool->bkname = opts->bkname;
+    pool->codec = opts->codec;
+    pool->chunkmin = config.chunk_threshold;
+    if (pool->chunkmin > 0)
+	sf_cdc_init();
+    memset(pool->dirs, 0, sizeof(pool->dirs));
+    // Unnamed temp files are linked in by their /proc/self/fd name
+    pool->tmpfile = access("/proc/self/fd", X_OK) == 0 ? 1 : 0;
+    pool->skipfiles = 0;
+    pool->skipbytes = 0;
+    pool->threads = malloc(sizeof(pthread_t) * (pool->nthreads + 1));
+    for (int i = 0; i < pool->nthreads; i++) {
+	if (pthread_create(&(pool->threads[i]), NULL, sf_worker, pool) != 0) {
+	    fprintf(stderr, "Error starting worker thread\n");
+	    exit(1);
+	}
+    }
+    return(pool);
+}
+
+// Wait for a free slot at the tail of the ring, and claim it
+struct sf_job *sf_job_next(struct sf_pool *pool, struct sf_link *out)
+{
+    struct sf_job *job;
+
+    sf_emit(pool, out, pool->njobs - 1);
+    pthread_mutex_lock(&(pool->lock));
+    job = &(pool->jobs[(pool->head + pool->count) % pool->njobs]);
+    pool->count++;
+    pthread_mutex_unlock(&(pool->lock));
+    job->state = SF_BUSY;
+    job->hash[0] = '\0';
+    job->format = "";
+    job->pack = 0;
+    job->resume = 0;
+    job->virtual = 0;
+    job->holes = 0;
+    job->chunklistlen = 0;
+    job->partial = NULL;
+    job->remaining = 0;
+    job->fed = 0;
+    job->chunks = NULL;
+    job->lastchunk = NULL;
+    job->tot_size = 0;
+    job->lastupdate_time = ftime();
+    job->out = out;
+    job->next = NULL;
+    return(job);
+}
+
+void sf_job_done(struct sf_pool *pool, struct sf_job *job)
+{
+    pthread_mutex_lock(&(pool->lock));
+    job->state = SF_DONE;
+    pthread_cond_broadcast(&(pool->done));
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Write out metadata records for finished jobs at the head of the
+ * ring, waiting on unfinished ones while more than maxpending jobs
+ * are outstanding.
+ */
+int sf_emit(struct sf_pool *pool, struct sf_link *out, int maxpending)
+{
+    struct sf_job *job;
+
+    pthread_mutex_lock(&(pool->lock));
+    while (pool->count > 0) {
+	job = &(pool->jobs[pool->head]);
+	if (job->state != SF_DONE) {
+	    if (pool->count <= maxpending)
+		break;
+	    pthread_cond_wait(&(pool->done), &(pool->lock));
+	    continue;
+	}
+	pthread_mutex_unlock(&(pool->lock));
+	sf_write_record(out, job);
+	pthread_mutex_lock(&(pool->lock));
+	job->state = SF_FREE;
+	pool->head = (pool->head + 1) % pool->njobs;
+	pool->count--;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return(0);
+}
+
+int sf_write_record(struct sf_link *out, struct sf_job *job)
+{
+    struct filespec *fs = &(job->fs);
+    struct sf_record *rec;
+
+    if (out->f == NULL) {
+	rec = sf_record_get(out);
+	rec->type = '1';
+	rec->ftype = job->ftype;
+	rec->mode = fs->mode;
+	strncpya0(&(rec->auid), fs->auid, 0);
+	rec->nuid = fs->nuid;
+	strncpya0(&(rec->agid), fs->agid, 0);
+	rec->ngid = fs->ngid;
+	rec->filesize = job->filesize;
+	strcpy(rec->hash, job->hash);
+	rec->modtime = fs->modtime;
+	strncpya0(&(rec->filename), fs->filename, 0);
+	strncpya0(&(rec->linktarget), job->holes == 1 ? job->sparsetext :
+	    fs->linktarget == 0 ? "" : fs->linktarget, 0);
+	if (dmalloc_size(rec->xheader) < fs->xheaderlen + 1)
+	    rec->xheader = drealloc(rec->xheader, fs->xheaderlen + 1);
+	memcpy(rec->xheader, fs->xheader, fs->xheaderlen);
+	rec->xheaderlen = fs->xheaderlen;
+	rec->pack = job->pack;
+	rec->offset = job->packoffset;
+	rec->length = job->packlen;
+	strncpya0(&(rec->format), job->format, 0);
+	strncpya0(&(rec->chunklist), job->chunklistlen > 0 ? job->chunklist : "", job->chunklistlen);
+	sf_queue_push(&(out->full), rec);
+	return(0);
+    }
+    sf_frame_begin(out, '1');
+    sf_frame_int(out, &(job->ftype), sizeof(job->ftype));
+    sf_frame_int(out, &(fs->mode), sizeof(fs->mode));
+    sf_frame_int(out, &(fs->nuid), sizeof(fs->nuid));
+    sf_frame_int(out, &(fs->ngid), sizeof(fs->ngid));
+    sf_frame_int(out, &(job->filesize), sizeof(job->filesize));
+    sf_frame_int(out, &(fs->modtime), sizeof(fs->modtime));
+    sf_frame_str(out, fs->auid, strlen(fs->auid));
+    sf_frame_str(out, fs->agid, strlen(fs->agid));
+    sf_frame_str(out, job->hash, strlen(job->hash));
+    sf_frame_str(out, fs->filename, strlen(fs->filename));
+    if (job->holes == 1)
+	sf_frame_str(out, job->sparsetext, strlen(job->sparsetext));
+    else
+	sf_frame_str(out, fs->linktarget == 0 ? "" : fs->linktarget,
+	    fs->linktarget == 0 ? 0 : strlen(fs->linktarget));
+    sf_frame_str(out, fs->xheader, fs->xheaderlen);
+    sf_frame_int(out, &(job->pack), sizeof(job->pack));
+    sf_frame_int(out, &(job->packoffset), sizeof(job->packoffset));
+    sf_frame_int(out, &(job->packlen), sizeof(job->packlen));
+    sf_frame_str(out, job->format, strlen(job->format));
+    sf_frame_str(out, job->chunklistlen > 0 ? job->chunklist : "", job->chunklistlen);
+    return(sf_frame_send(out));
+}
+
+// Hand a job to the workers and feed it the file body from stdin
+int sf_job_feed(struct sf_pool *pool, struct sf_job *job)
+{
+    struct sf_chunk *chunk;
+    size_t c;
+
+    pthread_mutex_lock(&(pool->lock));
+    job->fed = job->remaining == 0 ? 1 : 0;
+    if (pool->queuetail == NULL)
+	pool->queue = job;
+    else
+	pool->queuetail->next = job;
+    pool->queuetail = job;
+    pthread_cond_broadcast(&(pool->work));
+    pthread_mutex_unlock(&(pool->lock));
+
+    while (job->remaining > 0) {
+	pthread_mutex_lock(&(pool->lock));
+	while (pool->freechunks == NULL && pool->nchunks >= pool->maxchunks)
+	    pthread_cond_wait(&(pool->done), &(pool->lock));
+	if ((chunk = pool->freechunks) != NULL)
+	    pool->freechunks = chunk->next;
+	else
+	    pool->nchunks++;
+	pthread_mutex_unlock(&(pool->lock));
+	if (chunk == NULL)
+	    chunk = malloc(sizeof(struct sf_chunk) + SF_CHUNKSIZE);
+
+	c = fread(chunk->data, 1, job->remaining < SF_CHUNKSIZE ? job->remaining : SF_CHUNKSIZE, stdin);
+	if (c == 0) {
+	    fprintf(stderr, "Unexpected end of input, aborting\n");
+	    exit(1);
+	}
+	chunk->len = c;
+	chunk->pos = 0;
+	chunk->next = NULL;
+	pthread_mutex_lock(&(pool->lock));
+	job->remaining -= c;
+	if (job->lastchunk == NULL)
+	    job->chunks = chunk;
+	else
+	    job->lastchunk->next = chunk;
+	job->lastchunk = chunk;
+	if (job->remaining == 0)
+	    job->fed = 1;
+	pthread_cond_broadcast(&(pool->work));
+	pthread_mutex_unlock(&(pool->lock));
+	sf_progress(job, c);
+    }
+    return(0);
+}
+
+void sf_progress(struct sf_job *job, size_t c)
+{
+    double curtime;
+
+    job->tot_size += c;
+    if ((curtime = ftime()) > job->lastupdate_time + 1) {
+	sf_put_progress(job->out, job->fs.filename, job->tot_size);
+	job->lastupdate_time = curtime;
+    }
+}
+
+// c_fread style source for a job's body, serial mode
+size_t sf_stdin_read(void *buf, size_t sz, size_t count, struct sf_job *job)
+{
+    size_t c;
+
+    if (job->remaining == 0)
+	return(0);
+    c = fread(buf, 1, job->remaining < sz * count ? job->remaining : sz * count, stdin);
+    if (c == 0 && job->virtual == 1 && ferror(stdin) == 0) {
+	job->remaining = 0;
+	return(0);
+    }
+    if (c == 0) {
+	fprintf(stderr, "Unexpected end of input, aborting\n");
+	exit(1);
+    }
+    job->remaining -= c;
+    sf_progress(job, c);
+    return(c);
+}
+
+// c_fread style source for a job's body, fed by the tar reader
+size_t sf_chunk_read(void *buf, size_t sz, size_t count, struct sf_job *job)
+{
+    struct sf_pool *pool = job->pool;
+    struct sf_chunk *chunk;
+    size_t n = sz * count;
+    size_t t = 0;
+    size_t c;
+
+    pthread_mutex_lock(&(pool->lock));
+    while (t < n) {
+	while (job->chunks == NULL && job->fed == 0)
+	    pthread_cond_wait(&(pool->work), &(pool->lock));
+	if ((chunk = job->chunks) == NULL)
+	    break;
+	pthread_mutex_unlock(&(pool->lock));
+	c = chunk->len - chunk->pos < n - t ? chunk->len - chunk->pos : n - t;
+	memcpy(buf + t, chunk->data + chunk->pos, c);
+	chunk->pos += c;
+	t += c;
+	pthread_mutex_lock(&(pool->lock));
+	if (chunk->pos == chunk->len) {
+	    if ((job->chunks = chunk->next) == NULL)
+		job->lastchunk = NULL;
+	    chunk->next = pool->freechunks;
+	    pool->freechunks = chunk;
+	    pthread_cond_broadcast(&(pool->done));
+	}
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return(t);
+}
+
+void *sf_worker(void *arg)
+{
+    struct sf_pool *pool = arg;
+    struct sf_job *job;
+    int pending;
+
+    pthread_mutex_lock(&(pool->lock));
+    while (1) {
+	while (pool->queue == NULL && pool->shutdown == 0)
+	    pthread_cond_wait(&(pool->work), &(pool->lock));
+	if ((job = pool->queue) == NULL)
+	    break;
+	if ((pool->queue = job->next) == NULL)
+	    pool->queuetail = NULL;
+	pthread_mutex_unlock(&(pool->lock));
+	pending = sf_store(job, sf_chunk_read, job);
+	pthread_mutex_lock(&(pool->lock));
+	if (pending == 0) {
+	    job->state = SF_DONE;
+	    pthread_cond_broadcast(&(pool->done));
+	}
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return(NULL);
+}
+
+int sf_pool_finalize(struct sf_pool *pool, struct sf_link *out)
+{
+    struct sf_chunk *chunk;
+
+    sf_emit(pool, out, 0);
+    pthread_mutex_lock(&(pool->lock));
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&(pool->work));
+    pthread_mutex_unlock(&(pool->lock));
+    for (int i = 0; i < pool->nthreads; i++)
+	pthread_join(pool->threads[i], NULL);
+    sf_put_stats(out, pool->skipfiles, pool->skipbytes);
+    vault_uring_free(pool->uring);
+    vault_packer_free(pool->packer);
+    vault_filter_close(pool->filter);
+    if (pool->lzpool != NULL)
+	lzop_pool_free(pool->lzpool);
+    vault_codec_free(pool->codec);
+    while ((chunk = pool->freechunks) != NULL) {
+	pool->freechunks = chunk->next;
+	free(chunk);
+    }
+    for (int i = 0; i < pool->njobs; i++) {
+	fsfree(&(pool->jobs[i].fs));
+	dfree(pool->jobs[i].ciphertype);
+	dfree(pool->jobs[i].sparsetext);
+	dfree(pool->jobs[i].chunklist);
+    }
+    free(pool->jobs);
+    free(pool->threads);
+    pthread_mutex_destroy(&(pool->lock));
+    pthread_cond_destroy(&(pool->work));
+    pthread_cond_destroy(&(pool->done));
+    free(pool);
+    return(0);
+}
+
+/* Hash and compress a file body into the given sink, and return the
+ * extension of the resulting object.
+ */
+char *sf_encode(struct sf_job *job, size_t (*c_fread)(), void *c_handle,
+    size_t (*c_fwrite)(), void *c_fhandle, unsigned char *cfsha)
+{
+    struct lzop_file *lzf = NULL;
+    struct vault_zstd *vz = NULL;
+    struct sha_file *s1f;
+    int content;
+    int raw;
+    int zstd;
+    char *ext;
+    size_t bufsize = 256 * 1024;
+    char *databuf;
+    size_t c;
+
+    databuf = malloc(bufsize);
+    // Data that looks random at the start is stored without compression
+    c = c_fread(databuf, 1, bufsize, c_handle);
+    if (job->resume > 0)
+	raw = strcmp(job->partial->ext, "raw") == 0;
+    else
+	raw = job->use_hmac == 0 && job->is_ciphered == 0 && sf_incompressible(databuf, c);
+    /* Partial objects stay lzop, whose blocks stand alone, so that
+     * compression can carry on from a cut off transfer.
+     */
+    zstd = job->pool->codec != NULL && job->use_hmac == 0 && job->is_ciphered == 0 && raw == 0
+	&& job->partial == NULL;
+    ext = job->use_hmac == 1 ? "enc" : raw == 1 ? "raw" : zstd == 1 ? "zst" : "lzo";
+    if (job->partial != NULL)
+	sf_partial_open(job->partial, ext);
+    /* With content_hash set, or for raw objects, the hash is taken ahead
+     * of the compressor, so the object's name doesn't change with the
+     * compression library.
+     */
+    content = job->use_hmac == 0 && (config.content_hash == 1 || raw == 1);
+    if (content == 1 && zstd == 1) {
+	vz = vault_zstd_init_w(job->pool->codec, c_fwrite, c_fhandle);
+	c_fwrite = vault_zstd_write;
+	c_fhandle = vz;
+    }
+    else if (content == 1 && raw == 0) {
+	lzf = sf_lzop_init(job, c_fwrite, c_fhandle);
+	c_fwrite = lzop_write;
+	c_fhandle = lzf;
+    }
+    if (config.hash == 1)
+	s1f = sha_file_init_w(c_fwrite, c_fhandle, 1);
+    else if (config.hash == 2)
+	s1f = sha_file_init_w(c_fwrite, c_fhandle, 2);
+    else {
+	fprintf(stderr, "Couldn't determine hash type %d\n", config.hash);
+	exit(1);
+    }
+    /* Content hashes start with a tag, keeping them apart from hashes
+     * of lzop streams, which all start with the lzop magic.
+     */
+    if (content == 1)
+	sha_file_update(s1f, SF_CONTENT_TAG, strlen(SF_CONTENT_TAG));
+    c_fwrite = sha_file_write;
+    c_fhandle = s1f;
+    if (content == 0 && zstd == 1) {
+	vz = vault_zstd_init_w(job->pool->codec, sha_file_write, s1f);
+	c_fwrite = vault_zstd_write;
+	c_fhandle = vz;
+    }
+    else if (job->use_hmac == 0 && content == 0) {
+	lzf = sf_lzop_init(job, sha_file_write, s1f);
+	c_fwrite = lzop_write;
+	c_fhandle = lzf;
+    }
+    if (job->fs.n_sparsedata > 0) {
+	int stlen;
+	stlen = gen_sparse_data_string(&(job->fs), &(job->sparsetext));
+	c_fwrite(job->sparsetext, 1, stlen, c_fhandle);
+    }
+    if (job->resume > 0)
+	sf_partial_replay(job->partial, s1f, content, job->fs.filename);
+    while (c > 0) {
+	c_fwrite(databuf, 1, c, c_fhandle);
+	c = c_fread(databuf, 1, bufsize, c_handle);
+    }
+    free(databuf);
+    if (lzf != NULL && content == 0)
+	lzop_finalize_w(lzf);
+    if (vz != NULL && content == 0)
+	vault_zstd_finalize_w(vz);
+    sha_finalize_w(s1f, cfsha);
+    if (lzf != NULL && content == 1)
+	lzop_finalize_w(lzf);
+    if (vz != NULL && content == 1)
+	vault_zstd_finalize_w(vz);
+    // zstd objects are recorded as such, whichever way they are named
+    if (content == 1 || zstd == 1)
+	job->format = ext;
+    return(ext);
+}
+
+/* Store an lzop stream sent by the client as is.  It is decompressed
+ * along the way, both to check it before it goes in the vault, and to
+ * take the content hash when the vault is set to content_hash.
+ * Without content_hash the name is the hash of the stream, same as for
+ * objects compressed here.
+ */
+char *sf_passthru(struct sf_job *job, size_t (*c_fread)(), void *c_handle,
+    size_t (*c_fwrite)(), void *c_fhandle, unsigned char *cfsha)
+{
+    struct sf_tee tee;
+    struct lzop_file *lzf;
+    struct sha_file *s1f;
+    size_t bufsize = 256 * 1024;
+    char *databuf;
+    unsigned long long int remaining;
+    size_t c;
+
+    if (config.hash != 1 && config.hash != 2) {
+	fprintf(stderr, "Couldn't determine hash type %d\n", config.hash);
+	exit(1);
+    }
+    tee.c_fread = c_fread;
+    tee.c_handle = c_handle;
+    tee.c_fwrite = c_fwrite;
+    tee.c_fhandle = c_fhandle;
+    if (config.content_hash == 1) {
+	s1f = sha_file_init_w(sf_null_write, NULL, config.hash);
+	sha_file_update(s1f, SF_CONTENT_TAG, strlen(SF_CONTENT_TAG));
+    }
+    else {
+	s1f = sha_file_init_w(c_fwrite, c_fhandle, config.hash);
+	tee.c_fwrite = sha_file_write;
+	tee.c_fhandle = s1f;
+    }
+    databuf = malloc(bufsize);
+    lzf = lzop_init_r(sf_tee_read, &tee);
+    remaining = job->filesize;
+    while (remaining > 0 && lzf->error == 0) {
+	c = lzop_read(databuf, 1, remaining < bufsize ? remaining : bufsize, lzf);
+	if (c == 0)
+	    break;
+	if (config.content_hash == 1)
+	    sha_file_write(databuf, 1, c, s1f);
+	remaining -= c;
+    }
+    // The stream has to end right after the original size, and the body with it
+    if (remaining > 0 || lzf->error != 0 || lzop_read(databuf, 1, 1, lzf) != 0
+	|| lzf->eof == 0 || lzf->error != 0 || c_fread(databuf, 1, 1, c_handle) != 0) {
+	fprintf(stderr, "Invalid compressed data for %s, aborting\n", job->fs.filename);
+	exit(1);
+    }
+    lzop_finalize_r(lzf);
+    free(databuf);
+    sha_finalize_w(s1f, cfsha);
+    if (config.content_hash == 1)
+	job->format = "lzo";
+    return("lzo");
+}
+
+/* Compress and hash a file body into a temp file, then move it into
+ * place in the vault.  Runs either in the tar reader (serial mode) or
+ * in a worker thread.  Returns 1 if the object was handed to io_uring,
+ * which marks the job done once the object is in place.
+ */
+int sf_store(struct sf_job *job, size_t (*c_fread)(), void *c_handle)
+{
+    char tmpfilepath[1024];
+    FILE *curfile = NULL;
+    struct sf_membuf mem = { NULL, 0 };
+    int inmem;
+    char *ext;
+    char *alt;
+    size_t (*c_fwrite)();
+    void *c_fhandle;
+    size_t bufsize = 256 * 1024;
+    char *databuf;
+    unsigned char cfsha[SHA256_DIGEST_LENGTH];
+    struct sf_partial part;
+    struct sf_holes holes;
+
+    // Encrypted files are named by their hmac, so that can be checked first
+    if (job->use_hmac == 1 && sf_stored(job, "enc") == 1) {
+	databuf = malloc(bufsize);
+	while (c_fread(databuf, 1, bufsize, c_handle) > 0)
+	    ;
+	free(databuf);
+	sf_skipped(job);
+	return(0);
+    }
+    if (job->pool->chunkmin > 0 && job->use_hmac == 0 && job->is_ciphered == 0
+	&& job->precompressed == 0 && job->fs.n_sparsedata == 0 && job->resume == 0
+	&& (job->fs.filesize >= job->pool->chunkmin || job->virtual == 1))
+	return(sf_chunked(job, c_fread, c_handle));
+    inmem = job->fs.filesize <= job->pool->smallmax && job->resume == 0 && job->virtual == 0;
+    /* Only a partial object is read back to store a file dense, so one
+     * staged in memory has to be too small to outgrow the map.
+     */
+    holes.buf = NULL;
+    if (config.hole_elision == 1 && job->ftype == '0' && job->use_hmac == 0
+	&& job->is_ciphered == 0 && job->precompressed == 0 && job->resume == 0
+	&& job->virtual == 0 && job->fs.filesize >= SF_HOLE_BLOCK
+	&& (inmem == 0 || job->fs.filesize < SF_HOLE_MAXSEG * 2ULL * SF_HOLE_BLOCK)) {
+	holes.c_fread = c_fread;
+	holes.c_handle = c_handle;
+	holes.buf = malloc(SF_HOLE_BLOCK);
+	holes.len = 0;
+	holes.pos = 0;
+	holes.offset = 0;
+	holes.map = NULL;
+	holes.nmap = 0;
+	holes.holes = 0;
+	holes.overflow = 0;
+	holes.partial = NULL;
+	c_fread = sf_holes_read;
+	c_handle = &holes;
+    }
+    /* Otherwise the name is the hash of the compressed data.  Small files
+     * are compressed in memory, and only written out if not already in
+     * the vault.  Those small enough go into a pack.
+     */
+    if (inmem == 1) {
+	c_fwrite = sf_mem_write;
+	c_fhandle = &mem;
+    }
+    else if (job->resume > 0 || (job->fs.filesize >= SF_RESUME_MIN && job->is_ciphered == 0
+	&& job->precompressed == 0 && job->fs.n_sparsedata == 0 && job->virtual == 0)) {
+	vault_partial_path(job->pool->bkname, job->fs.filename, job->fs.filesize,
+	    job->fs.modtime, part.path);
+	part.f = NULL;
+	part.ext = NULL;
+	part.resume = job->resume;
+	part.holes = 0;
+	holes.partial = &part;
+	if (job->resume > 0 && (vault_partial_offset(part.path, &(part.ext)) < job->resume
+	    || (strcmp(part.ext, "lzo") == 0 && job->resume % (256 * 1024) != 0))) {
+	    fprintf(stderr, "No partial file to resume %s from, aborting\n", job->fs.filename);
+	    exit(1);
+	}
+	job->partial = &part;
+	c_fwrite = sf_partial_write;
+	c_fhandle = &part;
+    }
+    else {
+	curfile = sf_tmpfile(job->pool, tmpfilepath);
+	c_fwrite = fwrite;
+	c_fhandle = curfile;
+    }
+    if (job->is_ciphered == 1) {
+	c_fwrite(job->ciphertype, 1, strlen(job->ciphertype), c_fhandle);
+	c_fwrite("\n", 1, 1, c_fhandle);
+    }
+    if (job->precompressed == 1)
+	ext = sf_passthru(job, c_fread, c_handle, c_fwrite, c_fhandle, cfsha);
+    else
+	ext = sf_encode(job, c_fread, c_handle, c_fwrite, c_fhandle, cfsha);
+    if (holes.buf != NULL && holes.overflow == 1)
+	ext = sf_holes_dense(job, &holes, ext, cfsha);
+    if (holes.buf != NULL)
+	sf_holes_finish(&holes, job);
+    if (job->use_hmac == 0) {
+	encode_block_16((unsigned char *) job->hash, cfsha,
+	    config.hash == 1 ? SHA_DIGEST_LENGTH : SHA256_DIGEST_LENGTH);
+	job->hash[40] = '\0';
+    }
+    /* An object keeps its name whichever codec wrote it, so one stored
+     * before the backup name changed codecs, or since rewritten by
+     * recompress, will do.
+     */
+    if (job->use_hmac == 0
+	&& (alt = strcmp(ext, "zst") == 0 ? "lzo" : strcmp(ext, "lzo") == 0 ? "zst" : NULL) != NULL
+	&& vault_filter_maybe(job->pool->filter, job->hash) == 1 && sf_exists(job->hash, alt) == 1)
+	ext = job->format = alt;
+    if (inmem == 1) {
+	if (job->use_hmac == 0 && sf_stored(job, ext) == 1) {
+	    dfree(mem.buf);
+	    sf_skipped(job);
+	    return(0);
+	}
+	if (mem.len <= job->pool->packmax) {
+	    if (vault_pack_put(job->pool->packer, job->hash, mem.buf, mem.len,
+		&(job->pack), &(job->packoffset)) == 1)
+		sf_skipped(job);
+	    else if (job->pool->sync == SF_SYNC_FILE && vault_pack_sync(job->pool->packer) != 0) {
+		fprintf(stderr, "Error writing pack, aborting\n");
+		exit(1);
+	    }
+	    vault_filter_add(job->pool->filter, job->hash);
+	    job->packlen = mem.len;
+	    dfree(mem.buf);
+	    return(0);
+	}
+	if (job->pool->uring != NULL) {
+	    char targetdir[1024];
+	    char targetpath[1024];
+	    int fd;
+
+	    sf_vault_path(job->hash, ext, targetdir, targetpath);
+	    sf_vault_mkdir(job->pool, job->hash, targetdir);
+	    // Named, since the rename is queued; in its bucket to spread the load
+	    snprintf(tmpfilepath, 1024, "%s/%.2s/tbXXXXXX", config.vault, job->hash);
+	    if ((fd = mkstemp(tmpfilepath)) < 0) {
+		fprintf(stderr, "Error creating temp file in %s\n", targetdir);
+		exit(1);
+	    }
+	    vault_uring_commit(job->pool->uring, mem.buf, mem.len, fd, tmpfilepath,
+		targetpath, sf_store_done, job);
+	    vault_filter_add(job->pool->filter, job->hash);
+	    return(1);
+	}
+	curfile = sf_tmpfile(job->pool, tmpfilepath);
+	fwrite(mem.buf, 1, mem.len, curfile);
+	dfree(mem.buf);
+    }
+    if (job->partial != NULL) {
+	job->partial = NULL;
+	sf_commit(job->pool, job->hash, ext, part.f, part.filepath);
+	return(0);
+    }
+    sf_commit(job->pool, job->hash, ext, curfile, tmpfilepath);
+    return(0);
+}
+
+/* Estimate the byte entropy of the first block of a file.  Nearly 8
+ * bits per byte means it is already compressed or encrypted, and
+ * running it through lzo would only cost time.  The byte counts miss
+ * repeats, such as random blocks written over and over, so a block that
+ * passes is then given to lzo, and only one lzo can't shrink is raw.
+ */
+int sf_incompressible(char *buf, size_t len)
+{
+    size_t counts[256] = { 0 };
+    double entropy = 0;
+    unsigned char *cbuf;
+    void *working_memory;
+    lzo_uint clen;
+
+    if (len < SF_PROBE_MIN)
+	return(0);
+    for (size_t i = 0; i < len; i++)
+	counts[(unsigned char) buf[i]]++;
+    for (int i = 0; i < 256; i++) {
+	if (counts[i] > 0)
+	    entropy -= (double) counts[i] / len * log2((double) counts[i] / len);
+    }
+    if (entropy < SF_RAW_ENTROPY)
+	return(0);
+    cbuf = malloc(len + len / 16 + 64 + 3);
+    working_memory = malloc(LZO1X_1_MEM_COMPRESS);
+    lzo1x_1_compress((unsigned char *) buf, len, cbuf, &clen, working_memory);
+    free(working_memory);
+    free(cbuf);
+    return(clen * 100 >= len * SF_RAW_RATIO ? 1 : 0);
+}
+
+/* Store a large file as content-defined chunks, and set the job's hash
+ * and chunk list for the catalog.  Chunks already in the vault are only
+ * touched, so a file that changed in a few places costs a few chunks.
+ */
+int sf_chunked(struct sf_job *job, size_t (*c_fread)(), void *c_handle)
+{
+    char *buf;
+    size_t len = 0;
+    size_t cut;
+    size_t c;
+    int eof = 0;
+    int stored = 0;
+    struct sha_file *s1f;
+    unsigned char cfsha[SHA256_DIGEST_LENGTH];
+
+    buf = malloc(SF_CDC_MAX);
+    while (1) {
+	while (eof == 0 && len < SF_CDC_MAX) {
+	    if ((c = c_fread(buf + len, 1, SF_CDC_MAX - len, c_handle)) == 0)
+		eof = 1;
+	    len += c;
+	}
+	if (len == 0)
+	    break;
+	cut = sf_cdc_cut((unsigned char *) buf, len);
+	stored += sf_cdc_store(job, buf, cut);
+	memmove(buf, buf + cut, len - cut);
+	len -= cut;
+    }
+    free(buf);
+    s1f = sha_file_init_w(sf_null_write, NULL, config.hash);
+    sha_file_update(s1f, SF_CHUNKS_TAG, strlen(SF_CHUNKS_TAG));
+    if (job->chunklistlen > 0)
+	sha_file_update(s1f, job->chunklist, job->chunklistlen);
+    sha_finalize_w(s1f, cfsha);
+    encode_block_16((unsigned char *) job->hash, cfsha,
+	config.hash == 1 ? SHA_DIGEST_LENGTH : SHA256_DIGEST_LENGTH);
+    job->hash[40] = '\0';
+    job->format = "chunked";
+    if (stored == 0)
+	sf_skipped(job);
+    return(0);
+}
+
+static uint64_t sf_gear[256];
+
+// Fill the gear table from a fixed seed, so cut points never change
+void sf_cdc_init()
+{
+    uint64_t x = 0x736e656275636463ULL;
+    uint64_t z;
+
+    for (int i = 0; i < 256; i++) {
+	z = (x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	sf_gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the next chunk at the start of buf, holding len bytes
+size_t sf_cdc_cut(unsigned char *buf, size_t len)
+{
+    uint64_t h = 0;
+    size_t avg = len < SF_CDC_AVG ? len : SF_CDC_AVG;
+    size_t i;
+
+    if (len <= SF_CDC_MIN)
+	return(len);
+    for (i = SF_CDC_MIN; i < avg; i++) {
+	h = (h << 1) + sf_gear[buf[i]];
+	if ((h & SF_CDC_MASKS) == 0)
+	    return(i + 1);
+    }
+    for (; i < len; i++) {
+	h = (h << 1) + sf_gear[buf[i]];
+	if ((h & SF_CDC_MASKL) == 0)
+	    return(i + 1);
+    }
+    return(len);
+}
+
+/* Store one chunk unless the vault already has it, and add it to the
+ * job's chunk list.  Returns 1 if it was written.
+ */
+int sf_cdc_store(struct sf_job *job, char *buf, size_t len)
+{
+    struct sf_pool *pool = job->pool;
+    char hash[EVP_MAX_MD_SIZE * 2 + 1];
+    unsigned char cfsha[SHA256_DIGEST_LENGTH];
+    char tmpfilepath[1024];
+    char line[128];
+    struct sha_file *s1f;
+    struct lzop_file *lzf;
+    FILE *curfile;
+    char *ext;
+    int n;
+    int stored = 0;
+
+    ext = sf_incompressible(buf, len < 256 * 1024 ? len : 256 * 1024) == 1 ? "raw" : "lzo";
+    s1f = sha_file_init_w(sf_null_write, NULL, config.hash);
+    sha_file_update(s1f, SF_CONTENT_TAG, strlen(SF_CONTENT_TAG));
+    sha_file_update(s1f, buf, len);
+    sha_finalize_w(s1f, cfsha);
+    encode_block_16((unsigned char *) hash, cfsha,
+	config.hash == 1 ? SHA_DIGEST_LENGTH : SHA256_DIGEST_LENGTH);
+    hash[40] = '\0';
+    /* A chunk recompress has rewritten is as good, and keeps its place
+     * in the list as lzo, so the list, and the object's name, stay put.
+     */
+    if (vault_filter_maybe(pool->filter, hash) == 0 || (sf_exists(hash, ext) == 0
+	&& (strcmp(ext, "lzo") != 0 || sf_exists(hash, "zst") == 0))) {
+	curfile = sf_tmpfile(pool, tmpfilepath);
+	if (strcmp(ext, "raw") == 0)
+	    fwrite(buf, 1, len, curfile);
+	else {
+	    lzf = lzop_init_w(fwrite, curfile);
+	    if (pool->lzpool != NULL)
+		lzf = lzop_parallel_w(lzf, pool->lzpool, pool->inflight);
+	    lzop_write(buf, 1, len, lzf);
+	    lzop_finalize_w(lzf);
+	}
+	sf_commit(pool, hash, ext, curfile, tmpfilepath);
+	stored = 1;
+    }
+    n = snprintf(line, sizeof(line), "%s %s %zu\n", hash, ext, len);
+    if (dmalloc_size(job->chunklist) < job->chunklistlen + n + 1)
+	job->chunklist = drealloc(job->chunklist, (job->chunklistlen + n + 1) * 2);
+    memcpy(job->chunklist + job->chunklistlen, line, n + 1);
+    job->chunklistlen += n;
+    return(stored);
+}
+
+struct lzop_file *sf_lzop_init(struct sf_job *job, size_t (*c_fwrite)(), void *c_fhandle)
+{
+    struct lzop_file *lzf;
+
+    // A resumed object already has its header
+    if (job->resume > 0)
+	lzf = lzop_append_w(c_fwrite, c_fhandle);
+    else
+	lzf = lzop_init_w(c_fwrite, c_fhandle);
+    // Only files spanning several blocks gain from splitting them out
+    if (job->pool->lzpool != NULL && (job->fs.filesize > 256 * 1024 || job->virtual == 1))
+	return(lzop_parallel_w(lzf, job->pool->lzpool, job->pool->inflight));
+    return(lzf);
+}
+
+/* Open a partial object for writing, once it is known which kind of
+ * object it is.  A fresh one replaces anything left from an earlier
+ * version of the file.
+ */
+void sf_partial_open(struct sf_partial *part, char *ext)
+{
+    char partdir[1024];
+
+    part->written = 0;
+    part->synced = 0;
+    if (part->resume > 0) {
+	snprintf(part->filepath, sizeof(part->filepath), "%s.%s", part->path, part->ext);
+	if ((part->f = fopen(part->filepath, "r+")) == NULL) {
+	    fprintf(stderr, "Error opening %s, aborting\n", part->filepath);
+	    exit(1);
+	}
+	return;
+    }
+    snprintf(partdir, 1024, "%s/partial", config.vault);
+    if (mkdir(partdir, 0770) != 0 && errno != EEXIST) {
+	fprintf(stderr, "Error creating directory %s\n", partdir);
+	exit(1);
+    }
+    part->ext = ext;
+    snprintf(part->filepath, sizeof(part->filepath), "%s.%s", part->path, strcmp(ext, "raw") == 0 ? "lzo" : "raw");
+    unlink(part->filepath);
+    snprintf(part->filepath, sizeof(part->filepath), "%s.%s", part->path, ext);
+    if (part->holes == 1) {
+	unlink(part->filepath);
+	snprintf(part->filepath, sizeof(part->filepath), "%s.holes", part->path);
+    }
+    if ((part->f = fopen(part->filepath, "w")) == NULL) {
+	fprintf(stderr, "Error creating %s, aborting\n", part->filepath);
+	exit(1);
+    }
+}
+
+/* Read back what a resumed partial object holds, adding it to the hash,
+ * and leave the file positioned to take the rest.  A partial that
+ * doesn't check out is removed, so the next backup starts over.
+ */
+void sf_partial_replay(struct sf_partial *part, struct sha_file *s1f, int content, char *filename)
+{
+    struct sf_tee tee;
+    struct lzop_file *lzf;
+    size_t bufsize = 256 * 1024;
+    char *databuf;
+    unsigned long long int remaining = part->resume;
+    int damaged = 0;
+    off_t end;
+    size_t c;
+
+    databuf = malloc(bufsize);
+    if (strcmp(part->ext, "raw") == 0) {
+	while (remaining > 0 &&
+	    (c = fread(databuf, 1, remaining < bufsize ? remaining : bufsize, part->f)) > 0) {
+	    sha_file_update(s1f, databuf, c);
+	    remaining -= c;
+	}
+    }
+    else {
+	// Without content_hash the hash is of the stream itself
+	tee.c_fread = fread;
+	tee.c_handle = part->f;
+	if (content == 1)
+	    tee.c_fwrite = sf_null_write;
+	else
+	    tee.c_fwrite = sf_hash_write;
+	tee.c_fhandle = s1f;
+	lzf = lzop_init_r(sf_tee_read, &tee);
+	// Whole blocks only, so each read ends on a block boundary
+	while (remaining > 0 && lzf->error == 0 &&
+	    (c = lzop_read(databuf, 1, bufsize, lzf)) == bufsize) {
+	    if (content == 1)
+		sha_file_update(s1f, databuf, c);
+	    remaining -= c;
+	}
+	// A bad checksum still hands back the block, so check after the last
+	damaged = lzf->error;
+	free(lzf->buf);
+	free(lzf->cbuf);
+	free(lzf);
+    }
+    free(databuf);
+    if (remaining > 0 || damaged != 0) {
+	fprintf(stderr, "Partial file for %s is damaged, aborting\n", filename);
+	unlink(part->filepath);
+	exit(1);
+    }
+    if ((end = ftello(part->f)) < 0 || fflush(part->f) != 0 ||
+	ftruncate(fileno(part->f), end) != 0 || fseeko(part->f, end, SEEK_SET) != 0) {
+	fprintf(stderr, "Error writing %s, aborting\n", part->filepath);
+	exit(1);
+    }
+    part->written = end;
+    part->synced = end;
+}
+
+// c_fwrite style sink for a partial object, flushed to disk at each checkpoint
+size_t sf_partial_write(void *buf, size_t sz, size_t count, struct sf_partial *part)
+{
+    size_t c;
+
+    if ((c = fwrite(buf, sz, count, part->f)) < count) {
+	fprintf(stderr, "Error writing %s, aborting\n", part->filepath);
+	exit(1);
+    }
+    part->written += sz * c;
+    if (part->written - part->synced >= SF_CHECKPOINT) {
+	if (fflush(part->f) != 0 || fdatasync(fileno(part->f)) != 0) {
+	    fprintf(stderr, "Error writing %s, aborting\n", part->filepath);
+	    exit(1);
+	}
+	part->synced = part->written;
+    }
+    return(c);
+}
+
+/* Open a temp file for a vault object.  Where the filesystem allows
+ * it this is an unnamed O_TMPFILE file, which a crash can't leave
+ * behind, and tmpfilepath is set to "".
+ */
+FILE *sf_tmpfile(struct sf_pool *pool, char *tmpfilepath)
+{
+    int curtmpfile;
+
+    if (__atomic_load_n(&(pool->tmpfile), __ATOMIC_RELAXED) == 1) {
+	if ((curtmpfile = open(config.vault, O_TMPFILE | O_WRONLY, 0600)) >= 0) {
+	    tmpfilepath[0] = '\0';
+	    return(fdopen(curtmpfile, "w"));
+	}
+	if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+	    fprintf(stderr, "Error creating temp file in %s: %s\n", config.vault, strerror(errno));
+	    exit(1);
+	}
+	__atomic_store_n(&(pool->tmpfile), 0, __ATOMIC_RELAXED);
+    }
+    sprintf(tmpfilepath, "%s/tbXXXXXX", config.vault);
+    if ((curtmpfile = mkstemp(tmpfilepath)) < 0) {
+	fprintf(stderr, "Error creating temp file in %s\n", config.vault);
+	exit(1);
+    }
+    return(fdopen(curtmpfile, "w"));
+}
+
+// c_fwrite style sink collecting a small file in memory
+size_t sf_mem_write(void *buf, size_t sz, size_t count, struct sf_membuf *mem)
+{
+    size_t n = sz * count;
+
+    if (dmalloc_size(mem->buf) < mem->len + n)
+	mem->buf = drealloc(mem->buf, (mem->len + n) * 2);
+    memcpy(mem->buf + mem->len, buf, n);
+    mem->len += n;
+    return(count);
+}
+
+size_t sf_tee_read(void *buf, size_t size, size_t nmemb, struct sf_tee *tee)
+{
+    size_t c;
+
+    c = tee->c_fread(buf, size, nmemb, tee->c_handle);
+    if (c > 0)
+	tee->c_fwrite(buf, size, c, tee->c_fhandle);
+    return(c);
+}
+
+/* Pass a file body through a block at a time, skipping whole blocks of
+ * zeros.  Blocks are filled up before they are looked at, so a short
+ * block can only be the last one, and is always kept.
+ */
+size_t sf_holes_read(void *buf, size_t size, size_t nmemb, struct sf_holes *h)
+{
+    char path[1024 + 8];
+    size_t n = size * nmemb;
+    size_t c = 0;
+    size_t r;
+    int zero;
+
+    while (c < n) {
+	if (h->pos == h->len) {
+	    h->offset += h->len;
+	    h->len = 0;
+	    h->pos = 0;
+	    while (h->len < SF_HOLE_BLOCK &&
+		(r = h->c_fread(h->buf + h->len, 1, SF_HOLE_BLOCK - h->len, h->c_handle)) > 0)
+		h->len += r;
+	    if (h->len == 0)
+		break;
+	    zero = h->len == SF_HOLE_BLOCK && h->buf[0] == '\0' &&
+		memcmp(h->buf, h->buf + 1, SF_HOLE_BLOCK - 1) == 0;
+	    // Once the map is full, zeros are kept, so it doesn't grow any more
+	    if (zero == 1 && h->nmap >= SF_HOLE_MAXSEG)
+		h->overflow = 1;
+	    if (zero == 1 && h->overflow == 0) {
+		h->pos = h->len;
+		/* The partial object no longer holds the file as sent, so
+		 * it is moved where newbackup won't offer to resume it.
+		 */
+		if (h->holes++ == 0 && h->partial != NULL) {
+		    h->partial->holes = 1;
+		    if (h->partial->f != NULL) {
+			snprintf(path, sizeof(path), "%s.holes", h->partial->path);
+			if (rename(h->partial->filepath, path) != 0) {
+			    fprintf(stderr, "Error renaming %s, aborting\n", h->partial->filepath);
+			    exit(1);
+			}
+			strcpy(h->partial->filepath, path);
+		    }
+		}
+		continue;
+	    }
+	    if (h->nmap > 0 && h->map[h->nmap - 1].offset + h->map[h->nmap - 1].size == h->offset)
+		h->map[h->nmap - 1].size += h->len;
+	    else {
+		if (dmalloc_size(h->map) < (h->nmap + 1) * sizeof(struct sparsedata))
+		    h->map = drealloc(h->map, (h->nmap + 1) * 2 * sizeof(struct sparsedata));
+		h->map[h->nmap].offset = h->offset;
+		h->map[h->nmap].size = h->len;
+		h->nmap++;
+	    }
+	}
+	r = h->len - h->pos < n - c ? h->len - h->pos : n - c;
+	memcpy((char *) buf + c, h->buf + h->pos, r);
+	h->pos += r;
+	c += r;
+    }
+    return(c / size);
+}
+
+/* If any holes were left out, make the job a sparse file, with its map
+ * in the same "datasize:offset:size..." form sparse objects start with.
+ */
+void sf_holes_finish(struct sf_holes *h, struct sf_job *job)
+{
+    char segment[64];
+    unsigned long long int datasize = 0;
+
+    if (h->holes > 0 && h->overflow == 0) {
+	for (int i = 0; i < h->nmap; i++)
+	    datasize += h->map[i].size;
+	if (job->sparsetext != NULL)
+	    job->sparsetext[0] = '\0';
+	sprintf(segment, "%llu", datasize);
+	strcata(&(job->sparsetext), segment);
+	for (int i = 0; i < h->nmap; i++) {
+	    sprintf(segment, ":%llu:%llu", h->map[i].offset, h->map[i].size);
+	    strcata(&(job->sparsetext), segment);
+	}
+	// A file ending in a hole gets an empty last segment, as tar writes
+	if (h->nmap == 0 || h->map[h->nmap - 1].offset + h->map[h->nmap - 1].size < h->offset + h->len) {
+	    sprintf(segment, ":%llu:0", h->offset + h->len);
+	    strcata(&(job->sparsetext), segment);
+	}
+	job->ftype = 'S';
+	job->holes = 1;
+    }
+    free(h->buf);
+    dfree(h->map);
+}
+
+/* Store a file whose map outgrew SF_HOLE_MAXSEG dense after all, from
+ * its partial object read back with the holes put back in, and return
+ * the extension of the new object.
+ */
+char *sf_holes_dense(struct sf_job *job, struct sf_holes *h, char *ext, unsigned char *cfsha)
+{
+    struct sf_partial *part = job->partial;
+    struct sf_dense dense;
+    struct lzop_file *lzf = NULL;
+    char holespath[1024 + 8];
+    FILE *f;
+    int error;
+
+    if (fflush(part->f) != 0 || (f = fopen(part->filepath, "r")) == NULL) {
+	fprintf(stderr, "Error reading back %s, aborting\n", part->filepath);
+	exit(1);
+    }
+    fclose(part->f);
+    strcpy(holespath, part->filepath);
+    dense.c_fread = fread;
+    dense.c_handle = f;
+    if (strcmp(ext, "lzo") == 0) {
+	lzf = lzop_init_r(fread, f);
+	dense.c_fread = lzop_read;
+	dense.c_handle = lzf;
+    }
+    dense.map = h->map;
+    dense.nmap = h->nmap;
+    dense.seg = 0;
+    dense.offset = 0;
+    dense.size = h->offset + h->len;
+    part->f = NULL;
+    part->holes = 0;
+    job->format = "";
+    ext = sf_encode(job, sf_dense_read, &dense, sf_partial_write, part, cfsha);
+    error = dense.offset != dense.size || (lzf != NULL && lzf->error != 0);
+    if (lzf != NULL) {
+	free(lzf->buf);
+	free(lzf->cbuf);
+	free(lzf);
+    }
+    fclose(f);
+    unlink(holespath);
+    if (error != 0) {
+	fprintf(stderr, "Error reading back %s, aborting\n", holespath);
+	exit(1);
+    }
+    return(ext);
+}
+
+size_t sf_dense_read(void *buf, size_t size, size_t nmemb, struct sf_dense *d)
+{
+    size_t n = size * nmemb;
+    size_t c = 0;
+    size_t r;
+    unsigned long long int end;
+
+    while (c < n && d->offset < d->size) {
+	while (d->seg < d->nmap && d->map[d->seg].offset + d->map[d->seg].size <= d->offset)
+	    d->seg++;
+	if (d->seg < d->nmap && d->map[d->seg].offset <= d->offset) {
+	    end = d->map[d->seg].offset + d->map[d->seg].size;
+	    if ((r = d->c_fread((char *) buf + c, 1, end - d->offset < n - c ? end - d->offset : n - c,
+		d->c_handle)) == 0)
+		break;
+	}
+	else {
+	    end = d->seg < d->nmap ? d->map[d->seg].offset : d->size;
+	    r = end - d->offset < n - c ? end - d->offset : n - c;
+	    memset((char *) buf + c, 0, r);
+	}
+	d->offset += r;
+	c += r;
+    }
+    return(c / size);
+}
+
+size_t sf_null_write(void *buf, size_t size, size_t nmemb, void *handle)
+{
+    return(nmemb);
+}
+
+// c_fwrite style sink that only adds to a hash
+size_t sf_hash_write(void *buf, size_t size, size_t nmemb, struct sha_file *s1f)
+{
+    sha_file_update(s1f, buf, size * nmemb);
+    return(nmemb);
+}
+
+void sf_skipped(struct sf_job *job)
+{
+    __atomic_add_fetch(&(job->pool->skipfiles), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(job->pool->skipbytes), job->fs.filesize, __ATOMIC_RELAXED);
+}
+
+void sf_vault_path(char *hash, char *ext, char *targetdir, char *targetpath)
+{
+    char destdir2[3];
+
+    strncpy(destdir2, hash, 2);
+    destdir2[2] = '\0';
+    snprintf(targetdir, 1024, "%s/%s", config.vault, destdir2);
+    snprintf(targetpath, 1024, "%s/%s/%s.%s", config.vault, destdir2, hash + 2, ext);
+}
+
+/* Returns 1 if the named object is already in the vault, touching it
+ * so that it is seen as in use.
+ */
+int sf_exists(char *hash, char *ext)
+{
+    char targetdir[1024];
+    char targetpath[1024];
+    struct stat tmpfstat;
+
+    sf_vault_path(hash, ext, targetdir, targetpath);
+    if (stat(targetpath, &tmpfstat) != 0 || utime(targetpath, NULL) != 0)
+	return(0);
+    return(1);
+}
+
+void sf_store_done(void *arg)
+{
+    struct sf_job *job = arg;
+
+    sf_job_done(job->pool, job);
+}
+
+// Create a vault subdirectory the first time this session needs it
+void sf_vault_mkdir(struct sf_pool *pool, char *hash, char *targetdir)
+{
+    struct stat tmpfstat;
+    char hex[3] = { hash[0], hash[1], '\0' };
+    int i = strtol(hex, 0, 16) & 0xff;
+
+    if (__atomic_load_n(&(pool->dirs[i]), __ATOMIC_RELAXED) == 1)
+	return;
+    if (stat(targetdir, &tmpfstat) != 0 && mkdir(targetdir, 0770) != 0 &&
+	stat(targetdir, &tmpfstat) != 0) {
+	fprintf(stderr, "Error creating directory %s\n", targetdir);
+	exit(1);
+    }
+    __atomic_store_n(&(pool->dirs[i]), 1, __ATOMIC_RELAXED);
+}
+
+/* Like sf_exists, but also looks in the packs.  Objects the presence
+ * filter has never seen are known to be new without looking.
+ */
+int sf_stored(struct sf_job *job, char *ext)
+{
+    if (vault_filter_maybe(job->pool->filter, job->hash) == 0)
+	return(0);
+    if (sf_exists(job->hash, ext) == 1)
+	return(1);
+    if (job->pool->packer != NULL && vault_packed(job->pool->packer, job->hash) == 1)
+	return(1);
+    return(0);
+}
+
+/* Move a finished temp file to its place in the vault, and close it.
+ * Unnamed temp files are linked in, which fails harmlessly if another
+ * session stored the same object first.
+ */
+int sf_commit(struct sf_pool *pool, char *hash, char *ext, FILE *f, char *tmpfilepath)
+{
+    char targetdir[1024];
+    char targetpath[1024];
+    char procpath[64];
+    int moved = 0;
+
+    sf_vault_path(hash, ext, targetdir, targetpath);
+    sf_vault_mkdir(pool, hash, targetdir);
+    if (tmpfilepath[0] == '\0') {
+	if (fflush(f) != 0 || (pool->sync == SF_SYNC_FILE && fdatasync(fileno(f)) != 0)) {
+	    fprintf(stderr, "Error writing file, aborting\n");
+	    exit(1);
+	}
+	sprintf(procpath, "/proc/self/fd/%d", fileno(f));
+	if (linkat(AT_FDCWD, procpath, AT_FDCWD, targetpath, AT_SYMLINK_FOLLOW) == 0)
+	    moved = 1;
+	else if (errno != EEXIST || utime(targetpath, NULL) != 0) {
+	    fprintf(stderr, "Error moving file to vault: %s, aborting\n", strerror(errno));
+	    exit(1);
+	}
+	fclose(f);
+    }
+    else {
+	if (sf_close(f, pool->sync) != 0) {
+	    fprintf(stderr, "Error writing file, aborting\n");
+	    exit(1);
+	}
+	if (sf_exists(hash, ext) == 0) {
+	    if (rename(tmpfilepath, targetpath) != 0) {
+		fprintf(stderr, "Error moving file to vault, aborting\n");
+		exit(1);
+	    }
+	    moved = 1;
+	}
+	else
+	    unlink(tmpfilepath);
+    }
+    if (moved == 1 && pool->sync == SF_SYNC_FILE) {
+	int dirfd;
+
+	if ((dirfd = open(targetdir, O_RDONLY | O_DIRECTORY)) < 0 || fsync(dirfd) != 0) {
+	    fprintf(stderr, "Error syncing directory %s, aborting\n", targetdir);
+	    exit(1);
+	}
+	close(dirfd);
+    }
+    vault_filter_add(pool->filter, hash);
+    return(0);
+}
+
+// fclose, flushing the data to disk first with --sync=file
+int sf_close(FILE *f, int sync)
+{
+    if (sync == SF_SYNC_FILE && (fflush(f) != 0 || fdatasync(fileno(f)) != 0)) {
+	fclose(f);
+	return(EOF);
+    }
+    return(fclose(f));
+}
+
+/* Flush everything written to the vault's filesystem so far, which
+ * takes in every object the catalog has been told about.
+ */
+int sf_sync_vault()
+{
+    int fd;
+
+    if ((fd = open(config.vault, O_RDONLY | O_DIRECTORY)) < 0)
+	return(1);
+    if (syncfs(fd) != 0) {
+	close(fd);
+	return(1);
+    }
+    close(fd);
+    return(0);
+}
+
+/* Set up one end of the reader to catalog link.  With f set, records
+ * travel as frames over the pipe; otherwise through the queues.
+ */
+struct sf_link *sf_link_init(FILE *f)
+{
+    struct sf_link *link;
+
+    link = malloc(sizeof(struct sf_link));
+    memset(link, 0, sizeof(struct sf_link));
+    link->f = f;
+    if (f == NULL) {
+	sf_queue_init(&(link->full), SF_QUEUESIZE);
+	sf_queue_init(&(link->empty), SF_QUEUESIZE);
+    }
+    return(link);
+}
+
+void sf_record_free(struct sf_record *rec)
+{
+    dfree(rec->auid);
+    dfree(rec->agid);
+    dfree(rec->filename);
+    dfree(rec->linktarget);
+    dfree(rec->xheader);
+    dfree(rec->fingerprint);
+    dfree(rec->eprvkey);
+    dfree(rec->pubkey);
+    dfree(rec->hmackeyhash);
+    dfree(rec->comment);
+    dfree(rec->format);
+    dfree(rec->chunklist);
+}
+
+void sf_link_free(struct sf_link *link)
+{
+    struct sf_record *rec;
+
+    if (link->f == NULL) {
+	while (sf_queue_pop(&(link->full), &rec, 0) == 1)
+	    if (rec != NULL) {
+		sf_record_free(rec);
+		free(rec);
+	    }
+	while (sf_queue_pop(&(link->empty), &rec, 0) == 1) {
+	    sf_record_free(rec);
+	    free(rec);
+	}
+	sf_queue_free(&(link->full));
+	sf_queue_free(&(link->empty));
+    }
+    dfree(link->frame);
+    free(link);
+}
+
+/* Get a record for the reader to fill in, recycling ones the catalog
+ * writer is done with.  Waits once SF_QUEUESIZE records are in flight.
+ */
+struct sf_record *sf_record_get(struct sf_link *link)
+{
+    struct sf_record *rec;
+
+    if (sf_queue_pop(&(link->empty), &rec, link->nrecords >= SF_QUEUESIZE - 1) == 1)
+	return(rec);
+    rec = malloc(sizeof(struct sf_record));
+    memset(rec, 0, sizeof(struct sf_record));
+    link->nrecords++;
+    return(rec);
+}
+
+int sf_put_key(struct sf_link *link, int keynum, struct key_st *key)
+{
+    struct sf_record *rec;
+    char *fingerprint = key->fingerprint == NULL ? "" : key->fingerprint;
+    char *eprvkey = key->eprvkey == NULL ? "" : key->eprvkey;
+    char *pubkey = key->pubkey == NULL ? "" : key->pubkey;
+    char *hmackeyhash = key->hmac_hash_b64 == NULL ? "" : key->hmac_hash_b64;
+    char *comment = key->comment == NULL ? "" : key->comment;
+
+    if (link->f != NULL) {
+	sf_frame_begin(link, '0');
+	sf_frame_int(link, &keynum, sizeof(keynum));
+	sf_frame_str(link, fingerprint, strlen(fingerprint));
+	sf_frame_str(link, eprvkey, strlen(eprvkey));
+	sf_frame_str(link, pubkey, strlen(pubkey));
+	sf_frame_str(link, hmackeyhash, strlen(hmackeyhash));
+	sf_frame_str(link, comment, strlen(comment));
+	return(sf_frame_send(link));
+    }
+    rec = sf_record_get(link);
+    rec->type = '0';
+    rec->keynum = keynum;
+    strncpya0(&(rec->fingerprint), fingerprint, 0);
+    strncpya0(&(rec->eprvkey), eprvkey, 0);
+    strncpya0(&(rec->pubkey), pubkey, 0);
+    strncpya0(&(rec->hmackeyhash), hmackeyhash, 0);
+    strncpya0(&(rec->comment), comment, 0);
+    sf_queue_push(&(link->full), rec);
+    return(0);
+}
+
+int sf_put_keyhdr(struct sf_link *link)
+{
+    struct sf_record *rec;
+
+    if (link->f != NULL) {
+	sf_frame_begin(link, '3');
+	return(sf_frame_send(link));
+    }
+    rec = sf_record_get(link);
+    rec->type = '3';
+    sf_queue_push(&(link->full), rec);
+    return(0);
+}
+
+int sf_put_progress(struct sf_link *link, char *filename, size_t bytes)
+{
+    struct sf_record *rec;
+    unsigned long long int filesize = bytes;
+
+    if (link->f != NULL) {
+	sf_frame_begin(link, '2');
+	sf_frame_int(link, &filesize, sizeof(filesize));
+	sf_frame_str(link, filename, strlen(filename));
+	return(sf_frame_send(link));
+    }
+    rec = sf_record_get(link);
+    rec->type = '2';
+    strncpya0(&(rec->filename), filename, 0);
+    rec->filesize = filesize;
+    sf_queue_push(&(link->full), rec);
+    return(0);
+}
+
+int sf_put_stats(struct sf_link *link, int nfiles, unsigned long long bytes)
+{
+    struct sf_record *rec;
+    unsigned long long int filesize = bytes;
+
+    if (link->f != NULL) {
+	sf_frame_begin(link, '4');
+	sf_frame_int(link, &nfiles, sizeof(nfiles));
+	sf_frame_int(link, &filesize, sizeof(filesize));
+	return(sf_frame_send(link));
+    }
+    rec = sf_record_get(link);
+    rec->type = '4';
+    rec->nfiles = nfiles;
+    rec->filesize = filesize;
+    sf_queue_push(&(link->full), rec);
+    return(0);
+}
+
+// Tell the catalog writer there are no more records
+int sf_put_end(struct sf_link *link)
+{
+    sf_queue_push(&(link->full), NULL);
+    return(0);
+}
+
+/* Get the next record on the catalog writer side, or NULL at the end.
+ * Pass it back with sf_release_record() once done with it.
+ */
+struct sf_record *sf_get_record(struct sf_link *link)
+{
+    struct sf_record *rec = &(link->rec);
+    uint32_t framelen;
+    char *p;
+    int len;
+
+    if (link->f == NULL) {
+	sf_queue_pop(&(link->full), &rec, 1);
+	return(rec);
+    }
+    if (fread(&framelen, 1, 4, link->f) < 4)
+	return(NULL);
+    if (dmalloc_size(link->frame) < framelen)
+	link->frame = drealloc(link->frame, framelen);
+    if (fread(link->frame, 1, framelen, link->f) < framelen) {
+	fprintf(stderr, "Metadata recording error\n");
+	exit(1);
+    }
+    p = link->frame;
+    rec->type = *(p++);
+    if (rec->type == '0') {
+	sf_unframe_int(&p, &(rec->keynum), sizeof(rec->keynum));
+	rec->fingerprint = sf_unframe_str(&p, &len);
+	rec->eprvkey = sf_unframe_str(&p, &len);
+	rec->pubkey = sf_unframe_str(&p, &len);
+	rec->hmackeyhash = sf_unframe_str(&p, &len);
+	rec->comment = sf_unframe_str(&p, &len);
+    }
+    else if (rec->type == '1') {
+	sf_unframe_int(&p, &(rec->ftype), sizeof(rec->ftype));
+	sf_unframe_int(&p, &(rec->mode), sizeof(rec->mode));
+	sf_unframe_int(&p, &(rec->nuid), sizeof(rec->nuid));
+	sf_unframe_int(&p, &(rec->ngid), sizeof(rec->ngid));
+	sf_unframe_int(&p, &(rec->filesize), sizeof(rec->filesize));
+	sf_unframe_int(&p, &(rec->modtime), sizeof(rec->modtime));
+	rec->auid = sf_unframe_str(&p, &len);
+	rec->agid = sf_unframe_str(&p, &len);
+	strncpy(rec->hash, sf_unframe_str(&p, &len), sizeof(rec->hash) - 1);
+	rec->hash[sizeof(rec->hash) - 1] = '\0';
+	rec->filename = sf_unframe_str(&p, &len);
+	rec->linktarget = sf_unframe_str(&p, &len);
+	rec->xheader = sf_unframe_str(&p, &(rec->xheaderlen));
+	sf_unframe_int(&p, &(rec->pack), sizeof(rec->pack));
+	sf_unframe_int(&p, &(rec->offset), sizeof(rec->offset));
+	sf_unframe_int(&p, &(rec->length), sizeof(rec->length));
+	rec->format = sf_unframe_str(&p, &len);
+	rec->chunklist = sf_unframe_str(&p, &len);
+    }
+    else if (rec->type == '2') {
+	sf_unframe_int(&p, &(rec->filesize), sizeof(rec->filesize));
+	rec->filename = sf_unframe_str(&p, &len);
+    }
+    else if (rec->type == '4') {
+	sf_unframe_int(&p, &(rec->nfiles), sizeof(rec->nfiles));
+	sf_unframe_int(&p, &(rec->filesize), sizeof(rec->filesize));
+    }
+    if (p != link->frame + framelen) {
+	fprintf(stderr, "Metadata recording error\n");
+	exit(1);
+    }
+    return(rec);
+}
+
+void sf_release_record(struct sf_link *link, struct sf_record *rec)
+{
+    if (link->f == NULL)
+	sf_queue_push(&(link->empty), rec);
+}
+
+// Start a new frame, leaving room for the length
+void sf_frame_begin(struct sf_link *link, char type)
+{
+    link->framelen = 4;
+    memcpyao((void **) &(link->frame), &type, 1, link->framelen++);
+}
+
+void sf_frame_int(struct sf_link *link, void *v, size_t n)
+{
+    memcpyao((void **) &(link->frame), v, n, link->framelen);
+    link->framelen += n;
+}
+
+void sf_frame_str(struct sf_link *link, char *str, uint32_t len)
+{
+    sf_frame_int(link, &len, 4);
+    sf_frame_int(link, str, len);
+    sf_frame_int(link, "", 1);
+}
+
+int sf_frame_send(struct sf_link *link)
+{
+    uint32_t framelen = link->framelen - 4;
+
+    memcpy(link->frame, &framelen, 4);
+    if (fwrite(link->frame, 1, link->framelen, link->f) < link->framelen) {
+	fprintf(stderr, "Error sending metadata, aborting\n");
+	exit(1);
+    }
+    return(0);
+}
+
+void sf_unframe_int(char **p, void *v, size_t n)
+{
+    memcpy(v, *p, n);
+    *p += n;
+}
+
+char *sf_unframe_str(char **p, int *len)
+{
+    uint32_t l;
+    char *str;
+
+    sf_unframe_int(p, &l, 4);
+    str = *p;
+    *p += l + 1;
+    *len = l;
+    return(str);
+}
+
+void sf_queue_init(struct sf_queue *q, unsigned int size)
+{
+    q->ring = malloc(sizeof(struct sf_record *) * size);
+    q->size = size;
+    q->head = 0;
+    q->tail = 0;
+    q->waiting = 0;
+    pthread_mutex_init(&(q->lock), NULL);
+    pthread_cond_init(&(q->cond), NULL);
+}
+
+void sf_queue_free(struct sf_queue *q)
+{
+    free(q->ring);
+    pthread_mutex_destroy(&(q->lock));
+    pthread_cond_destroy(&(q->cond));
+}
 
-	    if (wrote_file == 1) {
-		if (use_hmac == 0) {
-		    strncpy(destdir2, (char *) cfshax, 2);
-		    destdir2[2] = '\0';
-		    snprintf(targetdir, 1024, "%s/%s", destdir, destdir2);
-		    snprintf(targetpath, 1024, "%s/%s/%s.lzo", destdir, destdir2, cfshax + 2);
-		}
-		else {
-		    strncpy(destdir2, (char *) hmac, 2);
-		    destdir2[2] = '\0';
-		    snprintf(targetdir, 1024, "%s/%s", destdir, destdir2);
-		    snprintf(targetpath, 1024, "%s/%s/%s.enc", destdir, destdir2, hmac + 2);
-		}
-		if (stat(targetdir, &tmpfstat) != 0) {
-		    if (mkdir(targetdir, 0770) != 0) {
-			if (stat(targetdir, &tmpfstat) != 0) {
-			    fprintf(stderr, "Error creating directory %s\n", targetdir);
-			    exit(1);
-			}
-		    }
-		}
-		if (stat(targetpath, &tmpfstat) != 0 || utime(targetpath, NULL) != 0) {
-		    if (rename(tmpfilepath, targetpath) == 0) {
-		    }
-		    else {
-			fprintf(stderr, "Error moving file to vault, aborting\n");
-			exit(1);
-		    }
-		}
-		else {
-		    unlink(tmpfilepath);
-		}
-		fprintf(out, "\n");
-	    }
-	    fsclear(&fs);
-	}
+/* The queue never fills, as no more than size records are ever in
+ * circulation.  The lock is only taken to wake a sleeping consumer.
+ */
+void sf_queue_push(struct sf_queue *q, struct sf_record *rec)
+{
+    unsigned int tail = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
 
-	fsfree(&fs);
-	if (escfname != NULL)
-	    stresc_free(&escfname);
-	if (esclname != NULL)
-	    stresc_free(&esclname);
-	dfree(escxheader);
-	fflush(out);
-	fclose(out);
-	close(out_h);
-	free(config.vault);
-	free(config.meta);
-	dfree(ciphertype);
-	dfree(sparsetext);
-	exit(0);
+    q->ring[tail % q->size] = rec;
+    __atomic_store_n(&(q->tail), tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(q->waiting), __ATOMIC_SEQ_CST) == 1) {
+	pthread_mutex_lock(&(q->lock));
+	pthread_cond_signal(&(q->cond));
+	pthread_mutex_unlock(&(q->lock));
     }
-    else {
-	close(out_h);
+}
+
+// Returns 1 if a record was taken, or 0 if empty and not waiting
+int sf_queue_pop(struct sf_queue *q, struct sf_record **rec, int wait)
+{
+    while (q->head == __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE)) {
+	if (wait == 0)
+	    return(0);
+	pthread_mutex_lock(&(q->lock));
+	__atomic_store_n(&(q->waiting), 1, __ATOMIC_SEQ_CST);
+	while (q->head == __atomic_load_n(&(q->tail), __ATOMIC_SEQ_CST))
+	    pthread_cond_wait(&(q->cond), &(q->lock));
+	__atomic_store_n(&(q->waiting), 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(q->lock));
     }
-    return(0);
+    *rec = q->ring[q->head % q->size];
+    q->head++;
+    return(1);
 }
 
+/* Metadata records from the tar reader are buffered here on their way
+ * to the catalog, so the reader never waits on a catalog flush.  Up to
+ * SF_PIPEBUF_RAM bytes are held in memory, and the rest spilled to a
+ * file in the vault.
+ */
 int pipebuf(int *in, int *out)
 {
     int pipein[2];
@@ -894,15 +3056,16 @@ int pipebuf(int *in, int *out)
 	return(0);
     }
     else {
-	struct ringbuf *r;
-
-	struct timeval s_tm;
-
+	struct spillbuf *sb;
 	int bufsize = 4096;
 	char buf[bufsize];
 	ssize_t n;
 	ssize_t o;
+	ssize_t w;
 	int ateof = 0;
+	fd_set s_in;
+	fd_set s_out;
+
 	fclose(stdout);
 	if (*in < 0)
 	    close(pipein[1]);
@@ -913,109 +3076,44 @@ int pipebuf(int *in, int *out)
 	else
 	    pipeout[1] = *out;
 
-	r = rbinit(1024 * 1024 * 1024);
-	fd_set s_in;
-	fd_set s_out;
+	sb = sbinit(SF_PIPEBUF_RAM, config.vault);
 	free(config.vault);
 	free(config.meta);
 
-//	fcntl(pipein[0], F_SETFL, O_NONBLOCK);
-//	fcntl(pipeout[1], F_SETFL, O_NONBLOCK);
+	/* Input is taken whenever there is some, since the buffer never
+	 * fills, and output written whenever the pipe has room for it.
+	 */
 	while (1) {
-	    if (rbused(r) == 0 && ateof == 1) {
-		rbfree(r);
+	    if (sbused(sb) == 0 && ateof == 1) {
+		sbfree(sb);
 		exit(0);
 	    }
-	    // if the buffer is empty, then wait for input and see if output will block
-	    if (rbused(r) == 0 && ateof == 0) {
-		FD_ZERO(&s_in);
+	    FD_ZERO(&s_in);
+	    FD_ZERO(&s_out);
+	    if (ateof == 0)
 		FD_SET(pipein[0], &s_in);
-		select(1024, &s_in, NULL, NULL, NULL);
-
-		s_tm.tv_sec = 0;
-		s_tm.tv_usec = 0;
-		FD_ZERO(&s_out);
+	    if (sbused(sb) > 0)
 		FD_SET(pipeout[1], &s_out);
-		select(1024, NULL, &s_out, NULL, &s_tm);
-
-		n = read(pipein[0], buf, bufsize);
-		if (n <= 0) {
-		    ateof = 1;
-		}
-		if (FD_ISSET(pipeout[1], &s_out)) {
-		    o = write(pipeout[1], buf, n);
-		    if (o < n) {
-			fprintf(stderr, "Short write a of %lu, wanted %lu, putting %lu bytes back in buffer\n", o, n, n - o);
-			rbrewind(r, n - o);
-		    }
-		}
-		else {
-		    rbwrite(buf, 1, n, r);
-		}
+	    if (select(1024, &s_in, &s_out, NULL, NULL) < 0) {
+		if (errno == EINTR)
+		    continue;
+		fprintf(stderr, "Pipe error\n");
+		exit(1);
 	    }
-	    // if there is room in the buffer, wait for either input or output
-	    else if (rbavail(r) > bufsize && ateof == 0) {
-		FD_ZERO(&s_in);
-		FD_SET(pipein[0], &s_in);
-		FD_ZERO(&s_out);
-		FD_SET(pipeout[1], &s_out);
-		select(1024, &s_in, &s_out, NULL, NULL);
-
-		// flush ring buffer until output blocks
-		while (FD_ISSET(pipeout[1], &s_out) && rbused(r) > 0) {
-		    n = rbread(buf, 1, bufsize, r);
-		    if (n <= 0)
-			fprintf(stderr, "Error 1 -- n is %lu\n", n);
-		    o = write(pipeout[1], buf, n);
-		    // if not all written, put remainder back in ring buffer
-		    if (o < n) {
-			fprintf(stderr, "Short write b of %lu, wanted %lu, putting %lu bytes back in buffer\n", o, n, n - o);
-			rbrewind(r, n - o);
-		    }
-		    s_tm.tv_sec = 0;
-		    s_tm.tv_usec = 0;
-		    FD_ZERO(&s_out);
-		    FD_SET(pipeout[1], &s_out);
-		    select(1024, NULL, &s_out, NULL, &s_tm);
-		}
-		if (ateof == 0) {
-		    n = read(pipein[0], buf, bufsize);
-		    if (n <= 0) {
-			ateof = 1;
-		    }
-		    if (rbused(r) == 0) {
-			o = write(pipeout[1], buf, n);
-			if (o < n) {
-			    fprintf(stderr, "Short write c of %lu, wanted %lu, putting %lu bytes back in buffer\n", o, n, n - o);
-			    rbrewind(r, n - o);
-			}
-		    }
-		    else {
-			rbwrite(buf, 1, n, r);
+	    if (FD_ISSET(pipeout[1], &s_out)) {
+		n = sbread(buf, bufsize, sb);
+		for (o = 0; o < n; o += w) {
+		    if ((w = write(pipeout[1], buf + o, n - o)) <= 0) {
+			fprintf(stderr, "Pipe error\n");
+			exit(1);
 		    }
 		}
 	    }
-	    // otherwise, buffer is full, wait for output
-	    else {
-		FD_ZERO(&s_out);
-		FD_SET(pipeout[1], &s_out);
-		select(1024, NULL, &s_out, NULL, NULL);
-
-		// flush ring buffer until output blocks
-		while (FD_ISSET(pipeout[1], &s_out) && rbused(r) > 0) {
-		    n = rbread(buf, 1, bufsize, r);
-		    if (n <= 0)
-			fprintf(stderr, "Error 1 -- n is %lu\n", n);
-		    o = write(pipeout[1], buf, n);
-		    // if not all written, put remainder back in ring buffer
-		    if (o < n) {
-			fprintf(stderr, "Short write d of %lu, wanted %lu, putting %lu bytes back in buffer\n", o, n, n - o);
-			rbrewind(r, n - o);
-		    }
-		    FD_ZERO(&s_out);
-		    FD_SET(pipeout[1], &s_out);
-		    select(1024, NULL, &s_out, NULL, NULL);
-		}
+	    if (FD_ISSET(pipein[0], &s_in)) {
+		if ((n = read(pipein[0], buf, bufsize)) <= 0)
+		    ateof = 1;
+		else
+		    sbwrite(buf, n, sb);
 	    }
 	}
 	exit(0);
@@ -1188,6 +3286,157 @@ struct ringbuf {
     int w;	// wrap
 };
 
+/* A ring in memory, backed by a spill file once it fills.  The file is
+ * a run of SF_SPILL_SEGMENT sized segments, with the one being written
+ * and the one being read each mapped in.  Once anything is spilled,
+ * new data goes to the file until it has all been read back, so bytes
+ * come out in the order they went in.  Segments are released as they
+ * are read, and the file emptied when it catches up.
+ */
+struct spillbuf {
+    struct ringbuf *r;
+    char dir[1024];
+    int fd;				// -1 until the first spill
+    char *wmap;				// segment being written
+    unsigned long long int wseg;
+    char *rmap;				// segment being read
+    unsigned long long int rseg;
+    unsigned long long int woff;	// bytes spilled
+    unsigned long long int roff;	// bytes read back
+    unsigned long long int fsize;
+};
+
+struct spillbuf *sbinit(size_t s, char *dir)
+{
+    struct spillbuf *sb;
+
+    sb = malloc(sizeof(struct spillbuf));
+    sb->r = rbinit(s);
+    snprintf(sb->dir, sizeof(sb->dir), "%s", dir);
+    sb->fd = -1;
+    sb->wmap = NULL;
+    sb->rmap = NULL;
+    sb->woff = 0;
+    sb->roff = 0;
+    sb->fsize = 0;
+    return(sb);
+}
+
+char *sbmap(struct spillbuf *sb, unsigned long long int seg)
+{
+    char *map;
+
+    if (sb->fsize < (seg + 1) * SF_SPILL_SEGMENT) {
+	if (ftruncate(sb->fd, (seg + 1) * SF_SPILL_SEGMENT) != 0) {
+	    fprintf(stderr, "Error extending spill file in %s\n", sb->dir);
+	    exit(1);
+	}
+	sb->fsize = (seg + 1) * SF_SPILL_SEGMENT;
+    }
+    if ((map = mmap(NULL, SF_SPILL_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED,
+	sb->fd, seg * SF_SPILL_SEGMENT)) == MAP_FAILED) {
+	fprintf(stderr, "Error mapping spill file in %s\n", sb->dir);
+	exit(1);
+    }
+    return(map);
+}
+
+void sbwrite(void *buf, size_t n, struct spillbuf *sb)
+{
+    char path[1024 + 16];
+    unsigned long long int seg;
+    size_t off;
+    size_t c;
+
+    if (sb->woff == sb->roff && rbavail(sb->r) >= n) {
+	rbwrite(buf, 1, n, sb->r);
+	return;
+    }
+    if (sb->fd < 0) {
+	snprintf(path, sizeof(path), "%s/spXXXXXX", sb->dir);
+	if ((sb->fd = mkstemp(path)) < 0) {
+	    fprintf(stderr, "Error creating spill file in %s\n", sb->dir);
+	    exit(1);
+	}
+	unlink(path);
+    }
+    while (n > 0) {
+	seg = sb->woff / SF_SPILL_SEGMENT;
+	off = sb->woff % SF_SPILL_SEGMENT;
+	if (sb->wmap == NULL || sb->wseg != seg) {
+	    if (sb->wmap != NULL && sb->wmap != sb->rmap)
+		munmap(sb->wmap, SF_SPILL_SEGMENT);
+	    sb->wmap = sb->rmap != NULL && sb->rseg == seg ? sb->rmap : sbmap(sb, seg);
+	    sb->wseg = seg;
+	}
+	c = SF_SPILL_SEGMENT - off < n ? SF_SPILL_SEGMENT - off : n;
+	memcpy(sb->wmap + off, buf, c);
+	sb->woff += c;
+	buf += c;
+	n -= c;
+    }
+}
+
+size_t sbread(void *buf, size_t n, struct spillbuf *sb)
+{
+    unsigned long long int seg;
+    size_t off;
+    size_t c;
+
+    if (rbused(sb->r) > 0)
+	return(rbread(buf, 1, n, sb->r));
+    if (sb->roff == sb->woff)
+	return(0);
+    seg = sb->roff / SF_SPILL_SEGMENT;
+    off = sb->roff % SF_SPILL_SEGMENT;
+    if (sb->rmap == NULL || sb->rseg != seg) {
+	if (sb->rmap != NULL && sb->rmap != sb->wmap) {
+	    munmap(sb->rmap, SF_SPILL_SEGMENT);
+	    // Give the segment's disk space back
+	    fallocate(sb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		sb->rseg * SF_SPILL_SEGMENT, SF_SPILL_SEGMENT);
+	}
+	sb->rmap = sb->wmap != NULL && sb->wseg == seg ? sb->wmap : sbmap(sb, seg);
+	sb->rseg = seg;
+    }
+    c = SF_SPILL_SEGMENT - off < n ? SF_SPILL_SEGMENT - off : n;
+    if (sb->woff - sb->roff < c)
+	c = sb->woff - sb->roff;
+    memcpy(buf, sb->rmap + off, c);
+    sb->roff += c;
+    // All read back, so start the file over
+    if (sb->roff == sb->woff) {
+	if (sb->rmap != NULL)
+	    munmap(sb->rmap, SF_SPILL_SEGMENT);
+	if (sb->wmap != NULL && sb->wmap != sb->rmap)
+	    munmap(sb->wmap, SF_SPILL_SEGMENT);
+	sb->rmap = NULL;
+	sb->wmap = NULL;
+	sb->roff = 0;
+	sb->woff = 0;
+	if (ftruncate(sb->fd, 0) == 0)
+	    sb->fsize = 0;
+    }
+    return(c);
+}
+
+unsigned long long int sbused(struct spillbuf *sb)
+{
+    return(rbused(sb->r) + (sb->woff - sb->roff));
+}
+
+void sbfree(struct spillbuf *sb)
+{
+    if (sb->rmap != NULL)
+	munmap(sb->rmap, SF_SPILL_SEGMENT);
+    if (sb->wmap != NULL && sb->wmap != sb->rmap)
+	munmap(sb->wmap, SF_SPILL_SEGMENT);
+    if (sb->fd >= 0)
+	close(sb->fd);
+    rbfree(sb->r);
+    free(sb);
+}
+
 struct ringbuf *rbinit(size_t s)
 {
     struct ringbuf *r;
@@ -1356,308 +3605,573 @@ char *DecodeBlock2(char *out, char *in, int m, int *n)
 }
 
 int flush_received_files(sqlite3 *bkcatalog, int verbose, int bkid,
-    unsigned long long est_size,  unsigned long long *bytes_read)
+    unsigned long long est_size, int sync)
 {
     char *sqlerr;
-    sqlite3_stmt *sqlres;
     char *sqlstmt = 0;
-    int x;
-//    static unsigned long long bytes_read_l = 0;
 
+//  Make the vault objects behind the received records durable before
+//  the records themselves are committed
+    if (sync == SF_SYNC_GROUP && sf_sync_vault() != 0) {
+	fprintf(stderr, "Error syncing vault %s, aborting\n", config.vault);
+	exit(1);
+    }
 
-//  Populate diskfiles table from temporary diskfiles_t
+//  Record newly packed objects, and mark packed objects seen again as
+//  in use, bringing back any that purge marked dead in the meantime
 
     sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into diskfiles select * from diskfiles_t"
+	"insert or replace into packed_objects "
+	"(hash, pack, offset, length, lastref, dead) "
+	"select hash, pack, offset, length, %lld, 0 from packed_objects_t", (long long) time(0)
     )), 0, 0, &sqlerr);
-//    fprintf(stderr, "%s\n", sqlstmt);
     if (sqlerr != 0) {
 	fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
 	sqlite3_free(sqlerr);
     }
     sqlite3_free(sqlstmt);
-    sqlite3_exec(bkcatalog, "delete from diskfiles_t", 0, 0, 0);
-
-
-//  Populate temporary table file_entities_t with received files
-
+    sqlite3_exec(bkcatalog, "delete from packed_objects_t", 0, 0, 0);
     sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into file_entities_t "
-	"(file_id, ftype, permission, device_id, inode, "
-        "user_name, user_id, group_name, group_id, size, hash, cdatestamp, "
-	"datestamp, filename, extdata, xheader) "
-	"select r.file_id, r.ftype, r.permission, n.device_id, n.inode, "
-	"r.user_name, r.user_id, r.group_name, r.group_id, r.size, "
-	"r.hash, n.cdatestamp, r.datestamp, n.filename, r.extdata, r.xheader "
-	"from received_file_entities_t r "
-	"join needed_file_entities n "
-	"on r.filename = n.infilename "
-	"where r.ftype != 1 "
-	"and n.backupset_id = %d", bkid
+	"update packed_objects set lastref = %lld, dead = 0 "
+	"where hash in (select hash from diskfiles_t)", (long long) time(0)
     )), 0, 0, &sqlerr);
-//    fprintf(stderr, "%s\n", sqlstmt);
     if (sqlerr != 0) {
 	fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
 	sqlite3_free(sqlerr);
     }
     sqlite3_free(sqlstmt);
+    sqlite3_exec(bkcatalog, "delete from diskfiles_t", 0, 0, 0);
 
-
-//  And now transfer to permanent file_entitities table
-
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into file_entities "
-	"(ftype, permission, device_id, inode, "
-	"user_name, user_id, group_name, group_id, size, %s, cdatestamp, "
-	"datestamp, filename, extdata, xheader) "
-	"select ftype, permission, device_id, inode, "
-	"user_name, user_id, group_name, group_id, size, hash, cdatestamp, "
-	"datestamp, filename, extdata, xheader "
-	"from file_entities_t", SHN
-    )), 0, 0, &sqlerr);
+//  Commit the records received since the last flush
+    sqlite3_exec(bkcatalog, "END", 0, 0, &sqlerr);
     if (sqlerr != 0) {
-        fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-        sqlite3_free(sqlerr);
+	fprintf(stderr, "%s\n", sqlerr);
+	sqlite3_free(sqlerr);
     }
-    sqlite3_free(sqlstmt);
-
-
-//  Take care of cipher_detail
-
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into cipher_detail ( "
-	"file_id, keynum, hmac) "
-	"select f.file_id, id, hmac "
-	"from temp_cipher_detail c "
-	"join temp_key_map m "
-	"on c.keynum = m.keyposition "
-	"join file_entities_t t on c.file_id = t.file_id "
-	"join file_entities f "
-	"on f.ftype = t.ftype and f.permission = t.permission "
-	"and f.device_id = t.device_id and f.inode = t.inode "
-	"and f.user_name = t.user_name and f.user_id = t.user_id "
-	"and f.group_name = t.group_name and f.group_id = t.group_id "
-	"and f.size = t.size and f.%s = t.hash and f.cdatestamp = t.cdatestamp "
-	"and f.datestamp = t.datestamp and f.filename = t.filename "
-	"and f.extdata = t.extdata and f.xheader = t.xheader "
-	"and f.cdatestamp = t.cdatestamp; ", SHN
-    )), 0, 0, &sqlerr);
+    return(0);
+}
 
-    if (sqlerr != 0) {
-        fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-        sqlite3_free(sqlerr);
-    }
-    sqlite3_free(sqlstmt);
+struct sf_ingest *sf_ingest_init(sqlite3 *bkcatalog, int bkid)
+{
+    struct sf_ingest *ing;
+    char *sqlstmt;
+    struct {
+	sqlite3_stmt **stmt;
+	char *sql;
+    } stmts[] = {
+	{ NULL, "select device_id, inode, cdatestamp, filename "
+	    "from needed_file_entities where backupset_id = ?1 and infilename = ?2" },
+	{ NULL, "insert or ignore into diskfiles (%s, format) values (?1, nullif(?2, ''))" },
+	{ NULL, "insert or ignore into file_entities "
+	    "(ftype, permission, device_id, inode, "
+	    "user_name, user_id, group_name, group_id, size, %s, cdatestamp, "
+	    "datestamp, filename, extdata, xheader) "
+	    "values (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15)" },
+	{ NULL, "select file_id from file_entities "
+	    "where ftype = ?1 and permission = ?2 and device_id = ?3 and inode = ?4 "
+	    "and user_name = ?5 and user_id = ?6 and group_name = ?7 and group_id = ?8 "
+	    "and size = ?9 and %s = ?10 and cdatestamp = ?11 and datestamp = ?12 "
+	    "and filename = ?13 and extdata = ?14 and xheader = ?15" },
+	{ NULL, "insert or ignore into backupset_detail (backupset_id, file_id) values (?1, ?2)" },
+	{ NULL, "insert or ignore into cipher_detail (file_id, keynum, hmac) "
+	    "select ?1, id, ?2 from temp_key_map where keyposition = ?3" },
+	{ NULL, "select f.file_id, f.ftype, f.permission, f.device_id, f.inode, "
+	    "f.user_name, f.user_id, f.group_name, f.group_id, f.size, f.%s, "
+	    "f.cdatestamp, f.datestamp, f.extdata, f.xheader "
+	    "from file_entities f join backupset_detail d on f.file_id = d.file_id "
+	    "where f.filename = ?1 and d.backupset_id = ?2" },
+	{ NULL, "insert or ignore into cipher_detail (file_id, keynum, hmac) "
+	    "select ?1, keynum, hmac from cipher_detail where file_id = ?2" },
+	{ NULL, "insert or ignore into diskfiles_t (hash) values (?1)" },
+	{ NULL, "insert or replace into packed_objects_t (hash, pack, offset, length) "
+	    "values (?1, ?2, ?3, ?4)" },
+	{ NULL, "insert or replace into object_chunks (object, seq, chunk, length) "
+	    "values (?1, ?2, ?3, ?4)" }
+    };
 
-#if 0
-    if (verbose >= 1) {
-	x = sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	    "select sum(size) from file_entities_t")), -1, &sqlres, 0);
-	if ((x = sqlite3_step(sqlres)) == SQLITE_ROW) {
-	    bytes_read_l = sqlite3_column_int64(sqlres, 0);
-	    *bytes_read = bytes_read_l;
+    ing = malloc(sizeof(*ing));
+    ing->bkcatalog = bkcatalog;
+    ing->bkid = bkid;
+    ing->ids = NULL;
+    ing->nids = 0;
+    ing->filter = vault_filter_open();
+    stmts[0].stmt = &(ing->needed);
+    stmts[1].stmt = &(ing->diskfile);
+    stmts[2].stmt = &(ing->entity);
+    stmts[3].stmt = &(ing->entityid);
+    stmts[4].stmt = &(ing->detail);
+    stmts[5].stmt = &(ing->cipher);
+    stmts[6].stmt = &(ing->linktarget);
+    stmts[7].stmt = &(ing->linkcipher);
+    stmts[8].stmt = &(ing->seen);
+    stmts[9].stmt = &(ing->packed);
+    stmts[10].stmt = &(ing->chunk);
+    for (int i = 0; i < sizeof(stmts) / sizeof(*stmts); i++) {
+	if (sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(stmts[i].sql, SHN)),
+	    -1, stmts[i].stmt, 0) != SQLITE_OK) {
+	    fprintf(stderr, "%s\n%s\n", sqlite3_errmsg(bkcatalog), sqlstmt);
+	    exit(1);
 	}
-	sqlite3_finalize(sqlres);
 	sqlite3_free(sqlstmt);
     }
-#endif
-
+    return(ing);
+}
 
-//  Create records in backupset_detail
+void sf_ingest_free(struct sf_ingest *ing)
+{
+    sqlite3_finalize(ing->needed);
+    sqlite3_finalize(ing->diskfile);
+    sqlite3_finalize(ing->entity);
+    sqlite3_finalize(ing->entityid);
+    sqlite3_finalize(ing->detail);
+    sqlite3_finalize(ing->cipher);
+    sqlite3_finalize(ing->linktarget);
+    sqlite3_finalize(ing->linkcipher);
+    sqlite3_finalize(ing->seen);
+    sqlite3_finalize(ing->packed);
+    sqlite3_finalize(ing->chunk);
+    vault_filter_close(ing->filter);
+    dfree(ing->ids);
+    free(ing);
+}
 
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into backupset_detail (backupset_id, file_id) "
-	"select %d, f.file_id from file_entities f "
-	"join file_entities_t t "
-	"on f.ftype = t.ftype and f.permission = t.permission "
-	"and f.device_id = t.device_id and f.inode = t.inode "
-	"and f.user_name = t.user_name and f.user_id = t.user_id "
-	"and f.group_name = t.group_name and f.group_id = t.group_id "
-	"and f.size = t.size and f.%s = t.hash and f.cdatestamp = t.cdatestamp "
-	"and f.datestamp = t.datestamp and f.filename = t.filename "
-	"and f.extdata = t.extdata and f.xheader = t.xheader "
-	"and f.cdatestamp = t.cdatestamp ", bkid, SHN
-    )), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
+// Run a statement that returns no rows, and reset it for the next use
+void sf_ingest_step(struct sf_ingest *ing, sqlite3_stmt *stmt)
+{
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+	fprintf(stderr, "Error recording received file: %s\n", sqlite3_errmsg(ing->bkcatalog));
+	exit(1);
     }
-    sqlite3_free(sqlstmt);
+    sqlite3_reset(stmt);
+}
 
+void sf_bind_entity(sqlite3_stmt *stmt, struct sf_entity *e)
+{
+    sqlite3_bind_text(stmt, 1, e->ftype, 1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, e->permission, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, e->device_id, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, e->inode, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, e->user_name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 6, e->user_id);
+    sqlite3_bind_text(stmt, 7, e->group_name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 8, e->group_id);
+    sqlite3_bind_int64(stmt, 9, e->size);
+    sqlite3_bind_text(stmt, 10, e->hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 11, e->cdatestamp);
+    sqlite3_bind_int64(stmt, 12, e->datestamp);
+    sqlite3_bind_text(stmt, 13, e->filename, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 14, e->extdata, -1, SQLITE_STATIC);
+    // An empty xheader is X'', never null, so hard links can join on it
+    if (e->xheader == NULL || e->xheaderlen == 0)
+	sqlite3_bind_zeroblob(stmt, 15, 0);
+    else
+	sqlite3_bind_blob(stmt, 15, e->xheader, e->xheaderlen, SQLITE_STATIC);
+}
 
-//  Clear out file_entities_t for next step
-    sqlite3_exec(bkcatalog, "delete from file_entities_t", 0, 0, 0);
+/* Insert a file entity and add it to the backup set.  Returns its
+ * file_id, from last_insert_rowid, or from the unique index when an
+ * identical entity was recorded before.
+ */
+sqlite3_int64 sf_ingest_entity(struct sf_ingest *ing, struct sf_entity *e)
+{
+    sqlite3_int64 file_id;
 
+    sf_bind_entity(ing->entity, e);
+    sf_ingest_step(ing, ing->entity);
+    if (sqlite3_changes(ing->bkcatalog) > 0)
+	file_id = sqlite3_last_insert_rowid(ing->bkcatalog);
+    else {
+	sf_bind_entity(ing->entityid, e);
+	if (sqlite3_step(ing->entityid) != SQLITE_ROW) {
+	    fprintf(stderr, "Error looking up file entity %s\n", e->filename);
+	    exit(1);
+	}
+	file_id = sqlite3_column_int64(ing->entityid, 0);
+	sqlite3_reset(ing->entityid);
+    }
+    sqlite3_bind_int(ing->detail, 1, ing->bkid);
+    sqlite3_bind_int64(ing->detail, 2, file_id);
+    sf_ingest_step(ing, ing->detail);
+    if (dmalloc_size(ing->ids) < (ing->nids + 1) * sizeof(*(ing->ids)))
+	ing->ids = drealloc(ing->ids, (ing->nids + 1) * 2 * sizeof(*(ing->ids)));
+    ing->ids[ing->nids++] = file_id;
+    return(file_id);
+}
 
-//  Handle hard link files
+/* Record one received file.  Regular entries take their file name,
+ * device, inode and change time from the matching needed_file_entities
+ * rows, found through the (backupset_id, infilename) index.  Hard links
+ * copy the entity they point to, which the tar stream always carries
+ * (or newbackup already linked) ahead of the link.  Returns the bytes
+ * of linked data, for the status line.  The entities are left in ids
+ * for the caller to attach cipher details to.
+ */
+unsigned long long sf_ingest_record(struct sf_ingest *ing, struct sf_record *rec, char *permission)
+{
+    struct sf_entity e;
+    unsigned long long linkbytes = 0;
+    sqlite3_int64 file_id;
 
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into file_entities_t "
-	"(file_id, ftype, permission, device_id, inode, "
-        "user_name, user_id, group_name, group_id, size, hash, cdatestamp, "
-	"datestamp, filename, extdata, xheader) "
-	"select f.file_id, f.ftype, f.permission, f.device_id, f.inode, "
-	"f.user_name, f.user_id, f.group_name, f.group_id, f.size, "
-	"f.%s, f.cdatestamp, f.datestamp, r.filename, f.extdata, f.xheader "
-	"from file_entities f "
-	"join backupset_detail d "
-	"on f.file_id = d.file_id "
-	"join received_file_entities_t r "
-	"on r.extdata = f.filename "
-	"where r.ftype = 1 "
-	"and d.backupset_id = %d", SHN, bkid
-    )), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
+    ing->nids = 0;
+    if (strcmp(rec->format, "chunked") == 0)
+	sf_ingest_chunks(ing, rec);
+    sqlite3_bind_text(ing->diskfile, 1, rec->hash, -1, SQLITE_STATIC);
+    sqlite3_bind_text(ing->diskfile, 2, rec->format, -1, SQLITE_STATIC);
+    sf_ingest_step(ing, ing->diskfile);
+    vault_filter_add(ing->filter, rec->hash);
+    // Objects seen this flush, for packed_objects
+    sqlite3_bind_text(ing->seen, 1, rec->hash, -1, SQLITE_STATIC);
+    sf_ingest_step(ing, ing->seen);
+    if (rec->pack > 0) {
+	sqlite3_bind_text(ing->packed, 1, rec->hash, -1, SQLITE_STATIC);
+	sqlite3_bind_int(ing->packed, 2, rec->pack);
+	sqlite3_bind_int64(ing->packed, 3, rec->offset);
+	sqlite3_bind_int64(ing->packed, 4, rec->length);
+	sf_ingest_step(ing, ing->packed);
     }
-    sqlite3_free(sqlstmt);
+    if (rec->ftype != '1') {
+	e.ftype = &(rec->ftype);
+	e.permission = permission;
+	e.user_name = rec->auid;
+	e.user_id = rec->nuid;
+	e.group_name = rec->agid;
+	e.group_id = rec->ngid;
+	e.size = rec->filesize;
+	e.hash = rec->hash;
+	e.datestamp = rec->modtime;
+	e.extdata = rec->linktarget;
+	e.xheader = rec->xheader;
+	e.xheaderlen = rec->xheaderlen;
+	sqlite3_bind_int(ing->needed, 1, ing->bkid);
+	sqlite3_bind_text(ing->needed, 2, rec->filename, -1, SQLITE_STATIC);
+	while (sqlite3_step(ing->needed) == SQLITE_ROW) {
+	    e.device_id = (char *) sqlite3_column_text(ing->needed, 0);
+	    e.inode = (char *) sqlite3_column_text(ing->needed, 1);
+	    e.cdatestamp = sqlite3_column_int64(ing->needed, 2);
+	    e.filename = (char *) sqlite3_column_text(ing->needed, 3);
+	    sf_ingest_entity(ing, &e);
+	}
+	sqlite3_reset(ing->needed);
+    }
+    else {
+	sqlite3_bind_text(ing->linktarget, 1, rec->linktarget, -1, SQLITE_STATIC);
+	sqlite3_bind_int(ing->linktarget, 2, ing->bkid);
+	while (sqlite3_step(ing->linktarget) == SQLITE_ROW) {
+	    e.ftype = (char *) sqlite3_column_text(ing->linktarget, 1);
+	    e.permission = (char *) sqlite3_column_text(ing->linktarget, 2);
+	    e.device_id = (char *) sqlite3_column_text(ing->linktarget, 3);
+	    e.inode = (char *) sqlite3_column_text(ing->linktarget, 4);
+	    e.user_name = (char *) sqlite3_column_text(ing->linktarget, 5);
+	    e.user_id = sqlite3_column_int(ing->linktarget, 6);
+	    e.group_name = (char *) sqlite3_column_text(ing->linktarget, 7);
+	    e.group_id = sqlite3_column_int(ing->linktarget, 8);
+	    e.size = sqlite3_column_int64(ing->linktarget, 9);
+	    e.hash = (char *) sqlite3_column_text(ing->linktarget, 10);
+	    e.cdatestamp = sqlite3_column_int64(ing->linktarget, 11);
+	    e.datestamp = sqlite3_column_int64(ing->linktarget, 12);
+	    e.filename = rec->filename;
+	    e.extdata = (char *) sqlite3_column_text(ing->linktarget, 13);
+	    e.xheader = (void *) sqlite3_column_blob(ing->linktarget, 14);
+	    e.xheaderlen = sqlite3_column_bytes(ing->linktarget, 14);
+	    file_id = sf_ingest_entity(ing, &e);
+	    sqlite3_bind_int64(ing->linkcipher, 1, file_id);
+	    sqlite3_bind_int64(ing->linkcipher, 2, sqlite3_column_int64(ing->linktarget, 0));
+	    sf_ingest_step(ing, ing->linkcipher);
+	    linkbytes += e.size;
+	}
+	sqlite3_reset(ing->linktarget);
+    }
+    return(linkbytes);
+}
 
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into file_entities "
-	"(ftype, permission, device_id, inode, "
-	"user_name, user_id, group_name, group_id, size, %s, cdatestamp, "
-	"datestamp, filename, extdata, xheader) "
-	"select ftype, permission, device_id, inode, "
-	"user_name, user_id, group_name, group_id, size, hash, cdatestamp, "
-	"datestamp, filename, extdata, xheader "
-	"from file_entities_t", SHN
-    )), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-        fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-        sqlite3_free(sqlerr);
+/* Record the chunks of a chunked file, each as an object of its own,
+ * and the order they go back together in.  The list is recorded every
+ * time the file is seen, since purge may have dropped it in between.
+ */
+void sf_ingest_chunks(struct sf_ingest *ing, struct sf_record *rec)
+{
+    char *p = rec->chunklist;
+    char *hash;
+    char *format;
+    char *end;
+    int seq = 0;
+
+    while (*p != '\0') {
+	hash = p;
+	if ((format = strchr(hash, ' ')) == NULL || (p = strchr(format + 1, ' ')) == NULL) {
+	    fprintf(stderr, "Invalid chunk list for %s\n", rec->filename);
+	    exit(1);
+	}
+	*(format++) = '\0';
+	*(p++) = '\0';
+	sqlite3_bind_text(ing->diskfile, 1, hash, -1, SQLITE_STATIC);
+	sqlite3_bind_text(ing->diskfile, 2, format, -1, SQLITE_STATIC);
+	sf_ingest_step(ing, ing->diskfile);
+	vault_filter_add(ing->filter, hash);
+	sqlite3_bind_text(ing->chunk, 1, rec->hash, -1, SQLITE_STATIC);
+	sqlite3_bind_int(ing->chunk, 2, seq++);
+	sqlite3_bind_text(ing->chunk, 3, hash, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(ing->chunk, 4, strtoll(p, &end, 10));
+	sf_ingest_step(ing, ing->chunk);
+	p = *end == '\n' ? end + 1 : end;
     }
-    sqlite3_free(sqlstmt);
+}
 
+struct sf_catalog *sf_catalog_init(sqlite3 *bkcatalog, int verbose, int bkid,
+    unsigned long long est_size, int sync, int batchsize)
+{
+    struct sf_catalog *cat;
 
-//  Cipher details again for hardlink files
+    cat = malloc(sizeof(struct sf_catalog));
+    memset(cat, 0, sizeof(struct sf_catalog));
+    cat->bkcatalog = bkcatalog;
+    cat->verbose = verbose;
+    cat->bkid = bkid;
+    cat->est_size = est_size;
+    cat->sync = sync;
+    for (int i = 0; i < 2; i++) {
+	cat->batch[i].recs = malloc(sizeof(struct sf_record) * batchsize);
+	memset(cat->batch[i].recs, 0, sizeof(struct sf_record) * batchsize);
+	cat->batch[i].size = batchsize;
+    }
+    cat->staging = &(cat->batch[0]);
+    cat->ing = sf_ingest_init(bkcatalog, bkid);
+    pthread_mutex_init(&(cat->lock), NULL);
+    pthread_cond_init(&(cat->cond), NULL);
+    if (pthread_create(&(cat->thread), NULL, sf_catalog_thread, cat) != 0) {
+	fprintf(stderr, "Error starting catalog thread\n");
+	exit(1);
+    }
+    return(cat);
+}
 
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into cipher_detail ( "
-	"file_id, keynum, hmac) "
-	"select f.file_id, keynum, hmac "
-	"from cipher_detail c "
-	"join file_entities_t t on c.file_id = t.file_id "
-	"join file_entities f "
-	"on f.ftype = t.ftype and f.permission = t.permission "
-	"and f.device_id = t.device_id and f.inode = t.inode "
-	"and f.user_name = t.user_name and f.user_id = t.user_id "
-	"and f.group_name = t.group_name and f.group_id = t.group_id "
-	"and f.size = t.size and f.%s = t.hash and f.cdatestamp = t.cdatestamp "
-	"and f.datestamp = t.datestamp and f.filename = t.filename "
-	"and f.extdata = t.extdata and f.xheader = t.xheader "
-	"and f.cdatestamp = t.cdatestamp; ", SHN
-    )), 0, 0, &sqlerr);
-    sqlite3_free(sqlstmt);
+// Copy a key or file record into the staging batch, returning its count
+int sf_catalog_stage(struct sf_catalog *cat, struct sf_record *rec)
+{
+    sf_record_copy(&(cat->staging->recs[cat->staging->nrecs]), rec);
+    return(++(cat->staging->nrecs));
+}
+
+/* Hand the staging batch to the catalog thread and start filling the
+ * other one.  Waits for the thread to finish the previous batch if
+ * wait is set, and otherwise returns 1 if it is still busy with it.
+ */
+int sf_catalog_submit(struct sf_catalog *cat, int wait)
+{
+    pthread_mutex_lock(&(cat->lock));
+    if (cat->pending != NULL && wait == 0) {
+	pthread_mutex_unlock(&(cat->lock));
+	return(1);
+    }
+    while (cat->pending != NULL)
+	pthread_cond_wait(&(cat->cond), &(cat->lock));
+    cat->pending = cat->staging;
+    pthread_cond_broadcast(&(cat->cond));
+    pthread_mutex_unlock(&(cat->lock));
+    cat->staging = cat->staging == &(cat->batch[0]) ? &(cat->batch[1]) : &(cat->batch[0]);
+    cat->staging->nrecs = 0;
+    return(0);
+}
 
+// Record what is left, and wait for the catalog thread to finish
+void sf_catalog_finish(struct sf_catalog *cat)
+{
+    sf_catalog_submit(cat, 1);
+    pthread_mutex_lock(&(cat->lock));
+    cat->done = 1;
+    pthread_cond_broadcast(&(cat->cond));
+    pthread_mutex_unlock(&(cat->lock));
+    pthread_join(cat->thread, NULL);
+    pthread_mutex_destroy(&(cat->lock));
+    pthread_cond_destroy(&(cat->cond));
+    sf_ingest_free(cat->ing);
+    for (int i = 0; i < 2; i++) {
+	for (int j = 0; j < cat->batch[i].size; j++)
+	    sf_record_free(&(cat->batch[i].recs[j]));
+	free(cat->batch[i].recs);
+    }
+    for (int i = 0; i < cat->numkeys; i++)
+	dfree(cat->cryptinfo[i].hmac);
+    free(cat->cryptinfo);
+    dfree(cat->keygroups);
+    dfree(cat->keygroupsp);
+}
 
-// Backupset details for hardlinks
+// Records and commits each batch handed over, in order
+void *sf_catalog_thread(void *arg)
+{
+    struct sf_catalog *cat = arg;
+    struct sf_batch *batch;
 
-    sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"insert or ignore into backupset_detail (backupset_id, file_id) "
-	"select %d, f.file_id from file_entities f "
-	"join file_entities_t t "
-	"on f.ftype = t.ftype and f.permission = t.permission "
-	"and f.device_id = t.device_id and f.inode = t.inode "
-	"and f.user_name = t.user_name and f.user_id = t.user_id "
-	"and f.group_name = t.group_name and f.group_id = t.group_id "
-	"and f.size = t.size and f.%s = t.hash and f.cdatestamp = t.cdatestamp "
-	"and f.datestamp = t.datestamp and f.filename = t.filename "
-	"and f.extdata = t.extdata and f.xheader = t.xheader "
-	"and f.cdatestamp = t.cdatestamp ", bkid, SHN
-    )), 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
-	sqlite3_free(sqlerr);
+    pthread_mutex_lock(&(cat->lock));
+    while (1) {
+	while (cat->pending == NULL && cat->done == 0)
+	    pthread_cond_wait(&(cat->cond), &(cat->lock));
+	if ((batch = cat->pending) == NULL)
+	    break;
+	pthread_mutex_unlock(&(cat->lock));
+	// Each batch is committed by the flush that follows it
+	sqlite3_exec(cat->bkcatalog, "BEGIN", 0, 0, 0);
+	for (int i = 0; i < batch->nrecs; i++)
+	    sf_catalog_record(cat, &(batch->recs[i]));
+	flush_received_files(cat->bkcatalog, cat->verbose, cat->bkid, cat->est_size, cat->sync);
+	pthread_mutex_lock(&(cat->lock));
+	cat->pending = NULL;
+	pthread_cond_broadcast(&(cat->cond));
     }
-    sqlite3_free(sqlstmt);
+    pthread_mutex_unlock(&(cat->lock));
+    return(NULL);
+}
+
+// Record a key or file record from the stream in the catalog
+void sf_catalog_record(struct sf_catalog *cat, struct sf_record *rec)
+{
+    sqlite3 *bkcatalog = cat->bkcatalog;
+    struct sf_ingest *ing = cat->ing;
+    char *sqlstmt;
+    char *sqlerr = NULL;
+    sqlite3_stmt *sqlres;
+    long cipherid = 0;
+    char permission[16];
+    char xattr_varstring[1024];
+    char *paxdata;
+    int paxdatalen;
+    int cipher_record;
 
-//  Get sum of bytes in hardlinked files for status reporting   
-    x = sqlite3_prepare_v2(bkcatalog, (sqlstmt = sqlite3_mprintf(
-	"select sum(size) from file_entities_t")), -1, &sqlres, 0);
-    if ((x = sqlite3_step(sqlres)) == SQLITE_ROW) {
-	*bytes_read = sqlite3_column_int64(sqlres, 0);
+    // Record encryption key data from global header
+    if (rec->type == '0') {
+	sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	    "insert or ignore into cipher_master (pkfp, eprivkey, pubkey, hmackeyhash, comment) "
+	    "values ('%q', '%q', '%q', '%q', '%q')", rec->fingerprint, rec->eprvkey, rec->pubkey,
+	    rec->hmackeyhash, rec->comment)), 0, 0, &sqlerr);
+	if (sqlerr != 0) {
+	    fprintf(stderr, "%s %s\n", sqlerr, sqlstmt);
+	    sqlite3_free(sqlerr);
+	}
+	sqlite3_free(sqlstmt);
+	// get the primary key (cipherid) of recorded key data
+	if (sqlite3_prepare_v2(bkcatalog,
+	    sqlstmt = sqlite3_mprintf("select cipherid from cipher_master "
+	    "where pkfp = '%q' and eprivkey = '%q' and pubkey = '%q' "
+	    "and hmackeyhash = '%q' and comment = '%q'", rec->fingerprint, rec->eprvkey, rec->pubkey,
+	    rec->hmackeyhash, rec->comment), -1, &sqlres, 0) == SQLITE_OK) {
+	    sqlite3_free(sqlstmt);
+	    if (sqlite3_step(sqlres) == SQLITE_ROW) {
+		cipherid = sqlite3_column_int(sqlres, 0);
+	    }
+	    else {
+		fprintf(stderr, "Cipher key recording failure\n");
+		exit(1);
+	    }
+	    sqlite3_finalize(sqlres);
+	}
+	// temporary map of inbound key number and recorded key
+	sqlite3_exec(bkcatalog, (sqlstmt = sqlite3_mprintf(
+	    "insert or replace into temp_key_map (keyposition, id)"
+	    "values (%d, %d)", rec->keynum, cipherid)), 0, 0, 0);
+	sqlite3_free(sqlstmt);
+	if (rec->keynum + 1 > cat->numkeys) {
+	    cat->cryptinfo = realloc(cat->cryptinfo, sizeof(struct sf_cryptinfo) * (rec->keynum + 1));
+	    for (int i = cat->numkeys; i < rec->keynum + 1; i++)
+		cat->cryptinfo[i].hmac = NULL;
+	    cat->numkeys = rec->keynum + 1;
+	}
+	return;
     }
-    sqlite3_finalize(sqlres);
-    sqlite3_free(sqlstmt);
+    cipher_record = 0;
+    if (getpaxvar(rec->xheader, rec->xheaderlen, "TC.cipher", &paxdata, &paxdatalen) == 0) {
+	cipher_record = 1;
+	cpypaxvarstr(rec->xheader, rec->xheaderlen, "TC.keygroup", &(cat->keygroups));
+	parse(cat->keygroups, &(cat->keygroupsp), '|');
+	for (int i = 0; cat->keygroupsp[i] != NULL; i++) {
+	    int n = atoi(cat->keygroupsp[i]);
+	    if (n < cat->numkeys) {
+		cat->cryptinfo[n].keynum = n;
+		if (cat->numkeys > 1)
+		    sprintf(xattr_varstring, "TC.hmac.%d", n);
+		else
+		    sprintf(xattr_varstring, "TC.hmac");
+		cpypaxvarstr(rec->xheader, rec->xheaderlen, xattr_varstring, &(cat->cryptinfo[n].hmac));
+		delpaxvar(&(rec->xheader), &(rec->xheaderlen), xattr_varstring);
+	    }
+	}
+    }
+    delpaxvar(&(rec->xheader), &(rec->xheaderlen), "atime");
+    delpaxvar(&(rec->xheader), &(rec->xheaderlen), "TC.segmented.header");
+    sprintf(permission, "%4.4o", rec->mode);
+    __atomic_add_fetch(&(cat->linkbytes), sf_ingest_record(ing, rec, permission), __ATOMIC_RELAXED);
 
+    if (cipher_record == 1) {
+	for (int j = 0; j < ing->nids; j++)
+	    for (int i = 0; cat->keygroupsp[i] != NULL; i++) {
+		int n = atoi(cat->keygroupsp[i]);
+		sqlite3_bind_int64(ing->cipher, 1, ing->ids[j]);
+		sqlite3_bind_text(ing->cipher, 2, cat->cryptinfo[n].hmac, -1, SQLITE_STATIC);
+		sqlite3_bind_int(ing->cipher, 3, cat->cryptinfo[n].keynum);
+		sf_ingest_step(ing, ing->cipher);
+	    }
+    }
+}
 
-    sqlite3_exec(bkcatalog, "delete from received_file_entities_t", 0, 0, 0);
-    sqlite3_exec(bkcatalog, "delete from file_entities_t", 0, 0, 0);
-    sqlite3_exec(bkcatalog, "delete from temp_cipher_detail", 0, 0, 0);
-    return(0);
+// Copy a received record into one whose fields are dmalloc'd
+void sf_record_copy(struct sf_record *dst, struct sf_record *src)
+{
+    dst->type = src->type;
+    if (src->type == '0') {
+	dst->keynum = src->keynum;
+	strncpya0(&(dst->fingerprint), src->fingerprint, 0);
+	strncpya0(&(dst->eprvkey), src->eprvkey, 0);
+	strncpya0(&(dst->pubkey), src->pubkey, 0);
+	strncpya0(&(dst->hmackeyhash), src->hmackeyhash, 0);
+	strncpya0(&(dst->comment), src->comment, 0);
+	return;
+    }
+    dst->ftype = src->ftype;
+    dst->mode = src->mode;
+    strncpya0(&(dst->auid), src->auid, 0);
+    dst->nuid = src->nuid;
+    strncpya0(&(dst->agid), src->agid, 0);
+    dst->ngid = src->ngid;
+    dst->filesize = src->filesize;
+    strcpy(dst->hash, src->hash);
+    dst->modtime = src->modtime;
+    strncpya0(&(dst->filename), src->filename, 0);
+    strncpya0(&(dst->linktarget), src->linktarget, 0);
+    if (dmalloc_size(dst->xheader) < src->xheaderlen + 1)
+	dst->xheader = drealloc(dst->xheader, src->xheaderlen + 1);
+    memcpy(dst->xheader, src->xheader, src->xheaderlen);
+    dst->xheader[src->xheaderlen] = '\0';
+    dst->xheaderlen = src->xheaderlen;
+    dst->pack = src->pack;
+    dst->offset = src->offset;
+    dst->length = src->length;
+    strncpya0(&(dst->format), src->format, 0);
+    strncpya0(&(dst->chunklist), src->chunklist, 0);
 }
+
 int submitfiles_tmptables(sqlite3 *bkcatalog, int bkid)
 {
     char *sqlerr;
     char *sqlstmt = NULL;
 
-    sqlite3_exec(bkcatalog,
-        "create temporary table if not exists received_file_entities_t (  \n"
-        "    file_id       integer primary key,  \n"
-        "    backupset_id  integer,  \n"
-        "    ftype         char,  \n"
-        "    permission    char,  \n"
-        "    user_name     char,  \n"
-        "    user_id       integer,  \n"
-        "    group_name    char,  \n"
-        "    group_id      integer,  \n"
-        "    size          integer,  \n"
-        "    hash          char,  \n"
-        "    datestamp     integer,  \n"
-        "    filename      char,  \n"
-        "    extdata       char default '',  \n"
-        "    xheader       blob default '',  \n"
-        "unique (  \n"
-            "backupset_id,  \n"
-            "ftype,  \n"
-            "permission,  \n"
-            "user_name,  \n"
-            "user_id,  \n"
-            "group_name,  \n"
-            "group_id,  \n"
-            "size,  \n"
-            "hash,  \n"
-            "datestamp,  \n"
-            "filename,  \n"
-            "extdata,  \n"
-            "xheader ))", 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n", sqlerr);
-	sqlite3_free(sqlerr);
-    }
-
     sqlite3_exec(bkcatalog, sqlstmt = sqlite3_mprintf(
-	"create temporary table if not exists file_entities_t "
-	"as select file_id, ftype, permission, device_id, inode, user_name, user_id, group_name, group_id, size, %s hash, cdatestamp, datestamp, filename, extdata, xheader from file_entities where 0", SHN), 0, 0, &sqlerr);
+	"create temporary table if not exists diskfiles_t "
+	"as select %s hash from diskfiles where 0", SHN), 0, 0, &sqlerr);
     if (sqlerr != 0) {
 	fprintf(stderr, "%s\n", sqlerr);
 	sqlite3_free(sqlerr);
     }
     sqlite3_free(sqlstmt);
-
-    sqlite3_exec(bkcatalog,
-    "create index if not exists received_file_entities_t_i1 on received_file_entities_t (  \n"
-    "    filename)", 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n\n\n",sqlerr);
-	sqlite3_free(sqlerr);
-    }
     sqlite3_exec(bkcatalog,
-    "create index if not exists received_file_entities_t_i2 on received_file_entities_t (  \n"
-    "    extdata)", 0, 0, &sqlerr);
-    if (sqlerr != 0) {
-	fprintf(stderr, "%s\n\n\n",sqlerr);
-	sqlite3_free(sqlerr);
-    }
-    sqlite3_exec(bkcatalog, sqlstmt = sqlite3_mprintf(
-	"create temporary table if not exists diskfiles_t "
-	"as select %s hash from diskfiles where 0", SHN), 0, 0, &sqlerr);
+	"create temporary table if not exists packed_objects_t (  \n"
+	"    hash          char primary key,  \n"
+	"    pack          integer,  \n"
+	"    offset        integer,  \n"
+	"    length        integer)", 0, 0, &sqlerr);
     if (sqlerr != 0) {
 	fprintf(stderr, "%s\n", sqlerr);
 	sqlite3_free(sqlerr);
     }
-    sqlite3_free(sqlstmt);
 	
     return(0);
 }
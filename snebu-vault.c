@@ -0,0 +1,1724 @@
+/* Copyright 2009 - 2021 Derek Pressnall
+ *
+ * This file is part of Snebu, the Simple Network Encrypting Backup Utility
+ *
+ * Snebu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3
+ * as published by the Free Software Foundation.
+ *
+ * Snebu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Snebu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Vault storage: the pack store for small objects, and an io_uring
+ * based writer for objects stored as files of their own.
+ *
+ * Objects at or below the pack threshold are appended to pack files,
+ * <vault>/packs/<n>.pack, instead of getting a file of their own.  The
+ * packed_objects table maps each object's hash to its pack, offset
+ * and length.  Each backup session appends to packs of its own, and
+ * the catalog side records the locations as the file records arrive.
+ *
+ * Purge marks unreferenced packed objects dead; the bytes stay put
+ * until compaction copies the live objects out of wasteful or small
+ * packs and deletes the old ones.  Backup sessions and restores hold
+ * a shared lock on <vault>/packs/lock while they use packs, and
+ * compaction only runs when it can take that lock exclusively, so no
+ * object moves or disappears under a session that has looked it up.
+ * Recompress waits for the same before removing the old files of
+ * objects it has rewritten in another format.
+ *
+ * Large files are written to <vault>/partial/<key>.lzo (or .raw) as
+ * they arrive, instead of to an unnamed temp file, so that a transfer
+ * cut off part way leaves its head behind.  The key is a hash of the
+ * backup name and the file's name, size and modification time, which
+ * both newbackup and submitfiles know.  newbackup reports how much of
+ * each needed file a partial already holds, the client sends only the
+ * rest, and submitfiles picks the partial up where it ended.  Partials
+ * nobody came back for are removed by purge.
+ *
+ * Files over the chunk threshold are stored as a series of chunk
+ * objects, listed in order in object_chunks, and read back here as a
+ * single stream for restore.
+ *
+ * A backup name can be set, in object_compression, to store its objects
+ * as zstd frames (<hash>.zst) instead of lzop streams, optionally with
+ * a dictionary trained on a sample of its files and kept in
+ * zstd_dictionaries.  The frame header carries the dictionary's id,
+ * which is all a reader needs to find it.
+ *
+ * <meta>/snebu-presence.filter is a blocked Bloom filter over the
+ * object names in diskfiles, mapped shared by every backup session.
+ * Each name sets one bit in each of the eight words of a 64 byte
+ * block, so a lookup touches one cache line.  Sessions add objects as
+ * they store and catalog them, and only look in the vault for objects
+ * the filter says may be there.  Bits can't be taken back out, so
+ * purge counts what it removed, and the filter is rebuilt from
+ * diskfiles once that, or the number of objects, outgrows its size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sqlite3.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tarlib.h"
+
+#define VAULT_PACKSIZE (1024LL * 1024 * 1024)
+#define VAULT_PARTIAL_DAYS 7
+#define VAULT_LZOP_HDRSIZE 38		// lzop header as written by lzop_init_w
+#define VAULT_FILTER_MAGIC "snebupf1"
+#define VAULT_FILTER_BITS 10		// per object at capacity, about 1% false hits
+#define VAULT_FILTER_MINBLOCKS 16384	// 1 MiB
+
+#ifdef HAVE_IO_URING
+/* Asynchronous vault object writer.  Each object is a linked chain of
+ * write, close and rename requests on an io_uring, and a reaper thread
+ * collects the completions in batches, so the thread storing objects
+ * never waits on them.  Object data and paths live in a vault_ucommit
+ * until its chain finishes, when its done callback is run.
+ */
+struct vault_uring {
+    int fd;
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqring;
+    size_t sqringsz;
+    void *cqring;
+    size_t cqringsz;
+    size_t sqesz;
+    pthread_mutex_t lock;
+    pthread_cond_t room;
+    int inflight;			// chains submitted and not yet reaped
+    pthread_t reaper;
+};
+
+struct vault_ucommit {
+    char *buf;				// dmalloc'd, freed once written
+    char tmpfilepath[1024];
+    char targetpath[1024];
+    int pending;			// completions still to come
+    void (*done)(void *arg);
+    void *arg;
+};
+
+#define VAULT_URING_ENTRIES 256
+#define VAULT_URING_INFLIGHT 64		// three entries each
+#endif
+
+struct vault_packer {
+    pthread_mutex_t lock;
+    sqlite3 *db;
+    sqlite3_stmt *lookup;
+    int pack;				// pack being appended to, or 0
+    int fd;
+    unsigned long long int end;
+    int newpack;			// pack file created since the last sync
+    char **packed;			// hashes packed in this session,
+    size_t nslots;			// not yet seen by the catalog
+    size_t npacked;
+};
+
+// Reads the chunks of a chunked object back to back
+struct vault_chunks {
+    sqlite3_stmt *sqlres;		// chunks in order
+    char chunk[EVP_MAX_MD_SIZE * 2 + 1];	// the one being read
+    struct vault_object *vo;
+    unsigned long long int remaining;	// bytes left in it
+    int error;				// set once a chunk is missing or damaged
+};
+
+/* A backup name's zstd settings.  Compressors are kept on a free list
+ * between objects, with the level and dictionary already set, so small
+ * files don't each pay for setting one up.
+ */
+struct vault_codec {
+    int level;
+    unsigned int dictid;		// 0 if there is no dictionary
+#ifdef HAVE_ZSTD
+    ZSTD_CDict *cdict;
+    pthread_mutex_t lock;
+    struct vault_zstd *writers;		// idle compressors
+#endif
+};
+
+#ifdef HAVE_ZSTD
+// A zstd frame read or written through c_fread / c_fwrite, like lzop_file
+struct vault_zstd {
+    size_t (*c_fwrite)();
+    void *c_fhandle;
+    size_t (*c_fread)();
+    void *c_handle;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    struct vault_codec *codec;		// writer's, to go back to
+    char *buf;
+    size_t bufsize;
+    ZSTD_inBuffer in;			// reader's input not yet decoded
+    int flushed;			// decoder has no output held back
+    int eof;				// reader reached the end of the frame
+    int error;
+    struct vault_zstd *next;
+};
+
+// Decompression dictionaries, loaded from zstd_dictionaries as needed
+struct vault_ddict {
+    unsigned int id;
+    ZSTD_DDict *ddict;
+    struct vault_ddict *next;
+};
+#endif
+
+// Reads any stored object back as the data it holds
+struct vault_object {
+    FILE *f;
+    unsigned long long int remaining;	// bytes of f that belong to it
+    struct lzop_file *lzf;
+    struct vault_zstd *vz;
+    struct vault_chunks *vc;
+};
+
+// The filter file is this header followed by nblocks blocks
+struct vault_filter_hdr {
+    char magic[8];
+    uint64_t nblocks;
+    uint64_t count;			// objects added (as far as bits show)
+    uint64_t removed;			// objects purged since the last build
+    char pad[32];
+};
+
+struct vault_filter {
+    struct vault_filter_hdr *hdr;
+    uint64_t *blocks;
+    size_t len;
+};
+
+struct vault_packer *vault_packer_init(unsigned long long int packmax);
+void vault_packer_free(struct vault_packer *vp);
+int vault_packed(struct vault_packer *vp, char *hash);
+int vault_pack_put(struct vault_packer *vp, char *hash, char *buf, size_t len,
+    int *pack, unsigned long long int *offset);
+int vault_pack_sync(struct vault_packer *vp);
+FILE *vault_pack_open_r(sqlite3 *db, char *hash, unsigned long long int *length);
+int vault_compact(sqlite3 *db, int verbose);
+int vault_lock(int op);
+struct vault_uring *vault_uring_init();
+void vault_uring_commit(struct vault_uring *vu, char *buf, size_t len, int fd,
+    char *tmpfilepath, char *targetpath, void (*done)(void *arg), void *arg);
+void vault_uring_free(struct vault_uring *vu);
+void *vault_uring_reaper(void *arg);
+void vault_pack_path(int pack, char *path);
+int vault_pack_new(sqlite3 *db, int *fd);
+int vault_write(int fd, char *buf, size_t len, unsigned long long int offset);
+size_t vault_hslot(struct vault_packer *vp, char *hash);
+void vault_hadd(struct vault_packer *vp, char *hash);
+int busy_retry(void *userdata, int count);
+void vault_partial_path(char *bkname, char *filename, unsigned long long int size,
+    long long int modtime, char *path);
+unsigned long long int vault_partial_offset(char *path, char **ext);
+int vault_partial_expire(int verbose);
+struct vault_chunks *vault_chunks_open_r(sqlite3 *db, char *hash);
+size_t vault_chunks_read(void *buf, size_t sz, size_t count, struct vault_chunks *vc);
+int vault_chunks_close(struct vault_chunks *vc);
+static int vault_chunks_next(struct vault_chunks *vc);
+struct vault_filter *vault_filter_open();
+void vault_filter_close(struct vault_filter *vf);
+int vault_filter_maybe(struct vault_filter *vf, char *hash);
+void vault_filter_add(struct vault_filter *vf, char *hash);
+int vault_filter_build(sqlite3 *db, int verbose);
+int vault_filter_prepare(sqlite3 *db, int verbose);
+int vault_filter_purged(sqlite3 *db, unsigned long long int n, int verbose);
+static int vault_filter_key(char *hash, uint64_t *h1, uint64_t *h2);
+static void vault_filter_path(char *path);
+struct vault_codec *vault_codec_load(sqlite3 *db, char *bkname);
+struct vault_codec *vault_codec_new(int level);
+void vault_codec_free(struct vault_codec *codec);
+struct vault_zstd *vault_zstd_init_w(struct vault_codec *codec, size_t (*c_fwrite)(), void *c_fhandle);
+size_t vault_zstd_write(void *buf, size_t sz, size_t count, struct vault_zstd *vz);
+int vault_zstd_finalize_w(struct vault_zstd *vz);
+struct vault_zstd *vault_zstd_init_r(sqlite3 *db, size_t (*c_fread)(), void *c_handle);
+size_t vault_zstd_read(void *buf, size_t sz, size_t count, struct vault_zstd *vz);
+int vault_zstd_finalize_r(struct vault_zstd *vz);
+struct vault_object *vault_object_open_r(sqlite3 *db, char *hash, char *format);
+size_t vault_object_read(void *buf, size_t sz, size_t count, struct vault_object *vo);
+int vault_object_close(struct vault_object *vo);
+extern struct {
+    char *vault;
+    char *meta;
+    int hash;
+} config;
+extern char *SHN;
+
+static int vault_lockfd = -1;
+
+/* Set up the pack writer for a backup session.  Returns NULL if
+ * packing is off and the vault has no packs, in which case there is
+ * nothing to look up either.  The caller holds the pack lock until
+ * the catalog has recorded everything written here.
+ */
+struct vault_packer *vault_packer_init(unsigned long long int packmax)
+{
+    struct vault_packer *vp;
+    char *dbpath;
+    sqlite3_stmt *sqlres;
+    int havepacks = 0;
+
+    if (vault_lock(LOCK_SH) != 0) {
+	fprintf(stderr, "Error locking the vault packs\n");
+	exit(1);
+    }
+    vp = malloc(sizeof(struct vault_packer));
+    if (asprintf(&dbpath, "%s/%s.db", config.meta, "snebu-catalog") < 0) {
+	fprintf(stderr, "Unable to load catalog -- memory allocation failure\n");
+	exit(1);
+    }
+    if (sqlite3_open(dbpath, &(vp->db)) != SQLITE_OK) {
+	fprintf(stderr, "Error: could not open catalog at %s\n", dbpath);
+	exit(1);
+    }
+    free(dbpath);
+    sqlite3_busy_handler(vp->db, busy_retry, NULL);
+    sqlite3_prepare_v2(vp->db, "select 1 from packs limit 1", -1, &sqlres, 0);
+    if (sqlite3_step(sqlres) == SQLITE_ROW)
+	havepacks = 1;
+    sqlite3_finalize(sqlres);
+    if (packmax == 0 && havepacks == 0) {
+	sqlite3_close(vp->db);
+	free(vp);
+	return(NULL);
+    }
+    pthread_mutex_init(&(vp->lock), NULL);
+    if (sqlite3_prepare_v2(vp->db,
+	"select 1 from packed_objects where hash = ? and dead = 0",
+	-1, &(vp->lookup), 0) != SQLITE_OK) {
+	fprintf(stderr, "%s\n", sqlite3_errmsg(vp->db));
+	exit(1);
+    }
+    vp->pack = 0;
+    vp->fd = -1;
+    vp->end = 0;
+    vp->newpack = 0;
+    vp->nslots = 1024;
+    vp->npacked = 0;
+    vp->packed = calloc(vp->nslots, sizeof(char *));
+    return(vp);
+}
+
+void vault_packer_free(struct vault_packer *vp)
+{
+    if (vp == NULL)
+	return;
+    if (vp->fd >= 0 && close(vp->fd) != 0) {
+	fprintf(stderr, "Error writing pack %d, aborting\n", vp->pack);
+	exit(1);
+    }
+    for (size_t i = 0; i < vp->nslots; i++)
+	dfree(vp->packed[i]);
+    free(vp->packed);
+    sqlite3_finalize(vp->lookup);
+    sqlite3_close(vp->db);
+    pthread_mutex_destroy(&(vp->lock));
+    free(vp);
+}
+
+static int vault_packed_l(struct vault_packer *vp, char *hash)
+{
+    int found = 0;
+
+    if (vp->packed[vault_hslot(vp, hash)] != NULL)
+	return(1);
+    sqlite3_bind_text(vp->lookup, 1, hash, -1, SQLITE_STATIC);
+    if (sqlite3_step(vp->lookup) == SQLITE_ROW)
+	found = 1;
+    sqlite3_reset(vp->lookup);
+    return(found);
+}
+
+/* Returns 1 if the object is in a pack and not marked dead.  Dead
+ * objects may be compacted away at any time after this session ends,
+ * so they are stored again rather than reused.
+ */
+int vault_packed(struct vault_packer *vp, char *hash)
+{
+    int found;
+
+    pthread_mutex_lock(&(vp->lock));
+    found = vault_packed_l(vp, hash);
+    pthread_mutex_unlock(&(vp->lock));
+    return(found);
+}
+
+/* Append an object to this session's pack, returning its location.
+ * Returns 1 without writing anything if it is already packed.
+ */
+int vault_pack_put(struct vault_packer *vp, char *hash, char *buf, size_t len,
+    int *pack, unsigned long long int *offset)
+{
+    pthread_mutex_lock(&(vp->lock));
+    if (vault_packed_l(vp, hash) == 1) {
+	pthread_mutex_unlock(&(vp->lock));
+	return(1);
+    }
+    if (vp->fd < 0 || vp->end + len > VAULT_PACKSIZE) {
+	if (vp->fd >= 0 && close(vp->fd) != 0) {
+	    fprintf(stderr, "Error writing pack %d, aborting\n", vp->pack);
+	    exit(1);
+	}
+	vp->pack = vault_pack_new(vp->db, &(vp->fd));
+	vp->end = 0;
+	vp->newpack = 1;
+    }
+    if (vault_write(vp->fd, buf, len, vp->end) != 0) {
+	fprintf(stderr, "Error writing pack %d, aborting\n", vp->pack);
+	exit(1);
+    }
+    *pack = vp->pack;
+    *offset = vp->end;
+    vp->end += len;
+    vault_hadd(vp, hash);
+    pthread_mutex_unlock(&(vp->lock));
+    return(0);
+}
+
+// Flush this session's current pack to disk, and its directory entry
+int vault_pack_sync(struct vault_packer *vp)
+{
+    char packdir[1024];
+    int dirfd;
+    int err = 0;
+
+    pthread_mutex_lock(&(vp->lock));
+    if (vp->fd >= 0 && fdatasync(vp->fd) != 0)
+	err = 1;
+    if (err == 0 && vp->newpack == 1) {
+	snprintf(packdir, 1024, "%s/packs", config.vault);
+	if ((dirfd = open(packdir, O_RDONLY | O_DIRECTORY)) < 0 || fsync(dirfd) != 0)
+	    err = 1;
+	if (dirfd >= 0)
+	    close(dirfd);
+	vp->newpack = 0;
+    }
+    pthread_mutex_unlock(&(vp->lock));
+    return(err);
+}
+
+/* Open a packed object for reading, positioned at its first byte.
+ * Returns NULL if the object isn't in a pack.
+ */
+FILE *vault_pack_open_r(sqlite3 *db, char *hash, unsigned long long int *length)
+{
+    sqlite3_stmt *sqlres;
+    char packpath[1024];
+    FILE *f = NULL;
+
+    if (vault_lockfd < 0 && vault_lock(LOCK_SH) != 0)
+	return(NULL);
+    sqlite3_prepare_v2(db,
+	"select pack, offset, length from packed_objects where hash = ?",
+	-1, &sqlres, 0);
+    sqlite3_bind_text(sqlres, 1, hash, -1, SQLITE_STATIC);
+    if (sqlite3_step(sqlres) == SQLITE_ROW) {
+	vault_pack_path(sqlite3_column_int(sqlres, 0), packpath);
+	if ((f = fopen(packpath, "r")) != NULL) {
+	    if (fseeko(f, sqlite3_column_int64(sqlres, 1), SEEK_SET) != 0) {
+		fclose(f);
+		f = NULL;
+	    }
+	    *length = sqlite3_column_int64(sqlres, 2);
+	}
+    }
+    sqlite3_finalize(sqlres);
+    return(f);
+}
+
+// Open a chunked object for reading with vault_chunks_read
+struct vault_chunks *vault_chunks_open_r(sqlite3 *db, char *hash)
+{
+    struct vault_chunks *vc;
+    char *sqlstmt;
+
+    vc = malloc(sizeof(struct vault_chunks));
+    vc->vo = NULL;
+    vc->remaining = 0;
+    vc->error = 0;
+    if (sqlite3_prepare_v2(db, (sqlstmt = sqlite3_mprintf(
+	"select c.chunk, d.format, c.length from object_chunks c "
+	"left join diskfiles d on d.%s = c.chunk "
+	"where c.object = ?1 order by c.seq", SHN)), -1, &(vc->sqlres), 0) != SQLITE_OK) {
+	fprintf(stderr, "%s\n%s\n", sqlite3_errmsg(db), sqlstmt);
+	exit(1);
+    }
+    sqlite3_free(sqlstmt);
+    sqlite3_bind_text(vc->sqlres, 1, hash, -1, SQLITE_TRANSIENT);
+    return(vc);
+}
+
+// Move on to the next chunk.  Returns 1 at the end, or if it is missing.
+static int vault_chunks_next(struct vault_chunks *vc)
+{
+    char *format;
+
+    if (vc->vo != NULL && vault_object_close(vc->vo) != 0)
+	vc->error = 1;
+    vc->vo = NULL;
+    if (sqlite3_step(vc->sqlres) != SQLITE_ROW)
+	return(1);
+    snprintf(vc->chunk, sizeof(vc->chunk), "%s", (char *) sqlite3_column_text(vc->sqlres, 0));
+    format = sqlite3_column_type(vc->sqlres, 1) == SQLITE_TEXT ?
+	(char *) sqlite3_column_text(vc->sqlres, 1) : "lzo";
+    if ((vc->vo = vault_object_open_r(sqlite3_db_handle(vc->sqlres), vc->chunk, format)) == NULL) {
+	fprintf(stderr, "Missing chunk %s\n", vc->chunk);
+	vc->error = 1;
+	return(1);
+    }
+    vc->remaining = sqlite3_column_int64(vc->sqlres, 2);
+    return(0);
+}
+
+size_t vault_chunks_read(void *buf, size_t sz, size_t count, struct vault_chunks *vc)
+{
+    size_t n = sz * count;
+    size_t t = 0;
+    size_t c;
+
+    while (t < n) {
+	if (vc->remaining == 0 && vault_chunks_next(vc) != 0)
+	    break;
+	c = n - t < vc->remaining ? n - t : vc->remaining;
+	c = vault_object_read(buf + t, 1, c, vc->vo);
+	if (c == 0) {
+	    fprintf(stderr, "Chunk %s is damaged\n", vc->chunk);
+	    vc->error = 1;
+	    break;
+	}
+	t += c;
+	vc->remaining -= c;
+    }
+    return(t);
+}
+
+// Returns nonzero if any chunk read was missing or damaged
+int vault_chunks_close(struct vault_chunks *vc)
+{
+    int error = vc->error;
+
+    if (vc->vo != NULL && vault_object_close(vc->vo) != 0)
+	error = 1;
+    sqlite3_finalize(vc->sqlres);
+    free(vc);
+    return(error);
+}
+
+/* Set up a backup name's object compression from object_compression.
+ * Returns NULL for the default, lzop.
+ */
+struct vault_codec *vault_codec_load(sqlite3 *db, char *bkname)
+{
+    struct vault_codec *codec = NULL;
+    sqlite3_stmt *sqlres;
+    char *sqlstmt;
+
+    if (sqlite3_prepare_v2(db, (sqlstmt = sqlite3_mprintf(
+	"select c.level, c.dict_id, z.dictionary from object_compression c "
+	"left join zstd_dictionaries z on z.dict_id = c.dict_id "
+	"where c.name = '%q' and c.method = 'zstd'", bkname)), -1, &sqlres, 0) != SQLITE_OK) {
+	fprintf(stderr, "%s\n%s\n", sqlite3_errmsg(db), sqlstmt);
+	exit(1);
+    }
+    sqlite3_free(sqlstmt);
+    if (sqlite3_step(sqlres) == SQLITE_ROW) {
+#ifdef HAVE_ZSTD
+	codec = vault_codec_new(sqlite3_column_int(sqlres, 0));
+	if (sqlite3_column_type(sqlres, 2) == SQLITE_BLOB) {
+	    codec->cdict = ZSTD_createCDict(sqlite3_column_blob(sqlres, 2),
+		sqlite3_column_bytes(sqlres, 2), codec->level);
+	    if (codec->cdict == NULL) {
+		fprintf(stderr, "Error loading zstd dictionary %lld\n",
+		    sqlite3_column_int64(sqlres, 1));
+		exit(1);
+	    }
+	    codec->dictid = ZSTD_getDictID_fromCDict(codec->cdict);
+	}
+	else if (sqlite3_column_type(sqlres, 1) != SQLITE_NULL)
+	    fprintf(stderr, "zstd dictionary %lld for %s is missing, compressing without it\n",
+		sqlite3_column_int64(sqlres, 1), bkname);
+#else
+	fprintf(stderr, "%s is set to zstd compression, and snebu was built without zstd support\n",
+	    bkname);
+	exit(1);
+#endif
+    }
+    sqlite3_finalize(sqlres);
+    return(codec);
+}
+
+// zstd at the given level, without a dictionary
+struct vault_codec *vault_codec_new(int level)
+{
+#ifdef HAVE_ZSTD
+    struct vault_codec *codec;
+
+    codec = malloc(sizeof(struct vault_codec));
+    codec->level = level;
+    codec->dictid = 0;
+    codec->cdict = NULL;
+    codec->writers = NULL;
+    pthread_mutex_init(&(codec->lock), NULL);
+    return(codec);
+#else
+    fprintf(stderr, "snebu was built without zstd support\n");
+    exit(1);
+#endif
+}
+
+void vault_codec_free(struct vault_codec *codec)
+{
+#ifdef HAVE_ZSTD
+    struct vault_zstd *vz;
+
+    if (codec == NULL)
+	return;
+    while ((vz = codec->writers) != NULL) {
+	codec->writers = vz->next;
+	ZSTD_freeCCtx(vz->cctx);
+	free(vz->buf);
+	free(vz);
+    }
+    if (codec->cdict != NULL)
+	ZSTD_freeCDict(codec->cdict);
+    pthread_mutex_destroy(&(codec->lock));
+    free(codec);
+#endif
+}
+
+#ifdef HAVE_ZSTD
+static struct vault_zstd *vault_zstd_readers = NULL;
+static struct vault_ddict *vault_ddicts = NULL;
+static pthread_mutex_t vault_zstd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Compress what is in "in", writing out whatever the encoder hands back
+static void vault_zstd_compress(struct vault_zstd *vz, ZSTD_inBuffer *in, ZSTD_EndDirective mode)
+{
+    ZSTD_outBuffer out;
+    size_t r;
+
+    do {
+	out.dst = vz->buf;
+	out.size = vz->bufsize;
+	out.pos = 0;
+	r = ZSTD_compressStream2(vz->cctx, &out, in, mode);
+	if (ZSTD_isError(r)) {
+	    fprintf(stderr, "zstd compression error: %s\n", ZSTD_getErrorName(r));
+	    exit(1);
+	}
+	if (out.pos > 0 && vz->c_fwrite(vz->buf, 1, out.pos, vz->c_fhandle) != out.pos) {
+	    fprintf(stderr, "Error writing zstd object\n");
+	    exit(1);
+	}
+    } while (mode == ZSTD_e_end ? r != 0 : in->pos < in->size);
+}
+
+/* Look up a decompression dictionary by the id in a frame header,
+ * loading it from the catalog the first time it is asked for.
+ */
+static ZSTD_DDict *vault_ddict(sqlite3 *db, unsigned int id)
+{
+    struct vault_ddict *d;
+    sqlite3_stmt *sqlres;
+
+    pthread_mutex_lock(&vault_zstd_lock);
+    for (d = vault_ddicts; d != NULL && d->id != id; d = d->next)
+	;
+    if (d == NULL) {
+	sqlite3_prepare_v2(db, "select dictionary from zstd_dictionaries where dict_id = ?",
+	    -1, &sqlres, 0);
+	sqlite3_bind_int64(sqlres, 1, id);
+	if (sqlite3_step(sqlres) == SQLITE_ROW && sqlite3_column_type(sqlres, 0) == SQLITE_BLOB) {
+	    d = malloc(sizeof(struct vault_ddict));
+	    d->id = id;
+	    d->ddict = ZSTD_createDDict(sqlite3_column_blob(sqlres, 0),
+		sqlite3_column_bytes(sqlres, 0));
+	    d->next = vault_ddicts;
+	    vault_ddicts = d;
+	}
+	sqlite3_finalize(sqlres);
+    }
+    pthread_mutex_unlock(&vault_zstd_lock);
+    return(d != NULL ? d->ddict : NULL);
+}
+#endif
+
+/* Start a zstd object, written out through c_fwrite.  A compressor
+ * left over from an earlier object of the same backup name is reused,
+ * with its level and dictionary already set.
+ */
+struct vault_zstd *vault_zstd_init_w(struct vault_codec *codec, size_t (*c_fwrite)(), void *c_fhandle)
+{
+#ifdef HAVE_ZSTD
+    struct vault_zstd *vz;
+
+    pthread_mutex_lock(&(codec->lock));
+    if ((vz = codec->writers) != NULL)
+	codec->writers = vz->next;
+    pthread_mutex_unlock(&(codec->lock));
+    if (vz == NULL) {
+	vz = malloc(sizeof(struct vault_zstd));
+	vz->cctx = ZSTD_createCCtx();
+	vz->dctx = NULL;
+	if (codec->cdict != NULL)
+	    ZSTD_CCtx_refCDict(vz->cctx, codec->cdict);
+	else
+	    ZSTD_CCtx_setParameter(vz->cctx, ZSTD_c_compressionLevel, codec->level);
+	ZSTD_CCtx_setParameter(vz->cctx, ZSTD_c_checksumFlag, 1);
+	vz->bufsize = ZSTD_CStreamOutSize();
+	vz->buf = malloc(vz->bufsize);
+    }
+    vz->codec = codec;
+    vz->c_fwrite = c_fwrite;
+    vz->c_fhandle = c_fhandle;
+    return(vz);
+#else
+    fprintf(stderr, "snebu was built without zstd support\n");
+    exit(1);
+#endif
+}
+
+size_t vault_zstd_write(void *buf, size_t sz, size_t count, struct vault_zstd *vz)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_inBuffer in = { buf, sz * count, 0 };
+
+    vault_zstd_compress(vz, &in, ZSTD_e_continue);
+#endif
+    return(count);
+}
+
+// End the frame, and put the compressor back for the next object
+int vault_zstd_finalize_w(struct vault_zstd *vz)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+
+    vault_zstd_compress(vz, &in, ZSTD_e_end);
+    ZSTD_CCtx_reset(vz->cctx, ZSTD_reset_session_only);
+    pthread_mutex_lock(&(vz->codec->lock));
+    vz->next = vz->codec->writers;
+    vz->codec->writers = vz;
+    pthread_mutex_unlock(&(vz->codec->lock));
+#endif
+    return(0);
+}
+
+/* Open a zstd object for reading through c_fread.  The dictionary, if
+ * the frame was made with one, is found by the id in its header.
+ * Reading stops at the end of the frame, so the stream may go on past
+ * it, as in a pack.
+ */
+struct vault_zstd *vault_zstd_init_r(sqlite3 *db, size_t (*c_fread)(), void *c_handle)
+{
+#ifdef HAVE_ZSTD
+    struct vault_zstd *vz;
+    ZSTD_DDict *ddict;
+    unsigned int dictid;
+
+    pthread_mutex_lock(&vault_zstd_lock);
+    if ((vz = vault_zstd_readers) != NULL)
+	vault_zstd_readers = vz->next;
+    pthread_mutex_unlock(&vault_zstd_lock);
+    if (vz == NULL) {
+	vz = malloc(sizeof(struct vault_zstd));
+	vz->cctx = NULL;
+	vz->dctx = ZSTD_createDCtx();
+	vz->bufsize = ZSTD_DStreamInSize();
+	vz->buf = malloc(vz->bufsize);
+    }
+    vz->c_fread = c_fread;
+    vz->c_handle = c_handle;
+    vz->eof = 0;
+    vz->error = 0;
+    vz->flushed = 1;
+    vz->in.src = vz->buf;
+    vz->in.size = c_fread(vz->buf, 1, vz->bufsize, c_handle);
+    vz->in.pos = 0;
+    if ((dictid = ZSTD_getDictID_fromFrame(vz->buf, vz->in.size)) != 0) {
+	if ((ddict = vault_ddict(db, dictid)) == NULL) {
+	    fprintf(stderr, "zstd dictionary %u is missing from the catalog\n", dictid);
+	    vz->error = 1;
+	}
+	else
+	    ZSTD_DCtx_refDDict(vz->dctx, ddict);
+    }
+    return(vz);
+#else
+    fprintf(stderr, "Object is zstd compressed, and snebu was built without zstd support\n");
+    exit(1);
+#endif
+}
+
+size_t vault_zstd_read(void *buf, size_t sz, size_t count, struct vault_zstd *vz)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_outBuffer out = { buf, sz * count, 0 };
+    size_t r;
+
+    while (out.pos < out.size && vz->eof == 0 && vz->error == 0) {
+	// Only read more once the decoder has nothing left to give
+	if (vz->in.pos == vz->in.size && vz->flushed == 1) {
+	    vz->in.size = vz->c_fread(vz->buf, 1, vz->bufsize, vz->c_handle);
+	    vz->in.pos = 0;
+	    if (vz->in.size == 0) {
+		fprintf(stderr, "zstd object is truncated\n");
+		vz->error = 1;
+		break;
+	    }
+	}
+	r = ZSTD_decompressStream(vz->dctx, &out, &(vz->in));
+	if (ZSTD_isError(r)) {
+	    fprintf(stderr, "zstd decompression error: %s\n", ZSTD_getErrorName(r));
+	    vz->error = 1;
+	}
+	else if (r == 0)
+	    vz->eof = 1;
+	vz->flushed = out.pos < out.size;
+    }
+    return(out.pos);
+#else
+    return(0);
+#endif
+}
+
+int vault_zstd_finalize_r(struct vault_zstd *vz)
+{
+    int error = 0;
+
+#ifdef HAVE_ZSTD
+    error = vz->error;
+    ZSTD_DCtx_reset(vz->dctx, ZSTD_reset_session_and_parameters);
+    pthread_mutex_lock(&vault_zstd_lock);
+    vz->next = vault_zstd_readers;
+    vault_zstd_readers = vz;
+    pthread_mutex_unlock(&vault_zstd_lock);
+#endif
+    return(error);
+}
+
+// c_fread over an object's file, or its part of a pack
+static size_t vault_object_fread(void *buf, size_t sz, size_t count, struct vault_object *vo)
+{
+    size_t n = sz * count < vo->remaining ? sz * count : vo->remaining;
+
+    n = fread(buf, 1, n, vo->f);
+    vo->remaining -= n;
+    return(n);
+}
+
+/* Open a stored object, of the given diskfiles format, for reading
+ * back the data it holds.  Returns NULL if it is missing.
+ */
+struct vault_object *vault_object_open_r(sqlite3 *db, char *hash, char *format)
+{
+    struct vault_object *vo;
+    char path[1024];
+    struct stat st;
+
+    vo = malloc(sizeof(struct vault_object));
+    vo->f = NULL;
+    vo->lzf = NULL;
+    vo->vz = NULL;
+    vo->vc = NULL;
+    if (strcmp(format, "chunked") == 0) {
+	vo->vc = vault_chunks_open_r(db, hash);
+	return(vo);
+    }
+    snprintf(path, sizeof(path), "%s/%.2s/%s.%s", config.vault, hash, hash + 2,
+	strcmp(format, "raw") == 0 || strcmp(format, "zst") == 0 ? format : "lzo");
+    if ((vo->f = fopen(path, "r")) != NULL && fstat(fileno(vo->f), &st) == 0)
+	vo->remaining = st.st_size;
+    else if (vo->f != NULL || (vo->f = vault_pack_open_r(db, hash, &(vo->remaining))) == NULL) {
+	if (vo->f != NULL)
+	    fclose(vo->f);
+	free(vo);
+	return(NULL);
+    }
+    if (strcmp(format, "zst") == 0)
+	vo->vz = vault_zstd_init_r(db, vault_object_fread, vo);
+    else if (strcmp(format, "raw") != 0)
+	vo->lzf = lzop_init_r(vault_object_fread, vo);
+    return(vo);
+}
+
+size_t vault_object_read(void *buf, size_t sz, size_t count, struct vault_object *vo)
+{
+    if (vo->vc != NULL)
+	return(vault_chunks_read(buf, sz, count, vo->vc));
+    if (vo->vz != NULL)
+	return(vault_zstd_read(buf, sz, count, vo->vz));
+    if (vo->lzf != NULL)
+	return(lzop_read(buf, sz, count, vo->lzf));
+    return(vault_object_fread(buf, sz, count, vo));
+}
+
+// Returns nonzero if the object turned out to be damaged
+int vault_object_close(struct vault_object *vo)
+{
+    int error = 0;
+
+    if (vo->vc != NULL)
+	error = vault_chunks_close(vo->vc);
+    if (vo->vz != NULL)
+	error = vault_zstd_finalize_r(vo->vz);
+    if (vo->lzf != NULL) {
+	error = vo->lzf->error;
+	lzop_finalize_r(vo->lzf);
+    }
+    if (vo->f != NULL)
+	fclose(vo->f);
+    free(vo);
+    return(error);
+}
+
+/* Rewrite packs that are mostly dead space, or too small to be worth
+ * keeping on their own, copying the live objects into new packs.
+ * Small packs are left alone unless there are at least two besides the
+ * newest, which may be the one the last compaction wrote, so that a
+ * merge always leaves fewer packs.  Skipped while any backup or restore
+ * holds the pack lock.
+ */
+int vault_compact(sqlite3 *db, int verbose)
+{
+    sqlite3_stmt *packs;
+    sqlite3_stmt *objects;
+    sqlite3_stmt *move;
+    char packpath[1024];
+    struct stat tmpfstat;
+    int *oldpacks = NULL;
+    int *small = NULL;
+    int noldpacks = 0;
+    int nsmall = 0;
+    int tail = 0;
+    int newpack = 0;
+    int newfd = -1;
+    unsigned long long int newend = 0;
+    unsigned long long int reclaimed = 0;
+    unsigned long long int smallreclaimed = 0;
+    char *buf = NULL;
+    char *sqlerr = 0;
+
+    snprintf(packpath, 1024, "%s/packs", config.vault);
+    if (stat(packpath, &tmpfstat) != 0)
+	return(0);
+    if (vault_lock(LOCK_EX | LOCK_NB) != 0) {
+	if (verbose > 0)
+	    fprintf(stderr, "Backups or restores in progress, not compacting packs\n");
+	return(0);
+    }
+
+    // Pick the packs to rewrite
+    sqlite3_prepare_v2(db, "select max(pack) from packs", -1, &packs, 0);
+    if (sqlite3_step(packs) == SQLITE_ROW)
+	tail = sqlite3_column_int(packs, 0);
+    sqlite3_finalize(packs);
+    sqlite3_prepare_v2(db,
+	"select p.pack, coalesce(sum(o.length), 0) from packs p "
+	"left join packed_objects o on o.pack = p.pack and o.dead = 0 "
+	"group by p.pack order by p.pack", -1, &packs, 0);
+    while (sqlite3_step(packs) == SQLITE_ROW) {
+	int pack = sqlite3_column_int(packs, 0);
+	unsigned long long int live = sqlite3_column_int64(packs, 1);
+	unsigned long long int size = 0;
+	int wasteful;
+
+	vault_pack_path(pack, packpath);
+	if (stat(packpath, &tmpfstat) == 0)
+	    size = tmpfstat.st_size;
+	if (size < live) {
+	    fprintf(stderr, "Pack %s is missing objects, not compacting it\n", packpath);
+	    continue;
+	}
+	wasteful = live == 0 || size - live > size / 4;
+	if (wasteful == 1 || (size < VAULT_PACKSIZE / 4 && pack != tail)) {
+	    oldpacks = realloc(oldpacks, sizeof(int) * (noldpacks + 1));
+	    small = realloc(small, sizeof(int) * (noldpacks + 1));
+	    small[noldpacks] = wasteful == 0;
+	    oldpacks[noldpacks++] = pack;
+	    if (wasteful == 0) {
+		nsmall++;
+		smallreclaimed += size - live;
+	    }
+	    else
+		reclaimed += size - live;
+	}
+    }
+    sqlite3_finalize(packs);
+    // A single small pack has nothing to merge with
+    if (nsmall == 1) {
+	int n = 0;
+
+	for (int i = 0; i < noldpacks; i++)
+	    if (small[i] == 0)
+		oldpacks[n++] = oldpacks[i];
+	noldpacks = n;
+    }
+    else
+	reclaimed += smallreclaimed;
+    free(small);
+    if (noldpacks == 0) {
+	free(oldpacks);
+	vault_lock(LOCK_UN);
+	return(0);
+    }
+
+    // Copy live objects out, oldest pack first
+    sqlite3_exec(db,
+	"create temporary table if not exists pack_moves ( \n"
+	"    hash	char primary key, \n"
+	"    pack	integer, \n"
+	"    offset	integer)", 0, 0, &sqlerr);
+    if (sqlerr != 0) {
+	fprintf(stderr, "%s\n", sqlerr);
+	sqlite3_free(sqlerr);
+	exit(1);
+    }
+    sqlite3_exec(db, "delete from pack_moves", 0, 0, 0);
+    sqlite3_prepare_v2(db,
+	"select hash, offset, length from packed_objects "
+	"where pack = ? and dead = 0 order by offset", -1, &objects, 0);
+    sqlite3_prepare_v2(db,
+	"insert into pack_moves (hash, pack, offset) values (?, ?, ?)", -1, &move, 0);
+    for (int i = 0; i < noldpacks; i++) {
+	FILE *f;
+
+	vault_pack_path(oldpacks[i], packpath);
+	f = fopen(packpath, "r");
+	sqlite3_bind_int(objects, 1, oldpacks[i]);
+	while (sqlite3_step(objects) == SQLITE_ROW) {
+	    size_t len = sqlite3_column_int64(objects, 2);
+
+	    if (f == NULL || fseeko(f, sqlite3_column_int64(objects, 1), SEEK_SET) != 0) {
+		fprintf(stderr, "Error reading pack %d, aborting compaction\n", oldpacks[i]);
+		exit(1);
+	    }
+	    if (dmalloc_size(buf) < len)
+		buf = drealloc(buf, len);
+	    if (fread(buf, 1, len, f) != len) {
+		fprintf(stderr, "Error reading pack %d, aborting compaction\n", oldpacks[i]);
+		exit(1);
+	    }
+	    if (newfd < 0 || newend + len > VAULT_PACKSIZE) {
+		if (newfd >= 0 && (fsync(newfd) != 0 || close(newfd) != 0)) {
+		    fprintf(stderr, "Error writing pack %d, aborting compaction\n", newpack);
+		    exit(1);
+		}
+		newpack = vault_pack_new(db, &newfd);
+		newend = 0;
+	    }
+	    if (vault_write(newfd, buf, len, newend) != 0) {
+		fprintf(stderr, "Error writing pack %d, aborting compaction\n", newpack);
+		exit(1);
+	    }
+	    sqlite3_bind_text(move, 1, (char *) sqlite3_column_text(objects, 0), -1, SQLITE_TRANSIENT);
+	    sqlite3_bind_int(move, 2, newpack);
+	    sqlite3_bind_int64(move, 3, newend);
+	    sqlite3_step(move);
+	    sqlite3_reset(move);
+	    newend += len;
+	}
+	sqlite3_reset(objects);
+	if (f != NULL)
+	    fclose(f);
+    }
+    sqlite3_finalize(objects);
+    sqlite3_finalize(move);
+    dfree(buf);
+    // The new packs must be on disk before the old ones go away
+    if (newfd >= 0 && (fsync(newfd) != 0 || close(newfd) != 0)) {
+	fprintf(stderr, "Error writing pack %d, aborting compaction\n", newpack);
+	exit(1);
+    }
+
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    sqlite3_exec(db,
+	"update packed_objects set "
+	"pack = (select m.pack from pack_moves m where m.hash = packed_objects.hash), "
+	"offset = (select m.offset from pack_moves m where m.hash = packed_objects.hash) "
+	"where hash in (select hash from pack_moves)", 0, 0, &sqlerr);
+    if (sqlerr != 0) {
+	fprintf(stderr, "%s\n", sqlerr);
+	sqlite3_free(sqlerr);
+	exit(1);
+    }
+    for (int i = 0; i < noldpacks; i++) {
+	char *sqlstmt;
+
+	sqlite3_exec(db, (sqlstmt = sqlite3_mprintf(
+	    "delete from packed_objects where pack = %d; "
+	    "delete from packs where pack = %d", oldpacks[i], oldpacks[i])),
+	    0, 0, &sqlerr);
+	if (sqlerr != 0) {
+	    fprintf(stderr, "%s\n", sqlerr);
+	    sqlite3_free(sqlerr);
+	    exit(1);
+	}
+	sqlite3_free(sqlstmt);
+    }
+    sqlite3_exec(db, "delete from pack_moves", 0, 0, 0);
+    sqlite3_exec(db, "END", 0, 0, 0);
+    for (int i = 0; i < noldpacks; i++) {
+	vault_pack_path(oldpacks[i], packpath);
+	unlink(packpath);
+    }
+    if (verbose > 0)
+	fprintf(stderr, "Compacted %d packs, reclaimed %llu bytes\n", noldpacks, reclaimed);
+    free(oldpacks);
+    vault_lock(LOCK_UN);
+    return(0);
+}
+
+/* Take or drop the lock that keeps compaction away from packs in use,
+ * and recompress from removing replaced object files.
+ * op is LOCK_SH, LOCK_EX (optionally with LOCK_NB) or LOCK_UN.
+ */
+int vault_lock(int op)
+{
+    char lockpath[1024];
+
+    if (op == LOCK_UN) {
+	if (vault_lockfd >= 0)
+	    close(vault_lockfd);
+	vault_lockfd = -1;
+	return(0);
+    }
+    if (vault_lockfd < 0) {
+	snprintf(lockpath, 1024, "%s/packs", config.vault);
+	if (mkdir(lockpath, 0770) != 0 && errno != EEXIST) {
+	    fprintf(stderr, "Error creating directory %s\n", lockpath);
+	    return(1);
+	}
+	snprintf(lockpath, 1024, "%s/packs/lock", config.vault);
+	if ((vault_lockfd = open(lockpath, O_RDWR | O_CREAT, 0600)) < 0) {
+	    fprintf(stderr, "Error opening %s\n", lockpath);
+	    return(1);
+	}
+    }
+    if (flock(vault_lockfd, op) != 0) {
+	close(vault_lockfd);
+	vault_lockfd = -1;
+	return(1);
+    }
+    return(0);
+}
+
+void vault_pack_path(int pack, char *path)
+{
+    snprintf(path, 1024, "%s/packs/%08d.pack", config.vault, pack);
+}
+
+// Allocate a pack number and create its file
+int vault_pack_new(sqlite3 *db, int *fd)
+{
+    char packpath[1024];
+    char *sqlerr = 0;
+    int pack;
+
+    sqlite3_exec(db, "insert into packs (created) values (strftime('%s', 'now'))",
+	0, 0, &sqlerr);
+    if (sqlerr != 0) {
+	fprintf(stderr, "%s\n", sqlerr);
+	sqlite3_free(sqlerr);
+	exit(1);
+    }
+    pack = sqlite3_last_insert_rowid(db);
+    vault_pack_path(pack, packpath);
+    // Any file already there was left behind by an interrupted compaction
+    if ((*fd = open(packpath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+	fprintf(stderr, "Error creating pack %s\n", packpath);
+	exit(1);
+    }
+    return(pack);
+}
+
+int vault_write(int fd, char *buf, size_t len, unsigned long long int offset)
+{
+    ssize_t c;
+
+    while (len > 0) {
+	if ((c = pwrite(fd, buf, len, offset)) <= 0) {
+	    if (c < 0 && errno == EINTR)
+		continue;
+	    return(1);
+	}
+	buf += c;
+	len -= c;
+	offset += c;
+    }
+    return(0);
+}
+
+// Slot for hash in the table of objects packed this session
+size_t vault_hslot(struct vault_packer *vp, char *hash)
+{
+    size_t i = strtoul(strlen(hash) > 8 ? hash + strlen(hash) - 8 : hash, 0, 16) % vp->nslots;
+
+    while (vp->packed[i] != NULL && strcmp(vp->packed[i], hash) != 0)
+	i = (i + 1) % vp->nslots;
+    return(i);
+}
+
+void vault_hadd(struct vault_packer *vp, char *hash)
+{
+    if ((vp->npacked + 1) * 2 > vp->nslots) {
+	char **old = vp->packed;
+	size_t nold = vp->nslots;
+
+	vp->nslots *= 2;
+	vp->packed = calloc(vp->nslots, sizeof(char *));
+	for (size_t i = 0; i < nold; i++)
+	    if (old[i] != NULL)
+		vp->packed[vault_hslot(vp, old[i])] = old[i];
+	free(old);
+    }
+    strncpya0(&(vp->packed[vault_hslot(vp, hash)]), hash, 0);
+    vp->npacked++;
+}
+
+#ifdef HAVE_IO_URING
+/* Set up a ring, or return NULL if the kernel lacks io_uring or any of
+ * the requests used here, in which case the caller writes objects
+ * synchronously.
+ */
+struct vault_uring *vault_uring_init()
+{
+    struct vault_uring *vu;
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    int fd;
+    int ops[] = { IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_RENAMEAT };
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, VAULT_URING_ENTRIES, &p)) < 0)
+	return(NULL);
+    probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+	free(probe);
+	close(fd);
+	return(NULL);
+    }
+    for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+	if (ops[i] > probe->last_op || (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0) {
+	    free(probe);
+	    close(fd);
+	    return(NULL);
+	}
+    }
+    free(probe);
+
+    vu = malloc(sizeof(struct vault_uring));
+    vu->fd = fd;
+    vu->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    vu->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (vu->cqringsz > vu->sqringsz)
+	    vu->sqringsz = vu->cqringsz;
+	vu->cqringsz = 0;
+    }
+    vu->sqring = mmap(0, vu->sqringsz, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (vu->cqringsz > 0)
+	vu->cqring = mmap(0, vu->cqringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    else
+	vu->cqring = vu->sqring;
+    vu->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+    vu->sqes = mmap(0, vu->sqesz, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (vu->sqring == MAP_FAILED || vu->cqring == MAP_FAILED || vu->sqes == MAP_FAILED) {
+	fprintf(stderr, "Error mapping io_uring, aborting\n");
+	exit(1);
+    }
+    vu->sqhead = vu->sqring + p.sq_off.head;
+    vu->sqtail = vu->sqring + p.sq_off.tail;
+    vu->sqmask = vu->sqring + p.sq_off.ring_mask;
+    vu->sqarray = vu->sqring + p.sq_off.array;
+    vu->cqhead = vu->cqring + p.cq_off.head;
+    vu->cqtail = vu->cqring + p.cq_off.tail;
+    vu->cqmask = vu->cqring + p.cq_off.ring_mask;
+    vu->cqes = vu->cqring + p.cq_off.cqes;
+    pthread_mutex_init(&(vu->lock), NULL);
+    pthread_cond_init(&(vu->room), NULL);
+    vu->inflight = 0;
+    if (pthread_create(&(vu->reaper), NULL, vault_uring_reaper, vu) != 0) {
+	fprintf(stderr, "Error starting io_uring thread\n");
+	exit(1);
+    }
+    return(vu);
+}
+
+static struct io_uring_sqe *vault_uring_sqe(struct vault_uring *vu, unsigned *tail)
+{
+    unsigned idx = *tail & *(vu->sqmask);
+    struct io_uring_sqe *sqe = &(vu->sqes[idx]);
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    vu->sqarray[idx] = idx;
+    (*tail)++;
+    return(sqe);
+}
+
+static void vault_uring_submit(struct vault_uring *vu, unsigned tail, int n)
+{
+    int c;
+
+    __atomic_store_n(vu->sqtail, tail, __ATOMIC_RELEASE);
+    while (n > 0) {
+	if ((c = syscall(__NR_io_uring_enter, vu->fd, n, 0, 0, NULL, 0)) < 0) {
+	    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+		continue;
+	    fprintf(stderr, "Error submitting to io_uring: %s, aborting\n", strerror(errno));
+	    exit(1);
+	}
+	n -= c;
+    }
+}
+
+/* Write buf to the temp file open on fd, close it and rename it to
+ * targetpath, then call done(arg).  Takes over buf, and may block
+ * while too many commits are in flight.
+ */
+void vault_uring_commit(struct vault_uring *vu, char *buf, size_t len, int fd,
+    char *tmpfilepath, char *targetpath, void (*done)(void *arg), void *arg)
+{
+    struct vault_ucommit *uc;
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+
+    uc = malloc(sizeof(struct vault_ucommit));
+    uc->buf = buf;
+    strcpy(uc->tmpfilepath, tmpfilepath);
+    strcpy(uc->targetpath, targetpath);
+    uc->pending = 3;
+    uc->done = done;
+    uc->arg = arg;
+
+    pthread_mutex_lock(&(vu->lock));
+    while (vu->inflight >= VAULT_URING_INFLIGHT)
+	pthread_cond_wait(&(vu->room), &(vu->lock));
+    vu->inflight++;
+    tail = *(vu->sqtail);
+    sqe = vault_uring_sqe(vu, &tail);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) uc->buf;
+    sqe->len = len;
+    sqe->off = 0;
+    sqe->user_data = (unsigned long) uc;
+    sqe = vault_uring_sqe(vu, &tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long) uc;
+    sqe = vault_uring_sqe(vu, &tail);
+    sqe->opcode = IORING_OP_RENAMEAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) uc->tmpfilepath;
+    sqe->len = AT_FDCWD;
+    sqe->off = (unsigned long) uc->targetpath;
+    sqe->user_data = (unsigned long) uc;
+    vault_uring_submit(vu, tail, 3);
+    pthread_mutex_unlock(&(vu->lock));
+}
+
+void *vault_uring_reaper(void *arg)
+{
+    struct vault_uring *vu = arg;
+    struct io_uring_cqe *cqe;
+    struct vault_ucommit *uc;
+    unsigned head;
+    int res;
+
+    while (1) {
+	head = *(vu->cqhead);
+	if (head == __atomic_load_n(vu->cqtail, __ATOMIC_ACQUIRE)) {
+	    syscall(__NR_io_uring_enter, vu->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	    continue;
+	}
+	cqe = &(vu->cqes[head & *(vu->cqmask)]);
+	uc = (struct vault_ucommit *) (unsigned long) cqe->user_data;
+	res = cqe->res;
+	__atomic_store_n(vu->cqhead, head + 1, __ATOMIC_RELEASE);
+	if (uc == NULL)
+	    break;
+	// Taking the lock orders us after the submitter's setup of uc,
+	// which thread checkers can't see through the kernel
+	pthread_mutex_lock(&(vu->lock));
+	// A failed write or close cancels the rest of the chain
+	if (res < 0) {
+	    fprintf(stderr, "Error storing %s: %s, aborting\n", uc->targetpath, strerror(-res));
+	    exit(1);
+	}
+	if (--(uc->pending) > 0) {
+	    pthread_mutex_unlock(&(vu->lock));
+	    continue;
+	}
+	vu->inflight--;
+	pthread_cond_signal(&(vu->room));
+	pthread_mutex_unlock(&(vu->lock));
+	dfree(uc->buf);
+	uc->done(uc->arg);
+	free(uc);
+    }
+    return(NULL);
+}
+
+// Wait for commits in flight, then stop the reaper and tear down
+void vault_uring_free(struct vault_uring *vu)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+
+    if (vu == NULL)
+	return;
+    pthread_mutex_lock(&(vu->lock));
+    while (vu->inflight > 0)
+	pthread_cond_wait(&(vu->room), &(vu->lock));
+    tail = *(vu->sqtail);
+    sqe = vault_uring_sqe(vu, &tail);
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = 0;
+    vault_uring_submit(vu, tail, 1);
+    pthread_mutex_unlock(&(vu->lock));
+    pthread_join(vu->reaper, NULL);
+    munmap(vu->sqes, vu->sqesz);
+    if (vu->cqring != vu->sqring)
+	munmap(vu->cqring, vu->cqringsz);
+    munmap(vu->sqring, vu->sqringsz);
+    close(vu->fd);
+    pthread_mutex_destroy(&(vu->lock));
+    pthread_cond_destroy(&(vu->room));
+    free(vu);
+}
+#else
+struct vault_uring *vault_uring_init()
+{
+    return(NULL);
+}
+
+void vault_uring_commit(struct vault_uring *vu, char *buf, size_t len, int fd,
+    char *tmpfilepath, char *targetpath, void (*done)(void *arg), void *arg)
+{
+}
+
+void vault_uring_free(struct vault_uring *vu)
+{
+}
+#endif
+
+/* Name (without extension) of the partial object for one version of a
+ * file in a backup set.
+ */
+void vault_partial_path(char *bkname, char *filename, unsigned long long int size,
+    long long int modtime, char *path)
+{
+    char *key;
+    unsigned char *hash;
+
+    key = sqlite3_mprintf("%s\n%llu\n%lld\n%s", bkname, size, modtime, filename);
+    hash = sha256_hex(key);
+    snprintf(path, 1024, "%s/partial/%s", config.vault, hash);
+    free(hash);
+    sqlite3_free(key);
+}
+
+/* How many bytes of the file the partial object at path holds, counting
+ * only whole lzop blocks, and which kind of object it is.  Returns 0 if
+ * there is nothing to resume from.  The blocks are only walked here,
+ * not decompressed; submitfiles checks them as it reads them back.
+ */
+unsigned long long int vault_partial_offset(char *path, char **ext)
+{
+    char partpath[1024];
+    struct stat st;
+    FILE *f;
+    uint32_t blockhdr[3];
+    unsigned long long int pos;
+    unsigned long long int offset = 0;
+
+    snprintf(partpath, 1024, "%s.raw", path);
+    if (stat(partpath, &st) == 0) {
+	*ext = "raw";
+	return(st.st_size);
+    }
+    snprintf(partpath, 1024, "%s.lzo", path);
+    if ((f = fopen(partpath, "r")) == NULL)
+	return(0);
+    *ext = "lzo";
+    if (fstat(fileno(f), &st) != 0 || fseeko(f, VAULT_LZOP_HDRSIZE, SEEK_SET) != 0) {
+	fclose(f);
+	return(0);
+    }
+    pos = VAULT_LZOP_HDRSIZE;
+    // A partial never has its short last block written, so whole blocks are full ones
+    while (fread(blockhdr, 4, 3, f) == 3) {
+	if (ntohl(blockhdr[0]) != 256 * 1024 || ntohl(blockhdr[1]) > 256 * 1024 ||
+	    pos + 12 + ntohl(blockhdr[1]) > st.st_size)
+	    break;
+	pos += 12 + ntohl(blockhdr[1]);
+	offset += 256 * 1024;
+	if (fseeko(f, pos, SEEK_SET) != 0)
+	    break;
+    }
+    fclose(f);
+    return(offset);
+}
+
+// Remove partial objects that haven't been written to for a while
+int vault_partial_expire(int verbose)
+{
+    char partdir[1024];
+    char partpath[1024 + 256];
+    DIR *dir;
+    struct dirent *d;
+    struct stat st;
+    time_t cutoff = time(NULL) - VAULT_PARTIAL_DAYS * 86400;
+    int removed = 0;
+
+    snprintf(partdir, 1024, "%s/partial", config.vault);
+    if ((dir = opendir(partdir)) == NULL)
+	return(0);
+    while ((d = readdir(dir)) != NULL) {
+	if (d->d_name[0] == '.')
+	    continue;
+	snprintf(partpath, sizeof(partpath), "%s/%s", partdir, d->d_name);
+	if (stat(partpath, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime < cutoff &&
+	    unlink(partpath) == 0)
+	    removed++;
+    }
+    closedir(dir);
+    if (verbose > 0 && removed > 0)
+	fprintf(stderr, "Removed %d abandoned partial files\n", removed);
+    return(removed);
+}
+
+static void vault_filter_path(char *path)
+{
+    snprintf(path, 1024, "%s/snebu-presence.filter", config.meta);
+}
+
+// Map the presence filter, or return NULL if there isn't a usable one
+struct vault_filter *vault_filter_open()
+{
+    struct vault_filter *vf;
+    char path[1024];
+    struct stat st;
+    void *map;
+    int fd;
+
+    vault_filter_path(path);
+    if ((fd = open(path, O_RDWR)) < 0)
+	return(NULL);
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct vault_filter_hdr) ||
+	(map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return(NULL);
+    }
+    close(fd);
+    vf = malloc(sizeof(struct vault_filter));
+    vf->hdr = map;
+    vf->blocks = map + sizeof(struct vault_filter_hdr);
+    vf->len = st.st_size;
+    if (memcmp(vf->hdr->magic, VAULT_FILTER_MAGIC, 8) != 0 || vf->hdr->nblocks == 0 ||
+	st.st_size != sizeof(struct vault_filter_hdr) + vf->hdr->nblocks * 64) {
+	vault_filter_close(vf);
+	return(NULL);
+    }
+    return(vf);
+}
+
+void vault_filter_close(struct vault_filter *vf)
+{
+    if (vf == NULL)
+	return;
+    munmap(vf->hdr, vf->len);
+    free(vf);
+}
+
+/* Object names are hex hashes, so their bits are used as they are: the
+ * first 64 pick the block, and the next 48 a bit in each of its words.
+ * Returns 1 for names too short to use.
+ */
+static int vault_filter_key(char *hash, uint64_t *h1, uint64_t *h2)
+{
+    char hex[17];
+
+    if (strlen(hash) < 32)
+	return(1);
+    memcpy(hex, hash, 16);
+    hex[16] = '\0';
+    *h1 = strtoull(hex, NULL, 16);
+    memcpy(hex, hash + 16, 16);
+    *h2 = strtoull(hex, NULL, 16);
+    return(0);
+}
+
+// Returns 0 if the object is certainly not in the vault
+int vault_filter_maybe(struct vault_filter *vf, char *hash)
+{
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t *block;
+
+    if (vf == NULL || vault_filter_key(hash, &h1, &h2) != 0)
+	return(1);
+    block = vf->blocks + (h1 % vf->hdr->nblocks) * 8;
+    for (int i = 0; i < 8; i++)
+	if ((__atomic_load_n(&(block[i]), __ATOMIC_RELAXED) & (1ULL << ((h2 >> (i * 6)) & 63))) == 0)
+	    return(0);
+    return(1);
+}
+
+void vault_filter_add(struct vault_filter *vf, char *hash)
+{
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t *block;
+    uint64_t bit;
+    int added = 0;
+
+    if (vf == NULL || vault_filter_key(hash, &h1, &h2) != 0)
+	return;
+    block = vf->blocks + (h1 % vf->hdr->nblocks) * 8;
+    for (int i = 0; i < 8; i++) {
+	bit = 1ULL << ((h2 >> (i * 6)) & 63);
+	if ((__atomic_fetch_or(&(block[i]), bit, __ATOMIC_RELAXED) & bit) == 0)
+	    added = 1;
+    }
+    if (added == 1)
+	__atomic_add_fetch(&(vf->hdr->count), 1, __ATOMIC_RELAXED);
+}
+
+/* Build a new filter from diskfiles, with room for twice the objects
+ * there are now, and move it into place.  Sessions that still have the
+ * old one mapped only miss out on each other's additions.
+ */
+int vault_filter_build(sqlite3 *db, int verbose)
+{
+    struct vault_filter vf;
+    sqlite3_stmt *sqlres;
+    char *sqlstmt;
+    char path[1024];
+    char tmppath[1024 + 16];
+    uint64_t nblocks = VAULT_FILTER_MINBLOCKS;
+    void *map;
+    int fd;
+
+    if (verbose > 0)
+	fprintf(stderr, "Building vault presence filter\n");
+    sqlite3_prepare_v2(db, "select count(*) from diskfiles", -1, &sqlres, 0);
+    if (sqlite3_step(sqlres) == SQLITE_ROW &&
+	sqlite3_column_int64(sqlres, 0) * 2 * VAULT_FILTER_BITS / 512 > nblocks)
+	nblocks = sqlite3_column_int64(sqlres, 0) * 2 * VAULT_FILTER_BITS / 512;
+    sqlite3_finalize(sqlres);
+    vault_filter_path(path);
+    snprintf(tmppath, sizeof(tmppath), "%s.%d", path, (int) getpid());
+    vf.len = sizeof(struct vault_filter_hdr) + nblocks * 64;
+    if ((fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0660)) < 0)
+	return(1);
+    if (ftruncate(fd, vf.len) != 0 ||
+	(map = mmap(NULL, vf.len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	unlink(tmppath);
+	return(1);
+    }
+    close(fd);
+    vf.hdr = map;
+    vf.blocks = map + sizeof(struct vault_filter_hdr);
+    vf.hdr->nblocks = nblocks;
+    sqlite3_prepare_v2(db, (sqlstmt = sqlite3_mprintf("select %s from diskfiles", SHN)),
+	-1, &sqlres, 0);
+    sqlite3_free(sqlstmt);
+    while (sqlite3_step(sqlres) == SQLITE_ROW)
+	if (sqlite3_column_type(sqlres, 0) == SQLITE_TEXT)
+	    vault_filter_add(&vf, (char *) sqlite3_column_text(sqlres, 0));
+    sqlite3_finalize(sqlres);
+    // The magic goes in last, so a half built filter is never used
+    memcpy(vf.hdr->magic, VAULT_FILTER_MAGIC, 8);
+    if (msync(map, vf.len, MS_SYNC) != 0 || rename(tmppath, path) != 0) {
+	munmap(map, vf.len);
+	unlink(tmppath);
+	return(1);
+    }
+    munmap(map, vf.len);
+    return(0);
+}
+
+// Make sure there is a filter with room to spare before a backup starts
+int vault_filter_prepare(sqlite3 *db, int verbose)
+{
+    struct vault_filter *vf;
+    int rebuild;
+
+    vf = vault_filter_open();
+    rebuild = vf == NULL || vf->hdr->count > vf->hdr->nblocks * 512 / VAULT_FILTER_BITS;
+    vault_filter_close(vf);
+    if (rebuild == 1 && vault_filter_build(db, verbose) != 0) {
+	fprintf(stderr, "Error building vault presence filter, continuing without it\n");
+	return(1);
+    }
+    return(0);
+}
+
+/* Note objects removed by purge.  Once a quarter of what the filter
+ * holds is gone, it is rebuilt to shed them.
+ */
+int vault_filter_purged(sqlite3 *db, unsigned long long int n, int verbose)
+{
+    struct vault_filter *vf;
+    int rebuild;
+
+    if ((vf = vault_filter_open()) == NULL)
+	return(0);
+    __atomic_add_fetch(&(vf->hdr->removed), n, __ATOMIC_RELAXED);
+    rebuild = vf->hdr->removed * 4 > vf->hdr->count;
+    vault_filter_close(vf);
+    if (rebuild == 1)
+	return(vault_filter_build(db, verbose));
+    return(0);
+}
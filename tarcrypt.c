@@ -53,6 +53,12 @@ int main(int argc, char **argv)
 	else if (strcmp(argv[1], "decrypt") == 0) {
 	    tardecrypt(argc - 1, argv + 1);
 	}
+	else if (strcmp(argv[1], "compress") == 0) {
+	    tarcompress(argc - 1, argv + 1);
+	}
+	else if (strcmp(argv[1], "resume") == 0) {
+	    tarresume(argc - 1, argv + 1);
+	}
 	else if (strcmp(argv[1], "genkey") == 0) {
 	    genkey(argc - 1, argv + 1);
 	}
@@ -472,6 +478,242 @@ int tarencrypt(int argc, char **argv)
     return(0);
 }
 
+/* Compress regular file bodies into lzop streams, in the same format
+ * the vault stores them in, so submitfiles can store them as sent.
+ * Each body goes through a temp file first, as its compressed size is
+ * needed for the header.
+ */
+int tarcompress(int argc, char **argv)
+{
+    struct filespec fs;
+    struct filespec fs2;
+    size_t bufsize = 256 * 1024;
+    char *databuf;
+    char padblock[512];
+    char tmpstr[64];
+    size_t sizeremaining;
+    size_t padding;
+    size_t c;
+    char *paxdata;
+    int paxdatalen;
+    struct lzop_file *lzf;
+    FILE *tmpf = NULL;
+    long csize;
+
+    fsinit(&fs);
+    fsinit(&fs2);
+    databuf = malloc(bufsize);
+    memset(padblock, 0, 512);
+    while (tar_get_next_hdr(&fs)) {
+	if (fs.ftype == '0' && fs.filesize > 0 && fs.n_sparsedata == 0 &&
+	    getpaxvar(fs.xheader, fs.xheaderlen, "TC.compression", &paxdata, &paxdatalen) != 0 &&
+	    getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) != 0) {
+	    if (tmpf == NULL && (tmpf = tmpfile()) == NULL) {
+		fprintf(stderr, "Error creating temp file\n");
+		exit(1);
+	    }
+	    rewind(tmpf);
+	    lzf = lzop_init_w(fwrite, tmpf);
+	    sizeremaining = fs.filesize;
+	    padding = 512 - ((fs.filesize - 1) % 512 + 1);
+	    while (sizeremaining > 0) {
+		c = fread(databuf, 1, sizeremaining < bufsize ? sizeremaining : bufsize, stdin);
+		if (c == 0) {
+		    fprintf(stderr, "Problem reading\n");
+		    exit(1);
+		}
+		lzop_write(databuf, 1, c, lzf);
+		sizeremaining -= c;
+	    }
+	    if (padding > 0)
+		c = fread(databuf, 1, padding, stdin);
+	    lzop_finalize_w(lzf);
+	    if ((csize = ftell(tmpf)) < 0) {
+		fprintf(stderr, "Error writing temp file\n");
+		exit(1);
+	    }
+	    fsclear(&fs2);
+	    fsdup(&fs2, &fs);
+	    sprintf(tmpstr, "%llu", fs.filesize);
+	    setpaxvar(&(fs2.xheader), &(fs2.xheaderlen), "TC.compression", "lzop", 4);
+	    setpaxvar(&(fs2.xheader), &(fs2.xheaderlen), "TC.original.size", tmpstr, strlen(tmpstr));
+	    fs2.filesize = csize;
+	    tar_write_next_hdr(&fs2);
+	    rewind(tmpf);
+	    sizeremaining = csize;
+	    padding = 512 - ((fs2.filesize - 1) % 512 + 1);
+	    while (sizeremaining > 0) {
+		c = fread(databuf, 1, sizeremaining < bufsize ? sizeremaining : bufsize, tmpf);
+		fwrite(databuf, 1, c, stdout);
+		sizeremaining -= c;
+	    }
+	    rewind(tmpf);
+	    if (padding > 0)
+		c = fwrite(padblock, 1, padding, stdout);
+	}
+	else {
+	    tar_write_next_hdr(&fs);
+	    sizeremaining = fs.filesize;
+	    padding = 512 - ((fs.filesize - 1) % 512 + 1);
+	    while (sizeremaining > 0) {
+		c = fread(databuf, 1, sizeremaining < bufsize ? sizeremaining : bufsize, stdin);
+		fwrite(databuf, 1, c, stdout);
+		sizeremaining -= c;
+	    }
+	    if (padding > 0) {
+		c = fread(padblock, 1, padding, stdin);
+		c = fwrite(padblock, 1, padding, stdout);
+		memset(padblock, 0, 512);
+	    }
+	}
+	fsclear(&fs);
+    }
+    if (tmpf != NULL)
+	fclose(tmpf);
+    free(databuf);
+    fsfree(&fs);
+    fsfree(&fs2);
+    return(0);
+}
+
+/* Drop the head of file bodies that an interrupted backup already left
+ * in the vault.  The list is written by newbackup --resume-list, an
+ * offset, a tab and a file name per entry, each ending in a null.  The
+ * rest of each body is sent with its offset in TC.resume.offset, and
+ * submitfiles appends it to what is there.
+ */
+struct tc_resume {
+    char *filename;
+    unsigned long long int offset;
+};
+
+int tc_resume_cmp(const void *a, const void *b)
+{
+    return(strcmp(((struct tc_resume *) a)->filename, ((struct tc_resume *) b)->filename));
+}
+
+int tarresume(int argc, char **argv)
+{
+    struct filespec fs;
+    struct filespec fs2;
+    size_t bufsize = 256 * 1024;
+    char *databuf;
+    char padblock[512];
+    char tmpstr[64];
+    size_t sizeremaining;
+    size_t padding;
+    size_t c;
+    char *paxdata;
+    int paxdatalen;
+    FILE *listf = NULL;
+    char *line = NULL;
+    size_t linelen = 0;
+    char *p;
+    struct tc_resume *list = NULL;
+    struct tc_resume key;
+    struct tc_resume *r;
+    int nlist = 0;
+    struct option longopts[] = {
+	{ "resume-list", required_argument, NULL, 'f' },
+	{ NULL, no_argument, NULL, 0 }
+    };
+    int longoptidx;
+    int optc;
+
+    while ((optc = getopt_long(argc, argv, "f:", longopts, &longoptidx)) >= 0) {
+	switch (optc) {
+	    case 'f':
+		if ((listf = fopen(optarg, "r")) == NULL) {
+		    fprintf(stderr, "Error opening %s\n", optarg);
+		    exit(1);
+		}
+		break;
+	    default:
+		fprintf(stderr, "Usage: tarcrypt resume -f resume-list\n");
+		exit(1);
+	}
+    }
+    if (listf == NULL) {
+	fprintf(stderr, "Usage: tarcrypt resume -f resume-list\n");
+	exit(1);
+    }
+    while (getdelim(&line, &linelen, 0, listf) > 0) {
+	if ((p = strchr(line, '\t')) == NULL)
+	    continue;
+	list = realloc(list, sizeof(struct tc_resume) * (nlist + 1));
+	list[nlist].offset = strtoull(line, 0, 10);
+	list[nlist].filename = strdup(p + 1);
+	nlist++;
+    }
+    fclose(listf);
+    free(line);
+    if (nlist > 0)
+	qsort(list, nlist, sizeof(struct tc_resume), tc_resume_cmp);
+
+    fsinit(&fs);
+    fsinit(&fs2);
+    databuf = malloc(bufsize);
+    memset(padblock, 0, 512);
+    while (tar_get_next_hdr(&fs)) {
+	key.filename = fs.filename;
+	r = NULL;
+	if (nlist > 0 && fs.ftype == '0' && fs.n_sparsedata == 0 &&
+	    getpaxvar(fs.xheader, fs.xheaderlen, "TC.compression", &paxdata, &paxdatalen) != 0 &&
+	    getpaxvar(fs.xheader, fs.xheaderlen, "TC.cipher", &paxdata, &paxdatalen) != 0)
+	    r = bsearch(&key, list, nlist, sizeof(struct tc_resume), tc_resume_cmp);
+	// A file that has since shrunk is sent whole; submitfiles won't find a partial for it
+	if (r != NULL && r->offset > 0 && r->offset < fs.filesize) {
+	    fsclear(&fs2);
+	    fsdup(&fs2, &fs);
+	    sizeremaining = r->offset;
+	    while (sizeremaining > 0) {
+		c = fread(databuf, 1, sizeremaining < bufsize ? sizeremaining : bufsize, stdin);
+		if (c == 0) {
+		    fprintf(stderr, "Problem reading\n");
+		    exit(1);
+		}
+		sizeremaining -= c;
+	    }
+	    sprintf(tmpstr, "%llu", r->offset);
+	    setpaxvar(&(fs2.xheader), &(fs2.xheaderlen), "TC.resume.offset", tmpstr, strlen(tmpstr));
+	    fs2.filesize = fs.filesize - r->offset;
+	    tar_write_next_hdr(&fs2);
+	    sizeremaining = fs2.filesize;
+	}
+	else {
+	    fsclear(&fs2);
+	    fsdup(&fs2, &fs);
+	    tar_write_next_hdr(&fs2);
+	    sizeremaining = fs2.filesize;
+	}
+	while (sizeremaining > 0) {
+	    c = fread(databuf, 1, sizeremaining < bufsize ? sizeremaining : bufsize, stdin);
+	    if (c == 0) {
+		fprintf(stderr, "Problem reading\n");
+		exit(1);
+	    }
+	    fwrite(databuf, 1, c, stdout);
+	    sizeremaining -= c;
+	}
+	// Padding is read for the whole body, and written for what was sent
+	padding = 512 - ((fs.filesize - 1) % 512 + 1);
+	if (padding > 0)
+	    c = fread(padblock, 1, padding, stdin);
+	memset(padblock, 0, 512);
+	padding = 512 - ((fs2.filesize - 1) % 512 + 1);
+	if (padding > 0)
+	    c = fwrite(padblock, 1, padding, stdout);
+	fsclear(&fs);
+    }
+    for (int i = 0; i < nlist; i++)
+	free(list[i].filename);
+    free(list);
+    free(databuf);
+    fsfree(&fs);
+    fsfree(&fs2);
+    return(0);
+}
+
 #define tf_encoding_ts 1
 #define tf_encoding_compression 2
 #define tf_encoding_cipher 4
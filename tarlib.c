@@ -45,6 +45,8 @@ int EVP_CIPHER_CTX_reset(EVP_CIPHER_CTX *ctx) ;
 int HMAC_CTX_reset(HMAC_CTX *ctx);
 static void *OPENSSL_zalloc(size_t num);
 #endif
+static struct lzop_file *lzop_header_w(struct lzop_file *cfile, int method, int level);
+static void lzop_compress(struct lzop_file *cfile, lzo_uint len);
 
 char *saved_passwords = NULL;
 
@@ -968,10 +970,64 @@ unsigned long long int g2ulli(char *p)
 }
 
 struct lzop_file *lzop_init_w(size_t (*c_fwrite)(), void *c_handle)
+{
+    return(lzop_header_w(lzop_append_w(c_fwrite, c_handle), LZOP_M_LZO1X_1, 5));
+}
+
+/* Writer that compresses with lzo1x_999, much slower than lzo1x_1 but
+ * tighter, for data that is written once and kept.  The stream reads
+ * back the same way.
+ */
+struct lzop_file *lzop_init_w999(size_t (*c_fwrite)(), void *c_handle)
 {
     struct lzop_file *cfile;
+
+    cfile = lzop_append_w(c_fwrite, c_handle);
+    free(cfile->working_memory);
+    cfile->working_memory = malloc(LZO1X_999_MEM_COMPRESS);
+    return(lzop_header_w(cfile, LZOP_M_LZO1X_999, 9));
+}
+
+static struct lzop_file *lzop_header_w(struct lzop_file *cfile, int method, int level)
+{
     char magic[] = {  0x89, 0x4c, 0x5a, 0x4f, 0x00, 0x0d, 0x0a, 0x1a, 0x0a };
     uint32_t chksum = 1;
+    char m = method;
+    char l = level;
+
+    cfile->method = method;
+    cfile->c_fwrite(magic, 1, sizeof(magic), cfile->c_handle);
+    fwritec(htonsp(0x1030), 1, 2, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(htonsp(lzo_version()), 1, 2, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(htonsp(0x0940), 1, 2, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(&m, 1, 1, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(&l, 1, 1, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(htonlp(0x300000d), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(htonlp(0x0), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(htonlp(0x0), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(htonlp(0x0), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec("\000", 1, 1, cfile->c_fwrite, cfile->c_handle, &chksum);
+    fwritec(htonlp(chksum), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
+    return(cfile);
+}
+
+// Compress len bytes of buf into cbuf with the writer's method
+static void lzop_compress(struct lzop_file *cfile, lzo_uint len)
+{
+    if (cfile->method == LZOP_M_LZO1X_999)
+	lzo1x_999_compress((unsigned char *) cfile->buf, len, (unsigned char *) cfile->cbuf, &(cfile->cbufsize), cfile->working_memory);
+    else
+	lzo1x_1_compress((unsigned char *) cfile->buf, len, (unsigned char *) cfile->cbuf, &(cfile->cbufsize), cfile->working_memory);
+}
+
+/* Writer for the rest of a stream whose header and first blocks have
+ * already been written, such as a partial vault object being resumed.
+ * Blocks don't depend on each other, so there is no state to carry
+ * over beyond where the last whole block ended.
+ */
+struct lzop_file *lzop_append_w(size_t (*c_fwrite)(), void *c_handle)
+{
+    struct lzop_file *cfile;
 
     cfile = malloc(sizeof(*cfile));
     cfile->bufsize = 256 * 1024;
@@ -981,20 +1037,8 @@ struct lzop_file *lzop_init_w(size_t (*c_fwrite)(), void *c_handle)
     cfile->working_memory = malloc(LZO1X_1_MEM_COMPRESS);
     cfile->c_fwrite = c_fwrite;
     cfile->c_handle = c_handle;
-    {
-	cfile->c_fwrite(magic, 1, sizeof(magic), cfile->c_handle);
-	fwritec(htonsp(0x1030), 1, 2, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec(htonsp(lzo_version()), 1, 2, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec(htonsp(0x0940), 1, 2, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec("\001", 1, 1, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec("\005", 1, 1, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec(htonlp(0x300000d), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec(htonlp(0x0), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec(htonlp(0x0), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec(htonlp(0x0), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec("\000", 1, 1, cfile->c_fwrite, cfile->c_handle, &chksum);
-	fwritec(htonlp(chksum), 1, 4, cfile->c_fwrite, cfile->c_handle, &chksum);
-    }
+    cfile->pool = NULL;
+    cfile->method = LZOP_M_LZO1X_1;
     return(cfile);
 }
 
@@ -1004,8 +1048,9 @@ size_t lzop_write(void *buf, size_t sz, size_t count, struct lzop_file *cfile)
     uint32_t chksum;
     size_t bufroom = 0;
     size_t t = 0;
-    size_t x;
 
+    if (cfile->pool != NULL)
+	return(lzop_write_p(buf, sz, count, cfile));
     while (n > 0) {
 	bufroom = cfile->bufsize - (cfile->bufp - cfile->buf);
 	if (n <= bufroom) {
@@ -1020,47 +1065,227 @@ size_t lzop_write(void *buf, size_t sz, size_t count, struct lzop_file *cfile)
 	    cfile->bufp += bufroom;
 	    t += bufroom; 
 
-	    // write uncompressed block size
-	    if (cfile->c_fwrite(htonlp(cfile->bufsize), 1, 4, cfile->c_handle) < 4) {
-		exit(1);
-	    }
 	    chksum = lzo_adler32(1, (unsigned char *) cfile->buf, cfile->bufsize);
-	    lzo1x_1_compress((unsigned char *) cfile->buf, cfile->bufsize, (unsigned char *) cfile->cbuf, &(cfile->cbufsize), cfile->working_memory);
-
-	    // if compression was beneficial
-	    if (cfile->cbufsize < cfile->bufsize) {
-		// write compressed block size
-		if (cfile->c_fwrite(htonlp(cfile->cbufsize), 1, 4, cfile->c_handle) < 4) {
-		    exit(1);
-		}
-	    }
-	    else
-		// write uncompressed block size again
-		if (cfile->c_fwrite(htonlp(cfile->bufsize), 1, 4, cfile->c_handle) < 4) {
-		    exit(1);
-		}
-	    // write checksum
-	    if (cfile->c_fwrite(htonlp(chksum), 1, 4, cfile->c_handle) < 4) {
+	    lzop_compress(cfile, cfile->bufsize);
+	    if (lzop_put_block(cfile, cfile->buf, cfile->bufsize, cfile->cbuf, cfile->cbufsize, chksum) != 0)
 		exit(1);
-	    }
-	    // if compression was beneficial
-	    if (cfile->cbufsize < cfile->bufsize) {
-		//write compressed data
-		if ((x = cfile->c_fwrite(cfile->cbuf, 1, cfile->cbufsize, cfile->c_handle)) < cfile->cbufsize) {
-		    exit(1);
-		}
-	    }
-	    else {
-		//write uncompressed data
-		if ((x = cfile->c_fwrite(cfile->buf, 1, cfile->bufsize, cfile->c_handle)) < cfile->bufsize) {
-		    exit(1);
-		}
-	    }
 	    cfile->bufp = cfile->buf;
 	}
     }
     return(t);
 }
+
+/* Write one compressed block:  uncompressed size, compressed size
+ * (or the uncompressed size again if compression didn't help),
+ * checksum, then the data.
+ */
+int lzop_put_block(struct lzop_file *cfile, char *buf, lzo_uint bufsize, char *cbuf, lzo_uint cbufsize, uint32_t chksum)
+{
+    // write uncompressed block size
+    if (cfile->c_fwrite(htonlp(bufsize), 1, 4, cfile->c_handle) < 4)
+	return(EOF);
+    // if compression was beneficial
+    if (cbufsize < bufsize) {
+	// write compressed block size
+	if (cfile->c_fwrite(htonlp(cbufsize), 1, 4, cfile->c_handle) < 4)
+	    return(EOF);
+    }
+    else
+	// write uncompressed block size again
+	if (cfile->c_fwrite(htonlp(bufsize), 1, 4, cfile->c_handle) < 4)
+	    return(EOF);
+    // write checksum
+    if (cfile->c_fwrite(htonlp(chksum), 1, 4, cfile->c_handle) < 4)
+	return(EOF);
+    // if compression was beneficial
+    if (cbufsize < bufsize) {
+	//write compressed data
+	if (cfile->c_fwrite(cbuf, 1, cbufsize, cfile->c_handle) < cbufsize)
+	    return(EOF);
+    }
+    else {
+	//write uncompressed data
+	if (cfile->c_fwrite(buf, 1, bufsize, cfile->c_handle) < bufsize)
+	    return(EOF);
+    }
+    return(0);
+}
+
+/* Parallel lzop writer.  Blocks are filled in turn from a ring of
+ * nblocks slots and handed to the pool for compression as soon as they
+ * are full.  Finished blocks are written out by the calling thread in
+ * the order they were filled, so the output is the same byte for byte
+ * as from the serial writer.
+ */
+struct lzop_file *lzop_init_wp(size_t (*c_fwrite)(), void *c_handle, struct lzop_pool *pool, int nblocks)
+{
+    return(lzop_parallel_w(lzop_init_w(c_fwrite, c_handle), pool, nblocks));
+}
+
+// Switch a serial writer, with nothing buffered yet, to the pool
+struct lzop_file *lzop_parallel_w(struct lzop_file *cfile, struct lzop_pool *pool, int nblocks)
+{
+    free(cfile->buf);
+    free(cfile->cbuf);
+    free(cfile->working_memory);
+    cfile->working_memory = NULL;
+    cfile->nblocks = nblocks < 2 ? 2 : nblocks;
+    cfile->blocks = malloc(sizeof(struct lzop_block) * cfile->nblocks);
+    for (int i = 0; i < cfile->nblocks; i++) {
+	cfile->blocks[i].buf = malloc(cfile->bufsize);
+	cfile->blocks[i].cbuf = malloc(256 * 1024 + 256 * 64 + 64 + 3);
+	cfile->blocks[i].state = LZOP_BLOCK_FREE;
+    }
+    cfile->head = 0;
+    cfile->count = 0;
+    cfile->buf = cfile->blocks[0].buf;
+    cfile->cbuf = NULL;
+    cfile->bufp = cfile->buf;
+    cfile->pool = pool;
+    return(cfile);
+}
+
+size_t lzop_write_p(void *buf, size_t sz, size_t count, struct lzop_file *cfile)
+{
+    size_t n = sz * count;
+    size_t bufroom = 0;
+    size_t t = 0;
+    size_t c;
+
+    while (n > 0) {
+	bufroom = cfile->bufsize - (cfile->bufp - cfile->buf);
+	c = n < bufroom ? n : bufroom;
+	memcpy(cfile->bufp, buf + t, c);
+	cfile->bufp += c;
+	t += c;
+	n -= c;
+	if (cfile->bufp == cfile->buf + cfile->bufsize)
+	    if (lzop_submit_block(cfile) != 0)
+		exit(1);
+    }
+    return(t);
+}
+
+// Queue the block being filled, and start filling the next free one
+int lzop_submit_block(struct lzop_file *cfile)
+{
+    struct lzop_pool *pool = cfile->pool;
+    struct lzop_block *block;
+
+    block = &(cfile->blocks[(cfile->head + cfile->count) % cfile->nblocks]);
+    block->bufsize = cfile->bufp - cfile->buf;
+    block->next = NULL;
+    pthread_mutex_lock(&(pool->lock));
+    block->state = LZOP_BLOCK_QUEUED;
+    if (pool->queuetail == NULL)
+	pool->queue = block;
+    else
+	pool->queuetail->next = block;
+    pool->queuetail = block;
+    pthread_cond_signal(&(pool->work));
+    pthread_mutex_unlock(&(pool->lock));
+    cfile->count++;
+
+    if (lzop_drain(cfile, cfile->nblocks - 1) != 0)
+	return(EOF);
+    cfile->buf = cfile->blocks[(cfile->head + cfile->count) % cfile->nblocks].buf;
+    cfile->bufp = cfile->buf;
+    return(0);
+}
+
+/* Write out compressed blocks from the head of the ring, waiting on
+ * blocks still being compressed while more than maxpending are queued.
+ */
+int lzop_drain(struct lzop_file *cfile, int maxpending)
+{
+    struct lzop_pool *pool = cfile->pool;
+    struct lzop_block *block;
+
+    pthread_mutex_lock(&(pool->lock));
+    while (cfile->count > 0) {
+	block = &(cfile->blocks[cfile->head]);
+	if (block->state != LZOP_BLOCK_DONE) {
+	    if (cfile->count <= maxpending)
+		break;
+	    pthread_cond_wait(&(pool->done), &(pool->lock));
+	    continue;
+	}
+	pthread_mutex_unlock(&(pool->lock));
+	if (lzop_put_block(cfile, block->buf, block->bufsize, block->cbuf, block->cbufsize, block->chksum) != 0)
+	    return(EOF);
+	block->state = LZOP_BLOCK_FREE;
+	pthread_mutex_lock(&(pool->lock));
+	cfile->head = (cfile->head + 1) % cfile->nblocks;
+	cfile->count--;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return(0);
+}
+
+struct lzop_pool *lzop_pool_init(int nthreads)
+{
+    struct lzop_pool *pool;
+
+    pool = malloc(sizeof(struct lzop_pool));
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->work), NULL);
+    pthread_cond_init(&(pool->done), NULL);
+    pool->queue = NULL;
+    pool->queuetail = NULL;
+    pool->shutdown = 0;
+    pool->nthreads = nthreads;
+    pool->threads = malloc(sizeof(pthread_t) * nthreads);
+    for (int i = 0; i < nthreads; i++) {
+	if (pthread_create(&(pool->threads[i]), NULL, lzop_pool_worker, pool) != 0) {
+	    fprintf(stderr, "Error starting compression thread\n");
+	    exit(1);
+	}
+    }
+    return(pool);
+}
+
+void *lzop_pool_worker(void *arg)
+{
+    struct lzop_pool *pool = arg;
+    struct lzop_block *block;
+    unsigned char *working_memory = malloc(LZO1X_1_MEM_COMPRESS);
+
+    pthread_mutex_lock(&(pool->lock));
+    while (1) {
+	while (pool->queue == NULL && pool->shutdown == 0)
+	    pthread_cond_wait(&(pool->work), &(pool->lock));
+	if ((block = pool->queue) == NULL)
+	    break;
+	if ((pool->queue = block->next) == NULL)
+	    pool->queuetail = NULL;
+	pthread_mutex_unlock(&(pool->lock));
+	block->chksum = lzo_adler32(1, (unsigned char *) block->buf, block->bufsize);
+	lzo1x_1_compress((unsigned char *) block->buf, block->bufsize, (unsigned char *) block->cbuf, &(block->cbufsize), working_memory);
+	pthread_mutex_lock(&(pool->lock));
+	block->state = LZOP_BLOCK_DONE;
+	pthread_cond_broadcast(&(pool->done));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    free(working_memory);
+    return(NULL);
+}
+
+int lzop_pool_free(struct lzop_pool *pool)
+{
+    pthread_mutex_lock(&(pool->lock));
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&(pool->work));
+    pthread_mutex_unlock(&(pool->lock));
+    for (int i = 0; i < pool->nthreads; i++)
+	pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&(pool->lock));
+    pthread_cond_destroy(&(pool->work));
+    pthread_cond_destroy(&(pool->done));
+    free(pool->threads);
+    free(pool);
+    return(0);
+}
+
 struct lzop_file *lzop_init_r(size_t (*c_fread)(), void *c_handle)
 {
     struct lzop_file *cfile;
@@ -1091,6 +1316,9 @@ struct lzop_file *lzop_init_r(size_t (*c_fread)(), void *c_handle)
     cfile->bufp = cfile->buf;
     cfile->c_fread = c_fread;
     cfile->c_handle = c_handle;
+    cfile->pool = NULL;
+    cfile->eof = 0;
+    cfile->error = 0;
 
     // Process header
     cfile->c_fread(&(lzop_header.magic), 1, sizeof(magic), cfile->c_handle);
@@ -1120,8 +1348,17 @@ struct lzop_file *lzop_init_r(size_t (*c_fread)(), void *c_handle)
     cfile->c_fread(&(lzop_header.filename_len), 1, 1, cfile->c_handle);
     if (lzop_header.filename_len > 0)
 	cfile->c_fread(&(lzop_header.filename), 1, lzop_header.filename_len, cfile->c_handle);
-    cfile->c_fread(&tmp32, 1, 4, cfile->c_handle);
+    if (cfile->c_fread(&tmp32, 1, 4, cfile->c_handle) < 4)
+	cfile->error = 1;
     lzop_header.chksum = ntohl(tmp32);
+    /* lzop_read handles one checksum per block, of the uncompressed
+     * data, and the lzo1x methods only.
+     */
+    if (memcmp(lzop_header.magic, magic, sizeof(magic)) != 0 ||
+	lzop_header.compmethod < 1 || lzop_header.compmethod > 3 ||
+	(lzop_header.flags & F_ADLER32_D) == 0 ||
+	(lzop_header.flags & (F_ADLER32_C | F_CRC32_D | F_CRC32_C | F_MULTIPART)) != 0)
+	cfile->error = 1;
     return(cfile);
 }
 
@@ -1155,26 +1392,53 @@ size_t lzop_read(void *buf, size_t sz, size_t count, struct lzop_file *cfile)
 	    memcpy(buf, cfile->bufp, cfile->buf + cfile->bufsize - cfile->bufp);
 	    bytesin -= (cfile->buf + cfile->bufsize - cfile->bufp);
 	    buf += (cfile->buf + cfile->bufsize - cfile->bufp);
-	    cfile->c_fread(&tucblocksz, 1, 4, cfile->c_handle);
+	    cfile->bufp = cfile->buf + cfile->bufsize;
+	    if (cfile->eof == 1 || cfile->error == 1)
+		return(orig_bytesin - bytesin);
+	    if (cfile->c_fread(&tucblocksz, 1, 4, cfile->c_handle) < 4) {
+		cfile->error = 1;
+		return(orig_bytesin - bytesin);
+	    }
 	    ucblocksz = ntohl(tucblocksz);
-	    if (ucblocksz == 0)
-		return(cfile->buf + cfile->bufsize - cfile->bufp);
-	    cfile->c_fread(&tcblocksz, 1, 4, cfile->c_handle);
+	    if (ucblocksz == 0) {
+		cfile->eof = 1;
+		return(orig_bytesin - bytesin);
+	    }
+	    if (cfile->c_fread(&tcblocksz, 1, 4, cfile->c_handle) < 4 ||
+		cfile->c_fread(&tchksum, 1, 4, cfile->c_handle) < 4) {
+		cfile->error = 1;
+		return(orig_bytesin - bytesin);
+	    }
 	    cblocksz = ntohl(tcblocksz);
-	    cfile->c_fread(&tchksum, 1, 4, cfile->c_handle);
 	    chksum = ntohl(tchksum);
+	    // Block sizes are checked, as the stream may come from a client
+	    if (ucblocksz > 256 * 1024 || cblocksz > ucblocksz) {
+		fprintf(stderr, "lzop_read error: bad block size\n");
+		cfile->error = 1;
+		return(orig_bytesin - bytesin);
+	    }
 	    if (cfile->c_fread(cfile->cbuf, 1, cblocksz, cfile->c_handle) < cblocksz) {
 		fprintf(stderr, "lzop_read error: short read\n");
+		cfile->error = 1;
 		return(0);
 	    }
 	    if (cblocksz < ucblocksz) {
-		lzo1x_decompress((unsigned char *) cfile->cbuf, cblocksz, (unsigned char *) cfile->buf, &(cfile->bufsize), NULL);
+		cfile->bufsize = 256 * 1024;
+		if (lzo1x_decompress_safe((unsigned char *) cfile->cbuf, cblocksz, (unsigned char *) cfile->buf,
+		    &(cfile->bufsize), NULL) != LZO_E_OK || cfile->bufsize != ucblocksz) {
+		    fprintf(stderr, "lzop_read error: corrupt block\n");
+		    cfile->bufsize = 0;
+		    cfile->bufp = cfile->buf;
+		    cfile->error = 1;
+		    return(orig_bytesin - bytesin);
+		}
 	    }
 	    else {
 		memcpy(cfile->buf, cfile->cbuf, cblocksz);
 	    }
 	    if (chksum != lzo_adler32(1, (unsigned char *) cfile->buf, ucblocksz)) {
 		fprintf(stderr, "Checksum error reading compressed lzo file\n");
+		cfile->error = 1;
 	    }
 	    cfile->bufp = cfile->buf;
 	    cfile->bufsize = ucblocksz;
@@ -1187,28 +1451,26 @@ int lzop_finalize_w(struct lzop_file *cfile)
 {
     uint32_t chksum = 0;
 
-    if (cfile->bufp - cfile->buf > 0) {
-	if (cfile->c_fwrite(htonlp(cfile->bufp - cfile->buf), 1, 4, cfile->c_handle) < 4) {
+    if (cfile->pool != NULL) {
+	if (cfile->bufp - cfile->buf > 0)
+	    lzop_submit_block(cfile);
+	if (lzop_drain(cfile, 0) != 0)
+	    return(EOF);
+	if (cfile->c_fwrite(htonlp(0), 1, 4, cfile->c_handle) < 4)
 	    return(EOF);
+	for (int i = 0; i < cfile->nblocks; i++) {
+	    free(cfile->blocks[i].buf);
+	    free(cfile->blocks[i].cbuf);
 	}
+	free(cfile->blocks);
+	free(cfile);
+	return(0);
+    }
+    if (cfile->bufp - cfile->buf > 0) {
 	chksum = lzo_adler32(1, (unsigned char *) cfile->buf, cfile->bufp - cfile->buf);
-	lzo1x_1_compress((unsigned char *) cfile->buf, cfile->bufp - cfile->buf, (unsigned char *) cfile->cbuf, &(cfile->cbufsize), cfile->working_memory);
-	if (cfile->cbufsize < (cfile->bufp - cfile->buf)) {
-	    if (cfile->c_fwrite(htonlp(cfile->cbufsize), 1, 4, cfile->c_handle) < 4)
-		return(EOF);
-	}
-	else
-	    if (cfile->c_fwrite(htonlp(cfile->bufp - cfile->buf), 1, 4, cfile->c_handle) < 4)
-		return(EOF);
-	if (cfile->c_fwrite(htonlp(chksum), 1, 4, cfile->c_handle) < 4)
+	lzop_compress(cfile, cfile->bufp - cfile->buf);
+	if (lzop_put_block(cfile, cfile->buf, cfile->bufp - cfile->buf, cfile->cbuf, cfile->cbufsize, chksum) != 0)
 	    return(EOF);
-	if (cfile->cbufsize < (cfile->bufp - cfile->buf)) {
-	    if (cfile->c_fwrite(cfile->cbuf, 1, cfile->cbufsize, cfile->c_handle) < cfile->cbufsize)
-		return(EOF);
-	}
-	else
-	    if (cfile->c_fwrite(cfile->buf, 1, (cfile->bufp - cfile->buf), cfile->c_handle) < cfile->bufp - cfile->buf)
-		return(EOF);
     }
     if (cfile->c_fwrite(htonlp(0), 1, 4, cfile->c_handle) < 4)
 	return(EOF);
@@ -1235,13 +1497,13 @@ int lzop_finalize_r(struct lzop_file *cfile)
 
 uint32_t *htonlp(uint32_t v)
 {
-    static uint32_t r;
+    static __thread uint32_t r;
     r = htonl(v);
     return(&r);
 }
 uint16_t *htonsp(uint16_t v)
 {
-    static uint16_t r;
+    static __thread uint16_t r;
     r = htons(v);
     return(&r);
 }
@@ -2281,6 +2543,15 @@ size_t sha_file_write(void *buf, size_t sz, size_t count, struct sha_file *s1f)
     return(c);
 }
 
+// Add data to the hash without passing it on
+void sha_file_update(struct sha_file *s1f, void *buf, size_t len)
+{
+    if (s1f->hash == 1)
+	SHA1_Update(&(s1f->u.cfshactl), buf, len);
+    else if (s1f->hash == 2)
+	SHA256_Update(&(s1f->u.cfsha256ctl), buf, len);
+}
+
 int sha_finalize_w(struct sha_file *s1f, unsigned char *cfsha)
 {
     if (s1f->hash == 1)
@@ -9,6 +9,7 @@
 #include <lzo/lzo1x.h>
 #include <arpa/inet.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
 #include <openssl/err.h>
@@ -99,7 +100,48 @@ struct lzop_file {
     void *c_handle;
     unsigned char *working_memory;
     char mode;
+    struct lzop_pool *pool;		// parallel writer only
+    struct lzop_block *blocks;
+    int nblocks;
+    int head;
+    int count;
+    int eof;				// reader has seen the end marker
+    int error;				// reader found the stream malformed
+    int method;				// writer's, LZOP_M_LZO1X_1 or _999
 };
+#define LZOP_M_LZO1X_1 1
+#define LZOP_M_LZO1X_999 3
+
+// A block handed to an lzop_pool thread for compression
+struct lzop_block {
+    char *buf;
+    char *cbuf;
+    lzo_uint bufsize;
+    lzo_uint cbufsize;
+    uint32_t chksum;
+    int state;
+    struct lzop_block *next;
+};
+#define LZOP_BLOCK_FREE 0
+#define LZOP_BLOCK_QUEUED 1
+#define LZOP_BLOCK_DONE 2
+
+// Thread pool compressing lzop blocks, shared by any number of writers
+struct lzop_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct lzop_block *queue;
+    struct lzop_block *queuetail;
+    pthread_t *threads;
+    int nthreads;
+    int shutdown;
+};
+#define F_ADLER32_D     0x00000001L
+#define F_ADLER32_C     0x00000002L
+#define F_CRC32_D       0x00000100L
+#define F_CRC32_C       0x00000200L
+#define F_MULTIPART     0x00000400L
 #define F_H_FILTER      0x00000800L
 
 struct sha_file {
@@ -193,6 +235,8 @@ struct tar_maxread_st {
 
 int tarencrypt(int argc, char **argv);
 int tardecrypt();
+int tarcompress(int argc, char **argv);
+int tarresume(int argc, char **argv);
 int tar_get_next_hdr(struct filespec *fs);
 int tar_write_next_hdr(struct filespec *fs);
 int fsinit(struct filespec *fs);
@@ -221,8 +265,19 @@ size_t fwritec(const void *ptr, size_t size, size_t nmemb, size_t (*c_fwrite)(),
 
 struct lzop_file *lzop_init(char mode, size_t (*c_fwrite)(), void *c_handle);
 struct lzop_file *lzop_init_w(size_t (*c_fwrite)(), void *c_handle);
+struct lzop_file *lzop_init_w999(size_t (*c_fwrite)(), void *c_handle);
 struct lzop_file *lzop_init_r(size_t (*c_fread)(), void *c_handle);
+struct lzop_file *lzop_init_wp(size_t (*c_fwrite)(), void *c_handle, struct lzop_pool *pool, int nblocks);
+struct lzop_file *lzop_append_w(size_t (*c_fwrite)(), void *c_handle);
+struct lzop_file *lzop_parallel_w(struct lzop_file *cfile, struct lzop_pool *pool, int nblocks);
 size_t lzop_write(void *buf, size_t sz, size_t count, struct lzop_file *cfile);
+size_t lzop_write_p(void *buf, size_t sz, size_t count, struct lzop_file *cfile);
+int lzop_put_block(struct lzop_file *cfile, char *buf, lzo_uint bufsize, char *cbuf, lzo_uint cbufsize, uint32_t chksum);
+int lzop_submit_block(struct lzop_file *cfile);
+int lzop_drain(struct lzop_file *cfile, int maxpending);
+struct lzop_pool *lzop_pool_init(int nthreads);
+void *lzop_pool_worker(void *arg);
+int lzop_pool_free(struct lzop_pool *pool);
 size_t lzop_read(void *buf, size_t sz, size_t count, struct lzop_file *cfile);
 int lzop_finalize(struct lzop_file *cfile);
 int lzop_finalize_w(struct lzop_file *cfile);
@@ -235,6 +290,7 @@ int rsa_file_finalize(struct rsa_file *rcf);
 
 struct sha_file *sha_file_init_w(size_t (*c_ffunc)(), void *c_handle, int hash);
 size_t sha_file_write(void *buf, size_t sz, size_t count, struct sha_file *s1f);
+void sha_file_update(struct sha_file *s1f, void *buf, size_t len);
 int sha_finalize_w(struct sha_file *s1f, unsigned char *cfsha);
 
 struct hmac_file *hmac_file_init_w(size_t (*c_ffunc)(), void *c_handle, unsigned char **key, int *keysz, int nk);
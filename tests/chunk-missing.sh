@@ -0,0 +1,21 @@
+#!/bin/bash
+# Restore exits non-zero when a chunk of a chunked file is missing, and
+# still restores the files after it.
+
+. $(dirname $0)/lib.sh
+
+echo "chunk_threshold = 1048576" >> $HOME/.snebu.conf
+mkdir -p $SRC/d
+seq 1 2000000 > $SRC/d/big.txt
+echo hello > $SRC/d/small.txt
+
+newbackup host1 1000
+submit host1 1000
+chunk=$(sqlite3 $CATALOG "select chunk from object_chunks order by seq limit 1 offset 2")
+[ -n "$chunk" ] || fail "big.txt not chunked"
+rm $WORKDIR/vault/${chunk:0:2}/${chunk:2}.*
+
+(cd $OUT && $SNEBU restore --name host1 --datestamp 1000 2>/dev/null | tar -xf - 2>/dev/null
+    [ ${PIPESTATUS[0]} != 0 ]) || fail "restore with a missing chunk succeeded"
+[ "$(cat $OUT$SRC/d/small.txt)" = hello ] || fail "files after the damaged one not restored"
+pass
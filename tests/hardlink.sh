@@ -0,0 +1,25 @@
+#!/bin/bash
+# A hard link comes back from restore as a hard link, and sending the
+# same files again doesn't add catalog entries for them.
+
+. $(dirname $0)/lib.sh
+
+mkdir -p $SRC/d
+echo hello > $SRC/d/t7
+ln $SRC/d/t7 $SRC/hl7
+
+newbackup host1 1000
+submit host1 1000
+restore host1 1000
+diff -r $SRC $OUT$SRC >/dev/null || fail "restored tree differs"
+[ $(stat -c %h $OUT$SRC/hl7) = 2 ] || fail "hl7 restored as a separate file"
+[ $(stat -c %i $OUT$SRC/hl7) = $(stat -c %i $OUT$SRC/d/t7) ] ||
+    fail "hl7 and d/t7 restored as different files"
+
+entities=$(sqlite3 $CATALOG "select count(*) from file_entities")
+newbackup host1 2000
+find $SRC -print0 | tr '\0' '\n' > $WORKDIR/inc
+submit host1 2000
+[ $(sqlite3 $CATALOG "select count(*) from file_entities") = $entities ] ||
+    fail "sending unchanged files again added catalog entries"
+pass
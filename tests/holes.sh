@@ -0,0 +1,35 @@
+#!/bin/bash
+# Blocks of zeros are only left out with hole_elision set.  A file with
+# more data segments than the catalog map holds is stored dense, under
+# the same object as without the setting.
+
+. $(dirname $0)/lib.sh
+
+{ head -c 1000000 /dev/urandom; head -c 10000000 /dev/zero; head -c 100000 /dev/urandom; } > $SRC/mid.img
+head -c 65536 /dev/urandom > $WORKDIR/data
+head -c 65536 /dev/zero > $WORKDIR/zero
+for i in $(seq 1100); do cat $WORKDIR/data $WORKDIR/zero; done > $SRC/frag.img
+
+catalog()
+{
+    sqlite3 $CATALOG "select f.ftype || ' ' || f.sha2 from file_entities f
+	join backupset_detail d on d.file_id = f.file_id
+	join backupsets b on b.backupset_id = d.backupset_id
+	where b.name = '$1' and f.filename like '%/$2'"
+}
+
+newbackup host1 1000
+submit host1 1000
+[ "$(catalog host1 mid.img | cut -c 1)" = 0 ] || fail "zeros left out without hole_elision"
+
+echo "hole_elision = yes" >> $HOME/.snebu.conf
+newbackup host2 1000
+submit host2 1000
+[ "$(catalog host2 mid.img | cut -c 1)" = S ] || fail "zeros kept with hole_elision"
+[ "$(catalog host2 frag.img)" = "$(catalog host1 frag.img)" ] ||
+    fail "file with too many segments not stored as before"
+restore host2 1000
+diff -r $SRC $OUT$SRC >/dev/null || fail "restored tree differs"
+[ $(du -k $OUT$SRC/mid.img | cut -f 1) -lt 5000 ] || fail "holes not recreated"
+[ -z "$(ls $WORKDIR/vault/partial)" ] || fail "partial objects left behind"
+pass
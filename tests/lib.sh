@@ -0,0 +1,58 @@
+# Shared setup for the tests in this directory, sourced by each of them.
+#
+# Each test gets a scratch directory ($WORKDIR) holding a source tree
+# ($SRC), a home with a .snebu.conf pointing at a fresh vault and
+# catalog, and a restore target ($OUT).  It is removed on success and
+# kept for a look on failure.
+
+SNEBU=${SNEBU:-$(cd $(dirname $0)/.. && pwd)/snebu}
+FILE_PATTERN="%y\t%#m\t%D\t%i\t%u\t%U\t%g\t%G\t%s\t0\t%C@\t%T@\t%p\0"
+
+WORKDIR=$(mktemp -d ${TMPDIR:-/tmp}/snebu-test.XXXXXX)
+SRC=$WORKDIR/src
+OUT=$WORKDIR/out
+CATALOG=$WORKDIR/meta/snebu-catalog.db
+mkdir -p $SRC $OUT $WORKDIR/home
+export HOME=$WORKDIR/home
+printf 'vault = %s\nmeta = %s\n' $WORKDIR/vault $WORKDIR/meta > $HOME/.snebu.conf
+
+fail()
+{
+    echo "FAIL $(basename $0): $*  (scratch files in $WORKDIR)"
+    exit 1
+}
+
+pass()
+{
+    echo "PASS $(basename $0)"
+    rm -rf $WORKDIR
+    exit 0
+}
+
+# newbackup name datestamp: the files it asks for go to $WORKDIR/inc
+newbackup()
+{
+    find $SRC \( -type f -o -type d \) -printf "$FILE_PATTERN" \
+	-o -type l -printf "$FILE_PATTERN%l\0" |
+	$SNEBU newbackup --name $1 --retention daily --datestamp $2 \
+	--null --not-null-output > $WORKDIR/inc 2>/dev/null ||
+	fail "newbackup $1 $2"
+}
+
+# submit name datestamp [submitfiles options]: send what newbackup asked for
+submit()
+{
+    local name=$1 datestamp=$2
+    shift 2
+    (cd / && tar --no-recursion -P -T $WORKDIR/inc -cf - 2>/dev/null) |
+	$SNEBU submitfiles --name $name --datestamp $datestamp "$@" 2>/dev/null ||
+	fail "submitfiles $name $datestamp"
+}
+
+# restore name datestamp: into $OUT
+restore()
+{
+    rm -rf $OUT && mkdir -p $OUT
+    (cd $OUT && $SNEBU restore --name $1 --datestamp $2 2>/dev/null | tar -xf - 2>/dev/null) ||
+	fail "restore $1 $2"
+}
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Purge only merges small packs when that leaves fewer of them, and
+# doesn't rewrite the pack the last merge wrote.
+
+. $(dirname $0)/lib.sh
+
+packs()
+{
+    sqlite3 $CATALOG "select group_concat(pack) from (select pack from packs order by pack)"
+}
+
+for ds in 1000 2000 3000; do
+    mkdir -p $SRC/$ds
+    for i in $(seq 20); do head -c 2000 /dev/urandom > $SRC/$ds/f$i; done
+    newbackup host1 $ds
+    submit host1 $ds --pack-threshold 65536
+    $SNEBU purge >/dev/null 2>&1 || fail "purge after $ds"
+    case $ds in
+	1000|2000) [ "$(packs)" = "$(seq -s , $((ds / 1000)))" ] ||
+	    fail "small packs merged with only the newest beside them: $(packs)" ;;
+	3000) [ "$(packs)" = 3,4 ] || fail "packs 1 and 2 not merged: $(packs)" ;;
+    esac
+done
+before=$(stat -c %Y.%i $WORKDIR/vault/packs/*)
+sleep 1.1
+$SNEBU purge >/dev/null 2>&1 || fail "purge"
+[ "$(stat -c %Y.%i $WORKDIR/vault/packs/*)" = "$before" ] || fail "packs rewritten with nothing to reclaim"
+restore host1 3000
+diff -r $SRC $OUT$SRC >/dev/null || fail "restored tree differs"
+pass
@@ -0,0 +1,19 @@
+#!/bin/bash
+# Random data is stored raw, but a file repeating one random block,
+# whose bytes look just as random, is still compressed.
+
+. $(dirname $0)/lib.sh
+
+head -c 4096 /dev/urandom > $WORKDIR/block
+for i in $(seq 2048); do cat $WORKDIR/block; done > $SRC/repeated
+head -c 1048576 /dev/urandom > $SRC/random
+
+newbackup host1 1000
+submit host1 1000
+restore host1 1000
+diff -r $SRC $OUT$SRC >/dev/null || fail "restored tree differs"
+[ $(find $WORKDIR/vault -name '*.raw' | wc -l) = 1 ] ||
+    fail "expected only the random file stored raw"
+[ $(du -sk $WORKDIR/vault | cut -f 1) -lt 4096 ] ||
+    fail "repeated block stored uncompressed"
+pass
@@ -0,0 +1,41 @@
+#!/bin/bash
+# A resume refuses a partial object whose last whole block is damaged,
+# and removes it, rather than adding the rest of the file to it.
+
+. $(dirname $0)/lib.sh
+TARCRYPT=$(dirname $SNEBU)/tarcrypt
+
+seq 1 12000000 > $SRC/big.txt
+
+newbackup host1 1000
+(cd / && tar --no-recursion -P -T $WORKDIR/inc -cf - 2>/dev/null) | head -c 70000000 |
+    $SNEBU submitfiles --name host1 --datestamp 1000 >/dev/null 2>&1
+part=$(ls $WORKDIR/vault/partial/*.lzo 2>/dev/null)
+[ -n "$part" ] || fail "no lzo partial left by the cut off transfer"
+
+# Walk the lzop blocks (38 byte header, then length, compressed length
+# and checksum ahead of each) and flip the last byte of the last whole one
+pos=38 size=$(stat -c %s $part) last=0
+while [ $((pos + 12)) -le $size ]; do
+    set -- $(od -An -tu1 -j $pos -N 12 $part)
+    clen=$(( ($5 << 24) | ($6 << 16) | ($7 << 8) | $8 ))
+    [ $((pos + 12 + clen)) -le $size ] || break
+    pos=$((pos + 12 + clen))
+    last=$((pos - 1))
+done
+[ $last -gt 0 ] || fail "no whole block in the partial"
+byte=$(od -An -tu1 -j $last -N 1 $part)
+printf "\\$(printf %o $(( byte ^ 0xff )))" |
+    dd of=$part bs=1 seek=$last conv=notrunc 2>/dev/null
+
+find $SRC -type f -printf "$FILE_PATTERN" |
+    $SNEBU newbackup --name host1 --retention daily --datestamp 1000 \
+    --null --not-null-output --resume-list $WORKDIR/rl > $WORKDIR/inc 2>/dev/null ||
+    fail "newbackup --resume-list"
+[ -s $WORKDIR/rl ] || fail "partial not offered for resume"
+(cd / && tar --no-recursion -P -T $WORKDIR/inc -cf - 2>/dev/null) |
+    $TARCRYPT resume -f $WORKDIR/rl |
+    $SNEBU submitfiles --name host1 --datestamp 1000 >/dev/null 2>&1 &&
+    fail "resume from a damaged partial succeeded"
+[ -e $part ] && fail "damaged partial left in place"
+pass
@@ -0,0 +1,22 @@
+#!/bin/bash
+# A --virtual-file dump sent on its own, into a backup set of its own,
+# doesn't change what the next newbackup of that name compares with.
+
+. $(dirname $0)/lib.sh
+
+mkdir -p $SRC/d
+for i in 1 2 3 4 5; do echo "file $i" > $SRC/d/f$i; done
+
+newbackup host1 1000
+submit host1 1000
+echo "dump" | $SNEBU submitfiles --name host1 --datestamp 2000 -r daily \
+    --virtual-file /db.dump 2>/dev/null || fail "virtual-file submit"
+
+newbackup host1 3000
+[ -s $WORKDIR/inc ] && fail "unchanged files listed again: $(tr '\n' ' ' < $WORKDIR/inc)"
+submit host1 3000
+restore host1 3000
+diff -r $SRC $OUT$SRC >/dev/null || fail "restored tree differs"
+restore host1 2000
+[ "$(cat $OUT/db.dump)" = dump ] || fail "virtual file not restored"
+pass